@@ -0,0 +1,12 @@
+(load benches/bench.lisp)
+
+;; Builds long lists and throws them away
+(defun build (n acc) (if (< n 1) acc (build (- n 1) (cons n acc))))
+(defun rev (lst acc) (if (eq lst nil) acc (rev (cdr lst) (cons (car lst) acc))))
+(defun bench-alloc () (rev (build 100000 nil) nil))
+
+(bench-run 'plain bench-alloc 10)
+(freeze build rev bench-alloc)
+(bench-run 'frozen bench-alloc 10)
+(compile build rev bench-alloc)
+(bench-run 'compiled bench-alloc 10)
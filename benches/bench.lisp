@@ -0,0 +1,15 @@
+;; The benchmark harness, see run.sh. The benchmarks define a function that
+;; takes no arguments and run it once for each tier with bench-run. The tier,
+;; the number of iterations, the elapsed nanoseconds and the number of garbage
+;; collections are printed on separate lines.
+
+(defun bench-repeat (f n) (if (< n 1) nil (progn (f) (bench-repeat f (- n 1)))))
+
+(defun bench-collections () (cdr (car (gc-stats))))
+
+;; The arguments are evaluated in order, the clock is read before the work is
+;; done and again after it
+(defun bench-finish (tier n collections start done)
+  (print tier n (- (time-ns) start) (- (bench-collections) collections)))
+
+(defun bench-run (tier f n) (bench-finish tier n (bench-collections) (time-ns) (bench-repeat f n)))
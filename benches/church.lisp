@@ -0,0 +1,33 @@
+(load benches/bench.lisp)
+
+;; The Church numerals from tests/test-church.lisp
+(defun one (f) (lambda (x) (f x)))
+
+(defun successor (n)
+  (lambda (f)
+    (lambda (x)
+      (f ((n f) x)))))
+
+(defun sum (n)
+  (lambda (m)
+    (lambda (f)
+      (lambda (x)
+        ((m f) ((n f) x))))))
+
+(defun pow (a)
+  (lambda (b)
+    (b a)))
+
+(defun printc (c) ((c (lambda (x) (+ x 1))) 0))
+
+(define two (successor one))
+(define three ((sum two) one))
+
+;; 2^3^2 = 512
+(defun bench-church () (printc ((pow two) ((pow three) two))))
+
+(bench-run 'plain bench-church 100)
+(freeze one successor sum pow printc bench-church)
+(bench-run 'frozen bench-church 100)
+(compile one successor sum pow printc bench-church)
+(bench-run 'compiled bench-church 100)
@@ -0,0 +1,10 @@
+(load benches/bench.lisp)
+
+(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(defun bench-fib () (fib 20))
+
+(bench-run 'plain bench-fib 10)
+(freeze fib bench-fib)
+(bench-run 'frozen bench-fib 10)
+(compile fib bench-fib)
+(bench-run 'compiled bench-fib 10)
@@ -0,0 +1,12 @@
+(load benches/bench.lisp)
+(load std.lisp)
+
+;; The mul and div functions of std.lisp
+(defun muldiv (n acc) (if (< n 1) acc (muldiv (- n 1) (+ acc (div (mul n 7) 3)))))
+(defun bench-muldiv () (muldiv 10000 0))
+
+(bench-run 'plain bench-muldiv 10)
+(freeze mul div muldiv bench-muldiv)
+(bench-run 'frozen bench-muldiv 10)
+(compile mul div muldiv bench-muldiv)
+(bench-run 'compiled bench-muldiv 10)
@@ -0,0 +1,33 @@
+(load benches/bench.lisp)
+(load std.lisp)
+
+;; The rule 110 automaton from demos/rule110.lisp without the output
+(defun next_cell_state (left mid rest)
+  (if (eq left 1)
+      (if (eq mid 1)
+          (if (eq (car rest) 1)
+              0
+              1)
+          (car rest))
+      (if (eq mid 1)
+          1
+          (car rest))))
+
+(defun next_state (state left mid rest)
+  (if rest
+      (cons (next_cell_state left mid rest) (next_state state mid (car rest) (cdr rest)))
+      (cons mid nil)))
+
+(defun generations (state iter)
+  (if (< iter 1)
+      state
+      (generations (cons (car state) (next_state state (car state) (car (cdr state)) (cdr (cdr state)))) (- iter 1))))
+
+(defvar initial (append (fill 256 0) 1))
+(defun bench-rule110 () (generations initial 100))
+
+(bench-run 'plain bench-rule110 10)
+(freeze next_cell_state next_state generations bench-rule110)
+(bench-run 'frozen bench-rule110 10)
+(compile next_cell_state next_state generations bench-rule110)
+(bench-run 'compiled bench-rule110 10)
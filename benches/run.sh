@@ -0,0 +1,36 @@
+#!/bin/bash
+#
+# Runs the benchmarks and prints the results as JSON. The automatic compilation
+# is disabled so that the plain tier stays in the bytecode interpreter until the
+# functions are explicitly frozen and compiled.
+
+set -o pipefail
+first=true
+echo "["
+
+for bench in benches/*.lisp
+do
+    name=$(basename "$bench" .lisp)
+
+    if [ "$name" == "bench" ]
+    then
+        continue
+    fi
+
+    # Each tier prints the tier name, iterations, nanoseconds and collections
+    ./lisp -q -c 0 -l 0 < "$bench" | paste -d ' ' - - - - > bench_output.txt || exit 1
+
+    while read -r tier iterations ns collections
+    do
+        [ -n "$tier" ] || continue
+        $first || echo ","
+        first=false
+        printf '  {"name": "%s", "tier": "%s", "iterations": %d, "ns": %d, "ops_per_sec": %s, "gc_count": %d}' \
+               "$name" "$tier" "$iterations" "$ns" \
+               "$(awk "BEGIN {printf \"%.2f\", $iterations * 1e9 / ($ns > 0 ? $ns : 1)}")" "$collections"
+    done < bench_output.txt
+done
+
+rm -f bench_output.txt
+echo
+echo "]"
@@ -0,0 +1,13 @@
+(load benches/bench.lisp)
+
+(defun tak (x y z)
+  (if (< y x)
+      (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))
+      z))
+(defun bench-tak () (tak 18 12 6))
+
+(bench-run 'plain bench-tak 10)
+(freeze tak bench-tak)
+(bench-run 'frozen bench-tak 10)
+(compile tak bench-tak)
+(bench-run 'compiled bench-tak 10)
@@ -1,11 +1,43 @@
 #include "compiler.h"
 #include "lisp.h"
+#include "vm.h"
 #include <dlfcn.h>
+#include <elf.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <setjmp.h>
 
 // Only x86-64 is supported currently
 #include "impl/x86_64.h"
 
-#define COMPILE_MEM_SIZE 4096
+// The size of the executable memory area where all compiled functions are
+// stored. The area is only reserved up front, the pages are allocated when code
+// is written into them.
+#define CODE_ARENA_SIZE (256 * 1024 * 1024)
+
+// The amount of free space that must be available before a function is
+// compiled. Larger functions can be compiled as long as there's room for
+// MAX_BITE_CODE_SIZE bytes per bite.
+#define CODE_MAX_FUNCTION_SIZE (1024 * 1024)
+
+// The upper limits for the size of the machine code of the function prologue
+// and of a single bite. A bite that saves all the registers around a call is
+// well below this.
+#define MAX_PROLOGUE_SIZE 32
+#define MAX_BITE_CODE_SIZE 512
+
+// The size of a cons cell and the registers that the inlined allocation of one
+// uses
+#define CONS_SIZE (int)CELL_SIZE
+#define CONS_REGISTERS 4
+
+// The start of each function is aligned to this
+#define CODE_ALIGNMENT 16
+
+// The faults this far below the end of the native stack are treated as
+// overflows of it. The kernel keeps a gap of at least this size below the
+// stack of the main thread.
+#define NATIVE_STACK_GUARD (64 * 1024)
 
 // A lot of instructions only allow 32-bit immediate values. Values larger than
 // that must be first stored into a register. For the register allocation
@@ -14,22 +46,76 @@
 #define MAX_IMMEDIATE_CONSTANT_SIZE 0xFFFFFFFCL
 
 #define MAX(a, b) (a > b ? a : b)
+#define MIN(a, b) (a < b ? a : b)
+
+// The absolute addresses in the machine code that depend on where things are
+// in memory. They are recorded so that the code can be saved into a shared
+// object and patched once it's loaded again, see jit_save_compiled().
+enum Relocation
+{
+    RELOC_CONS,      // compiled_cons
+    RELOC_WRITECHAR, // compiled_writechar
+    RELOC_EVAL,      // compiled_eval
+    RELOC_EVAL_FORM, // The index of a form in jit_forms
+    RELOC_CELL_PTR,  // &cell_ptr
+    RELOC_CELL_END,  // &cell_end
+    RELOC_TAIL_CALL, // compiled_tail_call
+    RELOC_CALL,      // The code of another compiled function
+};
+
+struct CodeReloc
+{
+    uint32_t offset; // Where the 64-bit immediate is from the start of the code
+    uint32_t kind;
+    intptr_t value;
+};
+
+typedef struct CodeReloc CodeReloc;
 
 struct CompiledFunction
 {
     void* memory;
-    Object* name;
+    char* name; // A copy of the name, the symbols are moved by the GC
+    size_t size;
+    CodeReloc* relocs;
+    int reloc_count;
     struct CompiledFunction* next;
 };
 
 typedef struct CompiledFunction CompiledFunction;
 
-CompiledFunction* compiled_functions = NULL;
+_Thread_local CompiledFunction* compiled_functions = NULL;
 
 typedef bool (*CompileFunc)(Object* scope, Object* name, Object* self, Object* params, Object* body);
 
 //The pointer to the start of the JIT stack
-Object** s_jit_stack = NULL;
+_Thread_local Object** s_jit_stack = NULL;
+
+// The first unused slot of the JIT stack, always contains JitEnd. The values
+// below it are the arguments of the calls into compiled code that are being
+// evaluated or are in progress.
+_Thread_local Object** s_jit_sp = NULL;
+
+// The end of the JIT stack and the start of the guard page after it
+_Thread_local Object** s_jit_stack_end = NULL;
+
+// Where jit_call jumps to if the compiled code overflows the JIT stack
+_Thread_local sigjmp_buf* jit_overflow = NULL;
+
+// The lowest address of the native stack of the thread. The compiled calls
+// that aren't in tail position use the native stack as well and it can run
+// out before the JIT stack does.
+_Thread_local uint8_t* native_stack_low = NULL;
+
+// The executable memory. All compiled functions are packed one after another
+// starting from code_arena and code_ptr points to the end of the last one.
+// While a batch of functions is being compiled, the memory from code_writable
+// onwards is writable but not executable, otherwise it's executable but not
+// writable. The last page of the arena is never accessible so that a function
+// that overflows it crashes instead of silently corrupting memory.
+_Thread_local uint8_t* code_arena = NULL;
+_Thread_local uint8_t* code_ptr = NULL;
+_Thread_local uint8_t* code_writable = NULL;
 
 const char* find_by_func_addr(void* addr)
 {
@@ -37,13 +123,209 @@ const char* find_by_func_addr(void* addr)
     {
         if (c->memory == addr)
         {
-            return get_symbol_by_pointed_value(c->name);
+            return c->name;
         }
     }
 
     return "<unknown address>";
 }
 
+// System profiler integration
+//
+// The perf map is a text file with the start address, the size and the name of
+// each function on its own line. The jitdump file has a record for each
+// function that also holds a copy of its machine code which lets perf annotate
+// it, see tools/perf/Documentation/jitdump-specification.txt in the Linux
+// source tree. The dump is used with `perf record -k mono` followed by `perf
+// inject --jit`.
+//
+// The files are shared by all interpreters and the lock serializes the writes.
+FILE* perf_map = NULL;
+FILE* perf_dump = NULL;
+uint64_t perf_code_index = 0;
+pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+#define JIT_CODE_CLOSE 3
+
+struct JitDumpHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct JitDumpRecord
+{
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+struct JitDumpCodeLoad
+{
+    struct JitDumpRecord header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    // Followed by the name and the machine code
+};
+
+uint64_t perf_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+bool jit_perf_open(bool map, bool dump)
+{
+    char path[PATH_MAX];
+
+    if (map)
+    {
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+        perf_map = fopen(path, "w");
+
+        if (!perf_map)
+        {
+            return false;
+        }
+    }
+
+    if (dump)
+    {
+        snprintf(path, sizeof(path), "/tmp/jit-%d.dump", getpid());
+        perf_dump = fopen(path, "w+");
+
+        if (!perf_dump)
+        {
+            return false;
+        }
+
+        struct JitDumpHeader header = {
+            .magic = JITDUMP_MAGIC,
+            .version = JITDUMP_VERSION,
+            .total_size = sizeof(header),
+            .elf_mach = EM_X86_64,
+            .pid = getpid(),
+            .timestamp = perf_timestamp(),
+        };
+
+        fwrite(&header, sizeof(header), 1, perf_dump);
+        fflush(perf_dump);
+
+        // perf finds the dump through the executable mapping of it. The mapping
+        // is never accessed and it stays until the process exits.
+        void* marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(perf_dump), 0);
+
+        if (marker == MAP_FAILED)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void perf_add(CompiledFunction* comp)
+{
+    if (!perf_map && !perf_dump)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&perf_lock);
+
+    if (perf_map)
+    {
+        fprintf(perf_map, "%lx %lx %s\n", (uintptr_t)comp->memory, comp->size, comp->name);
+        fflush(perf_map);
+    }
+
+    if (perf_dump)
+    {
+        size_t name_size = strlen(comp->name) + 1;
+        struct JitDumpCodeLoad rec = {
+            .header = {
+                .id = JIT_CODE_LOAD,
+                .total_size = sizeof(rec) + name_size + comp->size,
+                .timestamp = perf_timestamp(),
+            },
+            .pid = getpid(),
+            .tid = syscall(SYS_gettid),
+            .vma = (uintptr_t)comp->memory,
+            .code_addr = (uintptr_t)comp->memory,
+            .code_size = comp->size,
+            .code_index = perf_code_index++,
+        };
+
+        fwrite(&rec, sizeof(rec), 1, perf_dump);
+        fwrite(comp->name, name_size, 1, perf_dump);
+        fwrite(comp->memory, comp->size, 1, perf_dump);
+        fflush(perf_dump);
+    }
+
+    pthread_mutex_unlock(&perf_lock);
+}
+
+void jit_perf_close()
+{
+    if (perf_map)
+    {
+        fclose(perf_map);
+        perf_map = NULL;
+    }
+
+    if (perf_dump)
+    {
+        struct JitDumpRecord rec = {
+            .id = JIT_CODE_CLOSE,
+            .total_size = sizeof(rec),
+            .timestamp = perf_timestamp(),
+        };
+
+        fwrite(&rec, sizeof(rec), 1, perf_dump);
+        fclose(perf_dump);
+        perf_dump = NULL;
+    }
+}
+
+void add_compiled_function(CompiledFunction* comp)
+{
+    comp->next = compiled_functions;
+    compiled_functions = comp;
+    perf_add(comp);
+}
+
+bool jit_code_contains(void* addr)
+{
+    return (uint8_t*)addr >= code_arena && (uint8_t*)addr < code_ptr;
+}
+
+const char* jit_function_name(void* addr)
+{
+    for (CompiledFunction* c = compiled_functions; c; c = c->next)
+    {
+        if ((uint8_t*)addr >= (uint8_t*)c->memory && (uint8_t*)addr < (uint8_t*)c->memory + c->size)
+        {
+            return c->name;
+        }
+    }
+
+    return NULL;
+}
+
 bool not_in_gdb()
 {
     bool no_gdb = true;
@@ -78,12 +360,24 @@ Object* builtin_if(Object* scope, Object* args);
 Object* builtin_less(Object* scope, Object* args);
 Object* builtin_add(Object* scope, Object* args);
 Object* builtin_sub(Object* scope, Object* args);
+Object* builtin_mul(Object* scope, Object* args);
+Object* builtin_div(Object* scope, Object* args);
+Object* builtin_mod(Object* scope, Object* args);
+Object* builtin_logand(Object* scope, Object* args);
+Object* builtin_logior(Object* scope, Object* args);
+Object* builtin_logxor(Object* scope, Object* args);
+Object* builtin_ash(Object* scope, Object* args);
 Object* builtin_eq(Object* scope, Object* args);
 Object* builtin_car(Object* scope, Object* args);
 Object* builtin_cdr(Object* scope, Object* args);
+Object* builtin_vector_ref(Object* scope, Object* args);
+Object* builtin_vector_length(Object* scope, Object* args);
 Object* builtin_cons(Object* scope, Object* args);
 Object* builtin_progn(Object* scope, Object* args);
 Object* builtin_writechar(Object* scope, Object* args);
+Object* builtin_define(Object* scope, Object* args);
+Object* builtin_quote(Object* scope, Object* args);
+Object* builtin_lambda(Object* scope, Object* args);
 
 bool is_supported_builtin(Function fn)
 {
@@ -91,15 +385,44 @@ bool is_supported_builtin(Function fn)
         || fn == builtin_less
         || fn == builtin_add
         || fn == builtin_sub
+        || fn == builtin_mul
+        || fn == builtin_div
+        || fn == builtin_mod
+        || fn == builtin_logand
+        || fn == builtin_logior
+        || fn == builtin_logxor
+        || fn == builtin_ash
         || fn == builtin_eq
         || fn == builtin_car
         || fn == builtin_cdr
+        || fn == builtin_vector_ref
+        || fn == builtin_vector_length
         || fn == builtin_cons
         || fn == builtin_progn
         || fn == builtin_writechar;
 
 }
 
+// Whether the arithmetic builtin can be called with this many arguments, the
+// same limits are checked by the evaluator
+bool valid_arithmetic_arg_count(Function fn, int count)
+{
+    if (fn == builtin_mod || fn == builtin_ash)
+    {
+        return count == 2;
+    }
+    else if (fn == builtin_div)
+    {
+        return count >= 2;
+    }
+    else if (fn == builtin_mul || fn == builtin_logand || fn == builtin_logior || fn == builtin_logxor)
+    {
+        return count >= 1;
+    }
+
+    return true;
+}
+
 void compiled_writechar(Object* obj)
 {
     do_writechar(obj);
@@ -110,9 +433,80 @@ Object* compiled_cons(Object* a, Object* b)
     return cons(a, b);
 }
 
+// The forms are stored in pairs: the form itself and the function whose
+// parameters it refers to. The compiled code refers to them by their index.
+_Thread_local Object* jit_forms = Nil;
+_Thread_local size_t jit_form_count = 0;
+
+// Makes room for count more forms. The forms are added while the function is
+// turned into bites and nothing is allowed to run the GC at that point.
+void jit_forms_reserve(size_t count)
+{
+    size_t size = jit_forms == Nil ? 0 : get_obj(jit_forms)->length;
+    size_t needed = jit_form_count + count * 2;
+
+    if (needed > size)
+    {
+        Object* forms = make_vector(MAX(needed, size * 2), Nil);
+
+        for (size_t i = 0; i < jit_form_count; i++)
+        {
+            vector_items(forms)[i] = vector_items(jit_forms)[i];
+            write_barrier(forms, vector_items(forms)[i]);
+        }
+
+        jit_forms = forms;
+    }
+}
+
+intptr_t jit_forms_add(Object* form, Object* func)
+{
+    assert(jit_forms != Nil && jit_form_count + 2 <= get_obj(jit_forms)->length);
+    intptr_t index = jit_form_count;
+    vector_items(jit_forms)[index] = form;
+    write_barrier(jit_forms, form);
+    vector_items(jit_forms)[index + 1] = func;
+    write_barrier(jit_forms, func);
+    jit_form_count += 2;
+    return index;
+}
+
+// Evaluates a form that the compiled code can't do by itself. The form sees the
+// arguments of the compiled function the same way it'd see them if the
+// function was interpreted. Everything below sp is in use by the compiled code
+// and the calls to other compiled functions push their arguments after it.
+Object* compiled_eval(Object** args, Object** sp, intptr_t index)
+{
+    Object** prev_sp = s_jit_sp;
+    s_jit_sp = sp;
+    *s_jit_sp = JitEnd;
+
+    Object* form = vector_items(jit_forms)[index];
+    Object* func = vector_items(jit_forms)[index + 1];
+    Object* scope = Nil;
+    PUSH3(form, func, scope);
+
+    int count = get_func(func)->ufn.param_count;
+    scope = new_scope(func_env(func), func_params(func), count);
+
+    for (int i = 0; i < count; i++)
+    {
+        scope_slots(scope)[i] = args[i];
+        write_barrier(scope, args[i]);
+    }
+
+    Object* ret = eval(scope, form);
+    POP();
+
+    s_jit_sp = prev_sp;
+    return ret;
+}
+
 bool compile_expr(uint8_t** mem, Object* self, Object* params, Object* body);
 bool compile_expr_recurse(uint8_t** mem, Object* self, Object* params, Object* obj, bool can_recurse);
 
+Object* compiled_tail_call(Object** sp, Object** top);
+
 const char* symbol_name(Object* func)
 {
     const char* name = get_symbol_by_pointed_value(func);
@@ -140,6 +534,12 @@ const char* symbol_name(Object* func)
 
 bool is_parameter(Object* params, Object* value)
 {
+    if (is_local_ref(value))
+    {
+        // Only the parameters of the function itself are in the outermost scope
+        return local_ref_depth(value) == 0;
+    }
+
     for (Object* p = params; get_type(p) == TYPE_CELL; p = cdr(p))
     {
         if (car(p) == value)
@@ -178,6 +578,14 @@ Object* resolve_one_symbol(Object* scope, Object* name, Object* self, Object* pa
     return val;
 }
 
+// Whether the arguments of the form are evaluated. The symbols in the ones that
+// aren't must stay as they are.
+bool evaluates_arguments(Object* fn)
+{
+    return get_type(fn) != TYPE_MACRO
+        && !(get_type(fn) == TYPE_BUILTIN && (get_obj(fn)->fn == builtin_quote || get_obj(fn)->fn == builtin_lambda));
+}
+
 bool resolve_symbols(Object* scope, Object* name, Object* self, Object* params, Object* body)
 {
     if (get_type(body) != TYPE_CELL)
@@ -185,47 +593,127 @@ bool resolve_symbols(Object* scope, Object* name, Object* self, Object* params,
         return true;
     }
 
-    for (; body != Nil; body = cdr(body))
+    Object* head = body;
+    Object* val = Nil;
+    bool ok = true;
+    PUSH7(scope, name, self, params, body, head, val);
+
+    for (; ok && body != Nil; body = cdr(body))
     {
-        Object* val = car(body);
+        if (body != head && !evaluates_arguments(car(head)))
+        {
+            break;
+        }
+
+        val = car(body);
         int type = get_type(val);
 
         if (type == TYPE_SYMBOL)
         {
-            val = resolve_one_symbol(scope, name, self, params, val);
+            Object* sym = val;
+            val = resolve_one_symbol(scope, name, self, params, sym);
 
             if (val == Undefined)
             {
-                return false;
+                ok = false;
+                break;
             }
-            else
+
+            int val_type = get_type(val);
+
+            if (val_type == TYPE_CELL || (val_type == TYPE_SYMBOL && val != sym))
             {
-                get_obj(body)->car = val;
+                // Lists and symbols would be evaluated again, a global
+                // variable that holds one is replaced with a quoted value
+                val = cons(val, Nil);
+                val = cons(symbol_lookup(scope, symbol("quote")), val);
             }
+
+            get_obj(body)->car = val;
+            write_barrier(body, val);
         }
         else if (type == TYPE_CELL)
         {
-            if (!resolve_symbols(scope, name, self, params, val))
-            {
-                return false;
-            }
+            ok = resolve_symbols(scope, name, self, params, val);
         }
     }
 
-    return true;
+    POP();
+    return ok;
+}
+
+// Whether the expression is evaluated by calling back into the evaluator. This
+// is done for everything that the compiled code can't do by itself: calls to
+// functions that aren't compiled, unsupported builtins, macros and references
+// to variables that aren't parameters of the function.
+bool uses_evaluator(Object* self, Object* params, Object* body)
+{
+    int type = get_type(body);
+
+    if (is_local_ref(body))
+    {
+        return local_ref_depth(body) != 0;
+    }
+    else if (type == TYPE_NUMBER || type == TYPE_CONST)
+    {
+        return false;
+    }
+    else if (type == TYPE_SYMBOL)
+    {
+        return body != symbol("nil") && body != symbol("t") && !is_parameter(params, body);
+    }
+    else if (type != TYPE_CELL)
+    {
+        return true;
+    }
+
+    Object* func = car(body);
+    return func != self
+        && !(get_type(func) == TYPE_FUNCTION && jit_compiled(func))
+        && !(get_type(func) == TYPE_BUILTIN && is_supported_builtin(get_obj(func)->fn));
+}
+
+// The number of expressions in the body that are evaluated by the evaluator
+int count_eval_forms(Object* self, Object* params, Object* body)
+{
+    if (uses_evaluator(self, params, body))
+    {
+        return 1;
+    }
+
+    int count = 0;
+
+    if (get_type(body) == TYPE_CELL)
+    {
+        for (body = cdr(body); get_type(body) == TYPE_CELL; body = cdr(body))
+        {
+            count += count_eval_forms(self, params, car(body));
+        }
+    }
+
+    return count;
 }
 
 bool valid_for_compile(Object* self, Object* params, Object* body)
 {
     int type = get_type(body);
-    if (type == TYPE_NUMBER || type == TYPE_CONST
-        || (type == TYPE_SYMBOL && (body == symbol("nil") || body == symbol("t"))))
+
+    if (uses_evaluator(self, params, body))
     {
-        debug("Constant expression, trivial to implement");
+        if (type == TYPE_CELL && get_type(car(body)) == TYPE_BUILTIN && get_obj(car(body))->fn == builtin_define
+            && get_type(cdr(body)) == TYPE_CELL && is_parameter(params, car(cdr(body))))
+        {
+            // The evaluator would only redefine its own copy of the parameter
+            error("Cannot compile, define changes a parameter of the function");
+            print(body);
+            return false;
+        }
+
+        debug("Not supported by the compiler, evaluated by the interpreter");
         debug_print(body);
         return true;
     }
-    else if (type == TYPE_SYMBOL && is_parameter(params, body))
+    else if (is_local_ref(body) || (type == TYPE_SYMBOL && is_parameter(params, body)))
     {
         debug("Body refers to one of the parameters, trivial to implement");
         debug_print(body);
@@ -233,10 +721,9 @@ bool valid_for_compile(Object* self, Object* params, Object* body)
     }
     else if (type != TYPE_CELL)
     {
-        error("Cannot compile, function body is not a list or a constant:");
-        printf("%d\n", type);
+        debug("Constant expression, trivial to implement");
         debug_print(body);
-        return false;
+        return true;
     }
 
     Object* func = car(body);
@@ -245,27 +732,19 @@ bool valid_for_compile(Object* self, Object* params, Object* body)
     {
         debug("Self-recursive function");
     }
-    else if (get_type(func) == TYPE_FUNCTION && get_obj(func)->ufn.compiled == COMPILE_CODE)
+    else if (get_type(func) == TYPE_FUNCTION)
     {
         debug("Other compiled function");
     }
-    else if (get_type(func) != TYPE_BUILTIN)
-    {
-
-        error("%s (%s) is not a builtin or a compiled function, too complex",
-              get_symbol_by_pointed_value(func), get_type_name(get_type(func)));
-        print(body);
-        return false;
-    }
-    else if (!is_supported_builtin(get_obj(func)->fn))
+    else if (!valid_arithmetic_arg_count(get_obj(func)->fn, length(cdr(body))))
     {
-        error("Builtin not supported, too complex: %s", symbol_name(func));
+        error("Wrong number of arguments: %s", symbol_name(func));
         print(body);
         return false;
     }
 
     assert(get_type(car(body)) == TYPE_BUILTIN || func == self
-           || (get_type(car(body)) == TYPE_FUNCTION && get_func(car(body))->ufn.compiled == COMPILE_CODE));
+           || (get_type(car(body)) == TYPE_FUNCTION && jit_compiled(car(body))));
     debug("Builtin function or self-recursion, checking all arguments");
     debug_print(body);
 
@@ -280,15 +759,153 @@ bool valid_for_compile(Object* self, Object* params, Object* body)
     return true;
 }
 
+uint8_t* code_arena_limit()
+{
+    return code_arena + CODE_ARENA_SIZE - sysconf(_SC_PAGESIZE);
+}
+
+// Makes the unused part of the code arena writable. Must be called before any
+// functions are compiled.
+bool code_arena_begin()
+{
+    if (!code_arena)
+    {
+        void* mem = mmap(NULL, CODE_ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (mem == MAP_FAILED)
+        {
+            error("Failed to reserve executable memory: %d, %s", errno, strerror(errno));
+            return false;
+        }
+
+        code_arena = mem;
+        code_ptr = mem;
+    }
+
+    // Only the page that contains the end of the last function is shared with
+    // existing code. There are no calls to compiled code in progress while
+    // functions are being compiled so it doesn't matter that it's not
+    // executable for a while.
+    code_writable = code_arena + page_align(code_ptr - code_arena + 1) - sysconf(_SC_PAGESIZE);
+
+    if (mprotect(code_writable, code_arena_limit() - code_writable, PROT_READ | PROT_WRITE) != 0)
+    {
+        error("Failed to make code writable: %d, %s", errno, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// Makes the code compiled since code_arena_begin() executable and the rest of
+// the arena inaccessible.
+void code_arena_end()
+{
+    uint8_t* end = code_arena + page_align(code_ptr - code_arena);
+
+    if (end > code_writable)
+    {
+        mprotect(code_writable, end - code_writable, PROT_READ | PROT_EXEC);
+    }
+
+    if (end < code_arena_limit())
+    {
+        mprotect(end, code_arena_limit() - end, PROT_NONE);
+    }
+}
+
+// The locations of jumps that are patched once the function is done. The
+// lists grow as needed and are reused by the next function.
+struct Markers
+{
+    uint8_t** ptr;
+    int count;
+    int capacity;
+};
+
+typedef struct Markers Markers;
+
+void add_marker(Markers* markers, uint8_t* ptr)
+{
+    if (markers->count == markers->capacity)
+    {
+        markers->capacity = markers->capacity ? markers->capacity * 2 : 64;
+        markers->ptr = realloc(markers->ptr, sizeof(uint8_t*) * markers->capacity);
+    }
+
+    markers->ptr[markers->count++] = ptr;
+}
+
+void free_markers(Markers* markers)
+{
+    free(markers->ptr);
+    memset(markers, 0, sizeof(*markers));
+}
+
+// The jumps to the start of the function, to the tail calls, to the returns
+// that leave a tail call to the caller and to the bailout code, see
+// set_recursion_marker(), set_tail_call_marker(), set_tail_return_marker() and
+// set_bailout_marker()
+_Thread_local Markers recursion_markers;
+_Thread_local Markers tail_call_markers;
+_Thread_local Markers tail_return_markers;
+_Thread_local Markers bailout_markers;
+
+// The relocations of the function that's being compiled, relative to
+// reloc_base which is where the function starts
+struct Relocations
+{
+    CodeReloc* reloc;
+    int count;
+    int capacity;
+};
+
+typedef struct Relocations Relocations;
+
+_Thread_local Relocations code_relocs;
+_Thread_local uint8_t* reloc_base = NULL;
+
+void add_reloc(enum Relocation kind, uint8_t* ptr, intptr_t value)
+{
+    if (code_relocs.count == code_relocs.capacity)
+    {
+        code_relocs.capacity = code_relocs.capacity ? code_relocs.capacity * 2 : 64;
+        code_relocs.reloc = realloc(code_relocs.reloc, sizeof(CodeReloc) * code_relocs.capacity);
+    }
+
+    CodeReloc* r = &code_relocs.reloc[code_relocs.count++];
+    r->offset = ptr - reloc_base;
+    r->kind = kind;
+    r->value = value;
+}
+
+void jit_stack_free();
+
 void jit_free()
 {
     while (compiled_functions)
     {
         CompiledFunction* comp = compiled_functions;
         compiled_functions = compiled_functions->next;
-        munmap(comp->memory, COMPILE_MEM_SIZE);
+        free(comp->relocs);
+        free(comp->name);
         free(comp);
     }
+
+    if (code_arena)
+    {
+        munmap(code_arena, CODE_ARENA_SIZE);
+        code_arena = code_ptr = code_writable = NULL;
+    }
+
+    free_markers(&recursion_markers);
+    free_markers(&tail_call_markers);
+    free_markers(&tail_return_markers);
+    free_markers(&bailout_markers);
+    free(code_relocs.reloc);
+    memset(&code_relocs, 0, sizeof(code_relocs));
+
+    jit_stack_free();
 }
 
 #define BITE_ID_SIZE 10
@@ -302,6 +919,7 @@ struct Bite
     char  id[BITE_ID_SIZE];
     int   op;
     bool  printed;
+    bool  calls; // Whether the bite or any of its arguments call a function
     int   reg;
     int   reg_count;
 
@@ -311,33 +929,86 @@ struct Bite
 
 typedef struct Bite Bite;
 
-enum BiteType {
+// The bites are allocated from blocks that are chained together. New blocks
+// are allocated as needed which means the bites never move once they've been
+// allocated and functions of any size can be turned into bitecode.
+#define BITE_BLOCK_SIZE 1024
+
+struct BiteBlock
+{
+    struct BiteBlock* next;
+    Bite bites[BITE_BLOCK_SIZE];
+};
+
+typedef struct BiteBlock BiteBlock;
+
+_Thread_local BiteBlock* bite_blocks = NULL;
+_Thread_local Bite* bite_block_end = NULL;
+_Thread_local int bite_count = 0;
+
+void free_bites()
+{
+    while (bite_blocks)
+    {
+        BiteBlock* block = bite_blocks;
+        bite_blocks = block->next;
+        free(block);
+    }
+
+    bite_block_end = NULL;
+    bite_count = 0;
+}
+
+enum BiteType {
     OP_CONSTANT,
     OP_PARAMETER,
     OP_ADD,
     OP_SUB,
     OP_NEG,
+    OP_MUL, // The operations from OP_MUL to OP_ASH are in the same order as
+    OP_DIV, // the ones in enum Arith
+    OP_MOD,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_ASH,
     OP_LESS,
     OP_EQ,
     OP_PTR,
+    OP_VECTOR_REF,
+    OP_VECTOR_LENGTH,
     OP_IF,
     OP_BRANCH,
     OP_LIST,
     OP_RECURSE,
+    OP_TAIL_CALL,
+    OP_TAIL_RETURN,
     OP_CALL,
     OP_PROGN,
     OP_WRITECHAR,
     OP_CONS,
+    OP_EVAL,
 };
 
-int bite_ids;
+_Thread_local int bite_ids;
 
 Bite* make_bite_impl(Bite** bites, const char* id)
 {
+    if (*bites == bite_block_end)
+    {
+        BiteBlock* block = malloc(sizeof(BiteBlock));
+        block->next = bite_blocks;
+        bite_blocks = block;
+        bite_block_end = block->bites + BITE_BLOCK_SIZE;
+        *bites = block->bites;
+    }
+
     Bite* rv = *bites;
     *bites = rv + 1;
+    bite_count++;
 
     strcpy(rv->id, id);
+    rv->calls = false;
     rv->reg = -1;
     rv->reg_count = 0;
     rv->printed = false;
@@ -375,28 +1046,63 @@ Bite* make_bite(Bite** bites)
 Bite* bite_expr(Bite** bites, Object* self, Object* params, Object* obj);
 Bite* bite_expr_recurse(Bite** bites, Object* self, Object* params, Object* obj, bool recurse);
 
+// Small compiled functions are inlined into the function that calls them. The
+// size is the number of atoms and lists in the body of the callee.
+#define INLINE_MAX_SIZE 24
+#define INLINE_MAX_DEPTH 4
+#define INLINE_MAX_ARGS 8
+
+// The arguments of the function that is being inlined. The parameters of the
+// inlined function are replaced with these.
+struct InlineFrame
+{
+    Object* func;
+    Bite* args[INLINE_MAX_ARGS];
+    struct InlineFrame* parent;
+};
+
+typedef struct InlineFrame InlineFrame;
+
+_Thread_local InlineFrame* inline_frame = NULL;
+_Thread_local int inline_depth = 0;
+
+Bite* bite_inline_argument(Bite** bites, int i);
+
 Bite* bite_argument(Bite** bites, Object* params, Object* arg)
 {
     uint8_t i = 0;
 
-    while (params != Nil)
+    if (is_local_ref(arg))
+    {
+        assert(local_ref_depth(arg) == 0);
+        i = local_ref_slot(arg);
+    }
+    else
     {
-        if (car(params) == arg)
+        while (params != Nil)
         {
-            break;
-        }
+            if (car(params) == arg)
+            {
+                break;
+            }
 
-        i++;
-        params = cdr(params);
+            i++;
+            params = cdr(params);
+        }
     }
 
-    if (params == Nil)
+    if (!is_local_ref(arg) && params == Nil)
     {
         assert(arg != Nil);
         error("Unknown parameter.");
         return false;
     }
 
+    if (inline_frame)
+    {
+        return bite_inline_argument(bites, i);
+    }
+
     Bite* b = make_bite(bites);
     b->op = OP_PARAMETER;
     b->arg1 = (Bite*)(intptr_t)(i * OBJ_SIZE);
@@ -411,6 +1117,16 @@ Bite* bite_immediate(Bite** bites, Object* arg)
     return b;
 }
 
+// The form is evaluated at runtime with compiled_eval
+Bite* bite_eval(Bite** bites, Object* self, Object* obj)
+{
+    assert(!inline_frame);
+    Bite* b = make_bite(bites);
+    b->op = OP_EVAL;
+    b->arg1 = (Bite*)jit_forms_add(obj, self);
+    return b;
+}
+
 Bite* bite_list(Bite** bites, Object* self, Object* params, Object* args)
 {
     Bite* arglist = NULL;
@@ -436,16 +1152,273 @@ Bite* bite_recursion(Bite** bites, Object* self, Object* params, Object* args)
     return rec;
 }
 
-Bite* bite_call(Bite** bites, Object* self, Object* params, Object* func, Object* args)
+// Returns the slot of the parameter or -1 if obj isn't one
+int parameter_slot(Object* params, Object* obj)
+{
+    if (is_local_ref(obj))
+    {
+        return local_ref_depth(obj) == 0 ? local_ref_slot(obj) : -1;
+    }
+    else if (get_type(obj) == TYPE_SYMBOL)
+    {
+        int i = 0;
+
+        for (Object* p = params; get_type(p) == TYPE_CELL; p = cdr(p), i++)
+        {
+            if (car(p) == obj)
+            {
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// Counts the atoms and lists of the body, stops once the limit is exceeded
+int body_size(Object* body, int limit)
+{
+    int size = 1;
+
+    for (; get_type(body) == TYPE_CELL && size <= limit; body = cdr(body))
+    {
+        size += body_size(car(body), limit - size);
+    }
+
+    return size;
+}
+
+// Whether the body calls func or, if func is NULL, any function that could
+// have side effects.
+bool body_calls(Object* body, Object* func)
+{
+    if (get_type(body) != TYPE_CELL)
+    {
+        return false;
+    }
+
+    Object* head = car(body);
+
+    if (func ? head == func : (get_type(head) == TYPE_FUNCTION ||
+                               (get_type(head) == TYPE_BUILTIN && get_obj(head)->fn == builtin_writechar)))
+    {
+        return true;
+    }
+
+    for (; get_type(body) == TYPE_CELL; body = cdr(body))
+    {
+        if (body_calls(car(body), func))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Counts how many times each of the parameters is used and whether any of the
+// uses are in a branch of an if, i.e. might not be evaluated.
+void count_parameter_uses(Object* params, Object* body, int* uses, bool* conditional, bool in_branch)
+{
+    int slot = parameter_slot(params, body);
+
+    if (slot >= 0)
+    {
+        uses[slot]++;
+        conditional[slot] = conditional[slot] || in_branch;
+    }
+    else if (get_type(body) == TYPE_CELL)
+    {
+        Object* head = car(body);
+        bool is_if = get_type(head) == TYPE_BUILTIN && get_obj(head)->fn == builtin_if;
+        int i = 0;
+
+        for (body = cdr(body); get_type(body) == TYPE_CELL; body = cdr(body), i++)
+        {
+            count_parameter_uses(params, car(body), uses, conditional, in_branch || (is_if && i > 0));
+        }
+    }
+}
+
+// Whether evaluating the bite has no side effects
+bool is_pure(Bite* bite)
+{
+    switch (bite->op)
+    {
+    case OP_CONSTANT:
+    case OP_PARAMETER:
+        return true;
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_ASH:
+    case OP_LESS:
+    case OP_EQ:
+    case OP_CONS:
+        return is_pure(bite->arg1) && is_pure(bite->arg2);
+
+    case OP_NEG:
+    case OP_PTR:
+    case OP_VECTOR_LENGTH:
+        return is_pure(bite->arg1);
+
+    // The elements of a vector can be changed by the code in between
+    case OP_VECTOR_REF:
+        return false;
+
+    case OP_IF:
+        return is_pure(bite->arg1) && is_pure(bite->arg2->arg1) && is_pure(bite->arg2->arg2);
+
+    case OP_PROGN:
+        for (Bite* b = bite->arg1; b; b = b->arg2)
+        {
+            if (!is_pure(b->arg1))
+            {
+                return false;
+            }
+        }
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+bool is_trivial(Bite* bite)
+{
+    return bite->op == OP_CONSTANT || bite->op == OP_PARAMETER;
+}
+
+// The parameters of the inlined function refer to the arguments of the call.
+// Constants and parameters of the caller can be used any number of times and
+// are copied as each bite is only ever compiled once.
+Bite* bite_inline_argument(Bite** bites, int i)
+{
+    assert(i < INLINE_MAX_ARGS);
+    Bite* arg = inline_frame->args[i];
+
+    if (is_trivial(arg))
+    {
+        Bite* b = make_bite(bites);
+        b->op = arg->op;
+        b->arg1 = arg->arg1;
+        return b;
+    }
+
+    return arg;
+}
+
+// Whether the call to func with the given arguments can be replaced with the
+// body of the function. Only functions that were compiled with `compile` are
+// inlined as their bodies have been resolved into what the compiled code uses
+// and they can't change anymore. Arguments that aren't constants or parameters
+// must be evaluated exactly once and in the same order which means they must
+// only be used once outside of any branches and neither the argument nor the
+// inlined function can have side effects.
+bool can_inline(Object* func, Object* self, Bite** args, int count)
+{
+    if (inline_depth >= INLINE_MAX_DEPTH || get_func(func)->ufn.compiled != COMPILE_CODE
+        || count > INLINE_MAX_ARGS || count != get_func(func)->ufn.param_count)
+    {
+        return false;
+    }
+
+    Object* body = func_body(func);
+
+    // A call back to self from the inlined body would no longer be in a tail
+    // position and mutually recursive functions would then grow the stack.
+    if (body_size(body, INLINE_MAX_SIZE) > INLINE_MAX_SIZE || body_calls(body, func) || body_calls(body, self)
+        || count_eval_forms(func, func_params(func), body) > 0)
+    {
+        return false;
+    }
+
+    for (InlineFrame* f = inline_frame; f; f = f->parent)
+    {
+        if (f->func == func)
+        {
+            return false;
+        }
+    }
+
+    int uses[INLINE_MAX_ARGS] = {0};
+    bool conditional[INLINE_MAX_ARGS] = {false};
+    count_parameter_uses(func_params(func), body, uses, conditional, false);
+    bool side_effects = body_calls(body, NULL);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!is_trivial(args[i]) && (uses[i] != 1 || conditional[i] || side_effects || !is_pure(args[i])))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// A call in tail position reuses the argument slots of the caller and jumps to
+// the callee, see bite_compile_recurse(). The slots after the ones of the
+// caller can belong to whoever called it which means that a callee that takes
+// more arguments than the caller is instead left for the caller's caller to
+// call, see bite_compile_tail_return().
+Bite* bite_call(Bite** bites, Object* self, Object* params, Object* func, Object* args, bool tail)
 {
+    Bite* arglist = bite_list(bites, self, params, args);
+    int count = 0;
+
+    for (Bite* b = arglist; b; b = b->arg2)
+    {
+        count++;
+    }
+
+    if (func != self)
+    {
+        // The argument list is reversed
+        InlineFrame frame = {.func = func, .parent = inline_frame};
+
+        if (count <= INLINE_MAX_ARGS)
+        {
+            int i = count;
+
+            for (Bite* b = arglist; b; b = b->arg2)
+            {
+                frame.args[--i] = b->arg1;
+            }
+        }
+
+        if (can_inline(func, self, frame.args, count))
+        {
+            debug("Inlining call to %s", get_symbol_by_pointed_value(func));
+            inline_frame = &frame;
+            inline_depth++;
+            Bite* body = bite_expr(bites, func, func_params(func), func_body(func));
+            inline_depth--;
+            inline_frame = frame.parent;
+            return body;
+        }
+    }
+
     Bite* call = make_bite(bites);
     call->op = OP_CALL;
-    call->arg1 = bite_list(bites, self, params, args);
+
+    if (tail && count == get_func(func)->ufn.param_count)
+    {
+        call->op = count <= get_func(self)->ufn.param_count ? OP_TAIL_CALL : OP_TAIL_RETURN;
+    }
+
+    call->arg1 = arglist;
     call->arg2 = (Bite*)func_jit_mem(func);
     return call;
 }
 
-Bite* bite_progn(Bite** bites, Object* self, Object* params, Object* args)
+Bite* bite_progn(Bite** bites, Object* self, Object* params, Object* args, bool can_recurse)
 {
     Bite* arglist = NULL;
 
@@ -454,7 +1427,7 @@ Bite* bite_progn(Bite** bites, Object* self, Object* params, Object* args)
         bool is_last = cdr(args) == Nil;
         Bite* list = make_bite_impl(bites, "<list>");
         list->op = OP_LIST;
-        list->arg1 = bite_expr_recurse(bites, self, params, car(args), is_last);
+        list->arg1 = bite_expr_recurse(bites, self, params, car(args), is_last && can_recurse);
         list->arg2 = arglist;
         arglist = list;
     }
@@ -523,6 +1496,65 @@ Bite* bite_sub(Bite** bites, Object* self, Object* params, Object* args)
     return lhs;
 }
 
+// Returns the bite operation of the builtin or -1 if it's not one of the
+// operations in enum Arith
+int arithmetic_op(Function fn)
+{
+    if (fn == builtin_mul)
+    {
+        return OP_MUL;
+    }
+    else if (fn == builtin_div)
+    {
+        return OP_DIV;
+    }
+    else if (fn == builtin_mod)
+    {
+        return OP_MOD;
+    }
+    else if (fn == builtin_logand)
+    {
+        return OP_AND;
+    }
+    else if (fn == builtin_logior)
+    {
+        return OP_OR;
+    }
+    else if (fn == builtin_logxor)
+    {
+        return OP_XOR;
+    }
+    else if (fn == builtin_ash)
+    {
+        return OP_ASH;
+    }
+
+    return -1;
+}
+
+bool is_arithmetic_op(int op)
+{
+    return op == OP_ADD || op == OP_SUB || (op >= OP_MUL && op <= OP_ASH);
+}
+
+// Combines the arguments from left to right like bite_add does
+Bite* bite_arithmetic(Bite** bites, Object* self, Object* params, Object* args, int op)
+{
+    Bite* lhs = bite_expr(bites, self, params, car(args));
+
+    for (args = cdr(args); args != Nil; args = cdr(args))
+    {
+        Bite* rhs = bite_expr(bites, self, params, car(args));
+        Bite* b = make_bite(bites);
+        b->op = op;
+        b->arg1 = lhs;
+        b->arg2 = rhs;
+        lhs = b;
+    }
+
+    return lhs;
+}
+
 Bite* bite_less(Bite** bites, Object* self, Object* params, Object* args)
 {
     Bite* lhs = bite_expr(bites, self, params, car(args));
@@ -566,11 +1598,31 @@ Bite* bite_cdr(Bite** bites, Object* self, Object* params, Object* args)
     return b;
 }
 
-Bite* bite_if(Bite** bites, Object* self, Object* params, Object* args)
+Bite* bite_vector_ref(Bite** bites, Object* self, Object* params, Object* args)
+{
+    Bite* vec = bite_expr(bites, self, params, car(args));
+    Bite* index = bite_expr(bites, self, params, car(cdr(args)));
+    Bite* b = make_bite(bites);
+    b->op = OP_VECTOR_REF;
+    b->arg1 = vec;
+    b->arg2 = index;
+    return b;
+}
+
+Bite* bite_vector_length(Bite** bites, Object* self, Object* params, Object* args)
+{
+    Bite* val = bite_expr(bites, self, params, car(args));
+    Bite* b = make_bite(bites);
+    b->op = OP_VECTOR_LENGTH;
+    b->arg1 = val;
+    return b;
+}
+
+Bite* bite_if(Bite** bites, Object* self, Object* params, Object* args, bool can_recurse)
 {
     Bite* cond = bite_expr(bites, self, params, car(args));
-    Bite* if_true = bite_expr_recurse(bites, self, params, car(cdr(args)), true);
-    Bite* if_false = bite_expr_recurse(bites, self, params, car(cdr(cdr(args))), true);
+    Bite* if_true = bite_expr_recurse(bites, self, params, car(cdr(args)), can_recurse);
+    Bite* if_false = bite_expr_recurse(bites, self, params, car(cdr(cdr(args))), can_recurse);
     Bite* branch = make_bite_impl(bites, "<branch>");
     branch->op = OP_BRANCH;
     branch->arg1 = if_true;
@@ -603,6 +1655,11 @@ Bite* bite_cons(Bite** bites, Object* self, Object* params, Object* args)
 
 Bite* bite_expr_recurse(Bite** bites, Object* self, Object* params, Object* obj, bool can_recurse)
 {
+    if (uses_evaluator(self, params, obj))
+    {
+        return bite_eval(bites, self, obj);
+    }
+
     switch (get_type(obj))
     {
     case TYPE_CELL:
@@ -617,12 +1674,12 @@ Bite* bite_expr_recurse(Bite** bites, Object* self, Object* params, Object* obj,
                 }
                 else
                 {
-                    return bite_call(bites, self, params, fn, cdr(obj));
+                    return bite_call(bites, self, params, fn, cdr(obj), false);
                 }
             }
             else if (get_type(fn) == TYPE_FUNCTION)
             {
-                return bite_call(bites, self, params, fn, cdr(obj));
+                return bite_call(bites, self, params, fn, cdr(obj), can_recurse);
             }
             else if (get_obj(fn)->fn == builtin_add)
             {
@@ -632,6 +1689,10 @@ Bite* bite_expr_recurse(Bite** bites, Object* self, Object* params, Object* obj,
             {
                 return bite_sub(bites, self, params, cdr(obj));
             }
+            else if (arithmetic_op(get_obj(fn)->fn) >= 0)
+            {
+                return bite_arithmetic(bites, self, params, cdr(obj), arithmetic_op(get_obj(fn)->fn));
+            }
             else if (get_obj(fn)->fn == builtin_less)
             {
                 return bite_less(bites, self, params, cdr(obj));
@@ -648,17 +1709,25 @@ Bite* bite_expr_recurse(Bite** bites, Object* self, Object* params, Object* obj,
             {
                 return bite_cdr(bites, self, params, cdr(obj));
             }
+            else if (get_obj(fn)->fn == builtin_vector_ref)
+            {
+                return bite_vector_ref(bites, self, params, cdr(obj));
+            }
+            else if (get_obj(fn)->fn == builtin_vector_length)
+            {
+                return bite_vector_length(bites, self, params, cdr(obj));
+            }
             else if (get_obj(fn)->fn == builtin_cons)
             {
                 return bite_cons(bites, self, params, cdr(obj));
             }
             else if (get_obj(fn)->fn == builtin_if)
             {
-                return bite_if(bites, self, params, cdr(obj));
+                return bite_if(bites, self, params, cdr(obj), can_recurse);
             }
             else if (get_obj(fn)->fn == builtin_progn)
             {
-                return bite_progn(bites, self, params, cdr(obj));
+                return bite_progn(bites, self, params, cdr(obj), can_recurse);
             }
             else if (get_obj(fn)->fn == builtin_writechar)
             {
@@ -683,6 +1752,13 @@ Bite* bite_expr_recurse(Bite** bites, Object* self, Object* params, Object* obj,
         return bite_argument(bites, params, obj);
 
     case TYPE_CONST:
+        if (is_local_ref(obj))
+        {
+            return bite_argument(bites, params, obj);
+        }
+
+        return bite_immediate(bites, obj);
+
     case TYPE_NUMBER:
         return bite_immediate(bites, obj);
 
@@ -738,6 +1814,12 @@ void print_bite_neg(Bite* bite)
     print_fixed("%s = -%s", bite->id, bite->arg1->id);
 }
 
+void print_bite_arithmetic(Bite* bite)
+{
+    static const char* names[] = {"*", "/", "%", "&", "|", "^", "ash"};
+    print_fixed("%s = %s %s %s", bite->id, bite->arg1->id, names[bite->op - OP_MUL], bite->arg2->id);
+}
+
 void print_bite_writechar(Bite* bite)
 {
     print_fixed("%s = write(%s)", bite->id, bite->arg1->id);
@@ -758,6 +1840,16 @@ void print_bite_ptr(Bite* bite)
     print_fixed("%s = %s[%ld]", bite->id, bite->arg1->id, (intptr_t)bite->arg2);
 }
 
+void print_bite_vector_ref(Bite* bite)
+{
+    print_fixed("%s = %s[%s]", bite->id, bite->arg1->id, bite->arg2->id);
+}
+
+void print_bite_vector_length(Bite* bite)
+{
+    print_fixed("%s = length(%s)", bite->id, bite->arg1->id);
+}
+
 void print_bite_if(Bite* bite)
 {
     print_fixed("%s = %s ? %s : %s", bite->id, bite->arg1->id, bite->arg2->arg1->id, bite->arg2->arg2->id);
@@ -768,6 +1860,11 @@ void print_bite_cons(Bite* bite)
     print_fixed("%s = %s . %s", bite->id, bite->arg1->id, bite->arg2->id);
 }
 
+void print_bite_eval(Bite* bite)
+{
+    print_fixed("%s = eval[%ld]", bite->id, (intptr_t)bite->arg1);
+}
+
 void print_bite_list_args(Bite* bite)
 {
     if (bite->arg2)
@@ -808,6 +1905,15 @@ void print_bite_norecurse(Bite* bite)
     case OP_NEG:
         print_bite_neg(bite);
         break;
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_ASH:
+        print_bite_arithmetic(bite);
+        break;
     case OP_LESS:
         print_bite_less(bite);
         break;
@@ -817,7 +1923,13 @@ void print_bite_norecurse(Bite* bite)
     case OP_PTR:
         print_bite_ptr(bite);
         break;
-    case OP_IF:
+    case OP_VECTOR_REF:
+        print_bite_vector_ref(bite);
+        break;
+    case OP_VECTOR_LENGTH:
+        print_bite_vector_length(bite);
+        break;
+    case OP_IF:
         print_bite_if(bite);
         break;
     case OP_CONS:
@@ -826,6 +1938,12 @@ void print_bite_norecurse(Bite* bite)
     case OP_RECURSE:
         print_bite_list(bite, "recurse");
         break;
+    case OP_TAIL_CALL:
+        print_bite_list(bite, "tail-call");
+        break;
+    case OP_TAIL_RETURN:
+        print_bite_list(bite, "tail-return");
+        break;
     case OP_CALL:
         print_bite_list(bite, "call");
         break;
@@ -835,6 +1953,9 @@ void print_bite_norecurse(Bite* bite)
     case OP_WRITECHAR:
         print_bite_list(bite, "write-char");
         break;
+    case OP_EVAL:
+        print_bite_eval(bite);
+        break;
 
     case OP_BRANCH:
     case OP_LIST:
@@ -872,6 +1993,17 @@ void print_one_bitecode(Bite* bite)
         print_one_bitecode(bite->arg1);
         print_bite_neg(bite);
         break;
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_ASH:
+        print_one_bitecode(bite->arg1);
+        print_one_bitecode(bite->arg2);
+        print_bite_arithmetic(bite);
+        break;
     case OP_LESS:
         print_one_bitecode(bite->arg1);
         print_one_bitecode(bite->arg2);
@@ -886,6 +2018,15 @@ void print_one_bitecode(Bite* bite)
         print_one_bitecode(bite->arg1);
         print_bite_ptr(bite);
         break;
+    case OP_VECTOR_REF:
+        print_one_bitecode(bite->arg1);
+        print_one_bitecode(bite->arg2);
+        print_bite_vector_ref(bite);
+        break;
+    case OP_VECTOR_LENGTH:
+        print_one_bitecode(bite->arg1);
+        print_bite_vector_length(bite);
+        break;
     case OP_IF:
         print_one_bitecode(bite->arg1);
         print_one_bitecode(bite->arg2->arg1);
@@ -900,7 +2041,13 @@ void print_one_bitecode(Bite* bite)
         print_bite_cons(bite);
         break;
 
+    case OP_EVAL:
+        print_bite_eval(bite);
+        break;
+
     case OP_RECURSE:
+    case OP_TAIL_CALL:
+    case OP_TAIL_RETURN:
     case OP_CALL:
     case OP_PROGN:
     case OP_WRITECHAR:
@@ -914,6 +2061,12 @@ void print_one_bitecode(Bite* bite)
         case OP_RECURSE:
             print_bite_list(bite, "recurse");
             break;
+        case OP_TAIL_CALL:
+            print_bite_list(bite, "tail-call");
+            break;
+        case OP_TAIL_RETURN:
+            print_bite_list(bite, "tail-return");
+            break;
         case OP_CALL:
             print_bite_list(bite, "call");
             break;
@@ -944,19 +2097,29 @@ void mark_unprinted(Bite* bite)
     {
     case OP_CONSTANT:
     case OP_PARAMETER:
+    case OP_EVAL:
         break;
 
     case OP_ADD:
     case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_ASH:
     case OP_LESS:
     case OP_EQ:
     case OP_CONS:
+    case OP_VECTOR_REF:
         mark_unprinted(bite->arg1);
         mark_unprinted(bite->arg2);
         break;
 
     case OP_NEG:
     case OP_PTR:
+    case OP_VECTOR_LENGTH:
         mark_unprinted(bite->arg1);
         break;
 
@@ -967,6 +2130,8 @@ void mark_unprinted(Bite* bite)
         break;
 
     case OP_RECURSE:
+    case OP_TAIL_CALL:
+    case OP_TAIL_RETURN:
     case OP_CALL:
     case OP_PROGN:
     case OP_WRITECHAR:
@@ -994,11 +2159,29 @@ void print_bitecode(Bite* bite)
 // Bite compilation to machine code
 //
 
-#define TEMP_REGISTERS 3
+// The first three temporary registers are caller-saved and the rest are
+// callee-saved. The callee-saved ones are stored in the function prologue if
+// the function uses them and they survive calls to other functions which
+// means values that are needed after a call can be left in them.
+#define TEMP_REGISTERS 8
+#define CALLER_SAVED_REGISTERS 3
 #define LAST_TEMP_REGISTER TEMP_REGISTERS - 1
 
+// The callee-saved registers used by the function that's being compiled
+_Thread_local int callee_saved_used = 0;
+
+bool is_callee_saved(int reg)
+{
+    return reg >= CALLER_SAVED_REGISTERS;
+}
+
 int get_x86_64_register(int reg)
 {
+    if (is_callee_saved(reg))
+    {
+        callee_saved_used |= 1 << reg;
+    }
+
     switch (reg)
     {
     case 0:
@@ -1007,6 +2190,16 @@ int get_x86_64_register(int reg)
         return REG_TMP1;
     case 2:
         return REG_TMP2;
+    case 3:
+        return REG_RBX;
+    case 4:
+        return REG_R12;
+    case 5:
+        return REG_R13;
+    case 6:
+        return REG_R14;
+    case 7:
+        return REG_R15;
     default:
         assert(false);
         break;
@@ -1030,6 +2223,11 @@ intptr_t get_constant(Bite* bite)
     return (intptr_t)bite->arg1;
 }
 
+bool is_number_constant(Bite* bite)
+{
+    return bite->op == OP_CONSTANT && get_type((Object*)get_constant(bite)) == TYPE_NUMBER;
+}
+
 intptr_t get_ptr_offset(Bite* bite)
 {
     assert(bite->op == OP_PTR);
@@ -1039,24 +2237,98 @@ intptr_t get_ptr_offset(Bite* bite)
 // These are used to patch the jump point to the start of the function after the
 // function prologue. The way things are now is that the temporary count is only
 // known during compilation so function start offset is deduced later on.
-uint8_t* recursion_markers[1024];
-int recursion_marker_count = 0;
-
 void set_recursion_marker(uint8_t* ptr)
 {
-    recursion_markers[recursion_marker_count++] = ptr;
+    add_marker(&recursion_markers, ptr);
+}
+
+// The jumps to the code at the end of the function that restores the registers
+// of the caller and jumps to the function whose address is in REG_RET
+void set_tail_call_marker(uint8_t* ptr)
+{
+    add_marker(&tail_call_markers, ptr);
+}
+
+// The jumps to the code at the end of the function that restores the registers
+// of the caller and returns JitTailCall
+void set_tail_return_marker(uint8_t* ptr)
+{
+    add_marker(&tail_return_markers, ptr);
+}
+
+// The jumps to the bailout code at the end of the function. The bailout code
+// returns JitBailout from the function which causes jit_call to run the
+// function again in the VM, this time reporting the error like the evaluator
+// would. The type checks are only done for automatically compiled functions
+// but the result of every call is checked as any function can call one.
+_Thread_local bool emit_type_checks = false;
+
+void set_bailout_marker(uint8_t* ptr)
+{
+    add_marker(&bailout_markers, ptr);
+}
+
+// Moves an address that changes from one run to the next into a register
+void emit_address(uint8_t** mem, int reg, enum Relocation kind, intptr_t value)
+{
+    EMIT_MOV64_REG_IMM64(reg, value);
+    add_reloc(kind, *mem - sizeof(intptr_t), value);
+}
+
+void emit_number_check(uint8_t** mem, int reg)
+{
+    if (emit_type_checks)
+    {
+        EMIT_TEST64_IMM32(reg, TYPE_MASK);
+        EMIT_JNE_OFF32();
+        set_bailout_marker(*mem);
+    }
+}
+
+void emit_argument_number_check(uint8_t** mem, int offset)
+{
+    if (emit_type_checks)
+    {
+        EMIT_TEST64_OFF8_IMM32(REG_ARGS, offset, TYPE_MASK);
+        EMIT_JNE_OFF32();
+        set_bailout_marker(*mem);
+    }
+}
+
+// The called function can leave a tail call for the caller to make, see
+// bite_compile_tail_return(). The call is made by compiled_tail_call with the
+// arguments moved to the top of the caller's stack. Everything that's in use
+// is saved already as the call itself could have run the GC.
+void emit_call_result_check(uint8_t** mem)
+{
+    EMIT_CMP64_REG_IMM8(REG_RET, (intptr_t)JitTailCall);
+    EMIT_JNE_OFF8();
+    uint8_t* no_tail_call = *mem;
+    EMIT_PUSH(REG_ARGS);
+    EMIT_PUSH(REG_STACK);
+    EMIT_MOV64_REG_REG(REG_ARGS, REG_STACK);
+    EMIT_MOV64_REG_REG(REG_STACK, REG_RDX);
+    emit_address(mem, REG_RET, RELOC_TAIL_CALL, (intptr_t)compiled_tail_call);
+    EMIT_CALL_REG(REG_RET);
+    EMIT_POP(REG_STACK);
+    EMIT_POP(REG_ARGS);
+    PATCH_JMP8(no_tail_call, *mem - no_tail_call);
+
+    EMIT_CMP64_REG_IMM8(REG_RET, (intptr_t)JitBailout);
+    EMIT_JE_OFF32();
+    set_bailout_marker(*mem);
 }
 
 struct RegList
 {
-    int reg[4];
+    int reg[TEMP_REGISTERS];
     int size;
 };
 
 typedef struct RegList RegList;
 
-RegList* reglist;
-int temps = 0;
+_Thread_local RegList* reglist;
+_Thread_local int temps = 0;
 
 RegList* reglist_push(RegList* dest, int reg)
 {
@@ -1121,6 +2393,109 @@ bool reglist_in_use(int reg)
     return true;
 }
 
+// Whether the value in the register that's in use can't be a pointer to a heap
+// object. Pointers must be stored on the JIT stack whenever something that
+// might run the GC is called but these can stay in callee-saved registers.
+_Thread_local bool reg_unboxed[TEMP_REGISTERS];
+
+// Whether the value of the bite is a number or a constant. If the value is only
+// used as an argument to an arithmetic operation, it doesn't matter what it is:
+// with type checks any other value causes a bailout and without them the
+// result is garbage anyway.
+bool is_unboxed(Bite* bite, int use)
+{
+    switch (bite->op)
+    {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_NEG:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_ASH:
+    case OP_LESS:
+    case OP_EQ:
+    case OP_VECTOR_LENGTH:
+        return true;
+
+    case OP_CONSTANT:
+        return get_type((Object*)get_constant(bite)) == TYPE_NUMBER ||
+            get_type((Object*)get_constant(bite)) == TYPE_CONST;
+
+    case OP_IF:
+        return is_unboxed(bite->arg2->arg1, use) && is_unboxed(bite->arg2->arg2, use);
+
+    default:
+        return is_arithmetic_op(use);
+    }
+}
+
+// Keeps the value of the bite in its register while the rest of the expression
+// is compiled. If something that's compiled in the meantime calls a function,
+// unboxed values are moved into a free callee-saved register where they survive
+// the call without having to be stored on the JIT stack.
+RegList* reglist_hold(uint8_t** mem, RegList* dest, Bite* bite, bool calls, bool unboxed)
+{
+    if (calls && unboxed && !is_callee_saved(bite->reg))
+    {
+        for (int i = 0; i < reglist->size; i++)
+        {
+            int reg = reglist->reg[i];
+
+            if (is_callee_saved(reg))
+            {
+                debug("%s moved from register %d to register %d", bite->id, bite->reg, reg);
+                EMIT_MOV64_REG_REG(get_x86_64_register(reg), get_register(bite));
+                bite->reg = reg;
+                break;
+            }
+        }
+    }
+
+    reg_unboxed[bite->reg] = unboxed;
+    return reglist_push(dest, bite->reg);
+}
+
+bool is_call_argument_register(Bite* bite, int reg);
+
+// Whether the register must be saved on the JIT stack for the duration of a
+// call. The caller-saved registers are clobbered by all calls and the other
+// ones might contain pointers that the GC must update if the call can run it.
+bool must_save_register(int reg, bool gc)
+{
+    return reglist_in_use(reg) && (!is_callee_saved(reg) || (gc && !reg_unboxed[reg]));
+}
+
+int save_registers(uint8_t** mem, Bite* call, bool gc)
+{
+    int saved = 0;
+
+    for (int r = 0; r < TEMP_REGISTERS; r++)
+    {
+        if (must_save_register(r, gc) && !(call && is_call_argument_register(call, r)))
+        {
+            PUSH_TO_STACK(get_x86_64_register(r));
+            ++saved;
+        }
+    }
+
+    return saved;
+}
+
+void restore_registers(uint8_t** mem, Bite* call, bool gc)
+{
+    for (int r = TEMP_REGISTERS - 1; r >= 0; r--)
+    {
+        if (must_save_register(r, gc) && !(call && is_call_argument_register(call, r)))
+        {
+            POP_FROM_STACK(get_x86_64_register(r));
+        }
+    }
+}
+
 bool bite_compile(uint8_t** mem, Bite* bite);
 
 bool bite_compile_constant(uint8_t** mem, Bite* bite)
@@ -1139,13 +2514,167 @@ bool bite_compile_argument(uint8_t** mem, Bite* bite)
     return true;
 }
 
+// The side that needs more registers is compiled first so that the other side
+// can use the remaining ones. If only one of them calls a function, it's
+// compiled first as then nothing needs to be kept alive across the call.
+bool compile_rhs_first(Bite* lhs, Bite* rhs)
+{
+    if (lhs->calls != rhs->calls)
+    {
+        return rhs->calls;
+    }
+
+    return rhs->reg_count > lhs->reg_count;
+}
+
+// The multiplication untags the left-hand side first: the tag of the other
+// side is then enough for the result. The tag bits of the bitwise operations
+// are zero for numbers which means they can operate on the tagged values.
+void emit_untag_lhs(uint8_t** mem, int op, int reg)
+{
+    if (op == OP_MUL)
+    {
+        EMIT_SAR64_IMM8(reg, NUMBER_SHIFT);
+    }
+}
+
+// reg = reg <op> base[off]
+void emit_binary_op_mem(uint8_t** mem, int op, int reg, int base, int off)
+{
+    emit_untag_lhs(mem, op, reg);
+
+    switch (op)
+    {
+    case OP_ADD:
+        EMIT_ADD64_REG_OFF8(reg, base, off);
+        break;
+
+    case OP_SUB:
+        EMIT_SUB64_REG_OFF8(reg, base, off);
+        break;
+
+    case OP_MUL:
+        EMIT_IMUL64_REG_OFF8(reg, base, off);
+        break;
+
+    case OP_AND:
+        EMIT_AND64_REG_OFF8(reg, base, off);
+        break;
+
+    case OP_OR:
+        EMIT_OR64_REG_OFF8(reg, base, off);
+        break;
+
+    case OP_XOR:
+        EMIT_XOR64_REG_OFF8(reg, base, off);
+        break;
+
+    case OP_LESS:
+    case OP_EQ:
+        EMIT_CMP64_REG_OFF8(reg, base, off);
+        break;
+
+    default:
+        assert(false);
+        break;
+    }
+}
+
+// reg = reg <op> imm
+void emit_binary_op_imm(uint8_t** mem, int op, int reg, intptr_t imm)
+{
+    emit_untag_lhs(mem, op, reg);
+
+    switch (op)
+    {
+    case OP_ADD:
+        EMIT_ADD64_IMM32(reg, imm);
+        break;
+
+    case OP_SUB:
+        EMIT_SUB64_IMM32(reg, imm);
+        break;
+
+    case OP_MUL:
+        EMIT_IMUL64_IMM32(reg, imm);
+        break;
+
+    case OP_AND:
+        EMIT_AND64_IMM32(reg, imm);
+        break;
+
+    case OP_OR:
+        EMIT_OR64_IMM32(reg, imm);
+        break;
+
+    case OP_XOR:
+        EMIT_XOR64_IMM32(reg, imm);
+        break;
+
+    case OP_LESS:
+    case OP_EQ:
+        EMIT_CMP64_IMM32(reg, imm);
+        break;
+
+    default:
+        assert(false);
+        break;
+    }
+}
+
+// reg = reg <op> other
+void emit_binary_op_reg(uint8_t** mem, int op, int reg, int other)
+{
+    emit_untag_lhs(mem, op, reg);
+
+    switch (op)
+    {
+    case OP_ADD:
+        EMIT_ADD64_REG_REG(reg, other);
+        break;
+
+    case OP_SUB:
+        EMIT_SUB64_REG_REG(reg, other);
+        break;
+
+    case OP_MUL:
+        EMIT_IMUL64_REG_REG(reg, other);
+        break;
+
+    case OP_AND:
+        EMIT_AND64_REG_REG(reg, other);
+        break;
+
+    case OP_OR:
+        EMIT_OR64_REG_REG(reg, other);
+        break;
+
+    case OP_XOR:
+        EMIT_XOR64_REG_REG(reg, other);
+        break;
+
+    case OP_LESS:
+    case OP_EQ:
+        EMIT_CMP64_REG_REG(reg, other);
+        break;
+
+    default:
+        assert(false);
+        break;
+    }
+}
+
 bool bite_compile_binary_op(uint8_t** mem, Bite* bite, int op)
 {
     Bite* lhs = bite->arg1;
     Bite* rhs = bite->arg2;
 
-    // Constant should've been folded by now
-    assert(lhs->op != OP_CONSTANT || rhs->op != OP_CONSTANT);
+    bool is_arithmetic = is_arithmetic_op(op);
+
+    // Constants should've been folded by now, only arithmetic on things that
+    // aren't numbers is left.
+    assert(lhs->op != OP_CONSTANT || rhs->op != OP_CONSTANT ||
+           (is_arithmetic && !(is_number_constant(lhs) && is_number_constant(rhs))));
 
     if (rhs->reg_count == 0)
     {
@@ -1154,58 +2683,34 @@ bool bite_compile_binary_op(uint8_t** mem, Bite* bite, int op)
             return false;
         }
 
-        if (is_argument(rhs))
+        if (is_arithmetic)
         {
-            switch (op)
-            {
-            case OP_ADD:
-                EMIT_ADD64_REG_OFF8(get_register(lhs), REG_ARGS, get_constant(rhs));
-                break;
+            // Constants are checked when the function is compiled
+            emit_number_check(mem, get_register(lhs));
 
-            case OP_SUB:
-                EMIT_SUB64_REG_OFF8(get_register(lhs), REG_ARGS, get_constant(rhs));
-                break;
-
-            case OP_LESS:
-            case OP_EQ:
-                EMIT_CMP64_REG_OFF8(get_register(lhs), REG_ARGS, get_constant(rhs));
-                break;
-
-            default:
-                assert(false);
-                break;
+            if (is_argument(rhs))
+            {
+                emit_argument_number_check(mem, get_constant(rhs));
             }
         }
+
+        if (is_argument(rhs))
+        {
+            emit_binary_op_mem(mem, op, get_register(lhs), REG_ARGS, get_constant(rhs));
+        }
         else
         {
             assert(get_constant(rhs) < MAX_IMMEDIATE_CONSTANT_SIZE &&
                    get_constant(rhs) > -MAX_IMMEDIATE_CONSTANT_SIZE);
 
-            switch (op)
-            {
-            case OP_ADD:
-                EMIT_ADD64_IMM32(get_register(lhs), get_constant(rhs));
-                break;
-
-            case OP_SUB:
-                EMIT_SUB64_IMM32(get_register(lhs), get_constant(rhs));
-                break;
-
-            case OP_LESS:
-            case OP_EQ:
-                EMIT_CMP64_IMM32(get_register(lhs), get_constant(rhs));
-                break;
-
-            default:
-                assert(false);
-                break;
-            }
+            emit_binary_op_imm(mem, op, get_register(lhs), get_constant(rhs));
         }
 
         bite->reg = lhs->reg;
         debug("%s uses register %d from %s", bite->id, bite->reg, lhs->id);
     }
-    else if (rhs->reg_count <= lhs->reg_count && rhs->reg_count < reglist->size)
+    else if (rhs->reg_count < reglist->size &&
+             (!compile_rhs_first(lhs, rhs) || lhs->reg_count >= reglist->size))
     {
         if (!bite_compile(mem, lhs))
         {
@@ -1213,7 +2718,7 @@ bool bite_compile_binary_op(uint8_t** mem, Bite* bite, int op)
         }
 
         RegList r;
-        RegList* prev = reglist_push(&r, lhs->reg);
+        RegList* prev = reglist_hold(mem, &r, lhs, rhs->calls, is_unboxed(lhs, op));
 
         if (!bite_compile(mem, rhs))
         {
@@ -1224,30 +2729,18 @@ bool bite_compile_binary_op(uint8_t** mem, Bite* bite, int op)
 
         assert(rhs->reg != lhs->reg);
 
-        switch (op)
+        if (is_arithmetic)
         {
-        case OP_ADD:
-            EMIT_ADD64_REG_REG(get_register(lhs), get_register(rhs));
-            break;
-
-        case OP_SUB:
-            EMIT_SUB64_REG_REG(get_register(lhs), get_register(rhs));
-            break;
-
-        case OP_LESS:
-        case OP_EQ:
-            EMIT_CMP64_REG_REG(get_register(lhs), get_register(rhs));
-            break;
-
-        default:
-            assert(false);
-            break;
+            emit_number_check(mem, get_register(lhs));
+            emit_number_check(mem, get_register(rhs));
         }
 
+        emit_binary_op_reg(mem, op, get_register(lhs), get_register(rhs));
+
         bite->reg = lhs->reg;
         debug("%s uses register %d from %s", bite->id, bite->reg, lhs->id);
     }
-    else if (rhs->reg_count > lhs->reg_count && lhs->reg_count < reglist->size)
+    else if (lhs->reg_count < reglist->size)
     {
         if (!bite_compile(mem, rhs))
         {
@@ -1255,7 +2748,7 @@ bool bite_compile_binary_op(uint8_t** mem, Bite* bite, int op)
         }
 
         RegList r;
-        RegList* prev = reglist_push(&r, rhs->reg);
+        RegList* prev = reglist_hold(mem, &r, rhs, lhs->calls, is_unboxed(rhs, op));
 
         if (!bite_compile(mem, lhs))
         {
@@ -1266,26 +2759,14 @@ bool bite_compile_binary_op(uint8_t** mem, Bite* bite, int op)
 
         assert(rhs->reg != lhs->reg);
 
-        switch (op)
+        if (is_arithmetic)
         {
-        case OP_ADD:
-            EMIT_ADD64_REG_REG(get_register(lhs), get_register(rhs));
-            break;
-
-        case OP_SUB:
-            EMIT_SUB64_REG_REG(get_register(lhs), get_register(rhs));
-            break;
-
-        case OP_LESS:
-        case OP_EQ:
-            EMIT_CMP64_REG_REG(get_register(lhs), get_register(rhs));
-            break;
-
-        default:
-            assert(false);
-            break;
+            emit_number_check(mem, get_register(lhs));
+            emit_number_check(mem, get_register(rhs));
         }
 
+        emit_binary_op_reg(mem, op, get_register(lhs), get_register(rhs));
+
         bite->reg = lhs->reg;
         debug("%s uses register %d from %s", bite->id, bite->reg, lhs->id);
     }
@@ -1301,6 +2782,11 @@ bool bite_compile_binary_op(uint8_t** mem, Bite* bite, int op)
 
         int temp = temps++;
 
+        if (is_arithmetic)
+        {
+            emit_number_check(mem, get_register(rhs));
+        }
+
         EMIT_MOV64_PTR_REG(REG_STACK, get_register(rhs));
         EMIT_ADD64_IMM8(REG_STACK, OBJ_SIZE);
 
@@ -1311,25 +2797,12 @@ bool bite_compile_binary_op(uint8_t** mem, Bite* bite, int op)
             return false;
         }
 
-        switch (op)
+        if (is_arithmetic)
         {
-        case OP_ADD:
-            EMIT_ADD64_REG_OFF8(get_register(lhs), REG_STACK, -OBJ_SIZE);
-            break;
+            emit_number_check(mem, get_register(lhs));
+        }
 
-        case OP_SUB:
-            EMIT_SUB64_REG_OFF8(get_register(lhs), REG_STACK, -OBJ_SIZE);
-            break;
-
-        case OP_LESS:
-        case OP_EQ:
-            EMIT_CMP64_REG_OFF8(get_register(lhs), REG_STACK, -OBJ_SIZE);
-            break;
-
-        default:
-            assert(false);
-            break;
-        }
+        emit_binary_op_mem(mem, op, get_register(lhs), REG_STACK, -OBJ_SIZE);
 
         EMIT_SUB64_IMM8(REG_STACK, OBJ_SIZE);
         bite->reg = lhs->reg;
@@ -1362,6 +2835,245 @@ bool bite_compile_cmp_tail(uint8_t** mem, Bite* bite, int op)
     return true;
 }
 
+// Compiles both operands of an operation that needs them in registers. If
+// there aren't enough registers for both, the left-hand side is left on the JIT
+// stack and spilled is set. The right-hand side is always a number, the
+// left-hand side is checked to be one if lhs_number is set.
+bool bite_compile_operands(uint8_t** mem, Bite* bite, bool lhs_number, bool* spilled)
+{
+    Bite* lhs = bite->arg1;
+    Bite* rhs = bite->arg2;
+    *spilled = rhs->reg_count >= reglist->size;
+
+    if (!bite_compile(mem, lhs))
+    {
+        return false;
+    }
+
+    if (lhs_number)
+    {
+        emit_number_check(mem, get_register(lhs));
+    }
+
+    if (*spilled)
+    {
+        PUSH_TO_STACK(get_register(lhs));
+        debug("%s spilled to memory from register %d", lhs->id, lhs->reg);
+
+        if (!bite_compile(mem, rhs))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        RegList r;
+        RegList* prev = reglist_hold(mem, &r, lhs, rhs->calls, lhs_number || is_unboxed(lhs, bite->op));
+
+        if (!bite_compile(mem, rhs))
+        {
+            return false;
+        }
+
+        reglist_pop(prev);
+    }
+
+    emit_number_check(mem, get_register(rhs));
+    return true;
+}
+
+bool bite_compile_div(uint8_t** mem, Bite* bite, int op)
+{
+    Bite* lhs = bite->arg1;
+    Bite* rhs = bite->arg2;
+    bool spilled;
+
+    if (!bite_compile_operands(mem, bite, true, &spilled))
+    {
+        return false;
+    }
+
+    int divisor = get_register(rhs);
+
+    // The VM reports the division by zero
+    EMIT_TEST64_REG_REG(divisor, divisor);
+    EMIT_JE_OFF32();
+    set_bailout_marker(*mem);
+
+    // The dividend of IDIV is always in RDX:RAX. Both of them are saved on the
+    // machine stack as they might be in use and the divisor is stored there
+    // as it might be in either of them.
+    EMIT_PUSH(REG_RDX);
+    EMIT_PUSH(REG_RAX);
+    EMIT_PUSH(divisor);
+
+    if (spilled)
+    {
+        EMIT_MOV64_REG_OFF8(REG_RAX, REG_STACK, -OBJ_SIZE);
+    }
+    else if (get_register(lhs) != REG_RAX)
+    {
+        EMIT_MOV64_REG_REG(REG_RAX, get_register(lhs));
+    }
+
+    EMIT_CQO();
+    EMIT_IDIV64_PTR(REG_RSP);
+
+    // The quotient of two tagged numbers is untagged but the remainder is not
+    int result = REG_RDX;
+
+    if (op == OP_DIV)
+    {
+        EMIT_SAL64_IMM8(REG_RAX, NUMBER_SHIFT);
+        result = REG_RAX;
+    }
+
+    bite->reg = spilled ? rhs->reg : lhs->reg;
+    debug("%s uses register %d", bite->id, bite->reg);
+    int dest = get_register(bite);
+
+    if (dest != result)
+    {
+        EMIT_MOV64_REG_REG(dest, result);
+    }
+
+    EMIT_ADD64_IMM8(REG_RSP, OBJ_SIZE);
+
+    if (dest == REG_RAX)
+    {
+        EMIT_ADD64_IMM8(REG_RSP, OBJ_SIZE);
+    }
+    else
+    {
+        EMIT_POP(REG_RAX);
+    }
+
+    if (dest == REG_RDX)
+    {
+        EMIT_ADD64_IMM8(REG_RSP, OBJ_SIZE);
+    }
+    else
+    {
+        EMIT_POP(REG_RDX);
+    }
+
+    if (spilled)
+    {
+        FREE_STACK(OBJ_SIZE);
+    }
+
+    return true;
+}
+
+// Limits the shift count in RCX to 63 which gives the same result as any larger
+// shift count would
+void emit_shift_count_limit(uint8_t** mem)
+{
+    EMIT_CMP64_REG_IMM8(REG_RCX, 63);
+    EMIT_JLE_OFF8();
+    uint8_t* jump_start = *mem;
+    EMIT_MOV64_REG_IMM32(REG_RCX, 63);
+    PATCH_JMP8(jump_start, *mem - jump_start);
+}
+
+bool bite_compile_ash(uint8_t** mem, Bite* bite)
+{
+    Bite* lhs = bite->arg1;
+    Bite* rhs = bite->arg2;
+
+    if (is_number_constant(rhs))
+    {
+        if (!bite_compile(mem, lhs))
+        {
+            return false;
+        }
+
+        int reg = get_register(lhs);
+        int64_t count = get_number((Object*)get_constant(rhs));
+        emit_number_check(mem, reg);
+
+        if (count >= 0)
+        {
+            EMIT_SAL64_IMM8(reg, count > 63 ? 63 : count);
+        }
+        else
+        {
+            // The bits that are shifted into the tag are cleared
+            EMIT_SAR64_IMM8(reg, count < -63 ? 63 : -count);
+            EMIT_AND64_IMM32(reg, ~TYPE_MASK);
+        }
+
+        bite->reg = lhs->reg;
+        debug("%s uses register %d from %s", bite->id, bite->reg, lhs->id);
+        return true;
+    }
+
+    bool spilled;
+
+    if (!bite_compile_operands(mem, bite, true, &spilled))
+    {
+        return false;
+    }
+
+    // The shift count must be in CL and the direction depends on its sign. The
+    // value is shifted on the machine stack which leaves RCX as the only
+    // register that needs to be saved.
+    EMIT_PUSH(REG_RCX);
+
+    if (spilled)
+    {
+        EMIT_PUSH_OFF8(REG_STACK, -OBJ_SIZE);
+    }
+    else
+    {
+        EMIT_PUSH(get_register(lhs));
+    }
+
+    if (get_register(rhs) != REG_RCX)
+    {
+        EMIT_MOV64_REG_REG(REG_RCX, get_register(rhs));
+    }
+
+    EMIT_SAR64_IMM8(REG_RCX, NUMBER_SHIFT);
+    EMIT_TEST64_REG_REG(REG_RCX, REG_RCX);
+    EMIT_JS_OFF8();
+    uint8_t* jump_to_right = *mem;
+
+    emit_shift_count_limit(mem);
+    EMIT_SHL64_PTR_CL(REG_RSP);
+    EMIT_JMP_OFF8();
+    uint8_t* jump_to_end = *mem;
+
+    PATCH_JMP8(jump_to_right, *mem - jump_to_right);
+    EMIT_NEG64(REG_RCX);
+    emit_shift_count_limit(mem);
+    EMIT_SAR64_PTR_CL(REG_RSP);
+    EMIT_AND64_PTR_IMM8(REG_RSP, ~TYPE_MASK);
+
+    PATCH_JMP8(jump_to_end, *mem - jump_to_end);
+
+    bite->reg = spilled ? rhs->reg : lhs->reg;
+    debug("%s uses register %d", bite->id, bite->reg);
+    int dest = get_register(bite);
+    EMIT_POP(dest);
+
+    if (dest == REG_RCX)
+    {
+        EMIT_ADD64_IMM8(REG_RSP, OBJ_SIZE);
+    }
+    else
+    {
+        EMIT_POP(REG_RCX);
+    }
+
+    if (spilled)
+    {
+        FREE_STACK(OBJ_SIZE);
+    }
+
+    return true;
+}
+
 bool bite_compile_unary_op(uint8_t** mem, Bite* bite, int op)
 {
     Bite* val = bite->arg1;
@@ -1376,12 +3088,45 @@ bool bite_compile_unary_op(uint8_t** mem, Bite* bite, int op)
     switch (op)
     {
     case OP_NEG:
+        emit_number_check(mem, reg);
         EMIT_NEG64(reg);
         break;
 
     case OP_PTR:
-        assert(get_ptr_offset(bite) < 128);
-        EMIT_MOV64_REG_OFF8(reg, reg, get_ptr_offset(bite));
+        assert(get_ptr_offset(bite) + TYPE_CELL < 128);
+
+        if (emit_type_checks)
+        {
+            // Removing the tag leaves the low bits set if it's not a cons
+            // cell. The register is only needed for the load if the check
+            // succeeds which means no extra registers are needed.
+            EMIT_XOR64_IMM8(reg, TYPE_CELL);
+            EMIT_TEST64_IMM32(reg, TYPE_MASK);
+            EMIT_JNE_OFF32();
+            set_bailout_marker(*mem);
+            EMIT_MOV64_REG_OFF8(reg, reg, get_ptr_offset(bite) + TYPE_CELL);
+        }
+        else
+        {
+            EMIT_MOV64_REG_OFF8(reg, reg, get_ptr_offset(bite));
+        }
+        break;
+
+    case OP_VECTOR_LENGTH:
+        if (emit_type_checks)
+        {
+            EMIT_XOR64_IMM8(reg, TYPE_VECTOR);
+            EMIT_TEST64_IMM32(reg, TYPE_MASK);
+            EMIT_JNE_OFF32();
+            set_bailout_marker(*mem);
+            EMIT_MOV64_REG_OFF8(reg, reg, offsetof(Object, length));
+        }
+        else
+        {
+            EMIT_MOV64_REG_OFF8(reg, reg, offsetof(Object, length) - TYPE_VECTOR);
+        }
+
+        EMIT_SAL64_IMM8(reg, NUMBER_SHIFT);
         break;
     }
 
@@ -1390,6 +3135,62 @@ bool bite_compile_unary_op(uint8_t** mem, Bite* bite, int op)
     return true;
 }
 
+// The index is a tagged number which makes it the offset of the element from
+// the start of the items
+bool bite_compile_vector_ref(uint8_t** mem, Bite* bite)
+{
+    Bite* lhs = bite->arg1;
+    Bite* rhs = bite->arg2;
+    bool spilled;
+
+    if (!bite_compile_operands(mem, bite, false, &spilled))
+    {
+        return false;
+    }
+
+    int index = get_register(rhs);
+    int vec = get_register(lhs);
+    int offset = offsetof(Object, items) - TYPE_VECTOR;
+
+    if (spilled)
+    {
+        // The vector is on the JIT stack, a register is borrowed for it
+        vec = index == REG_RAX ? REG_RDX : REG_RAX;
+        EMIT_PUSH(vec);
+        EMIT_MOV64_REG_OFF8(vec, REG_STACK, -OBJ_SIZE);
+    }
+
+    if (emit_type_checks)
+    {
+        EMIT_XOR64_IMM8(vec, TYPE_VECTOR);
+        EMIT_TEST64_IMM32(vec, TYPE_MASK);
+        EMIT_JNE_OFF32();
+        set_bailout_marker(*mem);
+
+        // Negative indexes are out of range when compared as unsigned values
+        EMIT_SAR64_IMM8(index, NUMBER_SHIFT);
+        EMIT_CMP64_REG_OFF8(index, vec, offsetof(Object, length));
+        EMIT_JAE_OFF32();
+        set_bailout_marker(*mem);
+        EMIT_SAL64_IMM8(index, NUMBER_SHIFT);
+        offset += TYPE_VECTOR;
+    }
+
+    EMIT_ADD64_REG_REG(vec, index);
+    EMIT_MOV64_REG_OFF8(vec, vec, offset);
+
+    if (spilled)
+    {
+        EMIT_MOV64_REG_REG(index, vec);
+        EMIT_POP(vec);
+        FREE_STACK(OBJ_SIZE);
+    }
+
+    bite->reg = spilled ? rhs->reg : lhs->reg;
+    debug("%s uses register %d", bite->id, bite->reg);
+    return true;
+}
+
 bool bite_compile_if(uint8_t** mem, Bite* bite)
 {
     Bite* cond = bite->arg1;
@@ -1528,27 +3329,26 @@ bool bite_compile_call(uint8_t** mem, Bite* bite)
     bite->reg = bite->arg1 ? bite->arg1->arg1->reg : reglist->reg[0];
     debug("%s uses register %d from %s", bite->id, bite->reg,
           bite->arg1 ? bite->arg1->arg1->id : "free register list");
-    int temp_regs = 0;
+    int temp_regs = save_registers(mem, bite, true);
 
-    for (int r = 0; r < TEMP_REGISTERS; r++)
-    {
-        if (reglist_in_use(r) && !is_call_argument_register(bite, r))
-        {
-            PUSH_TO_STACK(get_x86_64_register(r));
-            ++temp_regs;
-        }
-    }
+    // Both are pushed to keep the stack aligned for the call. They're saved
+    // even if there are no arguments as the stack pointer is needed for the
+    // tail call that the callee might return.
+    EMIT_PUSH(REG_ARGS);
+    EMIT_PUSH(REG_STACK);
 
     if (len > 0)
     {
-        EMIT_PUSH(REG_ARGS);
         EMIT_MOV64_REG_REG(REG_ARGS, REG_STACK);
         EMIT_SUB64_IMM8(REG_ARGS, OBJ_SIZE * (len + temp_regs));
     }
 
     intptr_t fn = (intptr_t)bite->arg2;
-    EMIT_MOV64_REG_IMM64(REG_RET, fn);
+    emit_address(mem, REG_RET, RELOC_CALL, fn);
     EMIT_CALL_REG(REG_RET);
+    EMIT_POP(REG_STACK);
+    EMIT_POP(REG_ARGS);
+    emit_call_result_check(mem);
 
     // Move the result onto the stack
     if (get_register(bite) != REG_RET)
@@ -1556,24 +3356,45 @@ bool bite_compile_call(uint8_t** mem, Bite* bite)
         EMIT_MOV64_REG_REG(get_register(bite), REG_RET);
     }
 
+    restore_registers(mem, bite, true);
+
     if (len > 0)
     {
-        EMIT_POP(REG_ARGS);
+        FREE_STACK(OBJ_SIZE * len);
     }
 
-    for (int r = TEMP_REGISTERS - 1; r >= 0; r--)
+    return true;
+}
+
+// A tail call to a function that takes more arguments than the caller pushes
+// the arguments onto the stack followed by the code of the callee and the
+// number of arguments. The function then returns JitTailCall with the address
+// after them in RDX and whoever called it makes the call, either jit_run() or
+// the code after the call, see emit_call_result_check(). A chain of such tail
+// calls doesn't grow the stack.
+bool bite_compile_tail_return(uint8_t** mem, Bite* bite)
+{
+    int len = 0;
+
+    for (Bite* b = bite->arg1; b; b = b->arg2)
     {
-        if (reglist_in_use(r) && !is_call_argument_register(bite, r))
-        {
-            POP_FROM_STACK(get_x86_64_register(r));
-        }
+        len++;
     }
 
-    if (len > 0)
+    if (!bite_compile_call_arguments(mem, bite->arg1))
     {
-        FREE_STACK(OBJ_SIZE * len);
+        return false;
     }
 
+    bite->reg = bite->arg1 ? bite->arg1->arg1->reg : reglist->reg[0];
+    emit_address(mem, REG_RET, RELOC_CALL, (intptr_t)bite->arg2);
+    PUSH_TO_STACK(REG_RET);
+    EMIT_MOV64_REG_IMM32(REG_RET, len);
+    PUSH_TO_STACK(REG_RET);
+    EMIT_MOV64_REG_REG(REG_RDX, REG_STACK);
+    FREE_STACK(OBJ_SIZE * (len + 2));
+    EMIT_JMP_OFF32();
+    set_tail_return_marker(*mem);
     return true;
 }
 
@@ -1616,7 +3437,7 @@ bool bite_compile_recurse(uint8_t** mem, Bite* bite)
     assert(reglist->size == TEMP_REGISTERS);
 
     RegList* prev = reglist;
-    RegList regs[4];
+    RegList regs[TEMP_REGISTERS];
     int n = 0;
     int i = 0;
 
@@ -1637,8 +3458,15 @@ bool bite_compile_recurse(uint8_t** mem, Bite* bite)
 
             if (reglist->size > 1)
             {
+                bool calls = false;
+
+                for (Bite* next = b->arg2; next; next = next->arg2)
+                {
+                    calls = calls || next->arg1->calls;
+                }
+
+                reglist_hold(mem, &regs[n++], b->arg1, calls, is_unboxed(b->arg1, OP_RECURSE));
                 debug("%s stored in register %d for recursion for arg offset %d", b->arg1->id, b->arg1->reg, i);
-                reglist_push(&regs[n++], b->arg1->reg);
             }
             else
             {
@@ -1661,9 +3489,20 @@ bool bite_compile_recurse(uint8_t** mem, Bite* bite)
     // the previous step.
     copy_to_arguments(mem, bite->arg1, len, 0);
 
-    // The offset is patched after compilation is complete
-    EMIT_JMP_OFF32();
-    set_recursion_marker(*mem);
+    if (bite->op == OP_TAIL_CALL)
+    {
+        // The callee gets the stack the caller was called with and returns
+        // straight to it once the epilogue at the end of the function is done
+        emit_address(mem, REG_RET, RELOC_CALL, (intptr_t)bite->arg2);
+        EMIT_JMP_OFF32();
+        set_tail_call_marker(*mem);
+    }
+    else
+    {
+        // The offset is patched after compilation is complete
+        EMIT_JMP_OFF32();
+        set_recursion_marker(*mem);
+    }
 
     reglist_pop(prev);
 
@@ -1706,27 +3545,21 @@ bool bite_compile_writechar_arg(uint8_t** mem, Bite* bite)
         return false;
     }
 
-    assert(get_x86_64_register(0) == REG_RET);
-
-    if (reglist_in_use(0))
-    {
-        PUSH_TO_STACK(REG_RET);
-    }
+    // The function doesn't allocate memory so only the registers that it
+    // clobbers need to be saved. The register of the argument isn't in use.
+    save_registers(mem, NULL, false);
 
     EMIT_PUSH(REG_ARGS);
     EMIT_PUSH(REG_STACK);
 
     EMIT_MOV64_REG_REG(REG_ARGS, get_register(bite->arg1));
-    EMIT_MOV64_REG_IMM64(REG_RET, (intptr_t)compiled_writechar);
+    emit_address(mem, REG_RET, RELOC_WRITECHAR, (intptr_t)compiled_writechar);
     EMIT_CALL_REG(REG_RET);
 
     EMIT_POP(REG_STACK);
     EMIT_POP(REG_ARGS);
 
-    if (reglist_in_use(0))
-    {
-        POP_FROM_STACK(REG_RET);
-    }
+    restore_registers(mem, NULL, false);
 
     return true;
 }
@@ -1742,39 +3575,115 @@ bool bite_compile_writechar(uint8_t** mem, Bite* bite)
     return true;
 }
 
-bool bite_compile_cons(uint8_t** mem, Bite* bite)
+// Calls cons with the values in the two registers and stores the result in the
+// first one. Neither of the registers needs to be kept alive: cons keeps the
+// values reachable while it allocates.
+void emit_cons_call(uint8_t** mem, int car_reg, int cdr_reg)
 {
-    // Push all of the in-use registers onto the stack
-    for (int r = 0; r < TEMP_REGISTERS; r++)
-    {
-        if (reglist_in_use(r))
-        {
-            PUSH_TO_STACK(get_x86_64_register(r));
-        }
-    }
+    assert(car_reg != REG_ARGS && car_reg != REG_STACK);
+    assert(cdr_reg != REG_ARGS && cdr_reg != REG_STACK);
+    assert(REG_ARGS == REG_RDI); // 1st argument
+    assert(REG_STACK == REG_RSI); // 2nd argument
 
-    // Save the two arguments onto the stack
+    // Push the in-use registers that the call might clobber onto the stack
+    save_registers(mem, NULL, true);
 
-    if (!bite_compile(mem, bite->arg1))
-    {
-        return false;
-    }
+    EMIT_PUSH(REG_ARGS);
+    EMIT_PUSH(REG_STACK);
 
-    bite->reg = bite->arg1->reg;
-    debug("%s uses register %d from %s", bite->id, bite->reg, bite->arg1->id);
+    // Store a NULL value at the end of the stack so that the garbage collection
+    // knows where the stack ends.
+    EMIT_MOV64_REG_IMM64(REG_RDI, (intptr_t)JitEnd);
+    EMIT_MOV64_PTR_REG(REG_STACK, REG_RDI);
 
-    PUSH_TO_STACK(get_register(bite->arg1));
+    EMIT_MOV64_REG_REG(REG_RDI, car_reg);
+    EMIT_MOV64_REG_REG(REG_RSI, cdr_reg);
+    emit_address(mem, REG_RET, RELOC_CONS, (intptr_t)compiled_cons);
+    EMIT_CALL_REG(REG_RET);
 
-    if (!bite_compile(mem, bite->arg2))
+    EMIT_POP(REG_STACK);
+    EMIT_POP(REG_ARGS);
+
+    if (car_reg != REG_RET)
     {
-        return false;
+        EMIT_MOV64_REG_REG(car_reg, REG_RET);
     }
 
-    PUSH_TO_STACK(get_register(bite->arg2));
+    restore_registers(mem, NULL, true);
+}
 
-    assert(get_x86_64_register(0) == REG_RET);
-    assert(REG_ARGS == REG_RDI); // 1st argument
-    assert(REG_STACK == REG_RSI); // 2nd argument
+// Allocates the cell directly from the cell nursery if there's room for it. The
+// slow path that's jumped to if there isn't is returned.
+uint8_t* emit_cons_fast_path(uint8_t** mem, int car_reg, int cdr_reg, int ptr, int addr)
+{
+    intptr_t end_offset = (uint8_t*)&cell_end - (uint8_t*)&cell_ptr;
+    bool near_end = end_offset >= INT8_MIN && end_offset <= INT8_MAX;
+
+    // ptr = cell_ptr + size
+    emit_address(mem, addr, RELOC_CELL_PTR, (intptr_t)&cell_ptr);
+    EMIT_MOV64_REG_PTR(ptr, addr);
+    EMIT_ADD64_IMM8(ptr, CONS_SIZE);
+
+    if (near_end)
+    {
+        EMIT_CMP64_REG_OFF8(ptr, addr, end_offset);
+    }
+    else
+    {
+        emit_address(mem, addr, RELOC_CELL_END, (intptr_t)&cell_end);
+        EMIT_CMP64_REG_PTR(ptr, addr);
+    }
+
+    EMIT_JA_OFF32();
+    uint8_t* jump_to_slow = *mem;
+
+    if (!near_end)
+    {
+        emit_address(mem, addr, RELOC_CELL_PTR, (intptr_t)&cell_ptr);
+    }
+
+    EMIT_MOV64_PTR_REG(addr, ptr);
+
+    // The cell is in the nursery which means the stores need no write barrier
+    EMIT_MOV64_OFF8_REG(ptr, car_reg, (int)offsetof(Object, car) - CONS_SIZE);
+    EMIT_MOV64_OFF8_REG(ptr, cdr_reg, (int)offsetof(Object, cdr) - CONS_SIZE);
+
+    // car_reg = make_ptr(ptr - size, TYPE_CELL)
+    EMIT_MOV64_REG_REG(car_reg, ptr);
+    EMIT_SUB64_IMM8(car_reg, CONS_SIZE - TYPE_CELL);
+
+    return jump_to_slow;
+}
+
+// Used when there aren't enough registers to keep both of the values in them:
+// the values are stored on the JIT stack and cons is always called.
+bool bite_compile_cons_spill(uint8_t** mem, Bite* bite)
+{
+    // Push the in-use registers that the call might clobber onto the stack
+    save_registers(mem, NULL, true);
+
+    // Save the two arguments onto the stack
+
+    if (!bite_compile(mem, bite->arg1))
+    {
+        return false;
+    }
+
+    bite->reg = bite->arg1->reg;
+    debug("%s uses register %d from %s", bite->id, bite->reg, bite->arg1->id);
+
+    PUSH_TO_STACK(get_register(bite->arg1));
+
+    if (!bite_compile(mem, bite->arg2))
+    {
+        return false;
+    }
+
+    PUSH_TO_STACK(get_register(bite->arg2));
+
+    assert(get_x86_64_register(0) == REG_RET);
+    assert(REG_ARGS == REG_RDI); // 1st argument
+    assert(REG_STACK == REG_RSI); // 2nd argument
 
     // Store a NULL value at the end of the stack so that the garbage collection
     // knows where the stack ends.
@@ -1789,7 +3698,7 @@ bool bite_compile_cons(uint8_t** mem, Bite* bite)
     // must be the last one that's moved.
     EMIT_MOV64_REG_OFF8(REG_RDI, REG_STACK, -OBJ_SIZE * 2);
     EMIT_MOV64_REG_OFF8(REG_RSI, REG_STACK, -OBJ_SIZE * 1);
-    EMIT_MOV64_REG_IMM64(REG_RET, (intptr_t)compiled_cons);
+    emit_address(mem, REG_RET, RELOC_CONS, (intptr_t)compiled_cons);
     EMIT_CALL_REG(REG_RET);
 
     EMIT_POP(REG_STACK);
@@ -1802,16 +3711,95 @@ bool bite_compile_cons(uint8_t** mem, Bite* bite)
     }
 
     FREE_STACK(OBJ_SIZE * 2);
+    assert(!reglist_in_use(bite->reg));
+    restore_registers(mem, NULL, true);
 
-    for (int r = TEMP_REGISTERS - 1; r >= 0; r--)
+    return true;
+}
+
+bool bite_compile_cons(uint8_t** mem, Bite* bite)
+{
+    if (bite->arg2->reg_count >= reglist->size)
     {
-        if (reglist_in_use(r))
-        {
-            assert(r != bite->reg);
-            POP_FROM_STACK(get_x86_64_register(r));
-        }
+        return bite_compile_cons_spill(mem, bite);
+    }
+
+    RegList* entry = reglist;
+    RegList car_list;
+    RegList cdr_list;
+
+    if (!bite_compile(mem, bite->arg1))
+    {
+        return false;
+    }
+
+    reglist_hold(mem, &car_list, bite->arg1, bite->arg2->calls, is_unboxed(bite->arg1, OP_CONS));
+
+    if (!bite_compile(mem, bite->arg2))
+    {
+        return false;
+    }
+
+    reglist_hold(mem, &cdr_list, bite->arg2, false, false);
+
+    int car_reg = get_register(bite->arg1);
+    int cdr_reg = get_register(bite->arg2);
+    bite->reg = bite->arg1->reg;
+    debug("%s uses register %d from %s", bite->id, bite->reg, bite->arg1->id);
+
+    if (reglist->size >= 2)
+    {
+        // Two more registers are needed for the bump allocation
+        uint8_t* jump_to_slow = emit_cons_fast_path(mem, car_reg, cdr_reg,
+                                                    get_x86_64_register(reglist->reg[0]),
+                                                    get_x86_64_register(reglist->reg[1]));
+        EMIT_JMP_OFF32();
+        uint8_t* jump_to_end = *mem;
+
+        reglist_pop(entry);
+        emit_cons_call(mem, car_reg, cdr_reg);
+
+        uint8_t* end = *mem;
+        PATCH_JMP32(jump_to_slow, jump_to_end - jump_to_slow);
+        PATCH_JMP32(jump_to_end, end - jump_to_end);
+    }
+    else
+    {
+        reglist_pop(entry);
+        emit_cons_call(mem, car_reg, cdr_reg);
+    }
+
+    assert(!reglist_in_use(bite->reg));
+    return true;
+}
+
+// Calls compiled_eval and stores the result in a free register. The arguments
+// and the stack are already in the registers that the function takes them in.
+bool bite_compile_eval(uint8_t** mem, Bite* bite)
+{
+    assert(REG_ARGS == REG_RDI); // 1st argument
+    assert(REG_STACK == REG_RSI); // 2nd argument
+    bite->reg = reglist->reg[0];
+    debug("%s takes register %d", bite->id, bite->reg);
+
+    save_registers(mem, NULL, true);
+
+    EMIT_PUSH(REG_ARGS);
+    EMIT_PUSH(REG_STACK);
+
+    emit_address(mem, REG_RDX, RELOC_EVAL_FORM, (intptr_t)bite->arg1);
+    emit_address(mem, REG_RET, RELOC_EVAL, (intptr_t)compiled_eval);
+    EMIT_CALL_REG(REG_RET);
+
+    EMIT_POP(REG_STACK);
+    EMIT_POP(REG_ARGS);
+
+    if (get_register(bite) != REG_RET)
+    {
+        EMIT_MOV64_REG_REG(get_register(bite), REG_RET);
     }
 
+    restore_registers(mem, NULL, true);
     return true;
 }
 
@@ -1827,8 +3815,19 @@ bool bite_compile(uint8_t** mem, Bite* bite)
 
     case OP_ADD:
     case OP_SUB:
+    case OP_MUL:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
         return bite_compile_binary_op(mem, bite, bite->op);
 
+    case OP_DIV:
+    case OP_MOD:
+        return bite_compile_div(mem, bite, bite->op);
+
+    case OP_ASH:
+        return bite_compile_ash(mem, bite);
+
     case OP_EQ:
     case OP_LESS:
         return bite_compile_binary_op(mem, bite, bite->op) &&
@@ -1837,15 +3836,23 @@ bool bite_compile(uint8_t** mem, Bite* bite)
 
     case OP_NEG:
     case OP_PTR:
+    case OP_VECTOR_LENGTH:
         return bite_compile_unary_op(mem, bite, bite->op);
 
+    case OP_VECTOR_REF:
+        return bite_compile_vector_ref(mem, bite);
+
     case OP_IF:
         return bite_compile_if(mem, bite);
 
     case OP_CALL:
         return bite_compile_call(mem, bite);
 
+    case OP_TAIL_RETURN:
+        return bite_compile_tail_return(mem, bite);
+
     case OP_RECURSE:
+    case OP_TAIL_CALL:
         return bite_compile_recurse(mem, bite);
 
     case OP_PROGN:
@@ -1857,6 +3864,9 @@ bool bite_compile(uint8_t** mem, Bite* bite)
     case OP_CONS:
         return bite_compile_cons(mem, bite);
 
+    case OP_EVAL:
+        return bite_compile_eval(mem, bite);
+
     case OP_BRANCH:
     case OP_LIST:
     default:
@@ -1868,6 +3878,50 @@ bool bite_compile(uint8_t** mem, Bite* bite)
 
 Bite* fold_constants(Bite* bite);
 
+// Turns a comparison of two constants into a constant
+Bite* compile_time_cmp(Bite* cmp)
+{
+    Object* lhs = (Object*)cmp->arg1->arg1;
+    Object* rhs = (Object*)cmp->arg2->arg1;
+    bool result;
+
+    if (cmp->op == OP_EQ)
+    {
+        result = lhs == rhs;
+    }
+    else if (is_number_constant(cmp->arg1) && is_number_constant(cmp->arg2))
+    {
+        result = get_number(lhs) < get_number(rhs);
+    }
+    else
+    {
+        return cmp;
+    }
+
+    debug("Compile time %s: %s %s %s => %s", cmp->op == OP_EQ ? "eq" : "less",
+          cmp->arg1->id, cmp->op == OP_EQ ? "=" : "<", cmp->arg2->id, result ? "t" : "nil");
+
+    cmp->arg1->arg1 = (Bite*)(result ? True : Nil);
+    return cmp->arg1;
+}
+
+// Division by zero is left for the compiled code to bail out on
+Bite* compile_time_arithmetic(Bite* bite)
+{
+    int64_t lhs = get_number((Object*)bite->arg1->arg1);
+    int64_t rhs = get_number((Object*)bite->arg2->arg1);
+    int64_t result;
+
+    if (!do_arithmetic(bite->op - OP_MUL, lhs, rhs, &result))
+    {
+        return bite;
+    }
+
+    debug("Compile time arithmetic: %s, %s => %ld", bite->arg1->id, bite->arg2->id, result);
+    bite->arg1->arg1 = (Bite*)make_number(result);
+    return bite->arg1;
+}
+
 Bite* compile_time_add(Bite* arg1, Bite* arg2)
 {
     Object* lhs = (Object*)arg1->arg1;
@@ -1902,7 +3956,7 @@ Bite* optimize_add_sub(Bite* arith, bool* optimized)
 {
     debug("%s: %s", arith->op == OP_ADD ? "ADD" : "SUB", arith->id);
 
-    if (arith->arg1->op == OP_CONSTANT && arith->arg2->op == OP_CONSTANT)
+    if (is_number_constant(arith->arg1) && is_number_constant(arith->arg2))
     {
         if (arith->op == OP_ADD)
         {
@@ -1949,6 +4003,7 @@ Bite* fold_constants(Bite* bite)
     {
     case OP_CONSTANT:
     case OP_PARAMETER:
+    case OP_EVAL:
         break;
 
     case OP_SUB:
@@ -1963,25 +4018,65 @@ Bite* fold_constants(Bite* bite)
         while (optimized && (bite->op == OP_ADD || bite->op == OP_SUB));
         break;
 
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_ASH:
+        bite->arg1 = fold_constants(bite->arg1);
+        bite->arg2 = fold_constants(bite->arg2);
+
+        if (is_number_constant(bite->arg1) && is_number_constant(bite->arg2))
+        {
+            bite = compile_time_arithmetic(bite);
+        }
+        break;
+
     case OP_LESS:
     case OP_EQ:
+        bite->arg1 = fold_constants(bite->arg1);
+        bite->arg2 = fold_constants(bite->arg2);
+
+        if (bite->arg1->op == OP_CONSTANT && bite->arg2->op == OP_CONSTANT)
+        {
+            bite = compile_time_cmp(bite);
+        }
+        break;
+
     case OP_CONS:
+    case OP_VECTOR_REF:
         bite->arg1 = fold_constants(bite->arg1);
         bite->arg2 = fold_constants(bite->arg2);
         break;
 
     case OP_NEG:
     case OP_PTR:
+    case OP_VECTOR_LENGTH:
         bite->arg1 = fold_constants(bite->arg1);
         break;
 
     case OP_IF:
         bite->arg1 = fold_constants(bite->arg1);
-        bite->arg2->arg1 = fold_constants(bite->arg2->arg1);
-        bite->arg2->arg2 = fold_constants(bite->arg2->arg2);
+
+        if (bite->arg1->op == OP_CONSTANT)
+        {
+            // Only the branch that's taken is left, usually after inlining
+            debug("Compile time if: %s", bite->id);
+            bite = get_constant(bite->arg1) != (int64_t)Nil ? bite->arg2->arg1 : bite->arg2->arg2;
+            bite = fold_constants(bite);
+        }
+        else
+        {
+            bite->arg2->arg1 = fold_constants(bite->arg2->arg1);
+            bite->arg2->arg2 = fold_constants(bite->arg2->arg2);
+        }
         break;
 
     case OP_RECURSE:
+    case OP_TAIL_CALL:
+    case OP_TAIL_RETURN:
     case OP_CALL:
     case OP_PROGN:
     case OP_WRITECHAR:
@@ -2010,6 +4105,16 @@ const char* reg_name(int reg)
         return "rdx";
     case 2:
         return "rcx";
+    case 3:
+        return "rbx";
+    case 4:
+        return "r12";
+    case 5:
+        return "r13";
+    case 6:
+        return "r14";
+    case 7:
+        return "r15";
     }
 
     static char buffer[64];
@@ -2025,19 +4130,29 @@ void recurse_bites(Bite* bite, RecurseBiteFunc func, int depth)
     {
     case OP_CONSTANT:
     case OP_PARAMETER:
+    case OP_EVAL:
         break;
 
     case OP_ADD:
     case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_ASH:
     case OP_LESS:
     case OP_EQ:
     case OP_CONS:
+    case OP_VECTOR_REF:
         recurse_bites(bite->arg1, func, depth + 1);
         recurse_bites(bite->arg2, func, depth + 1);
         break;
 
     case OP_NEG:
     case OP_PTR:
+    case OP_VECTOR_LENGTH:
         recurse_bites(bite->arg1, func, depth + 1);
         break;
 
@@ -2048,6 +4163,8 @@ void recurse_bites(Bite* bite, RecurseBiteFunc func, int depth)
         break;
 
     case OP_RECURSE:
+    case OP_TAIL_CALL:
+    case OP_TAIL_RETURN:
     case OP_CALL:
     case OP_PROGN:
     case OP_WRITECHAR:
@@ -2110,12 +4227,30 @@ void calculate_register_count(Bite* bite, bool left_leaf)
         bite->reg_count = left_leaf ? 1 : 0;
         break;
 
+    case OP_EVAL:
+        bite->reg_count = 1;
+        bite->calls = true;
+        break;
+
     case OP_ADD:
     case OP_SUB:
+    case OP_MUL:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_ASH:
     case OP_LESS:
     case OP_EQ:
+    case OP_VECTOR_REF:
         calculate_register_count(bite->arg1, true);
-        calculate_register_count(bite->arg2, false);
+        // The divisor, the index and the shift count are always needed in a
+        // register unless the shift count is a constant
+        calculate_register_count(bite->arg2, bite->op == OP_DIV || bite->op == OP_MOD ||
+                                 bite->op == OP_VECTOR_REF ||
+                                 (bite->op == OP_ASH && !is_number_constant(bite->arg2)));
+        bite->calls = bite->arg1->calls || bite->arg2->calls;
 
         if (bite->arg1->reg_count == bite->arg2->reg_count)
         {
@@ -2129,44 +4264,61 @@ void calculate_register_count(Bite* bite, bool left_leaf)
 
     case OP_NEG:
     case OP_PTR:
+    case OP_VECTOR_LENGTH:
         calculate_register_count(bite->arg1, true);
         bite->reg_count = bite->arg1->reg_count;
+        bite->calls = bite->arg1->calls;
         break;
 
     case OP_IF:
         calculate_register_count(bite->arg1, true);
         calculate_register_count(bite->arg2->arg1, true);
         calculate_register_count(bite->arg2->arg2, true);
-        break;
+        bite->calls = bite->arg1->calls || bite->arg2->arg1->calls || bite->arg2->arg2->calls;
 
-    case OP_CONS:
-        calculate_register_count(bite->arg1, true);
-        calculate_register_count(bite->arg2, true);
+        // The value always ends up in a register, the condition is done by
+        // the time either of the branches is compiled.
+        bite->reg_count = bite->arg1->reg_count;
 
-        if (bite->arg1->reg_count > bite->arg2->reg_count)
+        if (bite->arg2->arg1->reg_count > bite->reg_count)
         {
-            bite->reg_count = bite->arg1->reg_count;
+            bite->reg_count = bite->arg2->arg1->reg_count;
         }
-        else
+
+        if (bite->arg2->arg2->reg_count > bite->reg_count)
         {
-            bite->reg_count = bite->arg2->reg_count;
+            bite->reg_count = bite->arg2->arg2->reg_count;
         }
         break;
 
+    case OP_CONS:
+        calculate_register_count(bite->arg1, true);
+        calculate_register_count(bite->arg2, true);
+        bite->calls = true;
+
+        // Both values are kept in registers and two more are needed for the
+        // inlined allocation
+        bite->reg_count = MAX(MAX(bite->arg1->reg_count, bite->arg2->reg_count + 1), CONS_REGISTERS);
+        break;
+
     case OP_RECURSE:
+    case OP_TAIL_CALL:
+    case OP_TAIL_RETURN:
     case OP_CALL:
     case OP_PROGN:
     case OP_WRITECHAR:
         {
             int reg_count = 1;
+            bite->calls = bite->op == OP_CALL || bite->op == OP_WRITECHAR;
 
             for (Bite* b = bite->arg1; b; b = b->arg2)
             {
                 calculate_register_count(b->arg1, true);
+                bite->calls = bite->calls || b->arg1->calls;
 
-                if (b->reg_count > reg_count)
+                if (b->arg1->reg_count > reg_count)
                 {
-                    reg_count = b->reg_count;
+                    reg_count = b->arg1->reg_count;
                 }
             }
 
@@ -2181,25 +4333,82 @@ void calculate_register_count(Bite* bite, bool left_leaf)
     }
 }
 
-bool generate_bytecode(uint8_t** mem, Object* scope, Object* name, Object* self, Object* params, Object* body)
+// The function prologue pushes the callee-saved registers that the function
+// uses and reserves one more slot if needed to keep the stack aligned the same
+// way as it would be without them.
+void emit_prologue(uint8_t** mem)
 {
-    recursion_marker_count = 0;
-
-    // Always emit the instructions for the function prologue.
     EMIT_PROLOGUE();
+    int count = 0;
+
+    for (int r = CALLER_SAVED_REGISTERS; r < TEMP_REGISTERS; r++)
+    {
+        if (callee_saved_used & (1 << r))
+        {
+            EMIT_PUSH(get_x86_64_register(r));
+            count++;
+        }
+    }
+
+    if (count % 2)
+    {
+        EMIT_SUB64_IMM8(REG_RSP, OBJ_SIZE);
+    }
+}
+
+// The registers are loaded relative to the frame pointer which means the
+// epilogue works even if the bailout happens while arguments are being pushed.
+void emit_epilogue(uint8_t** mem)
+{
+    int count = 0;
+
+    for (int r = CALLER_SAVED_REGISTERS; r < TEMP_REGISTERS; r++)
+    {
+        if (callee_saved_used & (1 << r))
+        {
+            count++;
+            EMIT_MOV64_REG_OFF8(get_x86_64_register(r), REG_RBP, -OBJ_SIZE * count);
+        }
+    }
+
+    EMIT_EPILOGUE();
+}
+
+bool generate_bytecode(uint8_t** mem, Object* scope, Object* name, Object* self, Object* params, Object* body)
+{
+    recursion_markers.count = 0;
+    tail_call_markers.count = 0;
+    tail_return_markers.count = 0;
+    bailout_markers.count = 0;
+    code_relocs.count = 0;
+    callee_saved_used = 0;
+
+    // The prologue depends on which registers end up being used. Space is left
+    // for the largest one and the code is moved right after the real prologue
+    // once the function is done. All the jumps in the code are relative to the
+    // code itself which means it can be moved.
+    uint8_t* start = *mem;
+    *mem += MAX_PROLOGUE_SIZE;
     uint8_t* prologue_end = *mem;
+    reloc_base = start;
 
-    Bite bitecode[1024];
-    Bite* ptr = bitecode;
+    Bite* ptr = NULL;
     bite_ids = 0;
-    Bite* res = bite_expr(&ptr, self, params, body);
+    Bite* res = bite_expr_recurse(&ptr, self, params, body, true);
 
     if (debug_on())
     {
-        debug("Generated %ld bites, resulting variable is: %s.\n", ptr - bitecode, res->id);
+        debug("Generated %d bites, resulting variable is: %s.\n", bite_count, res->id);
         print_bitecode(res);
     }
 
+    if (code_arena_limit() - start < MAX_PROLOGUE_SIZE + (intptr_t)bite_count * MAX_BITE_CODE_SIZE)
+    {
+        error("Out of executable memory");
+        free_bites();
+        return false;
+    }
+
     res = fold_constants(res);
 
     if (debug_on())
@@ -2211,7 +4420,7 @@ bool generate_bytecode(uint8_t** mem, Object* scope, Object* name, Object* self,
     calculate_register_count(res, false);
 
     RegList regs;
-    for (int i = 0; i < 4; i++)
+    for (int i = 0; i < TEMP_REGISTERS; i++)
     {
         regs.reg[i] = i;
     }
@@ -2240,15 +4449,15 @@ bool generate_bytecode(uint8_t** mem, Object* scope, Object* name, Object* self,
             EMIT_MOV64_REG_REG(REG_RET, get_register(res));
         }
 
-        // Patch all the recursion markers to the start of the prologue. If the
-        // prologue is omitted, the jump distance will still be correct.
-        for (int i = 0; i < recursion_marker_count; i++)
+        // Patch all the recursion markers to the end of the prologue. The
+        // callee-saved registers only need to be stored once.
+        for (int i = 0; i < recursion_markers.count; i++)
         {
-            uint8_t* ptr = recursion_markers[i];
+            uint8_t* ptr = recursion_markers.ptr[i];
             PATCH_JMP32(ptr, prologue_end - ptr);
         }
 
-        EMIT_EPILOGUE();
+        emit_epilogue(mem);
 
         if (debug_on())
         {
@@ -2259,6 +4468,69 @@ bool generate_bytecode(uint8_t** mem, Object* scope, Object* name, Object* self,
 
     EMIT_RET();
 
+    if (ok && tail_call_markers.count > 0)
+    {
+        uint8_t* tail_call = *mem;
+        emit_epilogue(mem);
+        EMIT_JMP_REG(REG_RET);
+
+        for (int i = 0; i < tail_call_markers.count; i++)
+        {
+            uint8_t* ptr = tail_call_markers.ptr[i];
+            PATCH_JMP32(ptr, tail_call - ptr);
+        }
+    }
+
+    if (ok && tail_return_markers.count > 0)
+    {
+        uint8_t* tail_return = *mem;
+        emit_epilogue(mem);
+        EMIT_MOV64_REG_IMM32(REG_RET, (intptr_t)JitTailCall);
+        EMIT_RET();
+
+        for (int i = 0; i < tail_return_markers.count; i++)
+        {
+            uint8_t* ptr = tail_return_markers.ptr[i];
+            PATCH_JMP32(ptr, tail_return - ptr);
+        }
+    }
+
+    if (ok && bailout_markers.count > 0)
+    {
+        // The index of the function itself is returned along with JitBailout
+        // so that jit_call knows which function to run again. After a tail
+        // call it's not the one that jit_call called.
+        uint8_t* bailout = *mem;
+        emit_epilogue(mem);
+        EMIT_MOV64_REG_IMM32(REG_RET, (intptr_t)JitBailout);
+        emit_address(mem, REG_RDX, RELOC_EVAL_FORM, jit_forms_add(body, self));
+        EMIT_RET();
+
+        for (int i = 0; i < bailout_markers.count; i++)
+        {
+            uint8_t* ptr = bailout_markers.ptr[i];
+            PATCH_JMP32(ptr, bailout - ptr);
+        }
+    }
+
+    if (ok)
+    {
+        uint8_t* end = *mem;
+        *mem = start;
+        emit_prologue(mem);
+        assert(*mem - start <= MAX_PROLOGUE_SIZE);
+        memmove(*mem, prologue_end, end - prologue_end);
+
+        for (int i = 0; i < code_relocs.count; i++)
+        {
+            assert(code_relocs.reloc[i].offset >= MAX_PROLOGUE_SIZE);
+            code_relocs.reloc[i].offset -= prologue_end - *mem;
+        }
+
+        *mem += end - prologue_end;
+    }
+
+    free_bites();
     return ok;
 }
 
@@ -2269,19 +4541,32 @@ bool compile_to_bytecode(Object* scope, Object* name, Object* self, Object* para
         return false;
     }
 
+    if (code_arena_limit() - code_ptr < CODE_MAX_FUNCTION_SIZE)
+    {
+        error("Out of executable memory");
+        return false;
+    }
+
     PUSH5(scope, name, self, params, body);
 
-    void* memory = mmap(NULL, COMPILE_MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    uint8_t* ptr = (uint8_t*)memory;
+    // Reserving the room for the forms can run the GC which isn't allowed once
+    // the bites are being generated. The bailout code needs one for the
+    // function itself.
+    size_t form_count = jit_form_count;
+    jit_forms_reserve(count_eval_forms(self, params, body) + 1);
+
+    uint8_t* memory = code_ptr;
+    uint8_t* ptr = memory;
     // The body is used to store the pointer that self-recursive functions need
     get_obj(self)->ufn.jit_mem = (Object*) memory;
     bool ok = generate_bytecode(&ptr, scope, name, self, params, body);
 
     if (ok)
     {
-        mprotect(memory, COMPILE_MEM_SIZE, PROT_READ | PROT_EXEC);
+        // The function stays in the arena, the next one starts after it
+        code_ptr = memory + ((ptr - memory + CODE_ALIGNMENT - 1) & ~(CODE_ALIGNMENT - 1));
 
-        debug("Compiled into %lu bytes.", ptr - (uint8_t*)memory);
+        debug("Compiled into %lu bytes.", ptr - memory);
 
         if (debug_on() && not_in_gdb())
         {
@@ -2289,10 +4574,10 @@ bool compile_to_bytecode(Object* scope, Object* name, Object* self, Object* para
             char buffer[1024];
             snprintf(buffer, sizeof(buffer), "gdb --pid=%d --batch --silent -ex 'disassemble /r %p,%p'", pid, memory, ptr);
 
-            printf("BEGIN dump of '%s'\n", get_symbol(name));
+            printf("BEGIN dump of '%s'\n", name == Nil ? "<func>" : get_symbol(name));
             fflush(stdout);
             system(buffer);
-            printf("END dump of '%s'\n", get_symbol(name));
+            printf("END dump of '%s'\n", name == Nil ? "<func>" : get_symbol(name));
             fflush(stdout);
         }
 
@@ -2300,14 +4585,23 @@ bool compile_to_bytecode(Object* scope, Object* name, Object* self, Object* para
 
         CompiledFunction* comp = malloc(sizeof(CompiledFunction));
         comp->memory = memory;
-        comp->name = name;
-        comp->next = compiled_functions;
-        compiled_functions = comp;
+        comp->name = strdup(name != Nil ? get_symbol(name) : get_symbol_by_pointed_value(self));
+        comp->size = ptr - memory;
+        comp->reloc_count = code_relocs.count;
+        comp->relocs = malloc(sizeof(CodeReloc) * MAX(code_relocs.count, 1));
+
+        if (code_relocs.count > 0)
+        {
+            memcpy(comp->relocs, code_relocs.reloc, sizeof(CodeReloc) * code_relocs.count);
+        }
+
+        add_compiled_function(comp);
     }
     else
     {
+        // The next function will overwrite whatever got generated
         get_obj(self)->ufn.jit_mem = NULL;
-        munmap(memory, COMPILE_MEM_SIZE);
+        jit_form_count = form_count;
     }
 
     POP();
@@ -2373,65 +4667,1160 @@ void jit_resolve_symbols(Object* scope, Object* args)
     compile_function(scope, args, resolve_symbols, COMPILE_SYMBOLS);
 }
 
-void jit_compile(Object* scope, Object* args)
+CompiledFunction* find_compiled(void* memory);
+
+// The functions that are compiled together can call each other directly. The
+// ones that come later weren't compiled yet when the earlier ones were, which
+// is why all of them are compiled a second time. The calls that the second
+// versions make to the first versions are then pointed at the second ones.
+void link_compiled(Object** funcs, void** first, size_t count)
 {
-    if (compile_function(scope, args, resolve_symbols, COMPILE_SYMBOLS))
+    for (size_t i = 0; i < count; i++)
     {
-        compile_function(scope, args, compile_to_bytecode, COMPILE_CODE);
+        CompiledFunction* comp = find_compiled(func_jit_mem(funcs[i]));
+
+        for (int j = 0; comp && j < comp->reloc_count; j++)
+        {
+            CodeReloc* r = &comp->relocs[j];
+
+            for (size_t k = 0; r->kind == RELOC_CALL && k < count; k++)
+            {
+                if (r->value == (intptr_t)first[k])
+                {
+                    r->value = (intptr_t)func_jit_mem(funcs[k]);
+                    memcpy((uint8_t*)comp->memory + r->offset, &r->value, sizeof(r->value));
+                    break;
+                }
+            }
+        }
     }
 }
 
-// The JIT functions receive their arguments in RDI and a stack in RSI
-typedef Object* (*JitFunc)(Object**, Object**);
-
-Object* jit_eval(Object* fn, Object* args)
+// Looks up the functions that compile_function() was given
+void lookup_functions(Object* scope, Object* args, Object** funcs)
 {
-    assert(get_type(fn) == TYPE_FUNCTION);
-    assert(get_obj(fn)->ufn.compiled == COMPILE_CODE);
-    int len = length(args);
-    int required = length(func_params(fn));
-
-    if (len != required)
+    for (size_t i = 0; get_type(args) == TYPE_CELL; args = cdr(args))
     {
-        error("Argument length mismatch: expected %d, have %d.", required, len);
-        return Nil;
+        funcs[i++] = symbol_lookup(scope, car(args));
     }
+}
 
-    int n_args = 0;
+void jit_compile(Object* scope, Object* args)
+{
+    PUSH2(scope, args);
 
-#ifndef NDEBUG
-    for (Object** p = s_jit_stack; p < s_jit_stack + JIT_STACK_SIZE; p++)
+    if (compile_function(scope, args, resolve_symbols, COMPILE_SYMBOLS) && code_arena_begin())
     {
-        *p = JitPoison;
-    }
-#endif
+        size_t count = length(args);
 
-    debugf("Calling %s", get_symbol_by_pointed_value(fn));
+        if (compile_function(scope, args, compile_to_bytecode, COMPILE_CODE) && count > 1)
+        {
+            Object** funcs = malloc(count * sizeof(Object*));
+            void** first = malloc(count * sizeof(void*));
+            lookup_functions(scope, args, funcs);
 
-    // The function arguments are bound in the reverse order they are declared to the
-    // scope. Each value is copied into the stack buffer that is then passed
-    // into the compiled function. The compiled functions expect the arguments
-    // to be stored in RDI and a temporary stack pointer to be in RSI.
-    for (Object* o = args; o != Nil; o = cdr(o))
-    {
-        s_jit_stack[len - n_args - 1] = cdr(car(o));
-        ++n_args;
+            for (size_t i = 0; i < count; i++)
+            {
+                first[i] = func_jit_mem(funcs[i]);
+            }
+
+            if (compile_function(scope, args, compile_to_bytecode, COMPILE_CODE))
+            {
+                lookup_functions(scope, args, funcs);
+                link_compiled(funcs, first, count);
+            }
+
+            free(first);
+            free(funcs);
+        }
+
+        code_arena_end();
     }
 
-    for (int i = 0; i < n_args; i++)
+    POP();
+}
+
+void jit_recompile(Object** funcs, size_t count)
+{
+    if (!code_arena_begin())
     {
-        Object* o = s_jit_stack[i];
-        int type = get_type(o);
-        debugf(" Arg[%d] = %p %s %s", i, o, get_type_name(type),
-               type == TYPE_SYMBOL ? get_symbol(o) : "");
+        return;
     }
 
-    debugf("\n");
+    void** first = malloc(count * sizeof(void*));
+    bool ok = true;
+
+    for (int pass = 0; pass < (count > 1 ? 2 : 1); pass++)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            first[i] = func_jit_mem(funcs[i]);
+
+            if (!compile_to_bytecode(Nil, Nil, funcs[i], func_params(funcs[i]), func_body(funcs[i])))
+            {
+                error("Compilation of a function from the image failed");
+                ok = false;
+            }
+        }
+    }
+
+    if (ok && count > 1)
+    {
+        link_compiled(funcs, first, count);
+    }
+
+    free(first);
+    code_arena_end();
+}
+
+//
+// Ahead-of-time compilation
+//
+// The machine code of the functions compiled with `compile` can be saved into a
+// shared object. Each function gets its own symbol in the text section and the
+// addresses in the code are described by relocations that are patched once the
+// shared object is loaded again. The forms that are evaluated by the
+// interpreter are found by their path from the start of the function body.
+//
+
+#define AOT_VERSION ((sizeof(Object) << 16) | (sizeof(UserFunction) << 8) | 3)
+#define AOT_TABLE "lisp_aot_table"
+#define AOT_MAX_PATH 1024
+
+// The layout of the table that the shared object exports. The relocations use
+// the same layout as CodeReloc except that the value of RELOC_CALL is the index
+// of the called function and the value of RELOC_EVAL_FORM is the path to it.
+struct AotFunction
+{
+    const char* name;
+    uint64_t hash;
+    uint8_t* code;
+    uint64_t size;
+    uint64_t reloc_count;
+    CodeReloc* relocs;
+};
+
+struct AotTable
+{
+    uint64_t version;
+    uint64_t count;
+    struct AotFunction funcs[];
+};
+
+uint64_t hash_value(uint64_t h, uint64_t value)
+{
+    // FNV-1a, one word at a time
+    return (h ^ value) * 0x100000001b3;
+}
+
+// Hashes the resolved body of a function. The builtins are hashed by their
+// offset from a known function which stays the same as long as the binary does.
+uint64_t hash_form(uint64_t h, Object* obj)
+{
+    for (; get_type(obj) == TYPE_CELL; obj = cdr(obj))
+    {
+        h = hash_form(hash_value(h, TYPE_CELL), car(obj));
+    }
+
+    switch (get_type(obj))
+    {
+    case TYPE_SYMBOL:
+        for (const char* c = get_symbol(obj); *c; c++)
+        {
+            h = hash_value(h, *c);
+        }
+
+        return hash_value(h, TYPE_SYMBOL);
+
+    case TYPE_BUILTIN:
+        return hash_value(h, (uintptr_t)get_builtin(obj)->fn - (uintptr_t)compiled_cons);
+
+    case TYPE_VECTOR:
+        for (size_t i = 0; i < get_obj(obj)->length; i++)
+        {
+            h = hash_form(h, vector_items(obj)[i]);
+        }
+
+        return hash_value(h, get_obj(obj)->length);
+
+    case TYPE_FUNCTION:
+    case TYPE_MACRO:
+        return hash_value(h, get_type(obj) | get_obj(obj)->ufn.param_count << NUMBER_SHIFT);
+
+    default:
+        return hash_value(h, (uintptr_t)obj);
+    }
+}
+
+uint64_t hash_function(Object* func)
+{
+    return hash_form(hash_form(0xcbf29ce484222325, func_params(func)), func_body(func));
+}
+
+// Stores the path from obj to form as a string of 'a' (car) and 'd' (cdr)
+bool find_form(Object* obj, Object* form, char* path, int depth)
+{
+    if (obj == form)
+    {
+        path[depth] = '\0';
+        return true;
+    }
+    else if (get_type(obj) != TYPE_CELL || depth + 1 >= AOT_MAX_PATH)
+    {
+        return false;
+    }
+
+    path[depth] = 'a';
+
+    if (find_form(car(obj), form, path, depth + 1))
+    {
+        return true;
+    }
+
+    path[depth] = 'd';
+    return find_form(cdr(obj), form, path, depth + 1);
+}
+
+Object* follow_path(Object* obj, const char* path)
+{
+    for (; *path; path++)
+    {
+        if (get_type(obj) != TYPE_CELL)
+        {
+            return Undefined;
+        }
+
+        obj = *path == 'a' ? car(obj) : cdr(obj);
+    }
+
+    return obj;
+}
+
+CompiledFunction* find_compiled(void* memory)
+{
+    for (CompiledFunction* c = compiled_functions; c; c = c->next)
+    {
+        if (c->memory == memory)
+        {
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+// The symbols of the functions only have letters, digits and escaped bytes in
+// them so that any name can be used
+void write_aot_symbol(FILE* f, const char* name)
+{
+    fputs("lisp_", f);
+
+    for (const char* c = name; *c; c++)
+    {
+        if (isalnum(*c))
+        {
+            fputc(*c, f);
+        }
+        else
+        {
+            fprintf(f, "_%02x", (unsigned char)*c);
+        }
+    }
+}
+
+void write_aot_string(FILE* f, const char* str)
+{
+    fputs("\t.asciz \"", f);
+
+    for (const char* c = str; *c; c++)
+    {
+        if (isalnum(*c))
+        {
+            fputc(*c, f);
+        }
+        else
+        {
+            fprintf(f, "\\%03o", (unsigned char)*c);
+        }
+    }
+
+    fputs("\"\n", f);
+}
+
+// Finds the function that the relocation calls from the ones before it
+int aot_call_index(Object** funcs, int count, CodeReloc* r)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if ((intptr_t)func_jit_mem(funcs[i]) == r->value)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+bool write_aot_assembly(FILE* f, Object** names, Object** funcs, CompiledFunction** comps, int count)
+{
+    char path[AOT_MAX_PATH];
+
+    fputs("\t.text\n", f);
+
+    for (int i = 0; i < count; i++)
+    {
+        const char* name = get_symbol(names[i]);
+        uint8_t* code = comps[i]->memory;
+
+        fputs("\t.balign 16\n\t.globl ", f);
+        write_aot_symbol(f, name);
+        fputs("\n\t.type ", f);
+        write_aot_symbol(f, name);
+        fputs(", @function\n", f);
+        write_aot_symbol(f, name);
+        fputs(":\n", f);
+
+        for (size_t j = 0; j < comps[i]->size; j++)
+        {
+            fprintf(f, j % 16 == 0 ? "\t.byte 0x%02x" : ",0x%02x", code[j]);
+
+            if (j % 16 == 15 || j + 1 == comps[i]->size)
+            {
+                fputc('\n', f);
+            }
+        }
+
+        fputs("\t.size ", f);
+        write_aot_symbol(f, name);
+        fputs(", .-", f);
+        write_aot_symbol(f, name);
+        fputc('\n', f);
+    }
+
+    fputs("\t.section .rodata\n", f);
+
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(f, ".Lname%d:\n", i);
+        write_aot_string(f, get_symbol(names[i]));
+
+        for (int j = 0; j < comps[i]->reloc_count; j++)
+        {
+            CodeReloc* r = &comps[i]->relocs[j];
+
+            if (r->kind == RELOC_EVAL_FORM)
+            {
+                Object** form = &vector_items(jit_forms)[r->value];
+
+                if (form[1] != funcs[i] || !find_form(func_body(funcs[i]), form[0], path, 0))
+                {
+                    error("Cannot find the form %ld evaluated by '%s'", r->value, get_symbol(names[i]));
+                    return false;
+                }
+
+                fprintf(f, ".Lpath%d_%d:\n", i, j);
+                write_aot_string(f, path);
+            }
+        }
+    }
+
+    fputs("\t.data\n\t.balign 8\n", f);
+
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(f, ".Lrelocs%d:\n", i);
+
+        for (int j = 0; j < comps[i]->reloc_count; j++)
+        {
+            CodeReloc* r = &comps[i]->relocs[j];
+            fprintf(f, "\t.long %u, %u\n", r->offset, r->kind);
+
+            if (r->kind == RELOC_EVAL_FORM)
+            {
+                fprintf(f, "\t.quad .Lpath%d_%d\n", i, j);
+            }
+            else if (r->kind == RELOC_CALL)
+            {
+                int index = aot_call_index(funcs, count, r);
+
+                if (index < 0)
+                {
+                    error("'%s' calls a compiled function that isn't saved with it", get_symbol(names[i]));
+                    return false;
+                }
+
+                fprintf(f, "\t.quad %d\n", index);
+            }
+            else
+            {
+                fputs("\t.quad 0\n", f);
+            }
+        }
+    }
+
+    fprintf(f, "\t.globl " AOT_TABLE "\n" AOT_TABLE ":\n\t.quad %lu, %d\n", AOT_VERSION, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(f, "\t.quad .Lname%d, 0x%lx, ", i, hash_function(funcs[i]));
+        write_aot_symbol(f, get_symbol(names[i]));
+        fprintf(f, ", %lu, %d, .Lrelocs%d\n", comps[i]->size, comps[i]->reloc_count, i);
+    }
+
+    fputs("\t.section .note.GNU-stack,\"\",@progbits\n", f);
+    return true;
+}
+
+// Nothing in here allocates memory which means the GC won't run
+bool jit_save_compiled(Object* scope, const char* path, Object* args)
+{
+    int count = length(args);
+    Object** names = malloc(sizeof(Object*) * count);
+    Object** funcs = malloc(sizeof(Object*) * count);
+    CompiledFunction** comps = malloc(sizeof(CompiledFunction*) * count);
+    bool ok = true;
+
+    for (int i = 0; ok && i < count; i++, args = cdr(args))
+    {
+        names[i] = car(args);
+        funcs[i] = get_type(names[i]) == TYPE_SYMBOL ? symbol_lookup(scope, names[i]) : Undefined;
+
+        if (get_type(names[i]) != TYPE_SYMBOL)
+        {
+            error("Argument is not a symbol");
+            ok = false;
+        }
+        else if (get_type(funcs[i]) != TYPE_FUNCTION || get_func(funcs[i])->ufn.compiled != COMPILE_CODE
+                 || !(comps[i] = find_compiled(func_jit_mem(funcs[i]))))
+        {
+            error("'%s' is not a compiled function", get_symbol(names[i]));
+            ok = false;
+        }
+        else if (aot_call_index(funcs, i, &(CodeReloc){0, RELOC_CALL, (intptr_t)func_jit_mem(funcs[i])}) >= 0)
+        {
+            error("'%s' is saved more than once", get_symbol(names[i]));
+            ok = false;
+        }
+    }
+
+    char asm_path[PATH_MAX];
+    char command[PATH_MAX * 2 + 64];
+    FILE* f = NULL;
+
+    if (!ok)
+    {
+        // The error was already reported
+    }
+    else if (strchr(path, '\'') || snprintf(asm_path, sizeof(asm_path), "%s.s", path) >= (int)sizeof(asm_path))
+    {
+        error("Invalid file name: %s", path);
+        ok = false;
+    }
+    else if (!(f = fopen(asm_path, "w")))
+    {
+        error("Failed to open file: %d, %s", errno, strerror(errno));
+        ok = false;
+    }
+    else
+    {
+        ok = write_aot_assembly(f, names, funcs, comps, count);
+
+        if (fclose(f) != 0)
+        {
+            error("Failed to write file: %d, %s", errno, strerror(errno));
+            ok = false;
+        }
+
+        // The assembly is built with the C compiler of the system. The shell
+        // exits with 127 if there isn't one.
+        snprintf(command, sizeof(command), "cc -shared -nostdlib -o '%s' '%s'", path, asm_path);
+        int status = ok ? system(command) : 0;
+
+        if (status == -1)
+        {
+            error("Failed to run the C compiler: %d, %s", errno, strerror(errno));
+            ok = false;
+        }
+        else if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+        {
+            error("Cannot build the shared object, the C compiler 'cc' was not found");
+            ok = false;
+        }
+        else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            error("Failed to build the shared object, exit status %d: %s",
+                  WIFEXITED(status) ? WEXITSTATUS(status) : -1, command);
+            ok = false;
+        }
+
+        remove(asm_path);
+    }
+
+    free(names);
+    free(funcs);
+    free(comps);
+    return ok;
+}
+
+// Checks that the function matches the one that was saved. Whether the
+// functions it calls can be loaded is checked once all of them are matched.
+bool aot_matches(Object* func, struct AotFunction* af, size_t count)
+{
+    if (hash_function(func) != af->hash)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < af->reloc_count; i++)
+    {
+        CodeReloc* r = &af->relocs[i];
+
+        if (r->kind == RELOC_CALL && (size_t)r->value >= count)
+        {
+            return false;
+        }
+        else if (r->kind == RELOC_EVAL_FORM && get_type(follow_path(func_body(func), (const char*)r->value)) != TYPE_CELL)
+        {
+            return false;
+        }
+        else if (r->kind > RELOC_CALL)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Whether the function calls one that isn't loaded
+bool aot_calls_missing(struct AotFunction* af, Object** loaded)
+{
+    for (size_t i = 0; i < af->reloc_count; i++)
+    {
+        if (af->relocs[i].kind == RELOC_CALL && loaded[af->relocs[i].value] == Nil)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Patches the code of one function and attaches it to func. The room for the
+// forms must've been reserved. The functions it calls are either compiled
+// already or their code is attached from the same table.
+void aot_attach(Object* name, Object* func, struct AotTable* table, struct AotFunction* af, Object** loaded)
+{
+    CompiledFunction* comp = malloc(sizeof(CompiledFunction));
+    comp->memory = af->code;
+    comp->name = strdup(get_symbol(name));
+    comp->size = af->size;
+    comp->reloc_count = af->reloc_count;
+    comp->relocs = malloc(sizeof(CodeReloc) * af->reloc_count);
+
+    for (size_t i = 0; i < af->reloc_count; i++)
+    {
+        CodeReloc* r = &af->relocs[i];
+        intptr_t value = 0;
+
+        switch (r->kind)
+        {
+        case RELOC_CONS:
+            value = (intptr_t)compiled_cons;
+            break;
+        case RELOC_WRITECHAR:
+            value = (intptr_t)compiled_writechar;
+            break;
+        case RELOC_EVAL:
+            value = (intptr_t)compiled_eval;
+            break;
+        case RELOC_EVAL_FORM:
+            value = jit_forms_add(follow_path(func_body(func), (const char*)r->value), func);
+            break;
+        case RELOC_CELL_PTR:
+            value = (intptr_t)&cell_ptr;
+            break;
+        case RELOC_CELL_END:
+            value = (intptr_t)&cell_end;
+            break;
+        case RELOC_TAIL_CALL:
+            value = (intptr_t)compiled_tail_call;
+            break;
+        case RELOC_CALL:
+            value = get_func(loaded[r->value])->ufn.compiled == COMPILE_CODE
+                ? (intptr_t)func_jit_mem(loaded[r->value]) : (intptr_t)table->funcs[r->value].code;
+            break;
+        }
+
+        memcpy(af->code + r->offset, &value, sizeof(value));
+        comp->relocs[i] = (CodeReloc){r->offset, r->kind, value};
+    }
+
+    get_func(func)->ufn.jit_mem = af->code;
+    get_func(func)->ufn.compiled = COMPILE_CODE;
+    add_compiled_function(comp);
+}
+
+bool jit_load_compiled(Object* scope, const char* file)
+{
+    // The path must have a slash in it, otherwise dlopen looks for it elsewhere
+    char path[PATH_MAX];
+
+    if (!realpath(file, path))
+    {
+        error("Failed to open file: %d, %s", errno, strerror(errno));
+        return false;
+    }
+
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+    if (!handle)
+    {
+        error("Failed to load compiled code: %s", dlerror());
+        return false;
+    }
+
+    struct AotTable* table = dlsym(handle, AOT_TABLE);
+
+    if (!table || table->version != AOT_VERSION)
+    {
+        error("%s was not saved with save-compiled by this binary", path);
+        dlclose(handle);
+        return false;
+    }
+    else if (table->count == 0)
+    {
+        dlclose(handle);
+        return true;
+    }
+
+    uint8_t* begin = (uint8_t*)UINTPTR_MAX;
+    uint8_t* end = NULL;
+
+    for (size_t i = 0; i < table->count; i++)
+    {
+        begin = MIN(begin, table->funcs[i].code);
+        end = MAX(end, table->funcs[i].code + table->funcs[i].size);
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    begin = (uint8_t*)((uintptr_t)begin & ~(page - 1));
+    end = begin + page_align(end - begin);
+
+    if (mprotect(begin, end - begin, PROT_READ | PROT_WRITE) != 0)
+    {
+        error("Failed to make the compiled code writable: %d, %s", errno, strerror(errno));
+        dlclose(handle);
+        return false;
+    }
+
+    bool ok = true;
+    int attached = 0;
+    Object* name = Nil;
+    Object* func = Nil;
+    Object** loaded = malloc(sizeof(Object*) * table->count);
+    PUSH3(scope, name, func);
+
+    for (size_t i = 0; i < table->count; i++)
+    {
+        loaded[i] = Nil;
+        ROOT(loaded[i]);
+    }
+
+    for (size_t i = 0; i < table->count; i++)
+    {
+        struct AotFunction* af = &table->funcs[i];
+        name = symbol(af->name);
+        func = symbol_lookup(scope, name);
+
+        if (get_type(func) != TYPE_FUNCTION)
+        {
+            error("Symbol '%s' does not point to a function", af->name);
+            ok = false;
+            continue;
+        }
+        else if (get_func(func)->ufn.compiled == COMPILE_CODE)
+        {
+            // Already compiled, the functions that call it can use that code
+            loaded[i] = func;
+            continue;
+        }
+        else if (get_func(func)->ufn.compiled != COMPILE_SYMBOLS)
+        {
+            if (!resolve_symbols(scope, name, func, func_params(func), func_body(func)))
+            {
+                error("Compilation of '%s' failed", af->name);
+                ok = false;
+                continue;
+            }
 
-    s_jit_stack[n_args] = JitEnd;
-    JitFunc func = (JitFunc)func_jit_mem(fn);
-    Object* ret = func(s_jit_stack, s_jit_stack + n_args);
-    s_jit_stack[0] = JitEnd;
+            get_func(func)->ufn.compiled = COMPILE_SYMBOLS;
+        }
+
+        if (!aot_matches(func, af, table->count))
+        {
+            error("The compiled code of '%s' does not match its definition", af->name);
+            ok = false;
+            continue;
+        }
+
+        loaded[i] = func;
+    }
+
+    // The functions can call each other in any order which means that a
+    // function that can't be loaded can prevent the loading of the ones that
+    // were matched before it
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+
+        for (size_t i = 0; i < table->count; i++)
+        {
+            if (loaded[i] != Nil && get_func(loaded[i])->ufn.compiled != COMPILE_CODE
+                && aot_calls_missing(&table->funcs[i], loaded))
+            {
+                error("The compiled code of '%s' does not match its definition", table->funcs[i].name);
+                loaded[i] = Nil;
+                ok = false;
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < table->count; i++)
+    {
+        struct AotFunction* af = &table->funcs[i];
+
+        if (loaded[i] == Nil || get_func(loaded[i])->ufn.compiled == COMPILE_CODE)
+        {
+            continue;
+        }
+
+        int forms = 0;
+
+        for (size_t j = 0; j < af->reloc_count; j++)
+        {
+            forms += af->relocs[j].kind == RELOC_EVAL_FORM;
+        }
+
+        jit_forms_reserve(forms);
+        name = symbol(af->name);
+        aot_attach(name, loaded[i], table, af, loaded);
+        attached++;
+    }
+
+    POP();
+    free(loaded);
+
+    // The shared object stays loaded for as long as the program runs unless
+    // none of its code is used
+    mprotect(begin, end - begin, PROT_READ | PROT_EXEC);
+
+    if (attached == 0)
+    {
+        dlclose(handle);
+    }
+
+    return ok;
+}
+
+uint32_t jit_call_threshold = 1000;
+uint32_t jit_loop_threshold = 10000;
+
+// Incremented whenever the automatically compiled code must be thrown away
+_Thread_local uint32_t jit_epoch = 1;
+
+// How deep the chain of uncompiled callees is allowed to be
+#define TIER_UP_MAX_DEPTH 64
+
+bool jit_compiled(Object* fn)
+{
+    UserFunction* ufn = &get_func(fn)->ufn;
+    return ufn->compiled == COMPILE_CODE || (ufn->compiled == COMPILE_AUTO && ufn->jit_epoch == jit_epoch);
+}
+
+void jit_invalidate()
+{
+    jit_epoch++;
+}
+
+bool tier_up(Object* fn, int depth);
+
+// Checks that a call to a builtin in an automatically compiled function behaves
+// exactly like it does in the evaluator. The argument counts are checked in the
+// evaluator and the machine code only checks the types of values that aren't
+// constants. The output of write-char would be repeated if the function had to
+// be run again by the VM so it's not allowed.
+bool valid_for_tier_up(Function fn, Object* args)
+{
+    int count = 0;
+    bool constant_numbers = true;
+    bool constant_lists = true;
+    bool constant_vector = true;
+
+    for (; args != Nil; args = cdr(args))
+    {
+        // The local variables are tagged as constants
+        int type = is_local_ref(car(args)) ? TYPE_CELL : get_type(car(args));
+        constant_numbers &= type != TYPE_CONST;
+        constant_lists &= type != TYPE_CONST && type != TYPE_NUMBER;
+
+        if (count == 0)
+        {
+            // Vectors are never constants in the code
+            constant_vector = type != TYPE_CONST && type != TYPE_NUMBER;
+        }
+
+        count++;
+    }
+
+    if (fn == builtin_if)
+    {
+        return count == 3;
+    }
+    else if (fn == builtin_car || fn == builtin_cdr)
+    {
+        return count == 1 && constant_lists;
+    }
+    else if (fn == builtin_vector_length)
+    {
+        return count == 1 && constant_vector;
+    }
+    else if (fn == builtin_vector_ref)
+    {
+        return count == 2 && constant_vector && constant_numbers;
+    }
+    else if (fn == builtin_cons || fn == builtin_less || fn == builtin_eq)
+    {
+        return count == 2;
+    }
+    else if (fn == builtin_add)
+    {
+        // A single argument is returned as-is
+        return count >= 2 && constant_numbers;
+    }
+    else if (fn == builtin_sub)
+    {
+        return count >= 1 && constant_numbers;
+    }
+    else if (fn == builtin_mul || fn == builtin_div || fn == builtin_mod || fn == builtin_logand
+             || fn == builtin_logior || fn == builtin_logxor || fn == builtin_ash)
+    {
+        return valid_arithmetic_arg_count(fn, count) && constant_numbers;
+    }
+    else if (fn == builtin_progn)
+    {
+        return count >= 1;
+    }
+
+    return false;
+}
+
+// Returns a copy of the expression where the symbols are replaced with what
+// they point to, like what resolve_symbols does in place. Returns Undefined if
+// the expression cannot be compiled. Unlike valid_for_compile, this does not
+// report any errors as the function is still usable even if it isn't compiled.
+//
+// As the compiled code only notices functions being redefined, only symbols in
+// the function position are resolved and the rest must be parameters or
+// constants.
+Object* resolve_for_tier_up(Object* self, Object* body, int depth)
+{
+    int type = get_type(body);
+
+    if (is_local_ref(body))
+    {
+        return local_ref_depth(body) == 0 ? body : Undefined;
+    }
+    else if (type == TYPE_NUMBER || type == TYPE_CONST)
+    {
+        return body;
+    }
+    else if (type == TYPE_SYMBOL)
+    {
+        return body == symbol("nil") || body == symbol("t") ? get_obj(body)->global : Undefined;
+    }
+    else if (type != TYPE_CELL)
+    {
+        return Undefined;
+    }
+
+    // Compiling the called function can run the GC
+    Object* func = car(body);
+    Object* ret = Nil;
+    Object* arg = Nil;
+    Object* tail = Nil;
+    PUSH6(self, body, func, ret, arg, tail);
+
+    if (get_type(func) == TYPE_SYMBOL)
+    {
+        func = get_obj(func)->global;
+    }
+
+    if (func == self)
+    {
+        // Self-recursion
+    }
+    else if (get_type(func) == TYPE_BUILTIN)
+    {
+        if (!is_supported_builtin(get_obj(func)->fn))
+        {
+            POP();
+            return Undefined;
+        }
+    }
+    else if (get_type(func) != TYPE_FUNCTION
+             || (!jit_compiled(func) && !tier_up(func, depth + 1)))
+    {
+        POP();
+        return Undefined;
+    }
+
+    ret = cons(func, Nil);
+    tail = ret;
+
+    for (body = cdr(body); get_type(body) == TYPE_CELL; body = cdr(body))
+    {
+        arg = resolve_for_tier_up(self, car(body), depth);
+
+        if (arg == Undefined)
+        {
+            break;
+        }
+
+        arg = cons(arg, Nil);
+        get_obj(tail)->cdr = arg;
+        write_barrier(tail, arg);
+        tail = arg;
+    }
+
+    if (body != Nil)
+    {
+        // Either one of the arguments can't be compiled or it's not a list
+        ret = Undefined;
+    }
+    else if (get_type(func) == TYPE_BUILTIN ? !valid_for_tier_up(get_obj(func)->fn, cdr(ret))
+             : length(cdr(ret)) != get_func(func)->ufn.param_count)
+    {
+        // The evaluator reports the wrong number of arguments
+        ret = Undefined;
+    }
+
+    POP();
+    return ret;
+}
+
+bool tier_up(Object* fn, int depth)
+{
+    UserFunction* ufn = &get_func(fn)->ufn;
+    ufn->call_count = 0;
+    ufn->loop_count = 0;
+
+    if (jit_compiled(fn))
+    {
+        return true;
+    }
+    else if ((ufn->compiled != 0 && ufn->jit_epoch == jit_epoch)
+             || ufn->compiled == COMPILE_SYMBOLS || depth > TIER_UP_MAX_DEPTH)
+    {
+        // Already failed, being compiled by the caller or the symbols were
+        // resolved by freeze which means the user is in control.
+        return false;
+    }
+
+    // The function is marked as failed while it's being compiled so that
+    // mutual recursion doesn't end up compiling it again.
+    ufn->compiled = COMPILE_FAILED;
+    ufn->jit_epoch = jit_epoch;
+
+    Object* body = Nil;
+    PUSH2(fn, body);
+    body = resolve_for_tier_up(fn, func_body(fn), depth);
+
+    emit_type_checks = true;
+    bool ok = body != Undefined && compile_to_bytecode(Nil, Nil, fn, func_params(fn), body);
+    emit_type_checks = false;
+
+    if (ok)
+    {
+        ufn = &get_func(fn)->ufn;
+        ufn->compiled = COMPILE_AUTO;
+        ufn->jit_epoch = jit_epoch;
+    }
+    else
+    {
+        get_func(fn)->ufn.compiled = COMPILE_FAILED;
+    }
+
+    POP();
+    return jit_compiled(fn);
+}
+
+bool jit_tier_up(Object* fn)
+{
+    bool ok = false;
+
+    if (debug_on())
+    {
+        // The debug output is only generated by the evaluator
+        get_func(fn)->ufn.call_count = 0;
+        get_func(fn)->ufn.loop_count = 0;
+    }
+    else if (code_arena_begin())
+    {
+        ok = tier_up(fn, 0);
+        code_arena_end();
+    }
+
+    return ok;
+}
+
+// The JIT functions receive their arguments in RDI and a stack in RSI. The
+// value is returned in RAX and if it's JitBailout, RDX has the index of the
+// function in jit_forms.
+struct JitResult
+{
+    Object* value;
+    intptr_t form;
+};
+
+typedef struct JitResult JitResult;
+typedef JitResult (*JitFunc)(Object**, Object**);
+
+bool jit_push(Object* value)
+{
+    // One slot is always needed for the JitEnd marker
+    if (s_jit_sp + 1 >= s_jit_stack_end)
+    {
+        error("JIT stack overflow");
+        return false;
+    }
+
+    *s_jit_sp++ = value;
+    *s_jit_sp = JitEnd;
+    return true;
+}
+
+// Moves the arguments of the tail call that the compiled code returned
+// JitTailCall for down to args and returns the code of the function to call,
+// see bite_compile_tail_return(). Nothing is allocated in between which means
+// the arguments left above the stack are still intact.
+JitFunc take_tail_call(Object** args, Object** top)
+{
+    // The end marker can end up where the callee was stored
+    intptr_t count = (intptr_t)top[-1];
+    JitFunc func = (JitFunc)top[-2];
+    memmove(args, top - 2 - count, count * sizeof(Object*));
+    s_jit_sp = args + count;
+    *s_jit_sp = JitEnd;
+    return func;
+}
+
+// Runs the compiled code with the arguments that end at the top of the JIT
+// stack. The tail calls that the code returns are made here, one after another.
+Object* jit_run(JitFunc func, Object** args)
+{
+    // The compiled functions expect the arguments to be stored in RDI and a
+    // temporary stack pointer to be in RSI. The stack starts right after the
+    // arguments. If the compiled code overflows the stack, the signal handler
+    // jumps back here and the roots of whatever was running are dropped.
+    Object* scope = Nil;
+    Object* fn = Nil;
+    PUSH2(scope, fn);
+    sigjmp_buf overflow;
+    sigjmp_buf* prev_overflow = jit_overflow;
+    JitResult res = {Nil, 0};
+    Object** end = s_jit_sp;
+    Object** prev_vm_sp = vm_sp;
+
+    while (true)
+    {
+        if (sigsetjmp(overflow, 0) != 0)
+        {
+            vm_sp = prev_vm_sp;
+            error("JIT stack overflow");
+            res = (JitResult){Nil, 0};
+            break;
+        }
+
+        jit_overflow = &overflow;
+        res = func(args, end);
+
+        if (res.value != JitTailCall)
+        {
+            break;
+        }
+
+        func = take_tail_call(args, (Object**)res.form);
+        end = s_jit_sp;
+    }
+
+    jit_overflow = prev_overflow;
+    Object* ret = res.value;
+
+    // The compiled code uses the slots after the arguments without moving the
+    // end marker. It's put back before anything allocates so that the GC only
+    // sees the arguments.
+    s_jit_sp = end;
+    *s_jit_sp = JitEnd;
+
+    if (ret == JitBailout)
+    {
+        // A type check failed, the VM reports the error. Automatically
+        // compiled functions don't have side effects which means they can be
+        // run again from the start. Other functions only end up here if one of
+        // the automatically compiled functions they call fails. If a tail call
+        // was made, the arguments are those of the function that was called
+        // and it's the one that's run again.
+        fn = vector_items(jit_forms)[res.form + 1];
+        int count = get_func(fn)->ufn.param_count;
+        scope = new_scope(func_env(fn), func_params(fn), count);
+
+        for (int i = 0; i < count; i++)
+        {
+            scope_slots(scope)[i] = args[i];
+            write_barrier(scope, args[i]);
+        }
+
+        jit_pop(args);
+        ret = vm_eval(fn, scope);
+    }
+    else
+    {
+        jit_pop(args);
+    }
+
+    POP();
+    return ret;
+}
+
+Object* jit_call(Object* fn, Object** args)
+{
+    assert(get_type(fn) == TYPE_FUNCTION);
+    assert(jit_compiled(fn));
+    assert(args <= s_jit_sp && s_jit_sp - args == get_obj(fn)->ufn.param_count);
+    Object** end = s_jit_sp;
+
+#ifndef NDEBUG
+    for (Object** p = end + 1; p < s_jit_stack_end && p < end + JIT_STACK_SIZE; p++)
+    {
+        *p = JitPoison;
+    }
+#endif
+
+    debugf("Calling %s", get_symbol_by_pointed_value(fn));
+
+    for (Object** p = args; p < end; p++)
+    {
+        Object* o = *p;
+        int type = get_type(o);
+        debugf(" Arg[%ld] = %p %s %s", p - args, o, get_type_name(type),
+               type == TYPE_SYMBOL ? get_symbol(o) : "");
+    }
+
+    debugf("\n");
+
+    Object* ret = jit_run((JitFunc)func_jit_mem(fn), args);
 
     debug("Call returned: %p %s %s", ret, get_type_name(get_type(ret)),
           get_type(ret) == TYPE_SYMBOL ? get_symbol(ret) : "");
@@ -2439,14 +5828,93 @@ Object* jit_eval(Object* fn, Object* args)
     return ret;
 }
 
+// Makes the tail call that a function called by compiled code left to it.
+// Everything below sp is in use by the compiled code, like in compiled_eval.
+Object* compiled_tail_call(Object** sp, Object** top)
+{
+    Object** prev_sp = s_jit_sp;
+    JitFunc func = take_tail_call(sp, top);
+    Object* ret = jit_run(func, sp);
+    s_jit_sp = prev_sp;
+    return ret;
+}
+
+Object** jit_sp()
+{
+    return s_jit_sp;
+}
+
+void jit_pop(Object** sp)
+{
+    assert(sp >= s_jit_stack && sp <= s_jit_sp);
+    s_jit_sp = sp;
+    *s_jit_sp = JitEnd;
+}
+
 Object** jit_stack()
 {
     return s_jit_stack;
 }
 
+void jit_stack_fault(void* addr)
+{
+    uint8_t* guard = (uint8_t*)s_jit_stack_end;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (jit_overflow && guard && (uint8_t*)addr >= guard && (uint8_t*)addr < guard + page)
+    {
+        siglongjmp(*jit_overflow, 1);
+    }
+
+    // The native stack ends at a guard area that the frames can skip a part of
+    if (jit_overflow && native_stack_low && (uint8_t*)addr >= native_stack_low - NATIVE_STACK_GUARD
+        && (uint8_t*)addr < native_stack_low + page)
+    {
+        siglongjmp(*jit_overflow, 1);
+    }
+}
+
+void jit_stack_free()
+{
+    if (s_jit_stack)
+    {
+        munmap(s_jit_stack, (uint8_t*)s_jit_stack_end - (uint8_t*)s_jit_stack + sysconf(_SC_PAGESIZE));
+        s_jit_stack = s_jit_stack_end = s_jit_sp = NULL;
+    }
+}
+
 void jit_stack_set_size(size_t size)
 {
-    free(s_jit_stack);
-    s_jit_stack = (Object**)aligned_alloc(sizeof(Object*), size);
+    jit_stack_free();
+
+    // The pages are only allocated once they're used. The guard page after the
+    // stack can't be accessed which catches the overflows of the compiled code,
+    // the pushes it does aren't checked.
+    size = page_align(MAX(size, sizeof(Object*) * 2));
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint8_t* mem = mmap(NULL, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (mem == MAP_FAILED)
+    {
+        printf("Failed to allocate the JIT stack: %d, %s\n", errno, strerror(errno));
+        exit(1);
+    }
+
+    mprotect(mem + size, page, PROT_NONE);
+
+    pthread_attr_t attr;
+    void* stack_addr = NULL;
+    size_t stack_size = 0;
+
+    if (pthread_getattr_np(pthread_self(), &attr) == 0)
+    {
+        pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+        pthread_attr_destroy(&attr);
+    }
+
+    native_stack_low = stack_addr;
+    s_jit_stack = (Object**)mem;
+    s_jit_stack_end = (Object**)(mem + size);
+    s_jit_sp = s_jit_stack;
     s_jit_stack[0] = JitEnd;
 }
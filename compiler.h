@@ -9,15 +9,93 @@
 #define COMPILE_SYMBOLS 1
 #define COMPILE_CODE    2
 
+// Functions that get called often enough are compiled automatically. As the
+// original body of the function is left as-is, the compiled code is only used
+// as long as the functions that it calls aren't redefined, i.e. while jit_epoch
+// stays the same. Failures are remembered in the same way.
+#define COMPILE_AUTO    3
+#define COMPILE_FAILED  4
+
 #define JIT_STACK_SIZE (4096 / sizeof(Object*))
 
-Object* jit_eval(Object* fn, Object* args);
+// Pushes an argument for a compiled function onto the JIT stack. Returns false
+// if the stack is full.
+bool jit_push(Object* value);
+
+// Calls the compiled function with the arguments between args and jit_sp(). The
+// arguments are popped off of the stack.
+Object* jit_call(Object* fn, Object** args);
+
+// The top of the JIT stack and a way to discard values pushed above sp
+Object** jit_sp();
+void jit_pop(Object** sp);
+
+// The number of calls and self-recursive tail calls after which a function is
+// compiled. Must be set before any functions are called.
+extern uint32_t jit_call_threshold;
+extern uint32_t jit_loop_threshold;
+
+// Whether the function can be called with jit_call
+bool jit_compiled(Object* fn);
+
+// Tries to compile a function that crossed one of the thresholds along with
+// the functions it calls. Returns true if the function can now be called with
+// jit_call.
+bool jit_tier_up(Object* fn);
+
+// Throws away all automatically compiled code, called when a global function
+// is redefined.
+void jit_invalidate();
 
 void jit_resolve_symbols(Object* scope, Object* args);
 void jit_compile(Object* scope, Object* args);
 
+// Compiles the functions in order. Their symbols must already be resolved, used
+// for the functions that were compiled when a heap image was saved. The
+// functions must be reachable from the GC roots.
+void jit_recompile(Object** funcs, size_t count);
+
+// Writes the machine code of the compiled functions into a shared object. The
+// compiled functions that they call must be saved with them, in any order. The
+// shared object can be loaded with jit_load_compiled which attaches the code to
+// the functions of the same name if they still have the same definition. The
+// shared object is built by running cc, false is returned if that fails.
+bool jit_save_compiled(Object* scope, const char* path, Object* args);
+bool jit_load_compiled(Object* scope, const char* path);
+
+// The forms in compiled functions that are evaluated by calling back into the
+// evaluator along with the functions they're in, see compiled_eval. The GC
+// keeps these alive.
+extern _Thread_local Object* jit_forms;
+
+// Whether the address is inside the machine code of a compiled function. Only
+// compares the address against the bounds of the code which means it can be
+// called from a signal handler.
+bool jit_code_contains(void* addr);
+
+// Returns the name of the compiled function whose machine code contains the
+// address or NULL if no function does
+const char* jit_function_name(void* addr);
+
+// Makes the compiled functions visible to system profilers like perf. With map,
+// each function is written into /tmp/perf-<pid>.map as it's compiled and with
+// dump, a jitdump record with the machine code is written into
+// /tmp/jit-<pid>.dump. Must be called before anything is compiled.
+bool jit_perf_open(bool map, bool dump);
+void jit_perf_close();
+
 // Returns a NULL pointer if there's no JIT call in progress
 Object** jit_stack();
+
+// Allocates the JIT stack of the thread. The stack is followed by a guard page
+// that the compiled code overflows into instead of checking the size.
 void jit_stack_set_size(size_t size);
 
+// Called by the SIGSEGV handler with the faulting address. If it's in the guard
+// page of the JIT stack or past the end of the native stack while compiled code
+// runs, jumps back to the innermost jit_call which reports the overflow. Returns
+// if the fault is something else. The handler must run on an alternate signal
+// stack for the native stack overflows to reach it.
+void jit_stack_fault(void* addr);
+
 void jit_free();
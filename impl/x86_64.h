@@ -9,7 +9,7 @@
 #define REG_RAX 0  // RAX: return value
 #define REG_RCX 1  // RCX: 4th argument
 #define REG_RDX 2  // RDX: 3rd argument
-#define REG_RBX 3  // RBX: callee saved (don't use)
+#define REG_RBX 3  // RBX: callee saved
 #define REG_RSP 4  // RSP: stack pointer (don't use)
 #define REG_RBP 5  // RBP: frame pointer (don't use)
 #define REG_RSI 6  // RSI: 2nd argument
@@ -18,10 +18,10 @@
 #define REG_R9  9  // R9:  6th argument
 #define REG_R10 10 // R10: temporary register
 #define REG_R11 11 // R11: temporary register
-#define REG_R12 12 // R12: callee saved (don't use)
-#define REG_R13 13 // R13: callee saved (don't use)
-#define REG_R14 14 // R14: callee saved (don't use)
-#define REG_R15 15 // R15: callee saved (don't use)
+#define REG_R12 12 // R12: callee saved
+#define REG_R13 13 // R13: callee saved
+#define REG_R14 14 // R14: callee saved
+#define REG_R15 15 // R15: callee saved
 
 // Constants used in the code, makes it easier to remember what each register is used for
 
@@ -37,10 +37,15 @@
 // Opcode prefixes
 #define REX_W 0x48
 #define REX_R 0x44
+#define REX_B 0x41
+
+// The prefix of a 64-bit instruction. The registers R8 to R15 need the extra
+// bit for the ModRM.reg field (reg) or the ModRM.rm field (rm) stored in it.
+#define REX(reg, rm) (REX_W | (((reg) & 8) >> 1) | (((rm) & 8) >> 3))
 
 #define OP_MOD(byte) (byte << 6)
-#define OP_REG(byte) (byte << 3)
-#define OP_RM(byte)  (byte)
+#define OP_REG(byte) (((byte) & 7) << 3)
+#define OP_RM(byte)  ((byte) & 7)
 
 // The EMIT macro needs a `uint8_t** mem` variable where the pointer to the executable memory is
 #define EMIT(byte) **mem = (uint8_t)(byte); (*mem)++;
@@ -52,95 +57,170 @@
 #define EMIT_IMM64(imm) EMIT(imm); EMIT((uint64_t)imm >> 8); EMIT((uint64_t)imm >> 16); EMIT((uint64_t)imm >> 24); \
     EMIT((uint64_t)imm >> 32); EMIT((uint64_t)imm >> 40); EMIT((uint64_t)imm >> 48); EMIT((uint64_t)imm >> 56);
 
+// Memory operands: b[off] and *b. RSP and R12 as the base register need the
+// SIB byte and RBP and R13 can only be used with an offset.
+#define EMIT_MEM_OFF8(a, b, off) EMIT(0x40 | OP_REG(a) | OP_RM(b)); if (OP_RM(b) == REG_RSP) {EMIT(0x24);} EMIT(off);
+#define EMIT_MEM_PTR(a, b) if (OP_RM(b) == REG_RBP) {EMIT_MEM_OFF8(a, b, 0);} else {EMIT(OP_REG(a) | OP_RM(b)); if (OP_RM(b) == REG_RSP) {EMIT(0x24);}}
+
+// Prefix for instructions that only encode the register in the opcode or in
+// ModRM.rm and don't need REX.W
+#define EMIT_REX_B(a) if ((a) & 8) {EMIT(REX_B);}
+
 // PUSH: a
-#define EMIT_PUSH(a) EMIT(0x50 + a)
+#define EMIT_PUSH(a) EMIT_REX_B(a); EMIT(0x50 + OP_RM(a))
 
 // POP: a
-#define EMIT_POP(a) EMIT(0x58 + a)
+#define EMIT_POP(a) EMIT_REX_B(a); EMIT(0x58 + OP_RM(a))
 
 // MOV: a = b (copy)
-#define EMIT_MOV64_REG_REG(a, b) EMIT(REX_W); EMIT(0x89); EMIT(0xc0 | OP_RM(a) | OP_REG(b))
+#define EMIT_MOV64_REG_REG(a, b) EMIT(REX(b, a)); EMIT(0x89); EMIT(0xc0 | OP_RM(a) | OP_REG(b))
 
 // MOV: *a = b (store)
-#define EMIT_MOV64_PTR_REG(a, b) EMIT(REX_W); EMIT(0x89); EMIT(OP_REG(b) | OP_RM(a))
+#define EMIT_MOV64_PTR_REG(a, b) EMIT(REX(b, a)); EMIT(0x89); EMIT_MEM_PTR(b, a)
 
 // MOV: a[off] = b (store)
-#define EMIT_MOV64_OFF8_REG(a, b, off) EMIT(REX_W); EMIT(0x89); EMIT(0x40 | OP_REG(b) | OP_RM(a)); EMIT(off);
+#define EMIT_MOV64_OFF8_REG(a, b, off) EMIT(REX(b, a)); EMIT(0x89); EMIT_MEM_OFF8(b, a, off);
 
 // MOV: a = *b (load)
-#define EMIT_MOV64_REG_PTR(a, b) EMIT(REX_W); EMIT(0x8b); EMIT(OP_REG(a) | OP_RM(b))
+#define EMIT_MOV64_REG_PTR(a, b) EMIT(REX(a, b)); EMIT(0x8b); EMIT_MEM_PTR(a, b)
 
 // MOV: a = b[off] (load)
-#define EMIT_MOV64_REG_OFF8(a, b, off) EMIT(REX_W); EMIT(0x8b); EMIT(0x40 | OP_REG(a) | OP_RM(b)); EMIT(off);
+#define EMIT_MOV64_REG_OFF8(a, b, off) EMIT(REX(a, b)); EMIT(0x8b); EMIT_MEM_OFF8(a, b, off);
 
 // MOV: a = imm32
-#define EMIT_MOV64_REG_IMM32(a, imm) EMIT(0xb8 + a); EMIT_IMM32(imm);
+#define EMIT_MOV64_REG_IMM32(a, imm) EMIT_REX_B(a); EMIT(0xb8 + OP_RM(a)); EMIT_IMM32(imm);
 
 // MOV: a = imm64
-#define EMIT_MOV64_REG_IMM64(a, imm) EMIT(REX_W); EMIT(0xb8 + a); EMIT_IMM64(imm);
+#define EMIT_MOV64_REG_IMM64(a, imm) EMIT(REX(0, a)); EMIT(0xb8 + OP_RM(a)); EMIT_IMM64(imm);
 
 // MOV: *a = imm32 (sign-extended to imm64)
-#define EMIT_MOV64_PTR_IMM32(a, imm) EMIT(REX_W); EMIT(0xc7); EMIT(OP_RM(a)); EMIT_IMM32(imm);
+#define EMIT_MOV64_PTR_IMM32(a, imm) EMIT(REX(0, a)); EMIT(0xc7); EMIT_MEM_PTR(0, a); EMIT_IMM32(imm);
 
 // ADD: a += b
-#define EMIT_ADD64_REG_REG(a, b) EMIT(REX_W); EMIT(0x01); EMIT(0xc0 | OP_REG(b) | OP_RM(a));
+#define EMIT_ADD64_REG_REG(a, b) EMIT(REX(b, a)); EMIT(0x01); EMIT(0xc0 | OP_REG(b) | OP_RM(a));
 
 // ADD: *a += b
-#define EMIT_ADD64_PTR_REG(a, b) EMIT(REX_W); EMIT(0x01); EMIT(OP_REG(b) | OP_RM(a));
+#define EMIT_ADD64_PTR_REG(a, b) EMIT(REX(b, a)); EMIT(0x01); EMIT_MEM_PTR(b, a);
 
 // ADD: a[off] += b
-#define EMIT_ADD64_OFF8_REG(a, b, off) EMIT(REX_W); EMIT(0x01); EMIT(0x40 |  OP_REG(b) | OP_RM(a)); EMIT(off);
+#define EMIT_ADD64_OFF8_REG(a, b, off) EMIT(REX(b, a)); EMIT(0x01); EMIT_MEM_OFF8(b, a, off);
 
 // ADD: a += b[off]
-#define EMIT_ADD64_REG_OFF8(a, b, off) EMIT(REX_W); EMIT(0x03); EMIT(0x40 |  OP_REG(a) | OP_RM(b)); EMIT(off);
+#define EMIT_ADD64_REG_OFF8(a, b, off) EMIT(REX(a, b)); EMIT(0x03); EMIT_MEM_OFF8(a, b, off);
 
 // ADD: a += imm8
-#define EMIT_ADD64_IMM8(a, i) EMIT(REX_W); EMIT(0x83); EMIT(0xc0 | OP_RM(a)); EMIT_IMM8(i);
+#define EMIT_ADD64_IMM8(a, i) EMIT(REX(0, a)); EMIT(0x83); EMIT(0xc0 | OP_RM(a)); EMIT_IMM8(i);
 
 // ADD: a += imm32
-#define EMIT_ADD64_IMM32(a, i) EMIT(REX_W); EMIT(0x81); EMIT(0xc0 | OP_RM(a)); EMIT_IMM32(i);
+#define EMIT_ADD64_IMM32(a, i) EMIT(REX(0, a)); EMIT(0x81); EMIT(0xc0 | OP_RM(a)); EMIT_IMM32(i);
 
 // SUB: a -= b
-#define EMIT_SUB64_REG_REG(a, b) EMIT(REX_W); EMIT(0x29); EMIT(0xc0 | OP_REG(b) | OP_RM(a));
+#define EMIT_SUB64_REG_REG(a, b) EMIT(REX(b, a)); EMIT(0x29); EMIT(0xc0 | OP_REG(b) | OP_RM(a));
 
 // SUB: *a -= b
-#define EMIT_SUB64_PTR_REG(a, b) EMIT(REX_W); EMIT(0x29); EMIT(OP_REG(b) | OP_RM(a));
+#define EMIT_SUB64_PTR_REG(a, b) EMIT(REX(b, a)); EMIT(0x29); EMIT_MEM_PTR(b, a);
 
 // SUB: a[off] -= b
-#define EMIT_SUB64_OFF8_REG(a, b, off) EMIT(REX_W); EMIT(0x29); EMIT(0x40 | OP_REG(b) | OP_RM(a)); EMIT(off);
+#define EMIT_SUB64_OFF8_REG(a, b, off) EMIT(REX(b, a)); EMIT(0x29); EMIT_MEM_OFF8(b, a, off);
 
 // SUB: a -= b[off]
-#define EMIT_SUB64_REG_OFF8(a, b, off) EMIT(REX_W); EMIT(0x2b); EMIT(0x40 | OP_REG(a) | OP_RM(b)); EMIT(off);
+#define EMIT_SUB64_REG_OFF8(a, b, off) EMIT(REX(a, b)); EMIT(0x2b); EMIT_MEM_OFF8(a, b, off);
 
 // SUB: a -= imm8
-#define EMIT_SUB64_IMM8(a, i) EMIT(REX_W); EMIT(0x83); EMIT(0xc0 | OP_REG(0x5) | OP_RM(a)); EMIT_IMM8(i);
+#define EMIT_SUB64_IMM8(a, i) EMIT(REX(0, a)); EMIT(0x83); EMIT(0xc0 | OP_REG(0x5) | OP_RM(a)); EMIT_IMM8(i);
 
 // SUB: a -= imm32
-#define EMIT_SUB64_IMM32(a, i) EMIT(REX_W); EMIT(0x81); EMIT(0xc0 | OP_REG(0x5) | OP_RM(a)); EMIT_IMM32(i);
+#define EMIT_SUB64_IMM32(a, i) EMIT(REX(0, a)); EMIT(0x81); EMIT(0xc0 | OP_REG(0x5) | OP_RM(a)); EMIT_IMM32(i);
 
 // NEG: a = -a
-#define EMIT_NEG64(a) EMIT(REX_W); EMIT(0xf7); EMIT(0xc0 | OP_REG(0x3) | OP_RM(a));
+#define EMIT_NEG64(a) EMIT(REX(0, a)); EMIT(0xf7); EMIT(0xc0 | OP_REG(0x3) | OP_RM(a));
 
 // SAR: a >>= imm8
-#define EMIT_SAR64_IMM8(a, i) EMIT(REX_W); EMIT(0xc1); EMIT(0xc0 | OP_REG(0x7)| OP_RM(a)); EMIT_IMM8(i);
+#define EMIT_SAR64_IMM8(a, i) EMIT(REX(0, a)); EMIT(0xc1); EMIT(0xc0 | OP_REG(0x7)| OP_RM(a)); EMIT_IMM8(i);
 
 // SAL: a <<= imm8
-#define EMIT_SAL64_IMM8(a, i) EMIT(REX_W); EMIT(0xc1); EMIT(0xc0 | OP_REG(0x4) | OP_RM(a)); EMIT_IMM8(i);
+#define EMIT_SAL64_IMM8(a, i) EMIT(REX(0, a)); EMIT(0xc1); EMIT(0xc0 | OP_REG(0x4) | OP_RM(a)); EMIT_IMM8(i);
+
+// IMUL: a *= b
+#define EMIT_IMUL64_REG_REG(a, b) EMIT(REX(a, b)); EMIT(0x0f); EMIT(0xaf); EMIT(0xc0 | OP_REG(a) | OP_RM(b));
+
+// IMUL: a *= b[off]
+#define EMIT_IMUL64_REG_OFF8(a, b, off) EMIT(REX(a, b)); EMIT(0x0f); EMIT(0xaf); EMIT_MEM_OFF8(a, b, off);
+
+// IMUL: a *= imm32
+#define EMIT_IMUL64_IMM32(a, i) EMIT(REX(a, a)); EMIT(0x69); EMIT(0xc0 | OP_REG(a) | OP_RM(a)); EMIT_IMM32(i);
+
+// CQO: RDX:RAX = sign-extended RAX
+#define EMIT_CQO() EMIT(REX_W); EMIT(0x99);
+
+// IDIV: RAX = RDX:RAX / *a, RDX = RDX:RAX % *a
+#define EMIT_IDIV64_PTR(a) EMIT(REX(0, a)); EMIT(0xf7); EMIT_MEM_PTR(0x7, a);
+
+// AND: a &= b
+#define EMIT_AND64_REG_REG(a, b) EMIT(REX(b, a)); EMIT(0x21); EMIT(0xc0 | OP_REG(b) | OP_RM(a));
+
+// AND: a &= b[off]
+#define EMIT_AND64_REG_OFF8(a, b, off) EMIT(REX(a, b)); EMIT(0x23); EMIT_MEM_OFF8(a, b, off);
+
+// AND: a &= imm32
+#define EMIT_AND64_IMM32(a, i) EMIT(REX(0, a)); EMIT(0x81); EMIT(0xc0 | OP_REG(0x4) | OP_RM(a)); EMIT_IMM32(i);
+
+// AND: *a &= imm8
+#define EMIT_AND64_PTR_IMM8(a, i) EMIT(REX(0, a)); EMIT(0x83); EMIT_MEM_PTR(0x4, a); EMIT_IMM8(i);
+
+// OR: a |= b
+#define EMIT_OR64_REG_REG(a, b) EMIT(REX(b, a)); EMIT(0x09); EMIT(0xc0 | OP_REG(b) | OP_RM(a));
+
+// OR: a |= b[off]
+#define EMIT_OR64_REG_OFF8(a, b, off) EMIT(REX(a, b)); EMIT(0x0b); EMIT_MEM_OFF8(a, b, off);
+
+// OR: a |= imm32
+#define EMIT_OR64_IMM32(a, i) EMIT(REX(0, a)); EMIT(0x81); EMIT(0xc0 | OP_REG(0x1) | OP_RM(a)); EMIT_IMM32(i);
+
+// XOR: a ^= b
+#define EMIT_XOR64_REG_REG(a, b) EMIT(REX(b, a)); EMIT(0x31); EMIT(0xc0 | OP_REG(b) | OP_RM(a));
+
+// XOR: a ^= b[off]
+#define EMIT_XOR64_REG_OFF8(a, b, off) EMIT(REX(a, b)); EMIT(0x33); EMIT_MEM_OFF8(a, b, off);
+
+// XOR: a ^= imm32
+#define EMIT_XOR64_IMM32(a, i) EMIT(REX(0, a)); EMIT(0x81); EMIT(0xc0 | OP_REG(0x6) | OP_RM(a)); EMIT_IMM32(i);
+
+// SHL: *a <<= CL
+#define EMIT_SHL64_PTR_CL(a) EMIT(REX(0, a)); EMIT(0xd3); EMIT_MEM_PTR(0x4, a);
+
+// SAR: *a >>= CL
+#define EMIT_SAR64_PTR_CL(a) EMIT(REX(0, a)); EMIT(0xd3); EMIT_MEM_PTR(0x7, a);
+
+// PUSH: b[off]
+#define EMIT_PUSH_OFF8(b, off) EMIT_REX_B(b); EMIT(0xff); EMIT_MEM_OFF8(0x6, b, off);
+
+// TEST: a & b
+#define EMIT_TEST64_REG_REG(a, b) EMIT(REX(b, a)); EMIT(0x85); EMIT(0xc0 | OP_REG(b) | OP_RM(a));
 
 // CMP: a - b
-#define EMIT_CMP64_REG_REG(a, b) EMIT(REX_W); EMIT(0x3b); EMIT(0xc0 | OP_REG(a) | OP_RM(b));
+#define EMIT_CMP64_REG_REG(a, b) EMIT(REX(a, b)); EMIT(0x3b); EMIT(0xc0 | OP_REG(a) | OP_RM(b));
 
 // CMP: a - *b
-#define EMIT_CMP64_REG_PTR(a, b) EMIT(REX_W); EMIT(0x3b); EMIT(OP_REG(a) | OP_RM(b));
+#define EMIT_CMP64_REG_PTR(a, b) EMIT(REX(a, b)); EMIT(0x3b); EMIT_MEM_PTR(a, b);
 
 // CMP: a - b[off]
-#define EMIT_CMP64_REG_OFF8(a, b, off) EMIT(REX_W); EMIT(0x3b); EMIT(0x40 | OP_REG(a) | OP_RM(b)); EMIT_IMM8(off);
+#define EMIT_CMP64_REG_OFF8(a, b, off) EMIT(REX(a, b)); EMIT(0x3b); EMIT_MEM_OFF8(a, b, off);
+
+// TEST: a & imm32
+#define EMIT_TEST64_IMM32(a, i) EMIT(REX(0, a)); EMIT(0xf7); EMIT(0xc0 | OP_REG(0x0) | OP_RM(a)); EMIT_IMM32(i);
+
+// TEST: b[off] & imm32
+#define EMIT_TEST64_OFF8_IMM32(b, off, i) EMIT(REX(0, b)); EMIT(0xf7); EMIT_MEM_OFF8(0x0, b, off); EMIT_IMM32(i);
+
+// XOR: a ^= imm8
+#define EMIT_XOR64_IMM8(a, i) EMIT(REX(0, a)); EMIT(0x83); EMIT(0xc0 | OP_REG(0x6) | OP_RM(a)); EMIT_IMM8(i);
 
 // CMP: a - imm8
-#define EMIT_CMP64_REG_IMM8(a, i) EMIT(REX_W); EMIT(0x83); EMIT(0xc0 | OP_REG(0x7) | OP_RM(a)); EMIT_IMM8(i);
+#define EMIT_CMP64_REG_IMM8(a, i) EMIT(REX(0, a)); EMIT(0x83); EMIT(0xc0 | OP_REG(0x7) | OP_RM(a)); EMIT_IMM8(i);
 
 // CMP: a - imm32
-#define EMIT_CMP64_IMM32(a, i) EMIT(REX_W); EMIT(0x81); EMIT(0xc0 | OP_REG(0x7) | OP_RM(a)); EMIT_IMM32(i);
+#define EMIT_CMP64_IMM32(a, i) EMIT(REX(0, a)); EMIT(0x81); EMIT(0xc0 | OP_REG(0x7) | OP_RM(a)); EMIT_IMM32(i);
 
 // JMP: unconditional jump, imm8 offset (Stores a placeholder that's filled in later)
 #define EMIT_JMP_OFF8() EMIT(0xeb); EMIT_IMM8(0x0);
@@ -154,15 +234,33 @@
 // JE: a - b == 0, imm8 offset (Stores a placeholder that's filled in later)
 #define EMIT_JE_OFF8() EMIT(0x74); EMIT(0x0);
 
+// JNE: a - b != 0, imm8 offset (Stores a placeholder that's filled in later)
+#define EMIT_JNE_OFF8() EMIT(0x75); EMIT(0x0);
+
 // JE: a - b == 0, imm32 offset (Stores a placeholder that's filled in later)
 #define EMIT_JE_OFF32() EMIT(0x0f); EMIT(0x84); EMIT_IMM32(0)
 
+// JNE: a - b != 0, imm32 offset (Stores a placeholder that's filled in later)
+#define EMIT_JNE_OFF32() EMIT(0x0f); EMIT(0x85); EMIT_IMM32(0)
+
 // JL: a - b < 0 (Stores a placeholder that's filled in later)
 #define EMIT_JL_OFF8() EMIT(0x7c); EMIT(0x0);
 
+// JLE: a - b <= 0 (Stores a placeholder that's filled in later)
+#define EMIT_JLE_OFF8() EMIT(0x7e); EMIT(0x0);
+
+// JS: the result is negative (Stores a placeholder that's filled in later)
+#define EMIT_JS_OFF8() EMIT(0x78); EMIT(0x0);
+
 // JL: a - b < 0, imm32 offset (Stores a placeholder that's filled in later)
 #define EMIT_JL_OFF32() EMIT(0x0f); EMIT(0x8c); EMIT_IMM32(0)
 
+// JA: a - b > 0 as unsigned, imm32 offset (Stores a placeholder that's filled in later)
+#define EMIT_JA_OFF32() EMIT(0x0f); EMIT(0x87); EMIT_IMM32(0)
+
+// JAE: a - b >= 0 as unsigned, imm32 offset (Stores a placeholder that's filled in later)
+#define EMIT_JAE_OFF32() EMIT(0x0f); EMIT(0x83); EMIT_IMM32(0)
+
 // Patches the jump point
 #define PATCH_JMP8(ptr, off) ptr[-1] = off;
 
@@ -170,7 +268,10 @@
 void PATCH_JMP32(uint8_t* ptr, uint32_t off);
 
 // CALL, address is stored in register
-#define EMIT_CALL_REG(a) EMIT(0xff); EMIT(0xc0 | OP_REG(0x2) | OP_RM(a));
+#define EMIT_CALL_REG(a) EMIT_REX_B(a); EMIT(0xff); EMIT(0xc0 | OP_REG(0x2) | OP_RM(a));
+
+// JMP, address is stored in register
+#define EMIT_JMP_REG(a) EMIT_REX_B(a); EMIT(0xff); EMIT(0xc0 | OP_REG(0x4) | OP_RM(a));
 
 // RET
 #define EMIT_RET() EMIT(0xc3);
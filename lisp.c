@@ -1,19 +1,45 @@
 #include "lisp.h"
 #include "compiler.h"
+#include "profiler.h"
+#include "vm.h"
+#include "parallel.h"
 #include <time.h>
-
-#define MAX_SYMBOL_LEN 1024
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio_ext.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdatomic.h>
+
+// The size of the blocks in which the standard input is read
+#define READ_BLOCK_SIZE (64 * 1024)
+
+// The maximum number of stack variables that are tracked for GC. The memory is
+// only reserved at startup and the pages are allocated as they are used.
+#define ROOT_STACK_SIZE (16 * 1024 * 1024)
+
+// How many major collections with a mostly empty heap are done before the heap
+// is shrunk.
+#define SHRINK_AFTER 4
+
+// If the heap has grown, a major collection is done after this many minor
+// collections. Otherwise the old space would never shrink if the program only
+// allocates short-lived objects after an allocation spike.
+#define IDLE_MINOR_COLLECTIONS 128
 
 #ifndef ALWAYS_GC
 #define ALWAYS_GC 0
 #endif
 
-Frame* stack_top = NULL;
+_Thread_local Object*** root_stack = NULL;
+_Thread_local size_t root_top = 0;
 
 int get_type(Object* obj)
 {
-    uint8_t type = (intptr_t)obj & TYPE_MASK;
-    return (type & 0x3) == 0 ? TYPE_NUMBER : type;
+    return (intptr_t)obj & TYPE_MASK;
 }
 
 Object* get_obj(Object* obj)
@@ -62,6 +88,8 @@ const char* get_type_name(enum Type type)
         return "TYPE_BUILTIN";
     case TYPE_CELL:
         return "TYPE_CELL";
+    case TYPE_VECTOR:
+        return "TYPE_VECTOR";
     case TYPE_FUNCTION:
         return "TYPE_FUNCTION";
     case TYPE_MACRO:
@@ -76,28 +104,87 @@ const char* get_type_name(enum Type type)
 
 // The special return value from some of the functions that indicates that the
 // return value should be evaluated in the same stack frame.
-Object TailCall_obj = {0};
-#define TailCall (&TailCall_obj)
+_Thread_local Object TailCall_obj = {0};
+
+_Thread_local Object* Env = Nil;
+
+// The symbols are interned into an open-addressed hash table that is stored
+// outside of the heap. The table is one of the roots of the garbage collection
+// which updates the entries whenever the symbols are moved. The table size is
+// always a power of two and it's kept at most half full.
+#define SYMBOL_TABLE_MIN_SIZE 1024
+
+_Thread_local Object** symbol_table = NULL;
+_Thread_local size_t symbol_table_size = 0;
+_Thread_local size_t symbol_count = 0;
+
+// The futures of the interpreter. A future is a constant that holds the index
+// of its entry and the number of the interpreter that created it, which means
+// that it can't be made from anything else. The entry keeps the task until the
+// future is touched and the result after that. The results are roots of the
+// garbage collection.
+#define FUTURE_TAG 0x17
+
+struct Future
+{
+    Task* task;
+    Object* result;
+};
+
+typedef struct Future Future;
 
-Object* AllSymbols = Nil;
-Object* Env = Nil;
+_Thread_local Future* futures = NULL;
+_Thread_local size_t future_count = 0;
+
+// Numbers the interpreters for the futures
+atomic_uint next_interpreter_id = 1;
+_Thread_local uint32_t interpreter_id = 0;
+
+// Returns the index of the future or -1 if obj isn't a future of this
+// interpreter
+int64_t future_index(Object* obj)
+{
+    uint64_t bits = (uint64_t)obj;
+
+    if ((bits & 0xff) != FUTURE_TAG || bits >> 40 != interpreter_id)
+    {
+        return -1;
+    }
+
+    uint64_t id = (bits >> 8) & 0xffffffff;
+    return id < future_count ? (int64_t)id : -1;
+}
 
 //
 // Globals
 //
+// All of the interpreter state is thread-local which means that every thread
+// that calls lisp_init gets an interpreter of its own. The settings that come
+// from the command line are shared by all of them and are only modified before
+// the first interpreter is started.
+//
 
-FILE* input;
-uint8_t* mem_root;
-uint8_t* mem_end;
-uint8_t* mem_ptr;
-bool grow_memory = false;
-bool is_running = true;
+_Thread_local uint8_t* mem_root;
+_Thread_local uint8_t* mem_end;
+_Thread_local uint8_t* mem_ptr;
+_Thread_local uint8_t* cell_end;
+_Thread_local uint8_t* cell_ptr;
+_Thread_local bool is_running = true;
+_Thread_local bool exit_called = false;
 bool echo = false;
 bool verbose_gc = false;
 bool quiet = false;
-int debug_step = 0;
-int debug_depth = 0;
-size_t memory_size = 1024 * 1024;
+_Thread_local int debug_step = 0;
+_Thread_local int debug_depth = 0;
+_Thread_local size_t memory_size = 0;
+_Thread_local size_t initial_memory_size = 0;
+_Thread_local size_t max_memory_size = 0;
+size_t heap_size = 1024 * 1024;
+size_t max_heap_size = 8ul * 1024 * 1024 * 1024;
+size_t jit_stack_size = 1024 * 1024 * 16;
+_Thread_local size_t idle_collections = 0;
+_Thread_local size_t minors_since_major = 0;
+size_t nursery_size = 256 * 1024;
 double memory_pct = 75.0;
 
 void print(Object* obj);
@@ -117,7 +204,7 @@ void error(const char* fmt, ...)
 #define DBG_INFO 1
 #define DBG_EXTRA 2
 
-int debug_level = 0;
+_Thread_local int debug_level = 0;
 
 #define DEBUG_INFO (debug_level >= 1)
 #define DEBUG_EXTRA (debug_level >= 2)
@@ -189,14 +276,16 @@ size_t type_size(enum Type type)
     {
     case TYPE_SYMBOL:
         // The actual size of the symbol is determined by the length of the name
-        return allocation_size(BASE_SIZE);
-    case TYPE_CELL:
-        return allocation_size(BASE_SIZE + sizeof(Object*) * 2);
+        return allocation_size(SYMBOL_BASE_SIZE);
+    case TYPE_VECTOR:
+        // The actual size of the vector is determined by the number of items
+        return allocation_size(offsetof(Object, items));
     case TYPE_FUNCTION:
     case TYPE_MACRO:
         return allocation_size(BASE_SIZE + sizeof(UserFunction));
     case TYPE_BUILTIN:
         return allocation_size(BASE_SIZE + sizeof(Function));
+    case TYPE_CELL:
     case TYPE_NUMBER:
     case TYPE_CONST:
     default:
@@ -211,7 +300,11 @@ size_t object_size(Object* obj)
 
     if (type == TYPE_SYMBOL)
     {
-        return allocation_size(BASE_SIZE + strlen(get_symbol(obj)) + 1);
+        return allocation_size(SYMBOL_BASE_SIZE + strlen(get_symbol(obj)) + 1);
+    }
+    else if (type == TYPE_VECTOR)
+    {
+        return allocation_size(offsetof(Object, items) + get_obj(obj)->length * sizeof(Object*));
     }
 
     return type_size(type);
@@ -225,6 +318,328 @@ Object* make_ptr(Object* obj, enum Type type)
 }
 
 // Garbage collection
+//
+// The heap is split into two generations. New objects are allocated from the
+// nursery and when it fills up, a minor collection copies the objects in it
+// that are still alive into the old space. Old objects that point into the
+// nursery are recorded in the remembered set by the write barrier and they act
+// as additional roots for the minor collection. When the old space cannot hold
+// the objects that would be promoted into it, a major collection copies all
+// live objects from both the nursery and the old space into the other half of
+// the old space.
+//
+// The cons cells are kept apart from the other objects which lets them do
+// without the header: there's a cell nursery next to the nursery and each half
+// of the old space has a cell space that goes with it. The type of a cell is
+// known from the pointer and the GC knows which of the spaces it's scanning.
+// Instead of the header, a cell that has been moved has its bit set in the
+// side bitmap and its car points to the copy. The cells and the objects share
+// the size of the old space.
+
+// The nursery is where all new objects are allocated from
+_Thread_local uint8_t* nursery_root;
+_Thread_local uint8_t* nursery_end;
+
+// The semi-space that the old objects are currently stored in
+_Thread_local uint8_t* old_root;
+_Thread_local uint8_t* old_ptr;
+
+// The cell nursery followed by the cell spaces of the two halves of the old
+// space. The first word of each space is unused, it's the header of the first
+// cell that cells don't have.
+_Thread_local uint8_t* cell_mem_root;
+_Thread_local size_t cell_mem_size;
+_Thread_local uint8_t* cell_nursery_root;
+_Thread_local uint8_t* cell_nursery_end;
+_Thread_local uint8_t* old_cell_root;
+_Thread_local uint8_t* old_cell_ptr;
+
+// One bit for each cell in the cell spaces: whether the cell has been moved
+// and whether it's in the remembered set.
+_Thread_local uint64_t* cell_moved_bits;
+_Thread_local uint64_t* cell_remembered_bits;
+
+// Where the garbage collector copies objects and cells to and the number of
+// bytes that can be used starting from gc_root and gc_cell_root
+_Thread_local uint8_t* gc_root;
+_Thread_local uint8_t* gc_ptr;
+_Thread_local uint8_t* gc_cell_root;
+_Thread_local uint8_t* gc_cell_ptr;
+_Thread_local size_t gc_limit;
+_Thread_local bool gc_minor = false;
+
+// Old objects that have pointers to objects in the nursery
+_Thread_local Object** remembered_set = NULL;
+_Thread_local size_t remembered_count = 0;
+_Thread_local size_t remembered_size = 0;
+
+_Thread_local size_t minor_collections = 0;
+_Thread_local size_t major_collections = 0;
+
+// The GC statistics that gc-stats returns. The allocated bytes do not include
+// what's currently in the nursery and the pauses are in microseconds.
+_Thread_local size_t gc_bytes_allocated = 0;
+_Thread_local size_t gc_bytes_copied = 0;
+_Thread_local size_t gc_resizes = 0;
+_Thread_local size_t gc_pauses = 0;
+_Thread_local double gc_pause_total = 0;
+_Thread_local double gc_pause_max = 0;
+
+// Writes one line per collection to stderr
+bool gc_telemetry = false;
+
+// Set in the header of an object when it is added to the remembered set
+#define GC_REMEMBERED 0x8
+
+// Set in the header of a copy when its original is added to the write log
+#define GC_LOGGED 0x10
+
+// The pause budget of incremental major collections in microseconds. Zero
+// means that the major collections copy all live objects at once.
+size_t gc_pause_budget = 0;
+
+// An incremental major collection copies the old space into the other half a
+// slice at a time while the program keeps using the original objects. The
+// header of a copied original points to its copy which means that the GC flags
+// of the object are kept in the header of the copy. The stores into copied
+// originals are logged by the write barrier and the copies are updated from
+// them. Once everything that's reachable has been copied, the roots are made to
+// point to the copies and the collection ends like a normal major collection.
+// The slices are only run right after minor collections: none of the copies
+// can point into the nursery as the originals don't at that point.
+_Thread_local bool gc_cycle = false;
+_Thread_local uint8_t* cycle_root; // The start of the half that is copied into
+_Thread_local uint8_t* cycle_ptr;  // Where the next copy goes
+_Thread_local uint8_t* cycle_scan; // The references of the copies below this are fixed
+_Thread_local uint8_t* cycle_cell_root;
+_Thread_local uint8_t* cycle_cell_ptr;
+_Thread_local uint8_t* cycle_cell_scan;
+
+// The copies of the cells in the cell space that starts at cycle_cell_from,
+// indexed by the position of the original. The car of an original that is still
+// in use can't point to its copy. The entries of the originals that are in the
+// write log have CELL_LOGGED set.
+_Thread_local Object** cycle_cells = NULL;
+_Thread_local uint8_t* cycle_cell_from;
+#define CELL_LOGGED 0x1
+
+// The originals that have been written to after they were copied
+_Thread_local Object** gc_log = NULL;
+_Thread_local size_t gc_log_count = 0;
+_Thread_local size_t gc_log_size = 0;
+
+// The originals of the copied functions. The counters and the compiled code of
+// the functions are updated without the write barrier and are copied when the
+// collection ends.
+_Thread_local Object** gc_functions = NULL;
+_Thread_local size_t gc_function_count = 0;
+_Thread_local size_t gc_function_size = 0;
+
+// The object slices always copy at least this many objects so that the
+// collection ends even if the minor collection used up the budget. The clock is
+// checked once per GC_CLOCK_INTERVAL objects.
+#define GC_SLICE_MIN_WORK 256
+#define GC_CLOCK_INTERVAL 64
+
+void gc_push(Object*** list, size_t* count, size_t* size, Object* obj)
+{
+    if (*count == *size)
+    {
+        *size = *size ? *size * 2 : 1024;
+        *list = realloc(*list, *size * sizeof(Object*));
+    }
+
+    (*list)[(*count)++] = obj;
+}
+
+// The object whose header holds the GC flags of the object
+Object* gc_header(Object* ptr)
+{
+    return get_stored_type(ptr) == 0 ? ptr->moved : ptr;
+}
+
+size_t cell_index(Object* cell)
+{
+    return ((uint8_t*)get_obj(cell) - cell_mem_root) / CELL_SIZE;
+}
+
+bool cell_bit(uint64_t* bits, Object* cell)
+{
+    size_t i = cell_index(cell);
+    return bits[i / 64] & (1ull << (i % 64));
+}
+
+void set_cell_bit(uint64_t* bits, Object* cell)
+{
+    size_t i = cell_index(cell);
+    bits[i / 64] |= 1ull << (i % 64);
+}
+
+void clear_cell_bit(uint64_t* bits, Object* cell)
+{
+    size_t i = cell_index(cell);
+    bits[i / 64] &= ~(1ull << (i % 64));
+}
+
+// Clears the bits of the cells from start up to end. The cell spaces start at
+// page boundaries which means that they never share a word of the bitmap.
+void clear_cell_bits(uint64_t* bits, uint8_t* start, uint8_t* end)
+{
+    size_t first = cell_index((Object*)start) / 64;
+    size_t last = (cell_index((Object*)end) + 63) / 64;
+    memset(bits + first, 0, (last - first) * sizeof(uint64_t));
+}
+
+// The entry of an original cell in cycle_cells
+Object** cycle_cell(Object* cell)
+{
+    return &cycle_cells[((uint8_t*)get_obj(cell) - cycle_cell_from) / CELL_SIZE];
+}
+
+bool in_nursery(Object* obj)
+{
+    uint8_t* ptr = (uint8_t*)get_obj(obj);
+
+    if (get_type(obj) == TYPE_CELL)
+    {
+        return ptr >= cell_nursery_root && ptr < cell_nursery_end;
+    }
+
+    return ptr >= nursery_root && ptr < nursery_end;
+}
+
+size_t nursery_used()
+{
+    return (mem_ptr - nursery_root) + (cell_ptr - cell_nursery_root);
+}
+
+size_t old_used()
+{
+    return (old_ptr - old_root) + (old_cell_ptr - old_cell_root);
+}
+
+// The number of bytes that can still be promoted into the old space
+size_t old_free()
+{
+    size_t used = old_used();
+    return used < memory_size / 2 ? memory_size / 2 - used : 0;
+}
+
+// The number of bytes that have been used from gc_root and gc_cell_root
+size_t gc_used()
+{
+    return (gc_ptr - gc_root) + (gc_cell_ptr - gc_cell_root);
+}
+
+// Logs a store into an original that has already been copied. Nothing needs to
+// be done for the ones that haven't been, they'll be copied as they are.
+void log_write(Object* obj)
+{
+    Object* ptr = get_obj(obj);
+
+    if (get_type(obj) == TYPE_CELL)
+    {
+        Object** copy = in_nursery(obj) ? NULL : cycle_cell(obj);
+
+        if (copy && *copy && !((intptr_t)*copy & CELL_LOGGED))
+        {
+            *copy = (Object*)((intptr_t)*copy | CELL_LOGGED);
+            gc_push(&gc_log, &gc_log_count, &gc_log_size, obj);
+        }
+    }
+    else if (get_stored_type(ptr) == 0)
+    {
+        Object* copy = ptr->moved;
+        intptr_t header = (intptr_t)copy->moved;
+
+        if (!(header & GC_LOGGED))
+        {
+            copy->moved = (Object*)(header | GC_LOGGED);
+            gc_push(&gc_log, &gc_log_count, &gc_log_size, ptr);
+        }
+    }
+}
+
+void write_barrier(Object* obj, Object* value)
+{
+    if (gc_cycle)
+    {
+        log_write(obj);
+    }
+
+    int type = get_type(value);
+
+    if (type == TYPE_NUMBER || type == TYPE_CONST || !in_nursery(value) || in_nursery(obj))
+    {
+        return;
+    }
+
+    if (get_type(obj) == TYPE_CELL)
+    {
+        if (!cell_bit(cell_remembered_bits, obj))
+        {
+            set_cell_bit(cell_remembered_bits, obj);
+            gc_push(&remembered_set, &remembered_count, &remembered_size, obj);
+        }
+
+        return;
+    }
+
+    Object* ptr = gc_header(get_obj(obj));
+    intptr_t header = (intptr_t)ptr->moved;
+
+    if (header & GC_REMEMBERED)
+    {
+        return;
+    }
+
+    ptr->moved = (Object*)(header | GC_REMEMBERED);
+    gc_push(&remembered_set, &remembered_count, &remembered_size, get_obj(obj));
+}
+
+void out_of_memory()
+{
+    error("Out of memory: heap limit of %lu bytes exceeded", max_memory_size);
+    exit(1);
+}
+
+// Copies the cell unless it's been copied already. The car of a copied cell
+// points to the copy except for the originals that stay in use during an
+// incremental collection.
+Object* make_cell_living(Object* obj)
+{
+    Object* ptr = get_obj(obj);
+    Object** forward = cycle_cells && !in_nursery(obj) ? cycle_cell(obj) : NULL;
+
+    if (forward ? *forward != NULL : cell_bit(cell_moved_bits, obj))
+    {
+        gc_debug("Already moved %p", obj);
+        return forward ? make_ptr(get_obj(*forward), TYPE_CELL) : ptr->car;
+    }
+
+    if (gc_used() + CELL_SIZE > gc_limit)
+    {
+        out_of_memory();
+    }
+
+    Object* copy = (Object*)gc_cell_ptr;
+    copy->car = ptr->car;
+    copy->cdr = ptr->cdr;
+    gc_cell_ptr += CELL_SIZE;
+    gc_debug("Moving %p to %p cell", obj, copy);
+
+    if (forward)
+    {
+        *forward = copy;
+    }
+    else
+    {
+        ptr->car = make_ptr(copy, TYPE_CELL);
+        set_cell_bit(cell_moved_bits, obj);
+    }
+
+    return make_ptr(copy, TYPE_CELL);
+}
 
 Object* make_living(Object* obj)
 {
@@ -237,6 +652,17 @@ Object* make_living(Object* obj)
         return obj;
     }
 
+    if (gc_minor && !in_nursery(obj))
+    {
+        // Old objects are not moved by minor collections
+        return obj;
+    }
+
+    if (type == TYPE_CELL)
+    {
+        return make_cell_living(obj);
+    }
+
     Object* ptr = get_obj(obj);
 
     // The moved pointer is set to the "moved to" address which has 8 byte
@@ -245,12 +671,26 @@ Object* make_living(Object* obj)
     if (get_stored_type(ptr))
     {
         size_t size = object_size(ptr);
-        assert(mem_ptr + size <= mem_end);
-        memcpy(mem_ptr, ptr, size);
-        assert(((intptr_t)mem_ptr & TYPE_MASK) == 0);
-        assert(((intptr_t)((Object*)mem_ptr)->moved & TYPE_MASK) == type);
-        ptr->moved = (Object*)mem_ptr;
-        mem_ptr += size;
+
+        if (gc_used() + size > gc_limit)
+        {
+            out_of_memory();
+        }
+
+        memcpy(gc_ptr, ptr, size);
+        assert(((intptr_t)gc_ptr & TYPE_MASK) == 0);
+        assert(((intptr_t)((Object*)gc_ptr)->moved & TYPE_MASK) == type);
+        // The copy starts out without any GC flags except when the original
+        // stays in use and can still be in the remembered set
+        intptr_t flags = gc_cycle ? (intptr_t)ptr->moved & GC_REMEMBERED : 0;
+        ((Object*)gc_ptr)->moved = (Object*)(intptr_t)(type | flags);
+        ptr->moved = (Object*)gc_ptr;
+        gc_ptr += size;
+
+        if (gc_cycle && !gc_minor && (type == TYPE_FUNCTION || type == TYPE_MACRO))
+        {
+            gc_push(&gc_functions, &gc_function_count, &gc_function_size, ptr);
+        }
         gc_debug("Moving %p to %p (%p) %s %s", obj, make_ptr(ptr->moved, type), ptr->moved, get_type_name(type), type == TYPE_SYMBOL ? get_symbol(obj) : "");
     }
     else
@@ -264,32 +704,42 @@ Object* make_living(Object* obj)
     return ret;
 }
 
-void fix_references(Object* obj)
+// Replaces each reference that the object has with what visit returns for it.
+// The GC uses this to move the referenced objects and the loading of heap
+// images to relocate the pointers.
+void visit_references(Object* obj, Object* (*visit)(Object*))
 {
     // The type information is also included in the object header. Otherwise it
     // would not be possible to know the type of the object when the heap memory is
     // scanned during garbage collection.
     assert(get_obj(obj) == obj);
-    int type = get_stored_type(obj);
+    int type = get_stored_type(gc_header(obj));
 
     switch (type)
     {
     case TYPE_SYMBOL:
+        obj->global = visit(obj->global);
+        break;
+
     case TYPE_BUILTIN:
         break;
 
-    case TYPE_CELL:
-        obj->car = make_living(obj->car);
-        obj->cdr = make_living(obj->cdr);
+    case TYPE_VECTOR:
+        for (size_t i = 0; i < obj->length; i++)
+        {
+            obj->items[i] = visit(obj->items[i]);
+        }
         break;
 
     case TYPE_FUNCTION:
     case TYPE_MACRO:
-        obj->ufn.func_params = make_living(obj->ufn.func_params);
-        obj->ufn.func_body = make_living(obj->ufn.func_body);
-        obj->ufn.func_env = make_living(obj->ufn.func_env);
+        obj->ufn.func_params = visit(obj->ufn.func_params);
+        obj->ufn.func_body = visit(obj->ufn.func_body);
+        obj->ufn.func_env = visit(obj->ufn.func_env);
+        obj->ufn.code = visit(obj->ufn.code);
         break;
 
+    case TYPE_CELL:
     case TYPE_NUMBER:
     case TYPE_CONST:
     default:
@@ -299,51 +749,71 @@ void fix_references(Object* obj)
     }
 }
 
-void collect_garbage()
+// The same for a cell, the type of which isn't stored in it
+void visit_cell(Object* cell, Object* (*visit)(Object*))
 {
-    gc_debug(">>>> Starting GC");
-    size_t space_size = memory_size / 2;
-    size_t memory_used = mem_ptr - mem_root;
-    uint8_t* old_root = NULL;
+    cell->car = visit(cell->car);
+    cell->cdr = visit(cell->cdr);
+}
+
+void fix_references(Object* obj)
+{
+    visit_references(obj, make_living);
+}
 
-    if (grow_memory)
+void fix_cell(Object* cell)
+{
+    visit_cell(cell, make_living);
+}
+
+// Fixes the references of an object in the remembered set or the write log,
+// the cells are stored there as tagged pointers
+void fix_entry(Object* obj)
+{
+    if (get_type(obj) == TYPE_CELL)
     {
-        old_root = mem_root;
-        memory_size *= 2;
-        space_size = memory_size / 2;
-        mem_root = aligned_alloc(ALLOC_ALIGN, memory_size);
-        mem_ptr = mem_root;
-        mem_end = mem_root + memory_size / 2;
+        fix_cell(get_obj(obj));
     }
-    else if (mem_end == mem_root + space_size)
+    else
+    {
+        fix_references(obj);
+    }
+}
+
+// Removes an object from the remembered set
+void forget_entry(Object* obj)
+{
+    if (get_type(obj) == TYPE_CELL)
     {
-        mem_ptr = mem_root + space_size;
-        mem_end = mem_root + memory_size;
+        clear_cell_bit(cell_remembered_bits, obj);
     }
     else
     {
-        memory_used -= space_size;
-        mem_ptr = mem_root;
-        mem_end = mem_root + space_size;
+        Object* header = gc_header(obj);
+        header->moved = (Object*)((intptr_t)header->moved & ~(intptr_t)GC_REMEMBERED);
     }
+}
 
-    uint8_t* scan_start = mem_ptr;
-    uint8_t* scan_ptr = scan_start;
-
+// Replaces all the roots with what visit returns for them
+void visit_roots(Object* (*visit)(Object*))
+{
     gc_debug("1. Make Env living");
-    Env = make_living(Env);
-    gc_debug("2. Make AllSymbols living");
-    AllSymbols = make_living(AllSymbols);
-
-    gc_debug("3. Make Frame living");
-    for (Frame* f = stack_top; f; f = f->next)
+    Env = visit(Env);
+    gc_debug("2. Make symbols living");
+    for (size_t i = 0; i < symbol_table_size; i++)
     {
-        for (int i = 0; i < f->size; i++)
+        if (symbol_table[i])
         {
-            *f->vars[i] = make_living(*f->vars[i]);
+            symbol_table[i] = visit(symbol_table[i]);
         }
     }
 
+    gc_debug("3. Make stack variables living");
+    for (size_t i = 0; i < root_top; i++)
+    {
+        *root_stack[i] = visit(*root_stack[i]);
+    }
+
     Object** jit_st = jit_stack();
     int jit_objects = 0;
 
@@ -356,1402 +826,4287 @@ void collect_garbage()
 
     for (int i = 0; jit_st[i] != JitEnd; i++)
     {
-        jit_st[i] = make_living(jit_st[i]);
+        jit_st[i] = visit(jit_st[i]);
         jit_objects++;
     }
 
     gc_debug("Jit objects alive: %d", jit_objects);
-    gc_debug("5. Fixing references");
+    jit_forms = visit(jit_forms);
 
-    while (scan_ptr < mem_ptr)
+    for (size_t i = 0; i < future_count; i++)
     {
-        Object* o = (Object*)scan_ptr;
-        gc_debug("Fixing %p", o);
-        fix_references(o);
-        scan_ptr += object_size(o);
+        if (!futures[i].task)
+        {
+            futures[i].result = visit(futures[i].result);
+        }
     }
 
-    assert(scan_ptr == mem_ptr);
+    gc_debug("5. Make VM stack living");
+    for (Object** p = vm_stack; p < vm_sp; p++)
+    {
+        *p = visit(*p);
+    }
+}
 
-    size_t still_in_use = scan_ptr - scan_start;
-    double pct_in_use = ((double)still_in_use / (double)space_size) * 100.0;
+// Makes all objects that are directly reachable from the roots living and then
+// fixes the references of all the objects that were copied to scan_start and
+// all the cells that were copied to cell_scan_start.
+void make_roots_living(uint8_t* scan_start, uint8_t* cell_scan_start)
+{
+    uint8_t* scan_ptr = scan_start;
+    uint8_t* cell_scan_ptr = cell_scan_start;
+    visit_roots(make_living);
 
-    if (verbose_gc)
+    if (gc_minor)
     {
-        size_t memory_freed = memory_used - still_in_use;
+        gc_debug("6. Fixing remembered objects");
 
-        if (grow_memory)
+        for (size_t i = 0; i < remembered_count; i++)
         {
-            printf("\nMemory resized: %lu -> %lu\n", memory_size / 2, memory_size);
+            forget_entry(remembered_set[i]);
+            fix_entry(remembered_set[i]);
         }
+    }
+
+    remembered_count = 0;
 
-        if (memory_freed)
+    gc_debug("7. Fixing references");
+
+    // The objects copy cells and the cells copy objects
+    while (scan_ptr < gc_ptr || cell_scan_ptr < gc_cell_ptr)
+    {
+        while (scan_ptr < gc_ptr)
         {
-            double pct_freed = ((double)memory_freed / (double)space_size) * 100.0;
-            printf("\nMemory freed: %lu (%.1lf%%) Memory used: %lu (%.1lf%%)\n", memory_freed, pct_freed, still_in_use, pct_in_use);
+            Object* o = (Object*)scan_ptr;
+            gc_debug("Fixing %p", o);
+            fix_references(o);
+            scan_ptr += object_size(o);
         }
-    }
 
-    if (grow_memory)
-    {
-        grow_memory = false;
-        free(old_root);
-    }
-    else if (pct_in_use > memory_pct)
-    {
-        grow_memory = true;
+        while (cell_scan_ptr < gc_cell_ptr)
+        {
+            fix_cell((Object*)cell_scan_ptr);
+            cell_scan_ptr += CELL_SIZE;
+        }
     }
 
-    gc_debug("<<<< GC done");
+    assert(scan_ptr == gc_ptr && cell_scan_ptr == gc_cell_ptr);
 }
 
-// Object creation
+// Empties the nursery once everything in it has been copied
+void reset_nursery()
+{
+    clear_cell_bits(cell_moved_bits, cell_nursery_root, cell_ptr);
+    mem_ptr = nursery_root;
+    cell_ptr = cell_nursery_root;
+}
 
-Object* allocate(size_t size)
+void minor_collection()
 {
-#if ALWAYS_GC
-    collect_garbage();
-#endif
-    assert(allocation_size(size) == size);
+    gc_debug(">>>> Starting minor GC");
+    size_t used = nursery_used();
+    size_t old_used_before = old_used();
+
+    gc_minor = true;
+    gc_root = old_root;
+    gc_ptr = old_ptr;
+    gc_cell_root = old_cell_root;
+    gc_cell_ptr = old_cell_ptr;
+    gc_limit = memory_size / 2;
+    make_roots_living(old_ptr, old_cell_ptr);
+    gc_minor = false;
+
+    old_ptr = gc_ptr;
+    old_cell_ptr = gc_cell_ptr;
+    size_t promoted = old_used() - old_used_before;
+    gc_bytes_allocated += used;
+    gc_bytes_copied += promoted;
+    reset_nursery();
+    minor_collections++;
+    minors_since_major++;
 
-    if (mem_ptr + size > mem_end)
+    if (verbose_gc)
     {
-        collect_garbage();
+        printf("\nMinor GC %lu: Promoted: %lu of %lu Old space used: %lu (%.1lf%%)\n",
+               minor_collections, promoted, used, old_used(),
+               ((double)old_used() / (double)(memory_size / 2)) * 100.0);
     }
 
-    Object* rv = (Object*)mem_ptr;
-    gc_debug("Allocate [%d] %p <%lu>", mem_end == mem_root + memory_size ? 2 : 1, rv, size);
-    mem_ptr += size;
-
-    assert(get_obj(rv) == rv);
-    return rv;
+    gc_debug("<<<< Minor GC done");
 }
 
-Object* cons(Object* car, Object* cdr)
+// Rounds the size up to a multiple of the page size
+size_t page_align(size_t size)
 {
-    PUSH2(car, cdr);
-    Object* rv = allocate(type_size(TYPE_CELL));
-    rv->moved = (Object*)TYPE_CELL;
-    rv->car = car;
-    rv->cdr = cdr;
-    POP();
-    return make_ptr(rv, TYPE_CELL);
+    size_t page = sysconf(_SC_PAGESIZE);
+    return ((size + page - 1) / page) * page;
 }
 
-Object* car(Object* obj)
+// Both halves of the old space are reserved up front with enough address space
+// to hold max_memory_size bytes. This allows them to be grown in place by
+// simply moving the end of the space.
+void reserve_memory()
 {
-    assert(get_type(obj) == TYPE_CELL);
-    return get_cell(obj)->car;
-}
+    max_memory_size = page_align(max_heap_size / 2) * 2;
+    memory_size = page_align(heap_size / 2) * 2;
 
-Object* cdr(Object* obj)
-{
-    assert(get_type(obj) == TYPE_CELL);
-    return get_cell(obj)->cdr;
+    // Each half must be able to hold both a full nursery and cell nursery
+    if (memory_size < nursery_size * 4)
+    {
+        memory_size = page_align(nursery_size) * 4;
+    }
+
+    if (memory_size > max_memory_size)
+    {
+        memory_size = max_memory_size;
+    }
+
+    initial_memory_size = memory_size;
+    mem_root = mmap(NULL, max_memory_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (mem_root == MAP_FAILED)
+    {
+        perror("Failed to reserve memory for the heap");
+        exit(1);
+    }
+
+    old_root = mem_root;
+    old_ptr = mem_root;
+
+    // The cells are reserved the same way, after the cell nursery. The extra
+    // page holds the cdr of the last cell when the second half is full.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t cell_nursery_size = page_align(nursery_size);
+    cell_mem_size = cell_nursery_size + max_memory_size + page;
+    cell_mem_root = mmap(NULL, cell_mem_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    // Both of the bitmaps have a bit for every cell
+    size_t bitmap_size = page_align(cell_mem_size / CELL_SIZE / 8);
+    cell_moved_bits = mmap(NULL, bitmap_size * 2, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (cell_mem_root == MAP_FAILED || cell_moved_bits == MAP_FAILED)
+    {
+        perror("Failed to reserve memory for the cells");
+        exit(1);
+    }
+
+    cell_remembered_bits = (uint64_t*)((uint8_t*)cell_moved_bits + bitmap_size);
+    cell_nursery_root = cell_mem_root;
+    cell_nursery_end = cell_mem_root + cell_nursery_size;
+    old_cell_root = cell_nursery_end;
+    old_cell_ptr = old_cell_root;
 }
 
-Object* make_number(int64_t val)
+// Frees what reserve_memory reserved
+void release_memory()
 {
-    return (Object*)((uint64_t)val << 2);
+    size_t bitmap_size = page_align(cell_mem_size / CELL_SIZE / 8);
+    munmap(mem_root, max_memory_size);
+    munmap(cell_mem_root, cell_mem_size);
+    munmap(cell_moved_bits, bitmap_size * 2);
 }
 
-int64_t get_number(Object* obj)
+// The root stack has a guard page at the end of it that turns an overflow into
+// a crash instead of a silent memory corruption.
+void reserve_root_stack()
 {
-    assert(get_type(obj) == TYPE_NUMBER);
-    int64_t val = (int64_t)obj;
-    return val >> 2;
+    size_t size = ROOT_STACK_SIZE * sizeof(Object**);
+    uint8_t* mem = mmap(NULL, size + sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (mem == MAP_FAILED)
+    {
+        perror("Failed to reserve memory for the root stack");
+        exit(1);
+    }
+
+    mprotect(mem + size, sysconf(_SC_PAGESIZE), PROT_NONE);
+    root_stack = (Object***)mem;
 }
 
-Object* make_symbol(const char* name)
+// Returns the start of the other half of the old space
+uint8_t* other_space()
 {
-    size_t sz = allocation_size(BASE_SIZE + strlen(name) + 1);
-    Object* rv = allocate(sz);
-    rv->moved = (Object*)TYPE_SYMBOL;
-    strcpy(rv->name, name);
-    return make_ptr(rv, TYPE_SYMBOL);
+    return old_root == mem_root ? mem_root + max_memory_size / 2 : mem_root;
 }
 
-Object* make_builtin(Function func)
+// Returns the start of the cell space of the other half
+uint8_t* other_cell_space()
 {
-    Object* rv = allocate(type_size(TYPE_BUILTIN));
-    rv->moved = (Object*)TYPE_BUILTIN;
-    rv->fn = func;
-    return make_ptr(rv, TYPE_BUILTIN);
+    return old_cell_root == cell_nursery_end ? cell_nursery_end + max_memory_size / 2 : cell_nursery_end;
 }
 
-Object* make_function(Object* params, Object* body, Object* env)
+// Grows the old space so that each half can hold at least the given amount of
+// bytes, up to the maximum memory size. The memory is not moved, only the end
+// of the current half changes.
+void grow_old_space(size_t needed)
 {
-    PUSH3(params, body, env);
-    Object* rv = allocate(type_size(TYPE_FUNCTION));
-    rv->moved = (Object*)TYPE_FUNCTION;
-    rv->ufn.func_params = params;
-    rv->ufn.func_body = body;
-    rv->ufn.func_env = env;
-    rv->ufn.jit_mem = NULL;
-    rv->ufn.compiled = 0;
-    POP();
-    return make_ptr(rv, TYPE_FUNCTION);
-}
+    size_t new_size = memory_size;
 
-Object* func_body(Object* obj)
-{
-    assert(get_type(obj) == TYPE_FUNCTION || get_type(obj) == TYPE_MACRO);
-    return get_func(obj)->ufn.func_body;
-}
+    while (new_size / 2 < needed && new_size < max_memory_size)
+    {
+        new_size *= 2;
+    }
 
-uint8_t* func_jit_mem(Object* obj)
-{
-    return get_func(obj)->ufn.jit_mem;
-}
+    if (new_size > max_memory_size)
+    {
+        new_size = max_memory_size;
+    }
 
-Object* func_params(Object* obj)
-{
-    assert(get_type(obj) == TYPE_FUNCTION || get_type(obj) == TYPE_MACRO);
-    return get_func(obj)->ufn.func_params;
-}
+    if (new_size != memory_size)
+    {
+        gc_resizes++;
 
-Object* func_env(Object* obj)
-{
-    assert(get_type(obj) == TYPE_FUNCTION || get_type(obj) == TYPE_MACRO);
-    return get_func(obj)->ufn.func_env;
-}
+        if (verbose_gc)
+        {
+            printf("\nMemory resized: %lu -> %lu\n", memory_size, new_size);
+        }
+    }
 
-Object* new_scope(Object* prev_scope)
-{
-    return cons(Nil, prev_scope);
+    memory_size = new_size;
 }
 
-Object* symbol(const char* name)
+// Shrinks the old space back towards its initial size and returns the unused
+// pages of both halves to the operating system.
+void shrink_old_space()
 {
-    for (Object* o = AllSymbols; o != Nil; o = cdr(o))
+    size_t used = old_used();
+    size_t new_size = memory_size;
+
+    while (new_size > initial_memory_size)
     {
-        Object* val = car(o);
+        // The smaller space must stay well below the threshold and still have
+        // room for a full nursery and cell nursery.
+        size_t half = new_size / 4;
 
-        if (strcmp(get_symbol(val), name) == 0)
+        if (used * 200 >= half * memory_pct || used + nursery_size * 2 > half)
         {
-            return val;
+            break;
         }
+
+        new_size /= 2;
     }
 
-    Object* sym = make_symbol(name);
-    AllSymbols = cons(sym, AllSymbols);
-    return car(AllSymbols);
-}
+    if (new_size == memory_size)
+    {
+        return;
+    }
 
-void bind_value(Object* scope, Object* symbol, Object* value)
-{
-    if (DEBUG_INFO)
+    gc_resizes++;
+
+    if (verbose_gc)
     {
-        printf("Binding '%s' to ", get_symbol(symbol));
-        print(value);
+        printf("\nMemory resized: %lu -> %lu\n", memory_size, new_size);
     }
 
-    Object* bound = Nil;
-    PUSH4(scope, symbol, value, bound);
-    bound = cons(symbol, value);
-    Object* res = cons(bound, car(scope));
-    get_cell(scope)->car = res;
-    POP();
+    size_t released = (memory_size - new_size) / 2;
+    madvise(old_root + new_size / 2, released, MADV_DONTNEED);
+    madvise(other_space() + new_size / 2, released, MADV_DONTNEED);
+    madvise(old_cell_root + new_size / 2, released, MADV_DONTNEED);
+    madvise(other_cell_space() + new_size / 2, released, MADV_DONTNEED);
+    memory_size = new_size;
 }
 
-void define_builtin_function(const char* name, Function fn)
+void end_major_collection(size_t memory_used, size_t extra);
+void finish_cycle(size_t extra);
+
+// A major collection moves all live objects into the other half of the old
+// space. The extra value is the number of bytes that must be available in the
+// old space after the collection.
+void major_collection(size_t extra)
 {
-    Object* func = Nil;
-    Object* sym = Nil;
-    PUSH2(func, sym);
+    if (gc_cycle)
+    {
+        finish_cycle(extra);
+        return;
+    }
 
-    func = make_builtin(fn);
-    sym = symbol(name);
+    gc_debug(">>>> Starting major GC");
+    size_t memory_used = old_used() + nursery_used();
 
-    bind_value(Env, sym, func);
-    POP();
+    // In the worst case everything is still alive in which case the other half
+    // must be able to hold both the nursery and the old space. If the maximum
+    // memory size is smaller than this, the collection fails only if the live
+    // objects do not fit into it.
+    if (memory_used + extra > memory_size / 2)
+    {
+        grow_old_space(memory_used + extra);
+    }
+
+    uint8_t* cells = old_cell_root;
+    uint8_t* cells_end = old_cell_ptr;
+    old_root = other_space();
+    old_cell_root = other_cell_space();
+    gc_root = old_root;
+    gc_ptr = old_root;
+    gc_cell_root = old_cell_root;
+    gc_cell_ptr = old_cell_root;
+    gc_limit = memory_size / 2;
+    make_roots_living(old_root, old_cell_root);
+    clear_cell_bits(cell_moved_bits, cells, cells_end);
+    clear_cell_bits(cell_remembered_bits, cells, cells_end);
+    end_major_collection(memory_used, extra);
 }
 
-void define_alias(const char* name, const char* alias)
+// Finishes a major collection that copied the live objects between old_root
+// and gc_ptr and the live cells between old_cell_root and gc_cell_ptr
+void end_major_collection(size_t memory_used, size_t extra)
 {
-    Object* sym = Nil;
-    Object* sym_alias = Nil;
-    Object* val = Nil;
-    PUSH3(sym, sym_alias, val);
+    old_ptr = gc_ptr;
+    old_cell_ptr = gc_cell_ptr;
 
-    sym = symbol(name);
-    sym_alias = symbol(alias);
-    val = symbol_lookup(Env, sym);
+    if (old_used() + extra > memory_size / 2)
+    {
+        // An incremental collection can copy more than a half holds
+        grow_old_space(old_used() + extra);
+    }
 
-    if (val)
+    gc_bytes_allocated += nursery_used();
+    gc_bytes_copied += old_used();
+    reset_nursery();
+    major_collections++;
+    minors_since_major = 0;
+
+    size_t space_size = memory_size / 2;
+    size_t still_in_use = old_used();
+    double pct_in_use = ((double)still_in_use / (double)space_size) * 100.0;
+
+    if (verbose_gc)
     {
-        bind_value(Env, sym_alias, val);
+        size_t memory_freed = memory_used - still_in_use;
+        double pct_freed = ((double)memory_freed / (double)space_size) * 100.0;
+        printf("\nMajor GC %lu (%lu minor): Memory freed: %lu (%.1lf%%) Memory used: %lu (%.1lf%%)\n",
+               major_collections, minor_collections, memory_freed, pct_freed, still_in_use, pct_in_use);
+    }
+
+    size_t nursery_capacity = (nursery_end - nursery_root) + (cell_nursery_end - cell_nursery_root) + extra;
+
+    if (pct_in_use > memory_pct || old_free() < nursery_capacity)
+    {
+        // Grow the memory if it's getting full or if there's not enough space
+        // left to promote a full nursery into the old space. As the growth
+        // happens in place, it takes effect immediately.
+        size_t wanted = space_size * 2;
+
+        if (wanted < still_in_use + nursery_capacity)
+        {
+            wanted = still_in_use + nursery_capacity;
+        }
+
+        grow_old_space(wanted);
+        idle_collections = 0;
+    }
+    else if (pct_in_use < memory_pct / 4 && memory_size > initial_memory_size)
+    {
+        // Only shrink the memory after it has stayed mostly unused for a while.
+        // This prevents short allocation spikes from shrinking and growing
+        // the memory repeatedly.
+        if (++idle_collections >= SHRINK_AFTER)
+        {
+            shrink_old_space();
+            idle_collections = 0;
+        }
     }
     else
     {
-        error("Undefined symbol: %s", name);
+        idle_collections = 0;
     }
 
-    POP();
+    gc_debug("<<<< Major GC done");
 }
 
-void define_constant(const char* name, Object* value)
+double gc_clock()
 {
-    Object* sym = Nil;
-    PUSH2(value, sym);
-    sym = symbol(name);
-    bind_value(Env, sym, value);
-    POP();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
 }
 
-void do_writechar(Object* obj)
+// Records the pause of a collection that started at the given time. The
+// collection counts from before it tell what kind of a collection it was.
+void gc_pause_done(double start, size_t minors, size_t majors)
 {
-    if (get_type(obj) == TYPE_NUMBER)
-    {
-        unsigned char ch = get_number(obj);
-        fwrite(&ch, 1, 1, stdout);
-    }
-    else if (get_type(obj) == TYPE_SYMBOL)
+    double pause = gc_clock() - start;
+    gc_pauses++;
+    gc_pause_total += pause;
+
+    if (pause > gc_pause_max)
     {
-        const char* sym = get_symbol(obj);
-        fwrite(sym, strlen(sym), 1, stdout);
+        gc_pause_max = pause;
     }
-    else
+
+    if (gc_telemetry)
     {
-        error("'write-char' takes a symbol or a number as its argument.");
-        print(obj);
+        const char* kind = major_collections != majors ? "major"
+            : minor_collections != minors ? "minor" : "slice";
+        fprintf(stderr, "gc=%lu kind=%s pause_us=%.0f allocated=%lu copied=%lu heap_size=%lu heap_used=%lu\n",
+                gc_pauses, kind, pause, gc_bytes_allocated, gc_bytes_copied,
+                memory_size, old_used());
     }
 }
 
-void print_scope(Object* scope)
+Object* replicate(Object* obj)
 {
-    int num_scopes = 0;
+    make_living(obj);
+    return obj;
+}
 
-    for (Object* s = scope; s != Nil; s = cdr(s))
+// Updates the copy of an original that was written to after it was copied. The
+// cells are in the write log as tagged pointers.
+void refresh_copy(Object* ptr)
+{
+    if (get_type(ptr) == TYPE_CELL)
     {
-        ++num_scopes;
+        Object** entry = cycle_cell(ptr);
+        Object* copy = get_obj(*entry);
+        *entry = copy;
+        copy->car = get_obj(ptr)->car;
+        copy->cdr = get_obj(ptr)->cdr;
+
+        if ((uint8_t*)copy < cycle_cell_scan)
+        {
+            fix_cell(copy);
+        }
+
+        return;
     }
 
-    for (Object* s = scope; s != Nil; s = cdr(s))
+    Object* copy = ptr->moved;
+    intptr_t header = (intptr_t)copy->moved & ~(intptr_t)GC_LOGGED;
+    memcpy(copy, ptr, object_size(copy));
+    copy->moved = (Object*)header;
+
+    if ((uint8_t*)copy < cycle_scan)
     {
-        printf("===== Scope %d =====\n", num_scopes--);
-        print(car(s));
+        fix_references(copy);
     }
 }
 
-Object* symbol_lookup(Object* scope, Object* sym)
+void start_cycle()
 {
-    for (Object* s = scope; s != Nil; s = cdr(s))
+    gc_debug(">>>> Starting incremental major GC");
+    cycle_root = other_space();
+    cycle_ptr = cycle_root;
+    cycle_scan = cycle_root;
+    cycle_cell_root = other_cell_space();
+    cycle_cell_ptr = cycle_cell_root;
+    cycle_cell_scan = cycle_cell_root;
+
+    // The cells that are promoted during the collection are added to the end of
+    // the cell space which means that the table must cover all of it
+    cycle_cell_from = old_cell_root;
+    cycle_cells = mmap(NULL, max_memory_size / 2 / CELL_SIZE * sizeof(Object*), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (cycle_cells == MAP_FAILED)
     {
-        for (Object* o = car(s); o != Nil; o = cdr(o))
-        {
-            Object* kv = car(o);
-            assert(get_type(kv) == TYPE_CELL);
-            Object* key = car(kv);
+        out_of_memory();
+    }
 
-            if (key == sym)
-            {
-                if (DEBUG_EXTRA)
-                {
-                    printf("Symbol '%s' points to ", get_symbol(key));
-                    print(cdr(kv));
-                }
+    gc_cycle = true;
+}
 
-                return cdr(kv);
-            }
-        }
+// Makes the roots point to the copies. Anything that's not yet been copied is
+// copied now, the nursery included, which means this can be done at any time.
+void finish_cycle(size_t extra)
+{
+    size_t memory_used = old_used() + nursery_used();
+
+    for (size_t i = 0; i < remembered_count; i++)
+    {
+        forget_entry(remembered_set[i]);
     }
 
-    return Undefined;
+    remembered_count = 0;
+
+    for (size_t i = 0; i < gc_function_count; i++)
+    {
+        UserFunction* from = &gc_functions[i]->ufn;
+        UserFunction* to = &gc_functions[i]->moved->ufn;
+        to->jit_mem = from->jit_mem;
+        to->param_count = from->param_count;
+        to->code_entry = from->code_entry;
+        to->call_count = from->call_count;
+        to->loop_count = from->loop_count;
+        to->jit_epoch = from->jit_epoch;
+        to->profile_id = from->profile_id;
+        to->compiled = from->compiled;
+    }
+
+    gc_function_count = 0;
+    gc_root = cycle_root;
+    gc_ptr = cycle_ptr;
+    gc_cell_root = cycle_cell_root;
+    gc_cell_ptr = cycle_cell_ptr;
+    gc_limit = max_memory_size / 2;
+
+    while (gc_log_count > 0)
+    {
+        refresh_copy(gc_log[--gc_log_count]);
+    }
+
+    gc_cycle = false;
+    old_root = cycle_root;
+    old_cell_root = cycle_cell_root;
+    make_roots_living(cycle_scan, cycle_cell_scan);
+    munmap(cycle_cells, max_memory_size / 2 / CELL_SIZE * sizeof(Object*));
+    cycle_cells = NULL;
+    end_major_collection(memory_used, extra);
 }
 
-const char* get_symbol_by_pointed_value(Object* val)
+// Does a slice of the incremental collection. The collection is finished once
+// all the objects that the roots point to have been copied.
+void gc_slice(double deadline)
 {
-    Object* scope = Env;
-
-    for (Object* s = scope; s != Nil; s = cdr(s))
+    assert(gc_cycle && nursery_used() == 0);
+    gc_root = cycle_root;
+    gc_ptr = cycle_ptr;
+    gc_cell_root = cycle_cell_root;
+    gc_cell_ptr = cycle_cell_ptr;
+    gc_limit = max_memory_size / 2;
+    bool roots_copied = false;
+
+    for (size_t n = 1; n < GC_SLICE_MIN_WORK || n % GC_CLOCK_INTERVAL || gc_clock() < deadline; n++)
     {
-        for (Object* o = car(s); o != Nil; o = cdr(o))
+        if (gc_log_count > 0)
         {
-            Object* kv = car(o);
-            assert(get_type(kv) == TYPE_CELL);
-            Object* key = car(kv);
-
-            if (cdr(kv) == val)
-            {
-                return get_symbol(key);
-            }
+            refresh_copy(gc_log[--gc_log_count]);
+        }
+        else if (cycle_scan < gc_ptr)
+        {
+            Object* o = (Object*)cycle_scan;
+            fix_references(o);
+            cycle_scan += object_size(o);
+        }
+        else if (cycle_cell_scan < gc_cell_ptr)
+        {
+            fix_cell((Object*)cycle_cell_scan);
+            cycle_cell_scan += CELL_SIZE;
+        }
+        else if (!roots_copied)
+        {
+            visit_roots(replicate);
+            roots_copied = true;
+        }
+        else
+        {
+            cycle_ptr = gc_ptr;
+            cycle_cell_ptr = gc_cell_ptr;
+            finish_cycle(0);
+            return;
         }
     }
 
-    return "{unbound}";
+    cycle_ptr = gc_ptr;
+    cycle_cell_ptr = gc_cell_ptr;
 }
 
+// Promotes the nursery into the old space during an incremental collection. If
+// the old space can't hold it, the collection is finished at once.
+void empty_nursery()
+{
+    size_t used = nursery_used();
 
-void print_one(Object* obj)
+    if (old_free() < used)
+    {
+        grow_old_space(old_used() + used);
+    }
+
+    if (old_free() < used)
+    {
+        major_collection(0);
+    }
+    else
+    {
+        minor_collection();
+    }
+}
+
+void collect_garbage()
 {
-    assert(obj != TailCall);
+    bool major = old_free() < nursery_used()
+        || (memory_size > initial_memory_size && minors_since_major >= IDLE_MINOR_COLLECTIONS);
+    double start = gc_clock();
+    size_t minors = minor_collections;
+    size_t majors = major_collections;
 
-    switch (get_type(obj))
+    if (gc_pause_budget == 0)
     {
-    case TYPE_NUMBER:
-        printf("%ld ", get_number(obj));
-        break;
-    case TYPE_SYMBOL:
-        printf("%s ", get_symbol(obj));
-        break;
-    case TYPE_CONST:
-        if (obj == True)
+        if (major)
         {
-            printf("t ");
+            major_collection(0);
         }
         else
         {
-            assert(obj == Nil);
-            printf("nil ");
+            minor_collection();
         }
-        break;
-    case TYPE_CELL:
-        {
-            printf("( ");
-            Object* o = obj;
-
-            for (; get_type(o) == TYPE_CELL; o = cdr(o))
-            {
-                print_one(car(o));
-            }
+    }
+    else
+    {
+        empty_nursery();
 
-            if (o != Nil)
+        if (major_collections == majors)
+        {
+            if (!gc_cycle && major)
             {
-                printf(". ");
-                print_one(o);
+                start_cycle();
             }
-            printf(") ");
-        }
-        break;
-    case TYPE_FUNCTION:
-        if (get_func(obj)->ufn.compiled)
-        {
-            printf("<compiled:%s>", get_symbol_by_pointed_value(obj));
-        }
-        else
-        {
-            printf("<func:%s>", get_symbol_by_pointed_value(obj));
 
-            if (DEBUG_INFO)
+            if (gc_cycle)
             {
-                printf(": ");
-                print_one(func_params(obj));
-                print_one(func_body(obj));
+                gc_slice(start + gc_pause_budget);
             }
         }
-        break;
-    case TYPE_MACRO:
-        printf("<macro> ");
-        break;
-    case TYPE_BUILTIN:
-        printf("<builtin:%s> ", get_symbol_by_pointed_value(obj));
-        break;
-    default:
-        assert(false);
-        break;
     }
-}
 
-void print(Object* obj)
-{
-    print_one(obj);
-    printf("\n");
+    gc_pause_done(start, minors, majors);
 }
 
-void debug_print(Object* obj)
+double gc_idle(double usec)
 {
-    if (DEBUG_INFO)
+    if (gc_pause_budget == 0 || (!gc_cycle && old_used() < memory_size / 4))
     {
-        print_one(obj);
-        printf("\n");
+        return 0;
+    }
+
+    double start = gc_clock();
+    size_t minors = minor_collections;
+    size_t majors = major_collections;
+    empty_nursery();
+
+    if (major_collections == majors)
+    {
+        if (!gc_cycle)
+        {
+            start_cycle();
+        }
+
+        gc_slice(start + usec);
     }
+
+    gc_pause_done(start, minors, majors);
+    return gc_clock() - start;
 }
 
-// Parsing and tokenization
+// Object creation
 
-int peek()
+bool is_large_object(size_t size)
 {
-    int ch = getc(input);
-    ungetc(ch, input);
-    return ch;
+    return size > (size_t)(nursery_end - nursery_root) / 4;
 }
 
-int get()
+// Makes room for a large object in the old space, collecting the garbage if
+// needed. Returns false if the object doesn't fit within the heap limit.
+bool reserve_old_space(size_t size)
 {
-    int rc = getc(input);
+    if (old_free() < size && gc_cycle)
+    {
+        grow_old_space(old_used() + size);
+    }
 
-    if (echo && rc != EOF && rc != '\n' && rc != '\r')
+    if (old_free() < size)
     {
-        printf("%c", rc);
+        double start = gc_clock();
+        size_t minors = minor_collections;
+        size_t majors = major_collections;
+        major_collection(size);
+        gc_pause_done(start, minors, majors);
     }
 
-    return rc;
+    return old_free() >= size;
 }
 
-Object* reverse(Object* list)
+Object* allocate(size_t size)
 {
-    assert(list);
-    Object* newlist = Nil;
+#if ALWAYS_GC
+    collect_garbage();
+#endif
+    assert(allocation_size(size) == size);
 
-    while (list != Nil)
+    if (is_large_object(size))
     {
-        Object* next = cdr(list);
-        get_cell(list)->cdr = newlist;
-        newlist = list;
-        list = next;
+        // Large objects are allocated directly from the old space to avoid
+        // having to copy them during minor collections. Since the object is
+        // old to begin with, all stores into it must use the write barrier.
+        if (!reserve_old_space(size))
+        {
+            out_of_memory();
+        }
+
+        Object* rv = (Object*)old_ptr;
+        gc_bytes_allocated += size;
+        gc_debug("Allocate [old] %p <%lu>", rv, size);
+        old_ptr += size;
+        return rv;
     }
 
-    return newlist;
+    if (mem_ptr + size > mem_end)
+    {
+        collect_garbage();
+    }
+
+    Object* rv = (Object*)mem_ptr;
+    gc_debug("Allocate %p <%lu>", rv, size);
+    mem_ptr += size;
+
+    assert(get_obj(rv) == rv);
+    return rv;
 }
 
-int length(Object* list)
+Object* allocate_cell()
 {
-    int i = 0;
+#if ALWAYS_GC
+    collect_garbage();
+#endif
 
-    for (; list != Nil; list = cdr(list))
+    if (cell_ptr + CELL_SIZE > cell_end)
     {
-        i++;
+        collect_garbage();
     }
 
-    return i;
+    Object* rv = (Object*)cell_ptr;
+    gc_debug("Allocate %p <cell>", rv);
+    cell_ptr += CELL_SIZE;
+    return rv;
 }
 
-Object* parse_expr();
+Object* cons(Object* car, Object* cdr)
+{
+    PUSH2(car, cdr);
+    Object* rv = allocate_cell();
+    rv->car = car;
+    rv->cdr = cdr;
+    POP();
+    return make_ptr(rv, TYPE_CELL);
+}
 
-Object* parse_list()
+Object* car(Object* obj)
 {
-    Object* value = Nil;
-    Object* obj = Nil;
-    PUSH2(value, obj);
-    assert(peek() == '(');
-    get();
-    obj = parse_expr();
+    assert(get_type(obj) == TYPE_CELL);
+    return get_cell(obj)->car;
+}
 
-    while (obj != Undefined)
+Object* cdr(Object* obj)
+{
+    assert(get_type(obj) == TYPE_CELL);
+    return get_cell(obj)->cdr;
+}
+
+Object* make_number(int64_t val)
+{
+    return (Object*)((uint64_t)val << NUMBER_SHIFT);
+}
+
+int64_t get_number(Object* obj)
+{
+    assert(get_type(obj) == TYPE_NUMBER);
+    int64_t val = (int64_t)obj;
+    return val >> NUMBER_SHIFT;
+}
+
+Object* make_symbol(const char* name, size_t len)
+{
+    size_t sz = allocation_size(SYMBOL_BASE_SIZE + len + 1);
+    Object* rv = allocate(sz);
+    rv->moved = (Object*)TYPE_SYMBOL;
+    rv->global = Undefined;
+    memcpy(rv->name, name, len);
+    rv->name[len] = '\0';
+    return make_ptr(rv, TYPE_SYMBOL);
+}
+
+size_t vector_size(size_t length)
+{
+    return allocation_size(offsetof(Object, items) + length * sizeof(Object*));
+}
+
+Object* make_vector(size_t length, Object* value)
+{
+    PUSH1(value);
+    Object* rv = allocate(vector_size(length));
+    rv->moved = (Object*)TYPE_VECTOR;
+    rv->length = length;
+
+    for (size_t i = 0; i < length; i++)
     {
-        value = cons(obj, value);
-        obj = parse_expr();
+        rv->items[i] = value;
     }
 
+    write_barrier(rv, value);
+
     POP();
-    return reverse(value);
+    return make_ptr(rv, TYPE_VECTOR);
 }
 
-Object* parse_number()
+Object** vector_items(Object* obj)
 {
-    char ch = get();
-    uint64_t val = ch - '0';
+    assert(get_type(obj) == TYPE_VECTOR);
+    return get_obj(obj)->items;
+}
 
-    while (isdigit(peek()))
+bool check_vector_index(Object* vec, Object* index)
+{
+    if (get_type(vec) != TYPE_VECTOR)
     {
-        ch = get();
-        val = ch - '0' + val * 10;
-
-        if (val >= LONG_MAX >> 2)
-        {
-            error("Integer overflow, value is larger than %lu", (LONG_MAX >> 2) - 1);
-            return Nil;
-        }
+        error("Not a vector");
+        return false;
+    }
+    else if (get_type(index) != TYPE_NUMBER)
+    {
+        error("Not a number");
+        return false;
+    }
+    else if ((uint64_t)get_number(index) >= get_obj(vec)->length)
+    {
+        error("Index %ld is out of range for a vector of length %lu", get_number(index), get_obj(vec)->length);
+        return false;
     }
 
-    int64_t ival = val;
-    return make_number(ival);
+    return true;
 }
 
-Object* parse_quote()
+Object* make_local_ref(int depth, int slot)
 {
-    Object* fn = symbol("quote");
-    Object* arg = Nil;
-    Object* arg_list = Nil;
-    PUSH3(fn, arg, arg_list);
-    assert(peek() == '\'');
-    get();
-    arg = parse_expr();
-    arg_list = cons(arg, Nil);
-    POP();
-    return cons(fn, arg_list);
+    return (Object*)(((uint64_t)depth << 32) | ((uint64_t)slot << 8) | LOCAL_REF_TAG);
 }
 
-Object* parse_symbol()
+bool is_local_ref(Object* obj)
 {
-    char name[MAX_SYMBOL_LEN];
-    char* ptr = name;
-    char ch = peek();
+    return ((intptr_t)obj & 0xff) == LOCAL_REF_TAG;
+}
 
-    while (ch != ')' && ch != '(' && !isspace(ch))
-    {
-        *ptr++ = get();
-        ch = peek();
+int local_ref_depth(Object* obj)
+{
+    return (uint64_t)obj >> 32;
+}
 
-        if (ptr == name + MAX_SYMBOL_LEN)
-        {
-            error("Symbol name too long");
-            return Undefined;
-        }
-    }
+int local_ref_slot(Object* obj)
+{
+    return ((uint64_t)obj >> 8) & 0xffffff;
+}
 
-    *ptr = '\0';
-    return symbol(name);
+Object* make_builtin(Function func)
+{
+    Object* rv = allocate(type_size(TYPE_BUILTIN));
+    rv->moved = (Object*)TYPE_BUILTIN;
+    rv->fn = func;
+    return make_ptr(rv, TYPE_BUILTIN);
 }
 
-Object* parse_expr()
+int param_count(Object* params)
 {
-    while (true)
+    int i = 0;
+
+    for (; get_type(params) == TYPE_CELL; params = cdr(params))
     {
-        switch (peek())
-        {
-        case ';':
-            {
-                char c = get();
+        i++;
+    }
 
-                while (c != '\n' && c != EOF)
-                {
-                    c = get();
-                }
+    return i;
+}
 
-                if (echo)
-                {
-                    printf("\n");
-                }
-                assert(c == '\n' || c == EOF);
-            }
-            break;
+Object* make_function(Object* params, Object* body, Object* env)
+{
+    PUSH3(params, body, env);
+    Object* rv = allocate(type_size(TYPE_FUNCTION));
+    rv->moved = (Object*)TYPE_FUNCTION;
+    rv->ufn.func_params = params;
+    rv->ufn.func_body = body;
+    rv->ufn.func_env = env;
+    rv->ufn.code = Nil;
+    rv->ufn.jit_mem = NULL;
+    rv->ufn.param_count = param_count(params);
+    rv->ufn.code_entry = 0;
+    rv->ufn.call_count = 0;
+    rv->ufn.loop_count = 0;
+    rv->ufn.jit_epoch = 0;
+    rv->ufn.profile_id = 0;
+    rv->ufn.compiled = 0;
+    POP();
+    return make_ptr(rv, TYPE_FUNCTION);
+}
 
-        case ' ':
-        case '\t':
-        case '\r':
-        case '\n':
-            get();
-            break;
+Object* func_body(Object* obj)
+{
+    assert(get_type(obj) == TYPE_FUNCTION || get_type(obj) == TYPE_MACRO);
+    return get_func(obj)->ufn.func_body;
+}
 
-        case '(':
-            return parse_list();
+uint8_t* func_jit_mem(Object* obj)
+{
+    return get_func(obj)->ufn.jit_mem;
+}
 
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-            return parse_number();
+Object* func_params(Object* obj)
+{
+    assert(get_type(obj) == TYPE_FUNCTION || get_type(obj) == TYPE_MACRO);
+    return get_func(obj)->ufn.func_params;
+}
 
-        case '-':
-            {
-                get();
-                Object* o;
+Object* func_env(Object* obj)
+{
+    assert(get_type(obj) == TYPE_FUNCTION || get_type(obj) == TYPE_MACRO);
+    return get_func(obj)->ufn.func_env;
+}
 
-                if (isdigit(peek()))
-                {
-                    o = parse_number();
+Object* new_scope(Object* prev_scope, Object* names, int size)
+{
+    Object* scope = Nil;
+    PUSH3(prev_scope, names, scope);
+    scope = make_vector(SCOPE_SLOTS + size, Nil);
+    vector_items(scope)[SCOPE_PARENT] = prev_scope;
+    vector_items(scope)[SCOPE_NAMES] = names;
+    POP();
+    return scope;
+}
 
-                    if (o != Nil)
-                    {
-                        int64_t val = get_number(o);
-                        o = make_number(-val);
-                    }
-                }
-                else if (isspace(peek()))
-                {
-                    o = symbol("-");
-                }
-                else
-                {
-                    o = parse_symbol();
-                    char* name = (char*)get_symbol(o);
-                    memmove(name + 1, name, strlen(name));
-                    name[0] = '-';
-                }
+Object* scope_parent(Object* scope)
+{
+    return vector_items(scope)[SCOPE_PARENT];
+}
 
-                return o;
-            }
+Object* scope_names(Object* scope)
+{
+    return vector_items(scope)[SCOPE_NAMES];
+}
 
-        case '\'':
-            return parse_quote();
+Object** scope_slots(Object* scope)
+{
+    return vector_items(scope) + SCOPE_SLOTS;
+}
 
-        case ')':
-            get();
-            return Undefined;
+int scope_index(Object* names, Object* sym)
+{
+    int i = 0;
 
-        case EOF:
-            return Undefined;
+    for (; get_type(names) == TYPE_CELL; names = cdr(names))
+    {
+        if (car(names) == sym)
+        {
+            return i;
+        }
 
-        default:
-            return parse_symbol();
-        };
+        i++;
     }
 
-    return Undefined;
+    return -1;
 }
-// Evaluation
 
-Object* expand_macro(Object* scope, Object* macro, Object* args)
+// Finds the slot where the local variable is stored or returns NULL if the
+// symbol does not refer to a local variable. If owner is not NULL, the scope
+// that the slot belongs to is stored in it.
+Object** local_lookup(Object* scope, Object* sym, Object** owner)
 {
-    Object* param = func_params(macro);
-    PUSH4(macro, param, args, scope);
-    scope = new_scope(scope);
-
-    while (param != Nil && args != Nil)
+    for (Object* s = scope; s != Env; s = scope_parent(s))
     {
-        assert(get_type(param) == TYPE_CELL);
+        int i = scope_index(scope_names(s), sym);
 
-        if (get_type(args) != TYPE_CELL)
+        if (i != -1)
         {
-            break;
-        }
+            if (owner)
+            {
+                *owner = s;
+            }
 
-        bind_value(scope, car(param), car(args));
-        param = cdr(param);
-        args = cdr(args);
+            return scope_slots(s) + i;
+        }
     }
 
-    Object* ret = Nil;
+    return NULL;
+}
 
-    if (args != Nil)
+Object* local_ref_value(Object* scope, Object* ref)
+{
+    for (int depth = local_ref_depth(ref); depth > 0; depth--)
     {
-        if (get_type(args) == TYPE_CELL)
-        {
-            error("Too many arguments to macro");
-        }
-        else
-        {
-            error("Invalid argument type:");
-            print(args);
-        }
+        scope = scope_parent(scope);
     }
-    else if (param != Nil)
+
+    return scope_slots(scope)[local_ref_slot(ref)];
+}
+
+// The name of the local variable that the reference points to
+Object* local_ref_name(Object* scope, Object* ref)
+{
+    for (int depth = local_ref_depth(ref); depth > 0; depth--)
     {
-        error("Not enough arguments to macro");
+        scope = scope_parent(scope);
     }
-    else
+
+    Object* names = scope_names(scope);
+
+    for (int i = local_ref_slot(ref); i > 0; i--)
     {
-        ret = eval(scope, func_body(macro));
+        names = cdr(names);
     }
 
-    POP();
-    return ret;
+    return car(names);
 }
 
-Object* eval_cell(Object* scope, Object* obj)
+uint64_t hash_bytes(const void* data, size_t len)
 {
-    Object* ret = Nil;
-    Object* fn = Nil;
-    Object* param = Nil;
-    Object* arg = Nil;
-    Object* next_scope = Nil;
-    PUSH7(scope, obj, ret, fn, param, arg, next_scope);
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
 
- start:
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= ((const uint8_t*)data)[i];
+        hash *= 0x100000001b3;
+    }
 
-    fn = eval(scope, car(obj));
-    int type = get_type(fn);
+    return hash;
+}
 
-    if (type == TYPE_MACRO)
+void symbol_table_insert(Object** table, size_t size, Object* sym)
+{
+    size_t mask = size - 1;
+    size_t i = hash_bytes(get_symbol(sym), strlen(get_symbol(sym))) & mask;
+
+    while (table[i])
     {
-        ret = expand_macro(scope, fn, cdr(obj));
-        ret = eval(scope, ret);
+        i = (i + 1) & mask;
     }
-    else if (type == TYPE_BUILTIN)
+
+    table[i] = sym;
+}
+
+void symbol_table_grow()
+{
+    size_t new_size = symbol_table_size ? symbol_table_size * 2 : SYMBOL_TABLE_MIN_SIZE;
+    Object** new_table = calloc(new_size, sizeof(Object*));
+
+    for (size_t i = 0; i < symbol_table_size; i++)
     {
-        ret = get_builtin(fn)->fn(scope, cdr(obj));
+        if (symbol_table[i])
+        {
+            symbol_table_insert(new_table, new_size, symbol_table[i]);
+        }
     }
-    else if (type == TYPE_FUNCTION)
+
+    free(symbol_table);
+    symbol_table = new_table;
+    symbol_table_size = new_size;
+}
+
+Object* intern(const char* name, size_t len)
+{
+    if (symbol_count * 2 >= symbol_table_size)
     {
-        next_scope = new_scope(func_env(fn));
-        param = func_params(fn);
-        arg = cdr(obj);
-        assert(param == Nil || get_type(param) == TYPE_CELL);
-        assert(arg == Nil || get_type(arg) == TYPE_CELL);
+        symbol_table_grow();
+    }
+
+    size_t mask = symbol_table_size - 1;
+    size_t i = hash_bytes(name, len) & mask;
+
+    for (; symbol_table[i]; i = (i + 1) & mask)
+    {
+        const char* other = get_symbol(symbol_table[i]);
 
-        while (param != Nil && arg != Nil)
+        if (strncmp(other, name, len) == 0 && other[len] == '\0')
         {
-            ret = eval(scope, car(arg));
-            bind_value(next_scope, car(param), ret);
-            param = cdr(param);
-            arg = cdr(arg);
+            return symbol_table[i];
         }
+    }
+
+    // The allocation can trigger a garbage collection but since it only
+    // updates the existing entries, the free slot stays the same.
+    Object* sym = make_symbol(name, len);
+    symbol_table[i] = sym;
+    symbol_count++;
+    return sym;
+}
+
+Object* symbol(const char* name)
+{
+    return intern(name, strlen(name));
+}
+
+void bind_value(Object* scope, Object* symbol, Object* value)
+{
+    if (DEBUG_INFO)
+    {
+        printf("Binding '%s' to ", get_symbol(symbol));
+        print(value);
+    }
+
+    // The local scopes cannot grow, only existing local variables can be
+    // rebound. Everything else is bound in the global scope.
+    Object* owner = Nil;
+    Object** slot = local_lookup(scope, symbol, &owner);
+
+    if (slot)
+    {
+        *slot = value;
+        write_barrier(owner, value);
+    }
+    else
+    {
+        Object* prev = get_obj(symbol)->global;
 
-        if (param != Nil)
+        if (get_type(prev) == TYPE_BUILTIN && prev != value)
         {
-            Object* sym = car(obj);
-            error("Not enough arguments to function '%s'. Expected %d, have %d.",
-                  get_type(sym) == TYPE_SYMBOL ? get_symbol(sym) : "<func>",
-                  length(func_params(fn)), length(cdr(obj)));
+            // The bytecode assumes that the builtins stay the same
+            vm_invalidate();
         }
-        else if (arg != Nil)
+
+        if ((get_type(prev) == TYPE_BUILTIN || get_type(prev) == TYPE_FUNCTION) && prev != value)
         {
-            Object* sym = car(obj);
-            error("Too many arguments to function '%s'. Expected %d, have %d.",
-                  get_type(sym) == TYPE_SYMBOL ? get_symbol(sym) : "<func>",
-                  length(func_params(fn)), length(cdr(obj)));
+            // The automatically compiled code assumes the same for all functions
+            jit_invalidate();
         }
-        else if (get_func(fn)->ufn.compiled == COMPILE_CODE)
+
+        get_obj(symbol)->global = value;
+        write_barrier(symbol, value);
+    }
+}
+
+void define_builtin_function(const char* name, Function fn)
+{
+    Object* func = Nil;
+    Object* sym = Nil;
+    PUSH2(func, sym);
+
+    func = make_builtin(fn);
+    sym = symbol(name);
+
+    bind_value(Env, sym, func);
+    POP();
+}
+
+void define_alias(const char* name, const char* alias)
+{
+    Object* sym = Nil;
+    Object* sym_alias = Nil;
+    Object* val = Nil;
+    PUSH3(sym, sym_alias, val);
+
+    sym = symbol(name);
+    sym_alias = symbol(alias);
+    val = symbol_lookup(Env, sym);
+
+    if (val)
+    {
+        bind_value(Env, sym_alias, val);
+    }
+    else
+    {
+        error("Undefined symbol: %s", name);
+    }
+
+    POP();
+}
+
+void define_constant(const char* name, Object* value)
+{
+    Object* sym = Nil;
+    PUSH2(value, sym);
+    sym = symbol(name);
+    bind_value(Env, sym, value);
+    POP();
+}
+
+bool do_arithmetic(enum Arith op, int64_t lhs, int64_t rhs, int64_t* result)
+{
+    switch (op)
+    {
+    case ARITH_MUL:
+        // Overflows wrap around like they do in the compiled code
+        *result = (int64_t)((uint64_t)lhs * (uint64_t)rhs);
+        break;
+
+    case ARITH_DIV:
+    case ARITH_MOD:
+        if (rhs == 0)
         {
-            // The arguments to the function are bound to the newest scope.
-            ret = jit_eval(fn, car(next_scope));
+            return false;
         }
-        else
-        {
-            Object* body = func_body(fn);
 
-            if (get_type(body) == TYPE_CELL)
-            {
-                if (DEBUG_EXTRA)
-                {
-                    printf("Function body is a list, evaluating in the same frame:\n");
-                }
-                obj = body;
-                scope = next_scope;
-                goto start;
-            }
+        *result = op == ARITH_DIV ? lhs / rhs : lhs % rhs;
+        break;
 
-            ret = eval(next_scope, body);
-        }
+    case ARITH_AND:
+        *result = lhs & rhs;
+        break;
 
-        if (DEBUG_EXTRA)
+    case ARITH_IOR:
+        *result = lhs | rhs;
+        break;
+
+    case ARITH_XOR:
+        *result = lhs ^ rhs;
+        break;
+
+    case ARITH_ASH:
+        // Shifting by more than 63 bits gives the same result as shifting by
+        // 63 bits: all of the bits of the number are gone.
+        if (rhs >= 0)
         {
-            printf("Return from: ");
-            print(func_body(fn));
+            *result = (int64_t)((uint64_t)lhs << (rhs > 63 ? 63 : rhs));
+        }
+        else
+        {
+            *result = lhs >> (rhs < -63 ? 63 : -rhs);
         }
+        break;
+    }
+
+    return true;
+}
+
+void do_writechar(Object* obj)
+{
+    if (get_type(obj) == TYPE_NUMBER)
+    {
+        unsigned char ch = get_number(obj);
+        fwrite(&ch, 1, 1, stdout);
+    }
+    else if (get_type(obj) == TYPE_SYMBOL)
+    {
+        const char* sym = get_symbol(obj);
+        fwrite(sym, strlen(sym), 1, stdout);
     }
     else
     {
-        error("Not a function:");
-        print(fn);
+        error("'write-char' takes a symbol or a number as its argument.");
+        print(obj);
     }
+}
 
-    if (ret == TailCall)
+void print_scope(Object* scope)
+{
+    int num_scopes = 0;
+
+    for (Object* s = scope; s != Env; s = scope_parent(s))
     {
-        obj = ret->tail_expr;
-        scope = ret->tail_scope;
-        ret = Nil;
+        ++num_scopes;
+    }
 
-        if (get_type(obj) == TYPE_CELL)
-        {
-            if (DEBUG_EXTRA)
-            {
-                printf("Doing tail call: ");
-                print(obj);
-                printf(":::::::::::: DO TAIL :::::::::::::::::\n");
-                print(car(scope));
-            }
+    for (Object* s = scope; s != Env; s = scope_parent(s))
+    {
+        printf("===== Scope %d =====\n", num_scopes--);
+        Object* names = scope_names(s);
 
-            goto start;
+        for (int i = 0; get_type(names) == TYPE_CELL; names = cdr(names), i++)
+        {
+            printf("%s = ", get_symbol(car(names)));
+            print(scope_slots(s)[i]);
         }
+    }
+}
+
+Object* symbol_lookup(Object* scope, Object* sym)
+{
+    // The global scope is always the last one and the values for it are stored
+    // in the symbols themselves.
+    Object** slot = local_lookup(scope, sym, NULL);
 
+    if (slot)
+    {
         if (DEBUG_EXTRA)
         {
-            printf("NOT doing tail call: ");
-            print(obj);
-            printf(":::::::::::: DO NOT TAIL :::::::::::::::::\n");
-            print(car(scope));
+            printf("Symbol '%s' points to ", get_symbol(sym));
+            print(*slot);
         }
 
-        // Not a list, evalue it here
-        ret = eval(scope, obj);
+        return *slot;
     }
 
-    POP();
-    return ret;
+    Object* val = get_obj(sym)->global;
+
+    if (DEBUG_EXTRA && val != Undefined)
+    {
+        printf("Symbol '%s' points to ", get_symbol(sym));
+        print(val);
+    }
+
+    return val;
 }
 
-Object* eval(Object* scope, Object* obj)
+const char* get_symbol_by_pointed_value(Object* val)
 {
-    Object* ret;
+    for (size_t i = 0; i < symbol_table_size; i++)
+    {
+        Object* sym = symbol_table[i];
 
-#ifndef NDEBUG
-    PUSH2(scope, obj);
-#endif
+        if (sym && get_obj(sym)->global == val)
+        {
+            return get_symbol(sym);
+        }
+    }
+
+    return "{unbound}";
+}
+
+
+void print_one(Object* obj)
+{
+    assert(obj != TailCall);
+
+    switch (get_type(obj))
+    {
+    case TYPE_NUMBER:
+        printf("%ld ", get_number(obj));
+        break;
+    case TYPE_SYMBOL:
+        printf("%s ", get_symbol(obj));
+        break;
+    case TYPE_CONST:
+        if (obj == True)
+        {
+            printf("t ");
+        }
+        else if (is_local_ref(obj))
+        {
+            printf("<local:%d:%d> ", local_ref_depth(obj), local_ref_slot(obj));
+        }
+        else if (future_index(obj) != -1)
+        {
+            printf("<future:%ld> ", future_index(obj));
+        }
+        else
+        {
+            assert(obj == Nil);
+            printf("nil ");
+        }
+        break;
+    case TYPE_CELL:
+        {
+            printf("( ");
+            Object* o = obj;
+
+            for (; get_type(o) == TYPE_CELL; o = cdr(o))
+            {
+                print_one(car(o));
+            }
+
+            if (o != Nil)
+            {
+                printf(". ");
+                print_one(o);
+            }
+            printf(") ");
+        }
+        break;
+    case TYPE_FUNCTION:
+        if (get_func(obj)->ufn.compiled == COMPILE_SYMBOLS || get_func(obj)->ufn.compiled == COMPILE_CODE)
+        {
+            printf("<compiled:%s>", get_symbol_by_pointed_value(obj));
+        }
+        else
+        {
+            printf("<func:%s>", get_symbol_by_pointed_value(obj));
+
+            if (DEBUG_INFO)
+            {
+                printf(": ");
+                print_one(func_params(obj));
+                print_one(func_body(obj));
+            }
+        }
+        break;
+    case TYPE_MACRO:
+        printf("<macro> ");
+        break;
+    case TYPE_VECTOR:
+        printf("<vector:%lu> ", get_obj(obj)->length);
+        break;
+    case TYPE_BUILTIN:
+        printf("<builtin:%s> ", get_symbol_by_pointed_value(obj));
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+void print(Object* obj)
+{
+    print_one(obj);
+    printf("\n");
+}
+
+void debug_print(Object* obj)
+{
+    if (DEBUG_INFO)
+    {
+        print_one(obj);
+        printf("\n");
+    }
+}
+
+// Parsing and tokenization
+//
+// The parser reads from a buffer that holds the input. Loaded files are mapped
+// into memory as a whole and the standard input is read in blocks whenever the
+// parser runs out of it. A refill keeps the part of the token that has already
+// been scanned which allows symbols to be interned straight from the buffer.
+struct Reader
+{
+    char* buffer;
+    size_t pos;  // The next byte to read
+    size_t len;  // The end of the data in the buffer
+    size_t size; // The size of the buffer if it is allocated
+    size_t mark; // The start of the token that is being scanned
+    int fd;      // Where more data is read from, -1 for mapped files
+};
+
+typedef struct Reader Reader;
+
+bool reader_fill(Reader* r)
+{
+    if (r->fd == -1)
+    {
+        return false;
+    }
+
+    size_t keep = r->len - r->mark;
+
+    if (keep)
+    {
+        memmove(r->buffer, r->buffer + r->mark, keep);
+    }
+
+    r->pos -= r->mark;
+    r->len = keep;
+    r->mark = 0;
+
+    if (r->len == r->size)
+    {
+        r->size = r->size ? r->size * 2 : READ_BLOCK_SIZE;
+        r->buffer = realloc(r->buffer, r->size);
+    }
+
+    ssize_t n;
+
+    do
+    {
+        n = read(r->fd, r->buffer + r->len, r->size - r->len);
+    }
+    while (n < 0 && errno == EINTR);
+
+    if (n <= 0)
+    {
+        return false;
+    }
+
+    r->len += n;
+    return true;
+}
+
+// Regular files are mapped, everything else is read like the standard input
+bool reader_open(Reader* r, const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+
+        return false;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+
+    if (S_ISREG(st.st_mode))
+    {
+        r->fd = -1;
+
+        if (st.st_size > 0)
+        {
+            r->buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (r->buffer == MAP_FAILED)
+            {
+                close(fd);
+                return false;
+            }
+
+            r->len = st.st_size;
+        }
+
+        close(fd);
+    }
+
+    return true;
+}
+
+void reader_close(Reader* r)
+{
+    if (r->fd == -1)
+    {
+        if (r->buffer)
+        {
+            munmap(r->buffer, r->len);
+        }
+    }
+    else
+    {
+        free(r->buffer);
+        close(r->fd);
+    }
+}
+
+int peek(Reader* r)
+{
+    if (r->pos == r->len && !reader_fill(r))
+    {
+        return EOF;
+    }
+
+    return (uint8_t)r->buffer[r->pos];
+}
+
+int get(Reader* r)
+{
+    int rc = peek(r);
+
+    if (rc != EOF)
+    {
+        r->pos++;
+
+        if (echo && rc != '\n' && rc != '\r')
+        {
+            printf("%c", rc);
+        }
+    }
+
+    return rc;
+}
+
+Object* reverse(Object* list)
+{
+    assert(list);
+    Object* newlist = Nil;
+
+    while (list != Nil)
+    {
+        Object* next = cdr(list);
+        get_cell(list)->cdr = newlist;
+        write_barrier(list, newlist);
+        newlist = list;
+        list = next;
+    }
+
+    return newlist;
+}
+
+int length(Object* list)
+{
+    int i = 0;
+
+    for (; list != Nil; list = cdr(list))
+    {
+        i++;
+    }
+
+    return i;
+}
+
+Object* parse_expr(Reader* r);
+
+Object* parse_list(Reader* r)
+{
+    Object* value = Nil;
+    Object* obj = Nil;
+    PUSH2(value, obj);
+    assert(peek(r) == '(');
+    get(r);
+    obj = parse_expr(r);
+
+    while (obj != Undefined)
+    {
+        value = cons(obj, value);
+        obj = parse_expr(r);
+    }
+
+    POP();
+    return reverse(value);
+}
+
+Object* parse_number(Reader* r)
+{
+    char ch = get(r);
+    uint64_t val = ch - '0';
+
+    while (isdigit(peek(r)))
+    {
+        ch = get(r);
+        val = ch - '0' + val * 10;
+
+        if (val >= LONG_MAX >> NUMBER_SHIFT)
+        {
+            error("Integer overflow, value is larger than %lu", (LONG_MAX >> NUMBER_SHIFT) - 1);
+            return Nil;
+        }
+    }
+
+    int64_t ival = val;
+    return make_number(ival);
+}
+
+Object* parse_quote(Reader* r)
+{
+    Object* fn = symbol("quote");
+    Object* arg = Nil;
+    Object* arg_list = Nil;
+    PUSH3(fn, arg, arg_list);
+    assert(peek(r) == '\'');
+    get(r);
+    arg = parse_expr(r);
+    arg_list = cons(arg, Nil);
+    POP();
+    return cons(fn, arg_list);
+}
+
+// The symbol starts from the mark, the part of it before the current position
+// has already been consumed
+Object* parse_symbol(Reader* r)
+{
+    size_t start = r->pos - r->mark;
+    int ch;
+
+    while ((ch = peek(r)) != EOF && ch != ')' && ch != '(' && !isspace(ch))
+    {
+        r->pos++;
+    }
+
+    if (echo)
+    {
+        fwrite(r->buffer + r->mark + start, 1, r->pos - r->mark - start, stdout);
+    }
+
+    return intern(r->buffer + r->mark, r->pos - r->mark);
+}
+
+Object* parse_expr(Reader* r)
+{
+    while (true)
+    {
+        // Everything before the mark can be discarded when the buffer is refilled
+        r->mark = r->pos;
+
+        switch (peek(r))
+        {
+        case ';':
+            {
+                char c = get(r);
+
+                while (c != '\n' && c != EOF)
+                {
+                    c = get(r);
+                }
+
+                if (echo)
+                {
+                    printf("\n");
+                }
+                assert(c == '\n' || c == EOF);
+            }
+            break;
+
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            get(r);
+            break;
+
+        case '(':
+            return parse_list(r);
+
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9':
+            return parse_number(r);
+
+        case '-':
+            {
+                get(r);
+                Object* o;
+
+                if (isdigit(peek(r)))
+                {
+                    o = parse_number(r);
+
+                    if (o != Nil)
+                    {
+                        int64_t val = get_number(o);
+                        o = make_number(-val);
+                    }
+                }
+                else if (isspace(peek(r)))
+                {
+                    o = symbol("-");
+                }
+                else
+                {
+                    // The mark is still at the '-' which makes it a part of the
+                    // name of the symbol.
+                    o = parse_symbol(r);
+                }
+
+                return o;
+            }
+
+        case '\'':
+            return parse_quote(r);
+
+        case ')':
+            get(r);
+            return Undefined;
+
+        case EOF:
+            return Undefined;
+
+        default:
+            return parse_symbol(r);
+        };
+    }
+
+    return Undefined;
+}
+// Evaluation
+
+// Returns Undefined if the arguments don't match the parameters of the macro
+Object* expand_macro(Object* scope, Object* macro, Object* args)
+{
+    int count = get_func(macro)->ufn.param_count;
+    int i = 0;
+    PUSH3(macro, args, scope);
+    scope = new_scope(scope, func_params(macro), count);
+
+    while (i < count && args != Nil)
+    {
+        if (get_type(args) != TYPE_CELL)
+        {
+            break;
+        }
+
+        scope_slots(scope)[i++] = car(args);
+        args = cdr(args);
+    }
+
+    Object* ret = Undefined;
+
+    if (args != Nil)
+    {
+        if (get_type(args) == TYPE_CELL)
+        {
+            error("Too many arguments to macro");
+        }
+        else
+        {
+            error("Invalid argument type:");
+            print(args);
+        }
+    }
+    else if (i < count)
+    {
+        error("Not enough arguments to macro");
+    }
+    else
+    {
+        ret = eval(scope, func_body(macro));
+    }
+
+    POP();
+    return ret;
+}
+
+// Copies the form with the references to local variables turned back into
+// symbols. The arguments of a macro that was defined only after the function
+// that calls it are resolved like any other form and the macro must not see
+// the references.
+Object* unresolve_locals(Object* scope, Object* obj)
+{
+    if (is_local_ref(obj))
+    {
+        return local_ref_name(scope, obj);
+    }
+    else if (get_type(obj) != TYPE_CELL)
+    {
+        return obj;
+    }
+
+    Object* head = Nil;
+    Object* tail = Nil;
+    PUSH4(scope, obj, head, tail);
+    head = unresolve_locals(scope, car(obj));
+    tail = unresolve_locals(scope, cdr(obj));
+    Object* ret = cons(head, tail);
+    POP();
+    return ret;
+}
+
+Object* eval_form(Object* scope, Object* obj, Object* fn)
+{
+    Object* ret = Nil;
+    Object* arg = Nil;
+    Object* next_scope = Nil;
+    PUSH6(scope, obj, ret, fn, arg, next_scope);
+
+ start:
+
+    if (fn == Undefined)
+    {
+        fn = eval(scope, car(obj));
+    }
+
+    int type = get_type(fn);
+
+    if (type == TYPE_MACRO)
+    {
+        arg = scope == Env ? cdr(obj) : unresolve_locals(scope, cdr(obj));
+        ret = expand_macro(scope, fn, arg);
+        ret = ret == Undefined ? Nil : eval(scope, ret);
+    }
+    else if (type == TYPE_BUILTIN)
+    {
+        ret = get_builtin(fn)->fn(scope, cdr(obj));
+    }
+    else if (type == TYPE_FUNCTION)
+    {
+        int count = get_func(fn)->ufn.param_count;
+        int i = 0;
+        arg = cdr(obj);
+        assert(arg == Nil || get_type(arg) == TYPE_CELL);
+
+        // Compiled functions take their arguments from the JIT stack and don't
+        // need a scope. For other functions, the arguments are evaluated
+        // directly into the slots of the new scope.
+        bool jit = jit_compiled(fn);
+        Object** jit_args = jit_sp();
+        next_scope = jit ? Nil : new_scope(func_env(fn), func_params(fn), count);
+
+        while (i < count && arg != Nil)
+        {
+            ret = eval(scope, car(arg));
+
+            if (jit)
+            {
+                if (!jit_push(ret))
+                {
+                    break;
+                }
+            }
+            else
+            {
+                scope_slots(next_scope)[i] = ret;
+                write_barrier(next_scope, ret);
+            }
+
+            i++;
+            arg = cdr(arg);
+        }
+
+        if (jit && i < count && arg != Nil)
+        {
+            // The JIT stack overflowed
+            jit_pop(jit_args);
+            ret = Nil;
+        }
+        else if (i < count)
+        {
+            Object* sym = car(obj);
+            jit_pop(jit_args);
+            error("Not enough arguments to function '%s'. Expected %d, have %d.",
+                  get_type(sym) == TYPE_SYMBOL ? get_symbol(sym) : "<func>",
+                  length(func_params(fn)), length(cdr(obj)));
+        }
+        else if (arg != Nil)
+        {
+            Object* sym = car(obj);
+            jit_pop(jit_args);
+            error("Too many arguments to function '%s'. Expected %d, have %d.",
+                  get_type(sym) == TYPE_SYMBOL ? get_symbol(sym) : "<func>",
+                  length(func_params(fn)), length(cdr(obj)));
+        }
+        else if (jit)
+        {
+            PROFILE_ENTER(fn);
+            ret = jit_call(fn, jit_args);
+            PROFILE_LEAVE();
+        }
+        else if (!debug_on())
+        {
+            PROFILE_ENTER(fn);
+            ret = vm_eval(fn, next_scope);
+            PROFILE_LEAVE();
+        }
+        else
+        {
+            // The debug output is only generated by the evaluator
+            Object* body = func_body(fn);
+
+            if (get_type(body) == TYPE_CELL)
+            {
+                if (DEBUG_EXTRA)
+                {
+                    printf("Function body is a list, evaluating in the same frame:\n");
+                }
+                obj = body;
+                scope = next_scope;
+                fn = Undefined;
+                goto start;
+            }
+
+            ret = eval(next_scope, body);
+        }
+
+        if (DEBUG_EXTRA)
+        {
+            printf("Return from: ");
+            print(func_body(fn));
+        }
+    }
+    else
+    {
+        error("Not a function:");
+        print(fn);
+    }
+
+    if (ret == TailCall)
+    {
+        obj = ret->tail_expr;
+        scope = ret->tail_scope;
+        ret = Nil;
+
+        if (get_type(obj) == TYPE_CELL)
+        {
+            if (DEBUG_EXTRA)
+            {
+                printf("Doing tail call: ");
+                print(obj);
+                printf(":::::::::::: DO TAIL :::::::::::::::::\n");
+                print_scope(scope);
+            }
+
+            fn = Undefined;
+            goto start;
+        }
+
+        if (DEBUG_EXTRA)
+        {
+            printf("NOT doing tail call: ");
+            print(obj);
+            printf(":::::::::::: DO NOT TAIL :::::::::::::::::\n");
+            print_scope(scope);
+        }
+
+        // Not a list, evalue it here
+        ret = eval(scope, obj);
+    }
+
+    POP();
+    return ret;
+}
+
+Object* eval_cell(Object* scope, Object* obj)
+{
+    return eval_form(scope, obj, Undefined);
+}
+
+Object* eval(Object* scope, Object* obj)
+{
+    Object* ret;
+
+#ifndef NDEBUG
+    PUSH2(scope, obj);
+#endif
+
+    if (DEBUG_INFO)
+    {
+        printf("EVAL %d (%d) ", debug_step++, debug_depth);
+        for (int i = 0; i < debug_depth; i++)
+        {
+            printf(". ");
+        }
+
+        printf(": ");
+        print(obj);
+        ++debug_depth;
+    }
+
+    switch (get_type(obj))
+    {
+    case TYPE_CONST:
+        ret = is_local_ref(obj) ? local_ref_value(scope, obj) : obj;
+        break;
+
+    case TYPE_NUMBER:
+    case TYPE_BUILTIN:
+    case TYPE_VECTOR:
+    case TYPE_FUNCTION:
+    case TYPE_MACRO:
+        ret = obj;
+        break;
+
+    case TYPE_SYMBOL:
+        ret = symbol_lookup(scope, obj);
+
+        if (ret == Undefined)
+        {
+            ret = Nil;
+            error("Undefined symbol: %s", get_symbol(obj));
+
+            if (DEBUG_EXTRA)
+            {
+                print_scope(scope);
+            }
+
+        }
+        break;
+
+    default:
+        assert(get_type(obj) == TYPE_CELL);
+        ret = eval_cell(scope, obj);
+        break;
+    }
+
+    if (DEBUG_INFO)
+    {
+        --debug_depth;
+        printf("RET: ");
+        print_one(obj);
+        printf(" -> ");
+        print(ret);
+    }
+
+#ifndef NDEBUG
+    POP();
+#endif
+    return ret;
+}
+
+// Lexical addressing
+//
+// Before a function is evaluated, the references to the parameters of the
+// function and the ones of the enclosing functions are replaced with local
+// variable references that point directly into the slots of the scope. The
+// arguments to forms that are not evaluated (quote, macros) are left as-is as
+// well as any symbols that do not refer to local variables. These are looked
+// up by name when they are evaluated.
+
+Object* builtin_quote(Object* scope, Object* args);
+Object* builtin_lambda(Object* scope, Object* args);
+Object* builtin_define(Object* scope, Object* args);
+Object* builtin_defun(Object* scope, Object* args);
+Object* builtin_defmacro(Object* scope, Object* args);
+Object* builtin_macroexpand(Object* scope, Object* args);
+Object* builtin_freeze(Object* scope, Object* args);
+Object* builtin_compile(Object* scope, Object* args);
+Object* builtin_save_compiled(Object* scope, Object* args);
+Object* builtin_load_compiled(Object* scope, Object* args);
+Object* builtin_load(Object* scope, Object* args);
+
+Object* resolve_local(LexicalScope* lex, Object* env, Object* sym)
+{
+    int depth = 0;
+
+    for (; lex; lex = lex->parent)
+    {
+        int i = scope_index(lex->names, sym);
+
+        if (i != -1)
+        {
+            return make_local_ref(depth, i);
+        }
+
+        depth++;
+    }
+
+    for (Object* s = env; s != Env; s = scope_parent(s))
+    {
+        int i = scope_index(scope_names(s), sym);
+
+        if (i != -1)
+        {
+            return make_local_ref(depth, i);
+        }
+
+        depth++;
+    }
+
+    return sym;
+}
+
+Object* resolve_locals(LexicalScope* lex, Object* env, Object* body);
+
+void resolve_locals_in_list(LexicalScope* lex, Object* env, Object* list)
+{
+    for (; get_type(list) == TYPE_CELL; list = cdr(list))
+    {
+        Object* value = resolve_locals(lex, env, car(list));
+        get_cell(list)->car = value;
+        write_barrier(list, value);
+    }
+}
+
+// Resolves the body of a (lambda params body) or (defun name params body) form
+void resolve_locals_in_function(LexicalScope* lex, Object* env, Object* args)
+{
+    if (get_type(args) == TYPE_CELL && get_type(cdr(args)) == TYPE_CELL)
+    {
+        LexicalScope inner = {car(args), lex};
+        resolve_locals_in_list(&inner, env, cdr(args));
+    }
+}
+
+// This function does not allocate any memory: the garbage collection cannot
+// happen while the body is being processed.
+Object* resolve_locals(LexicalScope* lex, Object* env, Object* body)
+{
+    int type = get_type(body);
+
+    if (type == TYPE_SYMBOL)
+    {
+        return resolve_local(lex, env, body);
+    }
+    else if (type != TYPE_CELL)
+    {
+        return body;
+    }
+
+    Object* fn = car(body);
+
+    if (get_type(fn) == TYPE_SYMBOL && resolve_local(lex, env, fn) == fn)
+    {
+        // Not shadowed by a local variable, check what the global value is
+        fn = get_obj(fn)->global;
+    }
+
+    if (get_type(fn) == TYPE_MACRO)
+    {
+        // The arguments to macros aren't evaluated
+        return body;
+    }
+    else if (get_type(fn) == TYPE_BUILTIN)
+    {
+        Function f = get_builtin(fn)->fn;
+        Object* args = cdr(body);
+
+        if (f == builtin_quote || f == builtin_macroexpand || f == builtin_freeze
+            || f == builtin_compile || f == builtin_load
+            || f == builtin_save_compiled || f == builtin_load_compiled)
+        {
+            return body;
+        }
+        else if (f == builtin_lambda)
+        {
+            resolve_locals_in_function(lex, env, args);
+            return body;
+        }
+        else if (f == builtin_defun || f == builtin_defmacro)
+        {
+            if (get_type(args) == TYPE_CELL)
+            {
+                resolve_locals_in_function(lex, env, cdr(args));
+            }
+
+            return body;
+        }
+        else if (f == builtin_define)
+        {
+            // The name that is being defined must stay as a symbol
+            if (get_type(args) == TYPE_CELL)
+            {
+                resolve_locals_in_list(lex, env, cdr(args));
+            }
+
+            return body;
+        }
+    }
+
+    resolve_locals_in_list(lex, env, body);
+    return body;
+}
+
+// Copies the cons cells of the tree, the other objects are shared
+Object* copy_tree(Object* obj)
+{
+    if (get_type(obj) != TYPE_CELL)
+    {
+        return obj;
+    }
+
+    Object* ret = Nil;
+    Object* tail = Nil;
+    Object* value = Nil;
+    PUSH4(obj, ret, tail, value);
+
+    for (; get_type(obj) == TYPE_CELL; obj = cdr(obj))
+    {
+        value = copy_tree(car(obj));
+        value = cons(value, Nil);
+
+        if (ret == Nil)
+        {
+            ret = value;
+        }
+        else
+        {
+            get_cell(tail)->cdr = value;
+            write_barrier(tail, value);
+        }
+
+        tail = value;
+    }
+
+    if (obj != Nil)
+    {
+        get_cell(tail)->cdr = obj;
+        write_barrier(tail, obj);
+    }
+
+    POP();
+    return ret;
+}
+
+Object* expand_macros(LexicalScope* lex, Object* env, Object* body);
+
+void expand_macros_in_list(LexicalScope* lex, Object* env, Object* list)
+{
+    Object* value = Nil;
+    PUSH3(env, list, value);
+
+    for (; get_type(list) == TYPE_CELL; list = cdr(list))
+    {
+        value = expand_macros(lex, env, car(list));
+        get_cell(list)->car = value;
+        write_barrier(list, value);
+    }
+
+    POP();
+}
+
+void expand_macros_in_function(LexicalScope* lex, Object* env, Object* args)
+{
+    if (get_type(args) == TYPE_CELL && get_type(cdr(args)) == TYPE_CELL)
+    {
+        LexicalScope inner = {car(args), lex};
+        PUSH2(args, inner.names);
+        expand_macros_in_list(&inner, env, cdr(args));
+        POP();
+    }
+}
+
+// Expands the macro calls in a function body when the function is defined
+// instead of every time the call is evaluated. The forms are walked the same
+// way as in resolve_locals and the macros that are shadowed by local variables
+// or that are defined only after the function are left as they are. Unlike
+// resolve_locals, this allocates memory: the names in the lexical scopes are
+// rooted by the function that creates the scope.
+Object* expand_macros(LexicalScope* lex, Object* env, Object* body)
+{
+    if (get_type(body) != TYPE_CELL)
+    {
+        return body;
+    }
+
+    Object* fn = car(body);
+    Object* args = cdr(body);
+
+    if (get_type(fn) == TYPE_SYMBOL && resolve_local(lex, env, fn) == fn)
+    {
+        fn = get_obj(fn)->global;
+    }
+
+    PUSH4(env, body, fn, args);
+
+    if (get_type(fn) == TYPE_MACRO)
+    {
+        // The expansion can contain parts of the body of the macro which must
+        // not be modified when the local variables are resolved
+        Object* expansion = expand_macro(env, fn, args);
+
+        if (expansion != Undefined)
+        {
+            body = copy_tree(expansion);
+            body = expand_macros(lex, env, body);
+        }
+    }
+    else if (get_type(fn) == TYPE_BUILTIN)
+    {
+        Function f = get_builtin(fn)->fn;
+
+        if (f == builtin_quote || f == builtin_macroexpand || f == builtin_freeze
+            || f == builtin_compile || f == builtin_load
+            || f == builtin_save_compiled || f == builtin_load_compiled)
+        {
+            // Not evaluated
+        }
+        else if (f == builtin_lambda)
+        {
+            expand_macros_in_function(lex, env, args);
+        }
+        else if (f == builtin_defun || f == builtin_defmacro)
+        {
+            if (get_type(args) == TYPE_CELL)
+            {
+                expand_macros_in_function(lex, env, cdr(args));
+            }
+        }
+        else if (f == builtin_define)
+        {
+            if (get_type(args) == TYPE_CELL)
+            {
+                expand_macros_in_list(lex, env, cdr(args));
+            }
+        }
+        else
+        {
+            expand_macros_in_list(lex, env, args);
+        }
+    }
+    else
+    {
+        expand_macros_in_list(lex, env, body);
+    }
+
+    POP();
+    return body;
+}
+
+// Expands the macros and resolves the local variables of a function body
+// that's defined in the given environment.
+Object* resolve_function_body(Object* params, Object* body, Object* env)
+{
+    LexicalScope lex = {params, NULL};
+    PUSH3(body, env, lex.names);
+    body = expand_macros(&lex, env, body);
+    POP();
+    return resolve_locals(&lex, env, body);
+}
+
+// Builtin operators
+
+Object* builtin_add(Object* scope, Object* args)
+{
+    if (args == Nil)
+    {
+        error("Not enough arguments to '+'.");
+        return Nil;
+    }
+
+    PUSH2(scope, args);
+    int64_t sum = 0;
+
+    for (; args != Nil; args = cdr(args))
+    {
+        Object* o = eval(scope, car(args));
+
+        if (get_type(o) != TYPE_NUMBER)
+        {
+            error("Not a number");
+            POP();
+            return Nil;
+        }
+
+        sum += get_number(o);
+    }
+
+    POP();
+    return make_number(sum);
+}
+
+Object* builtin_sub(Object* scope, Object* args)
+{
+    if (args == Nil)
+    {
+        error("Not enough arguments to '-'.");
+        return Nil;
+    }
+
+    PUSH2(scope, args);
+    int64_t sum = 0;
+
+    Object* o = eval(scope, car(args));
+
+    if (get_type(o) != TYPE_NUMBER)
+    {
+        error("Not a number");
+        POP();
+        return Nil;
+    }
+
+    sum = get_number(o);
+    args = cdr(args);
+
+    if (args == Nil)
+    {
+        sum = -sum;
+    }
+    else
+    {
+        for (; args != Nil; args = cdr(args))
+        {
+            o = eval(scope, car(args));
+
+            if (get_type(o) != TYPE_NUMBER)
+            {
+                error("Not a number");
+                POP();
+                return Nil;
+            }
+
+            sum -= get_number(o);
+        }
+    }
+
+    POP();
+    return make_number(sum);
+}
+
+// Evaluates the arguments and combines them from left to right with the
+// operation. The range of argument counts is checked before anything is
+// evaluated.
+Object* eval_arithmetic(Object* scope, Object* args, enum Arith op, const char* name, int min_args, int max_args)
+{
+    int count = length(args);
+
+    if (count < min_args || count > max_args)
+    {
+        if (min_args == max_args)
+        {
+            error("%s expects exactly %d arguments", name, min_args);
+        }
+        else
+        {
+            error("Not enough arguments to '%s'.", name);
+        }
+
+        return Nil;
+    }
+
+    PUSH2(scope, args);
+    int64_t value = 0;
+
+    for (int i = 0; args != Nil; args = cdr(args), i++)
+    {
+        Object* o = eval(scope, car(args));
+
+        if (get_type(o) != TYPE_NUMBER)
+        {
+            error("Not a number");
+            POP();
+            return Nil;
+        }
+
+        if (i == 0)
+        {
+            value = get_number(o);
+        }
+        else if (!do_arithmetic(op, value, get_number(o), &value))
+        {
+            error("Division by zero");
+            POP();
+            return Nil;
+        }
+    }
+
+    POP();
+    return make_number(value);
+}
+
+Object* builtin_mul(Object* scope, Object* args)
+{
+    return eval_arithmetic(scope, args, ARITH_MUL, "*", 1, INT_MAX);
+}
+
+Object* builtin_div(Object* scope, Object* args)
+{
+    return eval_arithmetic(scope, args, ARITH_DIV, "/", 2, INT_MAX);
+}
+
+Object* builtin_mod(Object* scope, Object* args)
+{
+    return eval_arithmetic(scope, args, ARITH_MOD, "mod", 2, 2);
+}
+
+Object* builtin_logand(Object* scope, Object* args)
+{
+    return eval_arithmetic(scope, args, ARITH_AND, "logand", 1, INT_MAX);
+}
+
+Object* builtin_logior(Object* scope, Object* args)
+{
+    return eval_arithmetic(scope, args, ARITH_IOR, "logior", 1, INT_MAX);
+}
+
+Object* builtin_logxor(Object* scope, Object* args)
+{
+    return eval_arithmetic(scope, args, ARITH_XOR, "logxor", 1, INT_MAX);
+}
+
+Object* builtin_ash(Object* scope, Object* args)
+{
+    return eval_arithmetic(scope, args, ARITH_ASH, "ash", 2, 2);
+}
+
+Object* builtin_less(Object* scope, Object* args)
+{
+    if (CHECK2ARGS(args))
+    {
+        error("< expects exactly two arguments");
+        return Nil;
+    }
+
+    Object* lhs = Nil;
+    Object* rhs = Nil;
+    PUSH4(scope, args, lhs, rhs);
+
+    lhs = eval(scope, car(args));
+    rhs = eval(scope, car(cdr(args)));
+
+    POP();
+    return get_number(lhs) < get_number(rhs) ? True : Nil;
+
+}
+
+Object* builtin_quote(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
+    {
+        error("Quote takes exactly one argument");
+        return Nil;
+    }
+
+    return car(args);
+}
+
+Object* builtin_list(Object* scope, Object* args)
+{
+    Object* ret = Nil;
+    Object* argret = Nil;
+    PUSH4(scope, args, ret, argret);
+
+    while (args != Nil)
+    {
+        argret = eval(scope, car(args));
+        ret = cons(argret, ret);
+        args = cdr(args);
+    }
+
+    POP();
+    return reverse(ret);
+}
+
+Object* builtin_eval(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
+    {
+        error("eval takes exactly one argument");
+        return Nil;
+    }
+
+    PUSH1(scope);
+
+    Object* ret = eval(scope, eval(scope, car(args)));
+
+    POP();
+    return ret;
+}
+
+Object* builtin_apply(Object* scope, Object* args)
+{
+    if (CHECK2ARGS(args))
+    {
+        error("apply takes exactly two arguments");
+        return Nil;
+    }
+
+    Object* func = Nil;
+    Object* func_args = Nil;
+    PUSH4(scope, args, func, func_args);
+
+    func = eval(scope, car(args));
+    func_args = eval(scope, car(cdr(args)));
+
+    if (func_args != Nil && get_type(func_args) != TYPE_CELL)
+    {
+        error("Arguments for apply are not a list");
+        POP();
+        return Nil;
+    }
+
+    Object* ret = cons(func, func_args);
+    ret = eval(scope, ret);
+
+    POP();
+    return ret;
+}
+
+Object* builtin_print(Object* scope, Object* args)
+{
+    PUSH2(scope, args);
+
+    while (args != Nil)
+    {
+        print(eval(scope, car(args)));
+        args = cdr(args);
+    }
+
+    POP();
+    return Nil;
+}
+
+Object* builtin_writechar(Object* scope, Object* args)
+{
+    PUSH2(scope, args);
+
+    while (args != Nil)
+    {
+        Object* obj = eval(scope, car(args));
+        do_writechar(obj);
+        args = cdr(args);
+    }
+
+    POP();
+    return Nil;
+}
+
+Object* builtin_sleep(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
+    {
+        error("'sleep' takes exactly one number as its argument.");
+    }
+    else
+     {
+         Object* obj = eval(scope, car(args));
+
+         if (get_type(obj) != TYPE_NUMBER)
+         {
+             error("'sleep' takes exactly one number as its argument.");
+         }
+         else
+         {
+             // The incremental garbage collection can use some of the time
+             int64_t usec = get_number(obj) * 1000;
+             usec -= gc_idle(usec);
+
+             if (usec > 0)
+             {
+                 struct timespec dur;
+                 dur.tv_sec = usec / 1000000;
+                 dur.tv_nsec = (usec % 1000000) * 1000;
+                 nanosleep(&dur, NULL);
+             }
+         }
+     }
+
+     return Nil;
+}
+
+Object* builtin_rand(Object* scope, Object* args)
+{
+    return make_number(rand());
+}
+
+Object* builtin_time_ns(Object* scope, Object* args)
+{
+    if (CHECK0ARGS(args))
+    {
+        error("time-ns takes no arguments");
+        return Nil;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return make_number(ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+Object* builtin_cons(Object* scope, Object* args)
+{
+    if (CHECK2ARGS(args))
+    {
+        error("cons takes exactly two arguments");
+        return Nil;
+    }
+
+    Object* car_obj = Nil;
+    Object* cdr_obj = Nil;
+    PUSH4(scope, args, car_obj, cdr_obj);
+
+    car_obj = eval(scope, car(args));
+    cdr_obj = eval(scope, car(cdr(args)));
+    Object* ret = cons(car_obj, cdr_obj);
+
+    POP();
+    return ret;
+}
+
+Object* builtin_car(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
+    {
+        error("car takes a list as its argument");
+        return Nil;
+    }
+
+    args = eval(scope, car(args));
+
+    if (get_type(args) != TYPE_CELL)
+    {
+        error("Evaluation did not produce a list");
+        return Nil;
+    }
+
+    return car(args);
+}
+
+Object* builtin_cdr(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
+    {
+        error("cdr takes a list as its argument");
+        return Nil;
+    }
+
+    args = eval(scope, car(args));
+
+    if (get_type(args) != TYPE_CELL)
+    {
+        error("Evaluation did not produce a list");
+        return Nil;
+    }
+
+    return cdr(args);
+}
+
+Object* builtin_make_vector(Object* scope, Object* args)
+{
+    int count = length(args);
+
+    if (count != 1 && count != 2)
+    {
+        error("make-vector takes a length and an optional initial value");
+        return Nil;
+    }
+
+    Object* len = Nil;
+    Object* value = Nil;
+    PUSH4(scope, args, len, value);
+
+    len = eval(scope, car(args));
+
+    if (cdr(args) != Nil)
+    {
+        value = eval(scope, car(cdr(args)));
+    }
+
+    Object* ret = Nil;
+
+    if (get_type(len) != TYPE_NUMBER || get_number(len) < 0)
+    {
+        error("The length of a vector must be a non-negative number");
+    }
+    else if ((uint64_t)get_number(len) > max_memory_size / sizeof(Object*)
+             || (is_large_object(vector_size(get_number(len)))
+                 && !reserve_old_space(vector_size(get_number(len)))))
+    {
+        error("Out of memory: a vector of %ld elements doesn't fit within the heap limit of %lu bytes",
+              get_number(len), max_memory_size);
+    }
+    else
+    {
+        ret = make_vector(get_number(len), value);
+    }
+
+    POP();
+    return ret;
+}
+
+Object* builtin_vector_ref(Object* scope, Object* args)
+{
+    if (CHECK2ARGS(args))
+    {
+        error("vector-ref takes a vector and an index");
+        return Nil;
+    }
+
+    PUSH2(scope, args);
+    Object* vec = eval(scope, car(args));
+    ROOT(vec);
+    Object* index = eval(scope, car(cdr(args)));
+    POP();
+
+    return check_vector_index(vec, index) ? vector_items(vec)[get_number(index)] : Nil;
+}
+
+Object* builtin_vector_set(Object* scope, Object* args)
+{
+    if (CHECK3ARGS(args))
+    {
+        error("vector-set takes a vector, an index and a value");
+        return Nil;
+    }
+
+    Object* vec = Nil;
+    Object* index = Nil;
+    Object* value = Nil;
+    PUSH5(scope, args, vec, index, value);
+
+    vec = eval(scope, car(args));
+    index = eval(scope, car(cdr(args)));
+    value = eval(scope, car(cdr(cdr(args))));
+
+    if (check_vector_index(vec, index))
+    {
+        vector_items(vec)[get_number(index)] = value;
+        write_barrier(vec, value);
+    }
+    else
+    {
+        value = Nil;
+    }
+
+    POP();
+    return value;
+}
+
+Object* builtin_vector_length(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
+    {
+        error("vector-length takes a vector as its argument");
+        return Nil;
+    }
+
+    args = eval(scope, car(args));
+
+    if (get_type(args) != TYPE_VECTOR)
+    {
+        error("Not a vector");
+        return Nil;
+    }
+
+    return make_number(get_obj(args)->length);
+}
+
+Object* builtin_eq(Object* scope, Object* args)
+{
+    if (CHECK2ARGS(args))
+    {
+        error("= takes exactly two arguments");
+        return Nil;
+    }
+
+    PUSH2(scope, args);
+    Object* lhs = eval(scope, car(args));
+    Object* rhs = eval(scope, car(cdr(args)));
+    POP();
+
+    // All types except cons cells can be compared for equality by comparing the
+    // pointers. For cons cells, this function returns true if the two values
+    // point to the same cons cell which is not what equality means for e.g. two
+    // lists. Comparing lists must be done using other means.
+    debug("Equals: %s", lhs == rhs ? "t" : "nil");
+    return lhs == rhs ? True : Nil;
+}
+
+Object* builtin_if(Object* scope, Object* args)
+{
+    if (CHECK3ARGS(args))
+    {
+        error("if takes exactly three arguments");
+        return Nil;
+    }
+
+    PUSH2(scope, args);
+    Object* cond = eval(scope, car(args));
+    Object* res = cond != Nil ? car(cdr(args)) : car(cdr(cdr(args)));
+
+    if (DEBUG_EXTRA)
+    {
+        printf("Condition ");
+        print_one(car(args));
+        printf(" evaluates to ");
+        print(cond);
+
+        printf("Evaluating ");
+        print(res);
+    }
+
+    TailCall->tail_expr = res;
+    TailCall->tail_scope = scope;
+    res = TailCall;
+
+    POP();
+    return res;
+}
+
+Object* builtin_progn(Object* scope, Object* args)
+{
+    Object* ret = Nil;
+    PUSH2(scope, args);
+
+    for (; args != Nil && cdr(args) != Nil; args = cdr(args))
+    {
+         ret = eval(scope, car(args));
+    }
+
+    POP();
+
+    if (args != Nil)
+    {
+        assert(cdr(args) == Nil);
+        TailCall->tail_expr = car(args);
+        TailCall->tail_scope = scope;
+        ret = TailCall;
+    }
+
+    return ret;
+}
+
+Object* builtin_exit(Object* scope, Object* args)
+{
+    is_running = false;
+    exit_called = true;
+    return Nil;
+}
+
+Object* builtin_debug(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
+    {
+        error("debug takes exactly one argument");
+        return Nil;
+    }
+
+    Object* ret = eval(scope, car(args));
+#ifndef NDEBUG
+    if (get_type(ret) == TYPE_NUMBER)
+    {
+        debug_level = get_number(ret);
+    }
+    else
+    {
+        error("argument is not a number");
+    }
+#else
+    (void)ret;
+    error("debug is not usable in release mode");
+#endif
+    return Nil;
+}
+
+Object* builtin_gc_stats(Object* scope, Object* args)
+{
+    if (CHECK0ARGS(args))
+    {
+        error("gc-stats takes no arguments");
+        return Nil;
+    }
+
+    // The values are read before anything is allocated as the allocations can
+    // start a collection
+    struct
+    {
+        const char* name;
+        size_t value;
+    } stats[] = {
+        {"collections", minor_collections + major_collections},
+        {"minor", minor_collections},
+        {"major", major_collections},
+        {"pause-total-us", gc_pause_total},
+        {"pause-max-us", gc_pause_max},
+        {"allocated", gc_bytes_allocated + nursery_used()},
+        {"copied", gc_bytes_copied},
+        {"heap-size", memory_size},
+        {"heap-used", old_used()},
+        {"resizes", gc_resizes},
+    };
+
+    int count = sizeof(stats) / sizeof(stats[0]);
+    Object* ret = Nil;
+    Object* pair = Nil;
+    PUSH2(ret, pair);
+
+    for (int i = count - 1; i >= 0; i--)
+    {
+        pair = symbol(stats[i].name);
+        pair = cons(pair, make_number(stats[i].value));
+        ret = cons(pair, ret);
+    }
+
+    POP();
+    return ret;
+}
+
+Object* builtin_profile(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
+    {
+        error("profile takes exactly one argument");
+        return Nil;
+    }
+
+    Object* arg = eval(scope, car(args));
+
+    if (arg == True)
+    {
+        profile_start();
+    }
+    else if (arg == Nil)
+    {
+        profile_stop(NULL);
+    }
+    else if (get_type(arg) == TYPE_SYMBOL)
+    {
+        if (!profile_stop(get_symbol(arg)))
+        {
+            error("Failed to write profile: %d, %s", errno, strerror(errno));
+        }
+    }
+    else
+    {
+        error("argument is not t, nil or a file name");
+    }
+
+    return Nil;
+}
+
+Object* builtin_lambda(Object* scope, Object* args)
+{
+    if (CHECK2ARGS(args))
+    {
+        error("lambda takes exactly two arguments");
+        print(args);
+        return Nil;
+    }
+
+    Object* params = car(args);
+    Object* body = car(cdr(args));
+    PUSH4(scope, args, params, body);
+
+    // Lambdas that are inside of functions are resolved when the enclosing
+    // function is defined.
+    if (scope == Env)
+    {
+        body = resolve_function_body(params, body, scope);
+        get_cell(cdr(args))->car = body;
+        write_barrier(cdr(args), body);
+    }
+
+    body = make_function(params, body, scope);
+    POP();
+    return body;
+}
+
+Object* builtin_define(Object* scope, Object* args)
+{
+    if (CHECK2ARGS(args))
+    {
+        error("define takes exactly two arguments");
+        return Nil;
+    }
+
+    Object* name = car(args);
+
+    if (get_type(name) != TYPE_SYMBOL)
+    {
+        error("First argument is not a symbol");
+        return Nil;
+    }
+
+    Object* value = Nil;
+    PUSH4(scope, args, name, value);
+
+    value = eval(scope, car(cdr(args)));
+    bind_value(scope, name, value);
+    POP();
+    return name;
+}
+
+Object* builtin_defun(Object* scope, Object* args)
+{
+    if (CHECK3ARGS(args))
+    {
+        error("defun takes exactly three arguments");
+        return Nil;
+    }
+
+    Object* name = car(args);
+    Object* params = car(cdr(args));
+    Object* body = car(cdr(cdr(args)));
+    Object* func = Nil;
+    PUSH6(scope, args, name, params, body, func);
+
+    body = resolve_function_body(params, body, scope);
+    get_cell(cdr(cdr(args)))->car = body;
+    write_barrier(cdr(cdr(args)), body);
+    func = make_function(params, body, scope);
+    bind_value(scope, name, func);
+    POP();
+    return func;
+}
+
+Object* builtin_freeze(Object* scope, Object* args)
+{
+    jit_resolve_symbols(scope, args);
+    vm_invalidate();
+    return Nil;
+}
+
+Object* builtin_compile(Object* scope, Object* args)
+{
+    jit_compile(scope, args);
+    vm_invalidate();
+    return Nil;
+}
+
+Object* builtin_save_compiled(Object* scope, Object* args)
+{
+    if (get_type(args) != TYPE_CELL || get_type(car(args)) != TYPE_SYMBOL)
+    {
+        error("First argument is not a symbol");
+        return Nil;
+    }
+
+    return jit_save_compiled(scope, get_symbol(car(args)), cdr(args)) ? True : Nil;
+}
+
+Object* builtin_load_compiled(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
+    {
+        error("load-compiled takes exactly one argument");
+        return Nil;
+    }
+
+    if (get_type(car(args)) != TYPE_SYMBOL)
+    {
+        error("First argument is not a symbol");
+        return Nil;
+    }
+
+    // The name is copied as loading the functions allocates memory
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", get_symbol(car(args)));
+    bool ok = jit_load_compiled(scope, path);
+    vm_invalidate();
+    return ok ? True : Nil;
+}
+
+Object* builtin_defmacro(Object* scope, Object* args)
+{
+    if (CHECK3ARGS(args))
+    {
+        error("defmacro takes exactly three arguments");
+        return Nil;
+    }
+
+    Object* name = car(args);
+    Object* params = car(cdr(args));
+    Object* body = car(cdr(cdr(args)));
+    Object* func = Nil;
+    PUSH6(scope, args, name, params, body, func);
+
+    // Macros are expanded in the scope of the caller, only the parameters of
+    // the macro itself can be resolved.
+    body = resolve_function_body(params, body, Env);
+    get_cell(cdr(cdr(args)))->car = body;
+    write_barrier(cdr(cdr(args)), body);
+    func = make_function(params, body, scope);
+    func = get_func(func);
+    func->moved = (Object*)TYPE_MACRO;
+    func = make_ptr(func, TYPE_MACRO);
+    bind_value(scope, name, func);
+    POP();
+    return func;
+}
+
+Object* builtin_macroexpand(Object* scope, Object* args)
+{
+    if (CHECK2ARGS(args))
+    {
+        error("macroexpand takes exactly two arguments");
+        return Nil;
+    }
+
+    if (get_type(car(args)) != TYPE_SYMBOL)
+    {
+        error("First argument is not a symbol");
+        return Nil;
+    }
+
+    PUSH2(scope, args);
+    Object* macro = eval(scope, car(args));
+    Object* ret = Nil;
+
+    if (get_type(macro) != TYPE_MACRO)
+    {
+        error("%s is not a macro", get_symbol(args));
+    }
+    else
+    {
+        ret = expand_macro(scope, macro, car(cdr(args)));
+        ret = ret == Undefined ? Nil : ret;
+    }
+
+    POP();
+    return ret;
+}
+
+Object* builtin_load(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
+    {
+        error("load takes exactly one argument");
+        return Nil;
+    }
+
+    if (get_type(car(args)) != TYPE_SYMBOL)
+    {
+        error("First argument is not a symbol");
+        return Nil;
+    }
+
+    // The reader is local to this call which allows loads to nest
+    Reader reader;
+
+    if (!reader_open(&reader, get_symbol(car(args))))
+    {
+        error("Failed to open file: %d, %s", errno, strerror(errno));
+        return Nil;
+    }
+
+    Object* expr = Nil;
+    Object* ret = Nil;
+    PUSH3(scope, expr, ret);
+
+    while (peek(&reader) != EOF)
+    {
+        expr = parse_expr(&reader);
+
+        if (expr != Undefined)
+        {
+            ret = eval(scope, expr);
+
+            if (!quiet)
+            {
+                assert(ret != Undefined);
+                print(ret);
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    reader_close(&reader);
+
+    POP();
+    return Nil;
+}
+
+// Heap images
+//
+// An image is the old space right after a major collection which means that all
+// the live objects are in one contiguous block and the live cells in another.
+// When the image is loaded, the blocks are mapped back into the old space and a
+// relocation pass adds the distance that each block moved to the pointers into
+// it. The builtins point
+// into the binary and are moved by the distance that the binary moved. The
+// symbol table is rebuilt from the symbols that are found in the image.
+//
+// Machine code and bytecode are not stored. The functions that were compiled
+// with `compile` are compiled again in the same order once the image has been
+// loaded and the rest are compiled when they are called.
+
+#define IMAGE_MAGIC "LISPIMG2"
+
+struct ImageHeader
+{
+    char     magic[8];
+    uint64_t layout;    // Identifies the binary that saved the image
+    uint64_t text_base; // Where the binary was loaded
+    uint64_t heap_base; // Where the old space started
+    uint64_t heap_size;
+    uint64_t cell_base; // Where the cell space started
+    uint64_t cell_size;
+    Object*  env;
+};
+
+typedef struct ImageHeader ImageHeader;
+
+// The images can only be loaded by the binary that saved them. The distance
+// between two functions changes with pretty much any change to the code.
+uint64_t image_layout()
+{
+    return ((uint64_t)sizeof(Object) << 56) ^ ((uint64_t)sizeof(UserFunction) << 48)
+        ^ (uint64_t)((uintptr_t)builtin_load - (uintptr_t)reserve_memory);
+}
+
+bool save_image(FILE* f)
+{
+    major_collection(0);
+
+    ImageHeader header = {
+        .layout = image_layout(),
+        .text_base = (uintptr_t)builtin_load,
+        .heap_base = (uintptr_t)old_root,
+        .heap_size = old_ptr - old_root,
+        .cell_base = (uintptr_t)old_cell_root,
+        .cell_size = old_cell_ptr - old_cell_root,
+        .env = Env,
+    };
+
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+
+    // The objects and the cells start at page boundaries so that they can be
+    // mapped. The cdr of the last cell is one word past the end of the cells.
+    size_t cell_bytes = header.cell_size + sizeof(Object*);
+    return fwrite(&header, sizeof(header), 1, f) == 1
+        && fseek(f, sysconf(_SC_PAGESIZE), SEEK_SET) == 0
+        && fwrite(old_root, 1, header.heap_size, f) == header.heap_size
+        && fseek(f, sysconf(_SC_PAGESIZE) + page_align(header.heap_size), SEEK_SET) == 0
+        && fwrite(old_cell_root, 1, cell_bytes, f) == cell_bytes;
+}
+
+_Thread_local intptr_t image_offset = 0;
+_Thread_local intptr_t image_cell_offset = 0;
+
+Object* relocate(Object* obj)
+{
+    int type = get_type(obj);
+    intptr_t offset = type == TYPE_CELL ? image_cell_offset : image_offset;
+    return type == TYPE_NUMBER || type == TYPE_CONST ? obj : (Object*)((intptr_t)obj + offset);
+}
+
+int compare_jit_mem(const void* a, const void* b)
+{
+    uintptr_t lhs = (uintptr_t)get_func(*(Object**)a)->ufn.jit_mem;
+    uintptr_t rhs = (uintptr_t)get_func(*(Object**)b)->ufn.jit_mem;
+    return lhs < rhs ? -1 : lhs > rhs;
+}
+
+// Loads the image into the empty heap, used instead of define_builtins
+bool load_image(const char* path)
+{
+    ImageHeader header;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        error("Failed to open image: %d, %s", errno, strerror(errno));
+        return false;
+    }
+    else if (read(fd, &header, sizeof(header)) != sizeof(header)
+             || memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        error("Not an image: %s", path);
+        close(fd);
+        return false;
+    }
+    else if (header.layout != image_layout())
+    {
+        error("The image was saved by a different binary: %s", path);
+        close(fd);
+        return false;
+    }
+
+    // The sizes are checked before mapping the file as the pages past its end
+    // can't be accessed. Each part must also fit into its half of the space.
+    struct stat st;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (fstat(fd, &st) != 0)
+    {
+        error("Failed to open image: %d, %s", errno, strerror(errno));
+        close(fd);
+        return false;
+    }
+    else if (header.heap_size > max_memory_size / 2 || header.cell_size + sizeof(Object*) > max_memory_size / 2
+             || header.heap_size % sizeof(Object*) != 0 || header.cell_size % CELL_SIZE != 0
+             || (uint64_t)st.st_size < page + page_align(header.heap_size) + header.cell_size + sizeof(Object*))
+    {
+        error("The image is truncated or corrupted: %s", path);
+        close(fd);
+        return false;
+    }
+
+    assert(old_used() == 0 && nursery_used() == 0);
+    size_t image_size = header.heap_size + header.cell_size;
+
+    if (image_size + nursery_size * 2 > memory_size / 2)
+    {
+        grow_old_space(image_size + nursery_size * 2);
+    }
 
-    if (DEBUG_INFO)
+    if (image_size > memory_size / 2)
     {
-        printf("EVAL %d (%d) ", debug_step++, debug_depth);
-        for (int i = 0; i < debug_depth; i++)
-        {
-            printf(". ");
-        }
+        error("The image doesn't fit within the heap limit of %lu bytes: %s", max_memory_size, path);
+        close(fd);
+        return false;
+    }
 
-        printf(": ");
-        print(obj);
-        ++debug_depth;
+    if ((header.heap_size > 0
+         && mmap(old_root, page_align(header.heap_size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 fd, page) == MAP_FAILED)
+        || mmap(old_cell_root, page_align(header.cell_size + sizeof(Object*)), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, page + page_align(header.heap_size)) == MAP_FAILED)
+    {
+        error("Failed to map image: %d, %s", errno, strerror(errno));
+        close(fd);
+        return false;
     }
 
-    switch (get_type(obj))
+    close(fd);
+
+    image_offset = (intptr_t)old_root - (intptr_t)header.heap_base;
+    image_cell_offset = (intptr_t)old_cell_root - (intptr_t)header.cell_base;
+    intptr_t text_offset = (intptr_t)builtin_load - (intptr_t)header.text_base;
+    old_ptr = old_root + header.heap_size;
+    old_cell_ptr = old_cell_root + header.cell_size;
+    Env = relocate(header.env);
+
+    for (uint8_t* ptr = old_cell_root; ptr < old_cell_ptr; ptr += CELL_SIZE)
     {
-    case TYPE_CONST:
-    case TYPE_NUMBER:
-    case TYPE_BUILTIN:
-    case TYPE_FUNCTION:
-    case TYPE_MACRO:
-        ret = obj;
-        break;
+        visit_cell((Object*)ptr, relocate);
+    }
 
-    case TYPE_SYMBOL:
-        ret = symbol_lookup(scope, obj);
+    Object** compiled = NULL;
+    size_t compiled_count = 0;
 
-        if (ret == Undefined)
+    for (uint8_t* ptr = old_root; ptr < old_ptr; ptr += object_size((Object*)ptr))
+    {
+        Object* obj = (Object*)ptr;
+        visit_references(obj, relocate);
+
+        switch (get_stored_type(obj))
         {
-            ret = Nil;
-            error("Undefined symbol: %s", get_symbol(obj));
+        case TYPE_SYMBOL:
+            if (symbol_count * 2 >= symbol_table_size)
+            {
+                symbol_table_grow();
+            }
 
-            if (DEBUG_EXTRA)
+            symbol_table_insert(symbol_table, symbol_table_size, make_ptr(obj, TYPE_SYMBOL));
+            symbol_count++;
+            break;
+
+        case TYPE_BUILTIN:
+            obj->fn = (Function)((intptr_t)obj->fn + text_offset);
+            break;
+
+        case TYPE_FUNCTION:
+        case TYPE_MACRO:
+            obj->ufn.code = Nil;
+            obj->ufn.code_entry = 0;
+            obj->ufn.call_count = 0;
+            obj->ufn.loop_count = 0;
+            obj->ufn.jit_epoch = 0;
+            obj->ufn.profile_id = 0;
+
+            if (obj->ufn.compiled == COMPILE_CODE)
             {
-                print_scope(scope);
+                // The old address of the machine code tells the order in
+                // which the functions were compiled
+                compiled = realloc(compiled, (compiled_count + 1) * sizeof(Object*));
+                compiled[compiled_count++] = make_ptr(obj, TYPE_FUNCTION);
+                obj->ufn.compiled = COMPILE_SYMBOLS;
             }
+            else
+            {
+                obj->ufn.jit_mem = NULL;
 
+                if (obj->ufn.compiled != COMPILE_SYMBOLS)
+                {
+                    obj->ufn.compiled = 0;
+                }
+            }
+            break;
         }
-        break;
+    }
 
-    default:
-        assert(get_type(obj) == TYPE_CELL);
-        ret = eval_cell(scope, obj);
-        break;
+    if (compiled_count > 0)
+    {
+        qsort(compiled, compiled_count, sizeof(Object*), compare_jit_mem);
     }
 
-    if (DEBUG_INFO)
+    ENTER();
+
+    for (size_t i = 0; i < compiled_count; i++)
     {
-        --debug_depth;
-        printf("RET: ");
-        print_one(obj);
-        printf(" -> ");
-        print(ret);
+        get_func(compiled[i])->ufn.jit_mem = NULL;
+        ROOT(compiled[i]);
     }
 
-#ifndef NDEBUG
+    jit_recompile(compiled, compiled_count);
     POP();
-#endif
-    return ret;
+    free(compiled);
+    return true;
 }
 
-// Builtin operators
+// Copying objects between interpreters
+//
+// The interpreters on different threads have heaps of their own. The objects
+// are passed between them by packing them into a buffer that's outside of both
+// heaps. The objects are numbered in the order they are found and a reference
+// to an object is stored as its number tagged with its type. Numbers and
+// constants are stored as-is. Each object has a record whose first word has
+// the type in the lowest bits and the length of the symbol name or the vector
+// in the upper bits:
+//
+//   symbol   - the name, padded to a multiple of eight bytes
+//   builtin  - the address of the C function, the same in all threads
+//   cons     - car, cdr
+//   vector   - the items
+//   function - params, body, env, the compilation state and the address of
+//              the machine code that tells the order in which the compiled
+//              functions were compiled
+//
+// The global scope isn't copied, references to it become references to the
+// global scope of the interpreter that unpacks the objects. The same goes for
+// the values of the global variables which means that only functions that
+// don't refer to any global variables, like frozen functions, behave the same
+// in all interpreters.
 
-Object* builtin_add(Object* scope, Object* args)
+#define PACKED_ENV TYPE_NUMBER // The record of the global scope
+
+struct Packer
 {
-    if (args == Nil)
+    Packed* packed;
+    Object** objects;
+    size_t count;
+    size_t size;
+    uint32_t* table; // Indexes into objects, plus one so that zero is empty
+    size_t table_size;
+};
+
+typedef struct Packer Packer;
+
+void packed_push(Packed* p, uint64_t word)
+{
+    if (p->used == p->size)
     {
-        error("Not enough arguments to '+'.");
-        return Nil;
+        p->size = p->size ? p->size * 2 : 64;
+        p->words = realloc(p->words, p->size * sizeof(uint64_t));
     }
 
-    PUSH2(scope, args);
-    int64_t sum = 0;
+    p->words[p->used++] = word;
+}
 
-    for (; args != Nil; args = cdr(args))
+size_t pack_hash(Object* obj)
+{
+    return ((uintptr_t)obj * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+void pack_table_grow(Packer* pk)
+{
+    free(pk->table);
+    pk->table_size = pk->table_size ? pk->table_size * 2 : 256;
+    pk->table = calloc(pk->table_size, sizeof(uint32_t));
+    size_t mask = pk->table_size - 1;
+
+    for (size_t n = 0; n < pk->count; n++)
     {
-        Object* o = eval(scope, car(args));
+        size_t i = pack_hash(pk->objects[n]) & mask;
 
-        if (get_type(o) != TYPE_NUMBER)
+        while (pk->table[i])
         {
-            error("Not a number");
-            POP();
-            return Nil;
+            i = (i + 1) & mask;
         }
 
-        sum += get_number(o);
+        pk->table[i] = n + 1;
     }
-
-    POP();
-    return make_number(sum);
 }
 
-Object* builtin_sub(Object* scope, Object* args)
+uint64_t pack_ref(Packer* pk, Object* obj)
 {
-    if (args == Nil)
+    int type = get_type(obj);
+
+    if (type == TYPE_NUMBER || type == TYPE_CONST)
     {
-        error("Not enough arguments to '-'.");
-        return Nil;
+        return (uint64_t)obj;
     }
 
-    PUSH2(scope, args);
-    int64_t sum = 0;
+    if (pk->count * 2 >= pk->table_size)
+    {
+        pack_table_grow(pk);
+    }
 
-    Object* o = eval(scope, car(args));
+    size_t mask = pk->table_size - 1;
+    size_t i = pack_hash(obj) & mask;
 
-    if (get_type(o) != TYPE_NUMBER)
+    for (; pk->table[i]; i = (i + 1) & mask)
     {
-        error("Not a number");
-        return Nil;
+        if (pk->objects[pk->table[i] - 1] == obj)
+        {
+            return ((uint64_t)(pk->table[i] - 1) << NUMBER_SHIFT) | type;
+        }
     }
 
-    sum = get_number(o);
-    args = cdr(args);
-
-    if (args == Nil)
+    if (pk->count == pk->size)
     {
-        sum = -sum;
+        pk->size = pk->size ? pk->size * 2 : 256;
+        pk->objects = realloc(pk->objects, pk->size * sizeof(Object*));
     }
-    else
+
+    pk->objects[pk->count] = obj;
+    pk->table[i] = pk->count + 1;
+    return ((uint64_t)pk->count++ << NUMBER_SHIFT) | type;
+}
+
+void pack_object(Packer* pk, Object* obj)
+{
+    Packed* p = pk->packed;
+    int type = get_type(obj);
+
+    switch (type)
     {
-        for (; args != Nil; args = cdr(args))
+    case TYPE_SYMBOL:
         {
-            o = eval(scope, car(args));
+            const char* name = get_symbol(obj);
+            size_t len = strlen(name);
+            packed_push(p, TYPE_SYMBOL | (len << 8));
 
-            if (get_type(o) != TYPE_NUMBER)
+            for (size_t i = 0; i < len; i += sizeof(uint64_t))
             {
-                error("Not a number");
-                return Nil;
+                uint64_t word = 0;
+                memcpy(&word, name + i, len - i < sizeof(word) ? len - i : sizeof(word));
+                packed_push(p, word);
+            }
+        }
+        break;
+
+    case TYPE_BUILTIN:
+        packed_push(p, TYPE_BUILTIN);
+        packed_push(p, (uintptr_t)get_builtin(obj)->fn);
+        break;
+
+    case TYPE_CELL:
+        packed_push(p, TYPE_CELL);
+        packed_push(p, pack_ref(pk, car(obj)));
+        packed_push(p, pack_ref(pk, cdr(obj)));
+        break;
+
+    case TYPE_VECTOR:
+        if (obj == Env)
+        {
+            packed_push(p, PACKED_ENV);
+        }
+        else
+        {
+            size_t len = get_obj(obj)->length;
+            packed_push(p, TYPE_VECTOR | (len << 8));
+
+            for (size_t i = 0; i < len; i++)
+            {
+                packed_push(p, pack_ref(pk, get_obj(obj)->items[i]));
             }
+        }
+        break;
 
-            sum -= get_number(o);
+    case TYPE_FUNCTION:
+    case TYPE_MACRO:
+        {
+            UserFunction* ufn = &get_func(obj)->ufn;
+            packed_push(p, type);
+            packed_push(p, pack_ref(pk, ufn->func_params));
+            packed_push(p, pack_ref(pk, ufn->func_body));
+            packed_push(p, pack_ref(pk, ufn->func_env));
+            packed_push(p, ufn->compiled);
+            packed_push(p, (uintptr_t)ufn->jit_mem);
         }
-    }
+        break;
 
-    POP();
-    return make_number(sum);
+    default:
+        assert(!true);
+        break;
+    }
 }
 
-Object* builtin_less(Object* scope, Object* args)
+Packed* pack(Object** roots, size_t count)
 {
-    if (CHECK2ARGS(args))
+    Packed* p = calloc(1, sizeof(Packed));
+    Packer pk = {p, NULL, 0, 0, NULL, 0};
+    p->roots = count;
+
+    for (size_t i = 0; i < count; i++)
     {
-        error("< expects exactly two arguments");
-        return Nil;
+        packed_push(p, pack_ref(&pk, roots[i]));
     }
 
-    Object* lhs = Nil;
-    Object* rhs = Nil;
-    PUSH4(scope, args, lhs, rhs);
-
-    lhs = eval(scope, car(args));
-    rhs = eval(scope, car(cdr(args)));
-
-    POP();
-    return get_number(lhs) < get_number(rhs) ? True : Nil;
+    // The objects are packed in the order they were found in
+    for (size_t i = 0; i < pk.count; i++)
+    {
+        pack_object(&pk, pk.objects[i]);
+    }
 
+    p->objects = pk.count;
+    free(pk.objects);
+    free(pk.table);
+    return p;
 }
 
-Object* builtin_quote(Object* scope, Object* args)
+void packed_free(Packed* packed)
 {
-    if (CHECK1ARGS(args))
+    if (packed)
     {
-        error("Quote takes exactly one argument");
-        return Nil;
+        free(packed->words);
+        free(packed);
     }
+}
 
-    return car(args);
+Object* unpack_ref(Object* objects, uint64_t ref)
+{
+    int type = ref & TYPE_MASK;
+    return type == TYPE_NUMBER || type == TYPE_CONST ? (Object*)ref : vector_items(objects)[ref >> NUMBER_SHIFT];
 }
 
-Object* builtin_list(Object* scope, Object* args)
+Object* unpack(Packed* p)
 {
+    Object* objects = Nil;
+    Object* obj = Nil;
     Object* ret = Nil;
-    Object* argret = Nil;
-    PUSH4(scope, args, ret, argret);
+    PUSH3(objects, obj, ret);
 
-    while (args != Nil)
-    {
-        argret = eval(scope, car(args));
-        ret = cons(argret, ret);
-        args = cdr(args);
-    }
+    size_t* compiled = NULL;
+    size_t compiled_count = 0;
 
-    POP();
-    return reverse(ret);
-}
+    // The objects are allocated first and the references between them are
+    // filled in once all of them exist
+    objects = make_vector(p->objects, Nil);
+    uint64_t* w = p->words + p->roots;
 
-Object* builtin_eval(Object* scope, Object* args)
-{
-    if (CHECK1ARGS(args))
+    for (size_t i = 0; i < p->objects; i++)
     {
-        error("eval takes exactly one argument");
-        return Nil;
-    }
+        uint64_t header = *w++;
+        size_t len = header >> 8;
 
-    PUSH1(scope);
+        switch (header & TYPE_MASK)
+        {
+        case PACKED_ENV:
+            obj = Env;
+            break;
 
-    Object* ret = eval(scope, eval(scope, car(args)));
+        case TYPE_SYMBOL:
+            obj = intern((const char*)w, len);
+            w += (len + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+            break;
 
-    POP();
-    return ret;
-}
+        case TYPE_BUILTIN:
+            obj = make_builtin((Function)*w++);
+            break;
 
-Object* builtin_apply(Object* scope, Object* args)
-{
-    if (CHECK2ARGS(args))
-    {
-        error("apply takes exactly two arguments");
-        return Nil;
-    }
+        case TYPE_CELL:
+            obj = cons(Nil, Nil);
+            w += 2;
+            break;
 
-    Object* func = Nil;
-    Object* func_args = Nil;
-    PUSH4(scope, args, func, func_args);
+        case TYPE_VECTOR:
+            obj = make_vector(len, Nil);
+            w += len;
+            break;
 
-    func = eval(scope, car(args));
-    func_args = eval(scope, car(cdr(args)));
+        case TYPE_FUNCTION:
+        case TYPE_MACRO:
+            obj = make_function(Nil, Nil, Nil);
 
-    if (func_args != Nil && get_type(func_args) != TYPE_CELL)
-    {
-        error("Arguments for apply are not a list");
-        POP();
-        return Nil;
+            if ((header & TYPE_MASK) == TYPE_MACRO)
+            {
+                obj = get_func(obj);
+                obj->moved = (Object*)TYPE_MACRO;
+                obj = make_ptr(obj, TYPE_MACRO);
+            }
+
+            if (w[3] == COMPILE_CODE)
+            {
+                compiled = realloc(compiled, (compiled_count + 1) * sizeof(size_t));
+                compiled[compiled_count++] = i;
+            }
+
+            w += 5;
+            break;
+        }
+
+        vector_items(objects)[i] = obj;
+        write_barrier(objects, obj);
     }
 
-    Object* ret = cons(func, func_args);
-    ret = eval(scope, ret);
+    w = p->words + p->roots;
 
-    POP();
-    return ret;
-}
+    for (size_t i = 0; i < p->objects; i++)
+    {
+        uint64_t header = *w++;
+        size_t len = header >> 8;
+        obj = vector_items(objects)[i];
+
+        switch (header & TYPE_MASK)
+        {
+        case TYPE_SYMBOL:
+            w += (len + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+            break;
+
+        case TYPE_BUILTIN:
+            w++;
+            break;
+
+        case TYPE_CELL:
+            get_cell(obj)->car = unpack_ref(objects, w[0]);
+            get_cell(obj)->cdr = unpack_ref(objects, w[1]);
+            write_barrier(obj, car(obj));
+            write_barrier(obj, cdr(obj));
+            w += 2;
+            break;
+
+        case TYPE_VECTOR:
+            for (size_t j = 0; j < len; j++)
+            {
+                vector_items(obj)[j] = unpack_ref(objects, w[j]);
+                write_barrier(obj, vector_items(obj)[j]);
+            }
+
+            w += len;
+            break;
+
+        case TYPE_FUNCTION:
+        case TYPE_MACRO:
+            {
+                UserFunction* ufn = &get_func(obj)->ufn;
+                ufn->func_params = unpack_ref(objects, w[0]);
+                ufn->func_body = unpack_ref(objects, w[1]);
+                ufn->func_env = unpack_ref(objects, w[2]);
+                write_barrier(obj, ufn->func_params);
+                write_barrier(obj, ufn->func_body);
+                write_barrier(obj, ufn->func_env);
+
+                // The code is compiled again below, automatic compilations are
+                // done again if the function gets called often enough
+                if (w[3] == COMPILE_CODE)
+                {
+                    ufn->compiled = COMPILE_SYMBOLS;
+                    ufn->jit_mem = (void*)w[4];
+                }
+                else if (w[3] == COMPILE_SYMBOLS)
+                {
+                    ufn->compiled = COMPILE_SYMBOLS;
+                }
 
-Object* builtin_print(Object* scope, Object* args)
-{
-    PUSH2(scope, args);
+                w += 5;
+            }
+            break;
+        }
+    }
 
-    while (args != Nil)
+    // The parameters are counted once all of the cells have been filled in
+    for (size_t i = 0; i < p->objects; i++)
     {
-        print(eval(scope, car(args)));
-        args = cdr(args);
-    }
+        obj = vector_items(objects)[i];
 
-    POP();
-    return Nil;
-}
+        if (get_type(obj) == TYPE_FUNCTION || get_type(obj) == TYPE_MACRO)
+        {
+            get_func(obj)->ufn.param_count = param_count(func_params(obj));
+        }
+    }
 
-Object* builtin_writechar(Object* scope, Object* args)
-{
-    PUSH2(scope, args);
+    ret = make_vector(p->roots, Nil);
 
-    while (args != Nil)
+    for (size_t i = 0; i < p->roots; i++)
     {
-        Object* obj = eval(scope, car(args));
-        do_writechar(obj);
-        args = cdr(args);
+        vector_items(ret)[i] = unpack_ref(objects, p->words[i]);
+        write_barrier(ret, vector_items(ret)[i]);
     }
 
-    POP();
-    return Nil;
-}
-
-Object* builtin_sleep(Object* scope, Object* args)
-{
-    if (CHECK1ARGS(args))
+    if (compiled_count > 0)
     {
-        error("'sleep' takes exactly one number as its argument.");
-    }
-    else
-     {
-         Object* obj = eval(scope, car(args));
+        // The functions are compiled in the same order as they originally were,
+        // the same way as when a heap image is loaded
+        Object** funcs = malloc(compiled_count * sizeof(Object*));
 
-         if (get_type(obj) != TYPE_NUMBER)
-         {
-             error("'sleep' takes exactly one number as its argument.");
-         }
-         else
-         {
-             int64_t num = get_number(obj);
-             struct timespec dur;
-             dur.tv_sec = num / 1000;
-             dur.tv_nsec = num * 1000000;
-             nanosleep(&dur, NULL);
-         }
-     }
+        for (size_t i = 0; i < compiled_count; i++)
+        {
+            funcs[i] = vector_items(objects)[compiled[i]];
+        }
 
-     return Nil;
-}
+        qsort(funcs, compiled_count, sizeof(Object*), compare_jit_mem);
 
-Object* builtin_rand(Object* scope, Object* args)
-{
-    return make_number(rand());
-}
+        for (size_t i = 0; i < compiled_count; i++)
+        {
+            get_func(funcs[i])->ufn.jit_mem = NULL;
+            ROOT(funcs[i]);
+        }
 
-Object* builtin_cons(Object* scope, Object* args)
-{
-    if (CHECK2ARGS(args))
-    {
-        error("cons takes exactly two arguments");
-        return Nil;
+        jit_recompile(funcs, compiled_count);
+        free(funcs);
     }
 
-    Object* car_obj = Nil;
-    Object* cdr_obj = Nil;
-    PUSH4(scope, args, car_obj, cdr_obj);
-
-    car_obj = eval(scope, car(args));
-    cdr_obj = eval(scope, car(cdr(args)));
-    Object* ret = cons(car_obj, cdr_obj);
-
     POP();
+    free(compiled);
     return ret;
 }
 
-Object* builtin_car(Object* scope, Object* args)
+Packed* eval_packed(Packed* input, bool map)
 {
-    if (CHECK1ARGS(args))
+    Object* args = Nil;
+    Object* results = Nil;
+    Object* form = Nil;
+    Object* list = Nil;
+    Object* quote = Nil;
+    PUSH5(args, results, form, list, quote);
+
+    args = unpack(input);
+    quote = symbol_lookup(Env, symbol("quote"));
+    size_t count = get_obj(args)->length;
+    results = make_vector(map ? count - 1 : 1, Nil);
+
+    // The arguments have already been evaluated which is why they are quoted
+    for (size_t i = 1; map && i < count; i++)
     {
-        error("car takes a list as its argument");
-        return Nil;
+        form = cons(vector_items(args)[i], Nil);
+        form = cons(quote, form);
+        form = cons(form, Nil);
+        form = cons(vector_items(args)[0], form);
+        form = eval(Env, form);
+        vector_items(results)[i - 1] = form;
+        write_barrier(results, form);
     }
 
-    args = eval(scope, car(args));
+    for (size_t i = count - 1; !map && i > 0; i--)
+    {
+        form = cons(vector_items(args)[i], Nil);
+        form = cons(quote, form);
+        list = cons(form, list);
+    }
 
-    if (get_type(args) != TYPE_CELL)
+    if (!map)
     {
-        error("Evaluation did not produce a list");
-        return Nil;
+        form = cons(vector_items(args)[0], list);
+        form = eval(Env, form);
+        vector_items(results)[0] = form;
+        write_barrier(results, form);
     }
 
-    return car(args);
+    Packed* output = pack(vector_items(results), get_obj(results)->length);
+    POP();
+    return output;
 }
 
-Object* builtin_cdr(Object* scope, Object* args)
+// The functions that check_portable has already seen
+struct PortableCheck
 {
-    if (CHECK1ARGS(args))
-    {
-        error("cdr takes a list as its argument");
-        return Nil;
-    }
-
-    args = eval(scope, car(args));
+    Object** funcs;
+    size_t count;
+};
 
-    if (get_type(args) != TYPE_CELL)
-    {
-        error("Evaluation did not produce a list");
-        return Nil;
-    }
+typedef struct PortableCheck PortableCheck;
 
-    return cdr(args);
-}
+bool check_portable_form(PortableCheck* pc, Object* form);
+bool check_portable_function(PortableCheck* pc, Object* fn);
 
-Object* builtin_eq(Object* scope, Object* args)
+bool check_portable_list(PortableCheck* pc, Object* list)
 {
-    if (CHECK2ARGS(args))
+    for (; get_type(list) == TYPE_CELL; list = cdr(list))
     {
-        error("= takes exactly two arguments");
-        return Nil;
+        if (!check_portable_form(pc, car(list)))
+        {
+            return false;
+        }
     }
 
-    PUSH2(scope, args);
-    Object* lhs = eval(scope, car(args));
-    Object* rhs = eval(scope, car(cdr(args)));
-    POP();
-
-    // All types except cons cells can be compared for equality by comparing the
-    // pointers. For cons cells, this function returns true if the two values
-    // point to the same cons cell which is not what equality means for e.g. two
-    // lists. Comparing lists must be done using other means.
-    debug("Equals: %s", lhs == rhs ? "t" : "nil");
-    return lhs == rhs ? True : Nil;
+    return true;
 }
 
-Object* builtin_if(Object* scope, Object* args)
+// The forms are walked the same way as in resolve_locals. The symbols that are
+// left are global variables that freeze didn't resolve, like the ones inside of
+// lambdas, and only the builtins are defined in the interpreters of the
+// workers. Nothing is allocated.
+bool check_portable_form(PortableCheck* pc, Object* form)
 {
-    if (CHECK3ARGS(args))
+    int type = get_type(form);
+
+    if (type == TYPE_SYMBOL)
     {
-        error("if takes exactly three arguments");
-        return Nil;
+        if (get_type(get_obj(form)->global) != TYPE_BUILTIN)
+        {
+            error("Function depends on the global variable: %s", get_symbol(form));
+            return false;
+        }
+
+        return true;
+    }
+    else if (type == TYPE_FUNCTION)
+    {
+        return check_portable_function(pc, form);
+    }
+    else if (type != TYPE_CELL)
+    {
+        return true;
     }
 
-    PUSH2(scope, args);
-    Object* cond = eval(scope, car(args));
-    Object* res = cond != Nil ? car(cdr(args)) : car(cdr(cdr(args)));
+    Object* fn = car(form);
+    Object* args = cdr(form);
 
-    if (DEBUG_EXTRA)
+    if (get_type(fn) == TYPE_SYMBOL)
     {
-        printf("Condition ");
-        print_one(car(args));
-        printf(" evaluates to ");
-        print(cond);
+        fn = get_obj(fn)->global;
+    }
 
-        printf("Evaluating ");
-        print(res);
+    if (get_type(fn) == TYPE_MACRO)
+    {
+        error("Function calls a macro that was defined after it");
+        return false;
     }
+    else if (get_type(fn) == TYPE_BUILTIN)
+    {
+        Function f = get_builtin(fn)->fn;
 
-    TailCall->tail_expr = res;
-    TailCall->tail_scope = scope;
-    res = TailCall;
+        if (f == builtin_quote || f == builtin_macroexpand || f == builtin_freeze
+            || f == builtin_compile || f == builtin_load
+            || f == builtin_save_compiled || f == builtin_load_compiled)
+        {
+            return true;
+        }
+        else if (f == builtin_lambda)
+        {
+            return get_type(args) != TYPE_CELL || check_portable_list(pc, cdr(args));
+        }
+        else if (f == builtin_defun || f == builtin_defmacro)
+        {
+            return get_type(args) != TYPE_CELL || get_type(cdr(args)) != TYPE_CELL
+                || check_portable_list(pc, cdr(cdr(args)));
+        }
+        else if (f == builtin_define)
+        {
+            return get_type(args) != TYPE_CELL || check_portable_list(pc, cdr(args));
+        }
+    }
 
-    POP();
-    return res;
+    return check_portable_list(pc, form);
 }
 
-Object* builtin_progn(Object* scope, Object* args)
+bool check_portable_function(PortableCheck* pc, Object* fn)
 {
-    Object* ret = Nil;
-    PUSH2(scope, args);
-
-    for (; args != Nil && cdr(args) != Nil; args = cdr(args))
+    for (size_t i = 0; i < pc->count; i++)
     {
-         ret = eval(scope, car(args));
+        if (pc->funcs[i] == fn)
+        {
+            return true;
+        }
     }
 
-    POP();
+    uint8_t compiled = get_func(fn)->ufn.compiled;
 
-    if (args != Nil)
+    if (compiled != COMPILE_SYMBOLS && compiled != COMPILE_CODE)
     {
-        assert(cdr(args) == Nil);
-        TailCall->tail_expr = car(args);
-        TailCall->tail_scope = scope;
-        ret = TailCall;
+        error("Function '%s' is not frozen or compiled", get_symbol_by_pointed_value(fn));
+        return false;
     }
 
-    return ret;
-}
-
-Object* builtin_exit(Object* scope, Object* args)
-{
-    is_running = false;
-    return Nil;
+    pc->funcs = realloc(pc->funcs, (pc->count + 1) * sizeof(Object*));
+    pc->funcs[pc->count++] = fn;
+    return check_portable_form(pc, func_body(fn));
 }
 
-Object* builtin_debug(Object* scope, Object* args)
+// Whether the function gives the same result in every worker: the builtins are
+// the same in all of the interpreters, the functions and the ones they call
+// must be frozen or compiled and must not use any global variables
+bool check_portable(Object* fn)
 {
-    if (CHECK1ARGS(args))
-    {
-        error("debug takes exactly one argument");
-        return Nil;
-    }
-
-    Object* ret = eval(scope, car(args));
-#ifndef NDEBUG
-    if (get_type(ret) == TYPE_NUMBER)
+    if (get_type(fn) == TYPE_BUILTIN)
     {
-        debug_level = get_number(ret);
+        return true;
     }
-    else
+    else if (get_type(fn) != TYPE_FUNCTION)
     {
-        error("argument is not a number");
+        error("First argument is not a function");
+        return false;
     }
-#else
-    (void)ret;
-    error("debug is not usable in release mode");
-#endif
-    return Nil;
+
+    PortableCheck pc = {NULL, 0};
+    bool ok = check_portable_function(&pc, fn);
+    free(pc.funcs);
+    return ok;
 }
 
-Object* builtin_lambda(Object* scope, Object* args)
+Object* builtin_pmap(Object* scope, Object* args)
 {
     if (CHECK2ARGS(args))
     {
-        error("lambda takes exactly two arguments");
-        print(args);
+        error("pmap takes exactly two arguments");
         return Nil;
     }
 
-    Object* params = car(args);
-    Object* body = car(cdr(args));
+    Object* fn = Nil;
+    Object* list = Nil;
+    Object* vec = Nil;
+    Object* ret = Nil;
+    PUSH5(args, fn, list, vec, ret);
 
-    return make_function(params, body, scope);
-}
+    fn = eval(scope, car(args));
+    list = eval(scope, car(cdr(args)));
 
-Object* builtin_define(Object* scope, Object* args)
-{
-    if (CHECK2ARGS(args))
+    if (!check_portable(fn))
     {
-        error("define takes exactly two arguments");
+        POP();
         return Nil;
     }
-
-    Object* name = car(args);
-
-    if (get_type(name) != TYPE_SYMBOL)
+    else if (list != Nil && get_type(list) != TYPE_CELL)
     {
-        error("First argument is not a symbol");
+        error("Second argument is not a list");
+        POP();
         return Nil;
     }
 
-    Object* value = Nil;
-    PUSH4(scope, args, name, value);
+    // A few tasks per thread gives the ones that finish early something to
+    // steal
+    size_t count = length(list);
+    size_t task_count = parallel_threads() * 4;
+    task_count = count < task_count ? count : task_count;
+    Task** tasks = malloc(task_count * sizeof(Task*));
+    Object** roots = malloc((count / (task_count ? task_count : 1) + 2) * sizeof(Object*));
+    Object* item = list;
 
-    value = eval(scope, car(cdr(args)));
-    bind_value(scope, name, value);
-    return name;
-}
+    for (size_t i = 0; i < task_count; i++)
+    {
+        size_t n = count / task_count + (i < count % task_count);
+        roots[0] = fn;
 
-Object* builtin_defun(Object* scope, Object* args)
-{
-    if (CHECK3ARGS(args))
+        for (size_t j = 1; j <= n; j++)
+        {
+            roots[j] = car(item);
+            item = cdr(item);
+        }
+
+        tasks[i] = task_submit(pack(roots, n + 1), true);
+    }
+
+    free(roots);
+    Packed** results = malloc(task_count * sizeof(Packed*));
+    bool failed = false;
+
+    for (size_t i = 0; i < task_count; i++)
     {
-        error("defun takes exactly three arguments");
-        return Nil;
+        results[i] = task_wait(tasks[i]);
+        failed = failed || !results[i];
     }
 
-    Object* name = car(args);
-    Object* params = car(cdr(args));
-    Object* body = car(cdr(cdr(args)));
-    Object* func = Nil;
-    PUSH5(scope, name, params, body, func);
+    if (failed)
+    {
+        error("There are no workers to evaluate the function");
 
-    func = make_function(params, body, scope);
-    bind_value(scope, name, func);
-    POP();
-    return func;
-}
+        for (size_t i = 0; i < task_count; i++)
+        {
+            packed_free(results[i]);
+        }
 
-Object* builtin_freeze(Object* scope, Object* args)
-{
-    jit_resolve_symbols(scope, args);
-    return Nil;
-}
+        task_count = 0;
+    }
+
+    for (size_t i = task_count; i > 0; i--)
+    {
+        vec = unpack(results[i - 1]);
+        packed_free(results[i - 1]);
+
+        for (size_t j = get_obj(vec)->length; j > 0; j--)
+        {
+            ret = cons(vector_items(vec)[j - 1], ret);
+        }
+    }
 
-Object* builtin_compile(Object* scope, Object* args)
-{
-    jit_compile(scope, args);
-    return Nil;
+    free(results);
+    free(tasks);
+    POP();
+    return ret;
 }
 
-Object* builtin_defmacro(Object* scope, Object* args)
+Object* builtin_future(Object* scope, Object* args)
 {
-    if (CHECK3ARGS(args))
+    if (get_type(args) != TYPE_CELL)
     {
-        error("defmacro takes exactly three arguments");
+        error("future takes at least one argument");
         return Nil;
     }
 
-    Object* name = car(args);
-    Object* params = car(cdr(args));
-    Object* body = car(cdr(cdr(args)));
-    Object* func = Nil;
-    PUSH5(scope, name, params, body, func);
+    Object* vec = Nil;
+    Object* value = Nil;
+    PUSH3(args, vec, value);
 
-    func = make_function(params, body, scope);
-    func = get_func(func);
-    func->moved = (Object*)TYPE_MACRO;
-    func = make_ptr(func, TYPE_MACRO);
-    bind_value(scope, name, func);
-    POP();
-    return func;
-}
+    vec = make_vector(length(args), Nil);
 
-Object* builtin_macroexpand(Object* scope, Object* args)
-{
-    if (CHECK2ARGS(args))
+    for (size_t i = 0; args != Nil; i++)
     {
-        error("macroexpand takes exactly two arguments");
+        value = eval(scope, car(args));
+        vector_items(vec)[i] = value;
+        write_barrier(vec, value);
+        args = cdr(args);
+    }
+
+    if (!check_portable(vector_items(vec)[0]))
+    {
+        POP();
         return Nil;
     }
 
-    if (get_type(car(args)) != TYPE_SYMBOL)
+    size_t id = future_count;
+    futures = realloc(futures, ++future_count * sizeof(Future));
+    futures[id].task = task_submit(pack(vector_items(vec), get_obj(vec)->length), false);
+    futures[id].result = Nil;
+    POP();
+    return (Object*)(((uint64_t)interpreter_id << 40) | ((uint64_t)id << 8) | FUTURE_TAG);
+}
+
+
+Object* builtin_touch(Object* scope, Object* args)
+{
+    if (CHECK1ARGS(args))
     {
-        error("First argument is not a symbol");
+        error("touch takes exactly one argument");
         return Nil;
     }
 
-    PUSH2(scope, args);
-    Object* macro = eval(scope, car(args));
-    Object* ret = Nil;
+    int64_t id = future_index(eval(scope, car(args)));
 
-    if (get_type(macro) != TYPE_MACRO)
+    if (id == -1)
     {
-        error("%s is not a macro", get_symbol(args));
+        error("Not a future");
+        return Nil;
     }
-    else
+    else if (futures[id].task)
     {
-        ret = expand_macro(scope, macro, car(cdr(args)));
+        // The tasks that are run while waiting can create futures which
+        // means that the table can move
+        Packed* result = task_wait(futures[id].task);
+        futures[id].task = NULL;
+
+        if (!result)
+        {
+            error("There are no workers to evaluate the function");
+            return Nil;
+        }
+
+        Object* ret = vector_items(unpack(result))[0];
+        packed_free(result);
+        futures[id].result = ret;
     }
 
-    POP();
-    return ret;
+    return futures[id].result;
 }
 
-Object* builtin_load(Object* scope, Object* args)
+Object* builtin_save_image(Object* scope, Object* args)
 {
     if (CHECK1ARGS(args))
     {
-        error("load takes exactly one argument");
+        error("save-image takes exactly one argument");
         return Nil;
     }
 
@@ -1761,7 +5116,7 @@ Object* builtin_load(Object* scope, Object* args)
         return Nil;
     }
 
-    FILE* f = fopen(get_symbol(car(args)), "r");
+    FILE* f = fopen(get_symbol(car(args)), "w");
 
     if (!f)
     {
@@ -1769,43 +5124,22 @@ Object* builtin_load(Object* scope, Object* args)
         return Nil;
     }
 
-    input = f;
-    Object* expr = Nil;
-    Object* ret = Nil;
-    PUSH3(scope, expr, ret);
+    bool ok = save_image(f);
 
-    while (peek() != EOF)
+    if (fclose(f) != 0 || !ok)
     {
-        expr = parse_expr();
-
-        if (expr != Undefined)
-        {
-            ret = eval(scope, expr);
-
-            if (!quiet)
-            {
-                assert(ret != Undefined);
-                print(ret);
-            }
-        }
-        else
-        {
-            break;
-        }
+        error("Failed to write image: %d, %s", errno, strerror(errno));
+        return Nil;
     }
 
-    fclose(f);
-    input = stdin;
-
-    POP();
-    return Nil;
+    return True;
 }
 
 // The program itself
 
 void define_builtins()
 {
-    Env = new_scope(Nil);
+    Env = new_scope(Nil, Nil, 0);
 
     // Constants
     Object* sym = Nil;
@@ -1820,11 +5154,22 @@ void define_builtins()
     define_builtin_function("+", builtin_add);
     define_builtin_function("-", builtin_sub);
     define_builtin_function("<", builtin_less);
+    define_builtin_function("*", builtin_mul);
+    define_builtin_function("/", builtin_div);
+    define_builtin_function("mod", builtin_mod);
+    define_builtin_function("logand", builtin_logand);
+    define_builtin_function("logior", builtin_logior);
+    define_builtin_function("logxor", builtin_logxor);
+    define_builtin_function("ash", builtin_ash);
     define_builtin_function("quote", builtin_quote);
     define_builtin_function("cons", builtin_cons);
     define_builtin_function("car", builtin_car);
     define_builtin_function("cdr", builtin_cdr);
     define_builtin_function("eq", builtin_eq);
+    define_builtin_function("make-vector", builtin_make_vector);
+    define_builtin_function("vector-ref", builtin_vector_ref);
+    define_builtin_function("vector-set", builtin_vector_set);
+    define_builtin_function("vector-length", builtin_vector_length);
     define_builtin_function("if", builtin_if);
     define_builtin_function("list", builtin_list);
     define_builtin_function("eval", builtin_eval);
@@ -1834,6 +5179,8 @@ void define_builtins()
     define_builtin_function("defun", builtin_defun);
     define_builtin_function("freeze", builtin_freeze);
     define_builtin_function("compile", builtin_compile);
+    define_builtin_function("save-compiled", builtin_save_compiled);
+    define_builtin_function("load-compiled", builtin_load_compiled);
     define_builtin_function("defmacro", builtin_defmacro);
     define_builtin_function("macroexpand", builtin_macroexpand);
 
@@ -1845,15 +5192,24 @@ void define_builtins()
     define_builtin_function("write-char", builtin_writechar);
     define_builtin_function("sleep", builtin_sleep);
     define_builtin_function("rand", builtin_rand);
+    define_builtin_function("time-ns", builtin_time_ns);
     define_builtin_function("load", builtin_load);
+    define_builtin_function("save-image", builtin_save_image);
     define_builtin_function("exit", builtin_exit);
     define_builtin_function("debug", builtin_debug);
+    define_builtin_function("profile", builtin_profile);
+    define_builtin_function("gc-stats", builtin_gc_stats);
+
+    // Parallelism
+    define_builtin_function("pmap", builtin_pmap);
+    define_builtin_function("future", builtin_future);
+    define_builtin_function("touch", builtin_touch);
 
     // Some common aliases
     define_alias("define", "defvar");
 }
 
-void parse()
+void parse(Reader* r)
 {
     if (DEBUG_EXTRA)
     {
@@ -1866,7 +5222,7 @@ void parse()
         fflush(stdout);
     }
 
-    Object* obj = parse_expr();
+    Object* obj = parse_expr(r);
 
     if (echo)
     {
@@ -1887,7 +5243,7 @@ void parse()
             print(obj);
         }
     }
-    else if (peek() == EOF)
+    else if (peek(r) == EOF)
     {
         printf("\n");
         is_running = false;
@@ -1898,14 +5254,307 @@ void parse()
     }
 }
 
+// Parses a size with an optional K, M or G suffix
+size_t parse_size(const char* str)
+{
+    char* end = NULL;
+    size_t size = strtoul(str, &end, 10);
+
+    switch (*end)
+    {
+    case 'g':
+    case 'G':
+        size *= 1024;
+        // fallthrough
+    case 'm':
+    case 'M':
+        size *= 1024;
+        // fallthrough
+    case 'k':
+    case 'K':
+        size *= 1024;
+        break;
+    }
+
+    return size;
+}
+
+// Zero disables the automatic compilation
+uint32_t parse_threshold(const char* str)
+{
+    long value = atol(str);
+    return value <= 0 || value > UINT32_MAX ? UINT32_MAX : value;
+}
+
+// The handler runs on a stack of its own as the native stack of the thread
+// could be the one that overflowed. Each thread needs its own.
+#define SIGNAL_STACK_SIZE (64 * 1024)
+
+_Thread_local void* signal_stack = NULL;
+
+void install_signal_stack()
+{
+    stack_t ss;
+    ss.ss_sp = malloc(SIGNAL_STACK_SIZE);
+    ss.ss_size = SIGNAL_STACK_SIZE;
+    ss.ss_flags = 0;
+
+    if (ss.ss_sp && sigaltstack(&ss, NULL) == 0)
+    {
+        signal_stack = ss.ss_sp;
+    }
+    else
+    {
+        free(ss.ss_sp);
+    }
+}
+
+void remove_signal_stack()
+{
+    if (signal_stack)
+    {
+        stack_t ss = {.ss_flags = SS_DISABLE};
+        sigaltstack(&ss, NULL);
+        free(signal_stack);
+        signal_stack = NULL;
+    }
+}
+
+bool lisp_init(const char* image)
+{
+    reserve_memory();
+    reserve_root_stack();
+    vm_init();
+
+    nursery_root = aligned_alloc(ALLOC_ALIGN, nursery_size);
+    nursery_end = nursery_root + nursery_size;
+    mem_ptr = nursery_root;
+    mem_end = nursery_end;
+    cell_ptr = cell_nursery_root;
+    cell_end = cell_nursery_end - sizeof(Object*);
+
+    jit_stack_set_size(jit_stack_size);
+    install_signal_stack();
+    interpreter_id = atomic_fetch_add(&next_interpreter_id, 1) & 0xffffff;
+
+    if (image)
+    {
+        return load_image(image);
+    }
+
+    define_builtins();
+    return true;
+}
+
+void lisp_free()
+{
+    // The futures that were never touched may still be in progress
+    for (size_t i = 0; i < future_count; i++)
+    {
+        if (futures[i].task)
+        {
+            packed_free(task_wait(futures[i].task));
+        }
+    }
+
+    free(futures);
+    futures = NULL;
+    future_count = 0;
+
+    remove_signal_stack();
+    jit_free();
+    vm_free();
+    profile_free();
+    release_memory();
+    munmap(root_stack, ROOT_STACK_SIZE * sizeof(Object**) + sysconf(_SC_PAGESIZE));
+    free(nursery_root);
+    free(remembered_set);
+    free(gc_log);
+    free(gc_functions);
+    free(symbol_table);
+}
+
+// Runs each interpreter on a thread of its own. All of them evaluate the same
+// input which is read into memory before they are started.
+struct InterpreterThread
+{
+    pthread_t thread;
+    const char* image;
+    Reader reader;
+    bool ok;
+};
+
+typedef struct InterpreterThread InterpreterThread;
+
+void* run_interpreter(void* arg)
+{
+    InterpreterThread* t = arg;
+    t->ok = lisp_init(t->image);
+
+    if (t->ok)
+    {
+        while (is_running)
+        {
+            parse(&t->reader);
+        }
+
+        lisp_free();
+    }
+
+    return NULL;
+}
+
+bool run_threads(int count, const char* image)
+{
+    // The mark stays at the start which keeps all of the input in the buffer
+    Reader input = {NULL, 0, 0, 0, 0, STDIN_FILENO};
+
+    while (reader_fill(&input))
+    {
+    }
+
+    InterpreterThread* threads = calloc(count, sizeof(InterpreterThread));
+    bool ok = true;
+
+    for (int i = 0; i < count; i++)
+    {
+        // The threads share the buffer, it's never written to when fd is -1
+        threads[i].image = image;
+        threads[i].reader = (Reader){input.buffer, 0, input.len, 0, 0, -1};
+
+        if (pthread_create(&threads[i].thread, NULL, run_interpreter, &threads[i]) != 0)
+        {
+            printf("Failed to start a thread: %d, %s\n", errno, strerror(errno));
+            count = i;
+            ok = false;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        ok = ok && threads[i].ok;
+    }
+
+    free(threads);
+    free(input.buffer);
+    return ok;
+}
+
+// Evaluates the forms that are sent over a Unix socket. The connections are
+// served one at a time by the same interpreter which means that the state of
+// the previous connections and of the standard input that was evaluated before
+// the server was started is kept. The output of each form is written back to
+// the connection as soon as the form has been evaluated. The server stops when
+// exit is called.
+bool serve(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("Socket path is too long: %s\n", path);
+        return false;
+    }
+
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1)
+    {
+        printf("Failed to listen on '%s': %d, %s\n", path, errno, strerror(errno));
+
+        if (fd != -1)
+        {
+            close(fd);
+        }
+
+        return false;
+    }
+
+    // The clients that disconnect early must not stop the server
+    signal(SIGPIPE, SIG_IGN);
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+
+    while (!exit_called)
+    {
+        int client = accept(fd, NULL, NULL);
+
+        if (client == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            printf("Failed to accept a connection: %d, %s\n", errno, strerror(errno));
+            break;
+        }
+
+        dup2(client, STDOUT_FILENO);
+        Reader reader = {NULL, 0, 0, 0, 0, client};
+        is_running = true;
+
+        while (is_running)
+        {
+            parse(&reader);
+            fflush(stdout);
+        }
+
+        // Whatever couldn't be written to a client that went away is dropped
+        __fpurge(stdout);
+        clearerr(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        free(reader.buffer);
+        close(client);
+    }
+
+    close(saved_stdout);
+    close(fd);
+    unlink(path);
+    return true;
+}
+
+// The compiled code doesn't check whether it overflows the JIT stack and ends
+// up here once it writes into the guard page after it. Other faults are passed
+// to the handler that was there before by restoring it, the instruction that
+// caused the fault then faults again.
+struct sigaction prev_segv_action;
+
+void segv_handler(int sig, siginfo_t* info, void* context)
+{
+    jit_stack_fault(info->si_addr);
+    sigaction(SIGSEGV, &prev_segv_action, NULL);
+}
+
+void install_segv_handler()
+{
+    // The signal isn't blocked while the handler runs as it doesn't return to
+    // the compiled code if the stack overflowed
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = segv_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &prev_segv_action);
+}
+
 int main(int argc, char** argv)
 {
     int ch;
-    input = stdin;
     srand(time(NULL));
-    int jit_stack_size = 1024 * 1024 * 16;
-
-    while ((ch = getopt(argc, argv, "dgem:qr:")) != -1)
+    int threads = 0;
+    const char* image = NULL;
+    const char* profile_path = NULL;
+    const char* socket_path = NULL;
+    bool perf_map = false;
+    bool perf_dump = false;
+
+    while ((ch = getopt(argc, argv, "dgGem:qr:j:H:M:c:l:i:p:P:J:t:w:S:")) != -1)
     {
         switch (ch)
         {
@@ -1930,6 +5579,10 @@ int main(int argc, char** argv)
 #endif
             break;
 
+        case 'G':
+            gc_telemetry = true;
+            break;
+
         case 'd':
 #ifdef NDEBUG
             printf("The -d flag is not available in optimized binaries\n");
@@ -1947,14 +5600,82 @@ int main(int argc, char** argv)
             jit_stack_size = atoi(optarg);
             break;
 
+        case 'H':
+            heap_size = parse_size(optarg);
+            break;
+
+        case 'M':
+            max_heap_size = parse_size(optarg);
+            break;
+
+        case 'c':
+            jit_call_threshold = parse_threshold(optarg);
+            break;
+
+        case 'l':
+            jit_loop_threshold = parse_threshold(optarg);
+            break;
+
+        case 'i':
+            image = optarg;
+            break;
+
+        case 'p':
+            gc_pause_budget = atol(optarg);
+            break;
+
+        case 'P':
+            profile_path = optarg;
+            break;
+
+        case 'S':
+            socket_path = optarg;
+            break;
+
+        case 't':
+            threads = atoi(optarg);
+            break;
+
+        case 'w':
+            worker_count = atoi(optarg);
+            break;
+
+        case 'J':
+            if (strcmp(optarg, "map") == 0)
+            {
+                perf_map = true;
+            }
+            else if (strcmp(optarg, "dump") == 0)
+            {
+                perf_dump = true;
+            }
+            else
+            {
+                printf("Unknown argument to -J: %s\n", optarg);
+                return 1;
+            }
+            break;
+
         default:
             printf("Unknown option: %c\n", ch);
             printf("Options: \n"
                    " -r SEED    Set random seed\n"
                    " -m MEM_PCT Set garbage collection threshold\n"
                    " -j SIZE    Set the size of the JIT stack\n"
+                   " -H SIZE    Set the initial heap size\n"
+                   " -M SIZE    Set the maximum heap size\n"
+                   " -c COUNT   Compile functions after this many calls, 0 disables\n"
+                   " -l COUNT   Compile functions after this many loop iterations, 0 disables\n"
+                   " -i FILE    Start from a heap image saved with save-image\n"
+                   " -p USEC    Do major collections incrementally in pauses of about USEC microseconds\n"
+                   " -P FILE    Profile the program and write the sampled call stacks into FILE\n"
+                   " -J KIND    Write the compiled functions into a perf map (map) or a jitdump file (dump)\n"
+                   " -t COUNT   Evaluate the input in COUNT interpreters that run on separate threads\n"
+                   " -w COUNT   Use COUNT worker threads for pmap and future\n"
+                   " -S PATH    Evaluate the forms sent to a Unix socket after the standard input\n"
                    " -e         Turn on input echoing\n"
                    " -g         Verbose GC\n"
+                   " -G         Write one line per garbage collection to stderr\n"
                    " -d         Debug output\n"
                    " -q         No output\n");
             return 1;
@@ -1970,20 +5691,66 @@ int main(int argc, char** argv)
         memory_pct = 1.0;
     }
 
-    memory_size = ((memory_size + ALLOC_ALIGN - 1) / ALLOC_ALIGN) * ALLOC_ALIGN;
-    mem_root = aligned_alloc(ALLOC_ALIGN, memory_size);
-    mem_ptr = mem_root;
-    mem_end = mem_root + memory_size / 2;
+    install_segv_handler();
 
-    jit_stack_set_size(jit_stack_size);
+    if ((perf_map || perf_dump) && !jit_perf_open(perf_map, perf_dump))
+    {
+        printf("Failed to open the perf files: %d, %s\n", errno, strerror(errno));
+        return 1;
+    }
 
-    define_builtins();
+    if (threads > 0)
+    {
+        if (profile_path)
+        {
+            // The profiler only samples the thread that started it
+            printf("The -P flag cannot be used with -t\n");
+            return 1;
+        }
+        else if (socket_path)
+        {
+            printf("The -S flag cannot be used with -t\n");
+            return 1;
+        }
+
+        bool ok = run_threads(threads, image);
+        parallel_free();
+        jit_perf_close();
+        return ok ? 0 : 1;
+    }
+
+    if (!lisp_init(image))
+    {
+        return 1;
+    }
+
+    if (profile_path)
+    {
+        profile_start();
+    }
+
+    Reader reader = {NULL, 0, 0, 0, 0, STDIN_FILENO};
 
     while (is_running)
     {
-        parse();
+        parse(&reader);
     }
 
-    jit_free();
-    free(mem_root);
+    bool ok = true;
+
+    if (socket_path && !exit_called)
+    {
+        ok = serve(socket_path);
+    }
+
+    if (profile_path && !profile_stop(profile_path))
+    {
+        printf("Failed to write profile: %d, %s\n", errno, strerror(errno));
+    }
+
+    free(reader.buffer);
+    lisp_free();
+    parallel_free();
+    jit_perf_close();
+    return ok ? 0 : 1;
 }
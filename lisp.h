@@ -30,16 +30,17 @@
 // to a 8 byte boundary gives 3 bits to store the type information and it makes
 // the minimum allocations size 16 bytes.
 //
-// If lowest two bits are zero, the value is an integer and the numeric value of
-// it can be extracted by shifting it two bits to the right. If the lowest three
-// bits are all set, the value is a constant. Otherwise, it's a heap allocated
-// object and the pointer to the real object can be extracted by masking off the
-// lowest three bits.
+// If lowest three bits are zero, the value is an integer and the numeric value
+// of it can be extracted by shifting it three bits to the right. If the lowest
+// three bits are all set, the value is a constant. Otherwise, it's a heap
+// allocated object and the pointer to the real object can be extracted by
+// masking off the lowest three bits.
 //
-// 0bX00 - Integer
+// 0b000 - Integer
 // 0b001 - Symbol
 // 0b010 - Builtin function
 // 0b011 - Cons cell
+// 0b100 - Vector
 // 0b101 - Lisp function
 // 0b110 - Lisp macro
 // 0b111 - Constant (nil or true)
@@ -50,11 +51,14 @@ enum Type {
     TYPE_SYMBOL   = 1,
     TYPE_BUILTIN  = 2,
     TYPE_CELL     = 3,
+    TYPE_VECTOR   = 4,
     TYPE_FUNCTION = 5,
     TYPE_MACRO    = 6,
     TYPE_CONST    = 7
 };
 
+#define NUMBER_SHIFT 3
+
 #define TYPE_MASK 0x7
 
 struct Object;
@@ -68,7 +72,14 @@ struct UserFunction
     Object* func_params;
     Object* func_body;
     Object* func_env;
+    Object* code; // The bytecode vector, see vm.c
     void*   jit_mem; // Stores the JIT compiled code
+    int     param_count;
+    int     code_entry; // Where the function starts in the bytecode vector
+    uint32_t call_count; // Calls since the last attempt to compile the function
+    uint32_t loop_count; // Tail calls to itself since the last attempt
+    uint32_t jit_epoch;  // The epoch of an automatic compilation, see compiler.h
+    uint32_t profile_id; // The name of the function in the profiler, see profiler.c
     uint8_t compiled;
 };
 
@@ -81,6 +92,8 @@ struct Object
     // lowest three bits but once GC has moved, it it will contain the actual
     // address where the object was moved. Whether an object was moved can be
     // detected with: (moved & TYPE_MASK) == 0
+    //
+    // Cons cells don't have this header, see CELL_SIZE.
     Object* moved;
 
     union
@@ -91,12 +104,23 @@ struct Object
             Object* cdr;
         };
 
-        // Symbol (TYPE_SYMBOL)
-        char name[1];
+        // Symbol (TYPE_SYMBOL). The global value of the symbol is stored in
+        // the symbol itself which makes the lookup of global variables a
+        // constant time operation. Unbound symbols point to Undefined.
+        struct {
+            Object* global;
+            char name[1];
+        };
 
         // Builtin function (TYPE_BUILTIN)
         Function fn;
 
+        // Vector (TYPE_VECTOR)
+        struct {
+            size_t  length;
+            Object* items[1];
+        };
+
         // Custom functions (TYPE_FUNCTION)
         UserFunction ufn;
 
@@ -116,34 +140,57 @@ struct Object
 #define Undefined ((Object*)0x2f) // Used as the error object in some functions
 #define JitEnd    ((Object*)0x3f) // Marks the end of the JIT stack
 #define JitPoison ((Object*)0x4f) // Marks unused JIT stack, debugging only
+#define JitBailout ((Object*)0x5f) // Returned by compiled code if a type check fails
+#define JitTailCall ((Object*)0x6f) // Returned by compiled code to leave a tail call to the caller
+
+// The special value that builtins return when the value they return must be
+// evaluated in the same stack frame.
+extern _Thread_local Object TailCall_obj;
+#define TailCall (&TailCall_obj)
+
+// The parameters of functions are resolved into local variable references
+// before the function is evaluated. These are constants that have the number
+// of scopes to skip (the depth) and the index of the variable (the slot) stored
+// in the upper bits.
+#define LOCAL_REF_TAG 0x07
+
+// The local scopes are vectors where the first value is the parent scope, the
+// second one is the list of variable names and the rest are the values of the
+// variables. The names are used for looking up variables that were not
+// resolved into local variable references.
+#define SCOPE_PARENT 0
+#define SCOPE_NAMES  1
+#define SCOPE_SLOTS  2
 
 // Allocation sizes and such
 #define ALLOC_ALIGN _Alignof(Object)
-#define BASE_SIZE offsetof(Object, name)
-
-// Stack variable tracking for GC
-#define MAX_VARS 7
+#define BASE_SIZE offsetof(Object, car)
+#define SYMBOL_BASE_SIZE offsetof(Object, name)
 
-struct Frame
-{
-    struct Frame* next;
-    int size;
-    Object** vars[MAX_VARS];
-};
+// Cons cells are stored without the header in spaces of their own. A pointer to
+// a cell points one word before the car which means that the car and the cdr
+// are accessed the same way as the fields of the other objects.
+#define CELL_SIZE (2 * sizeof(Object*))
 
-typedef struct Frame Frame;
+// Stack variable tracking for GC
+//
+// The addresses of the local variables that hold objects are stored in a
+// contiguous stack that the GC scans as one range. ENTER() remembers the
+// current top and POP() restores it. ROOT() adds one more variable to the
+// current frame, there's no limit on how many can be added.
+extern _Thread_local Object*** root_stack;
+extern _Thread_local size_t root_top;
 
-extern Frame* stack_top;
-#define ENTER() Frame frame; frame.next = stack_top; frame.size = 0; stack_top = &frame
-#define SETEND(n) frame.size = n
-#define PUSH1(a) ENTER(); frame.vars[0] = &a; SETEND(1)
-#define PUSH2(a, b) PUSH1(a); frame.vars[1] = &b; SETEND(2)
-#define PUSH3(a, b, c) PUSH2(a, b); frame.vars[2] = &c; SETEND(3)
-#define PUSH4(a, b, c, d) PUSH3(a, b, c); frame.vars[3] = &d; SETEND(4)
-#define PUSH5(a, b, c, d, e) PUSH4(a, b, c, d); frame.vars[4] = &e; SETEND(5)
-#define PUSH6(a, b, c, d, e, f) PUSH5(a, b, c, d, e); frame.vars[5] = &f; SETEND(6)
-#define PUSH7(a, b, c, d, e, f, g) PUSH6(a, b, c, d, e, f); frame.vars[6] = &g; SETEND(7)
-#define POP() stack_top = frame.next;
+#define ENTER() size_t root_frame = root_top
+#define ROOT(a) root_stack[root_top++] = &a
+#define PUSH1(a) ENTER(); ROOT(a)
+#define PUSH2(a, b) PUSH1(a); ROOT(b)
+#define PUSH3(a, b, c) PUSH2(a, b); ROOT(c)
+#define PUSH4(a, b, c, d) PUSH3(a, b, c); ROOT(d)
+#define PUSH5(a, b, c, d, e) PUSH4(a, b, c, d); ROOT(e)
+#define PUSH6(a, b, c, d, e, f) PUSH5(a, b, c, d, e); ROOT(f)
+#define PUSH7(a, b, c, d, e, f, g) PUSH6(a, b, c, d, e, f); ROOT(g)
+#define POP() root_top = root_frame;
 
 // Argument check macros
 #define CHECK0ARGS(args) args != Nil
@@ -169,21 +216,124 @@ const char* get_type_name(enum Type type);
 int64_t get_number(Object* obj);
 Object* func_params(Object* obj);
 Object* func_body(Object* obj);
+Object* func_env(Object* obj);
 uint8_t* func_jit_mem(Object* obj);
+Object* make_function(Object* params, Object* body, Object* env);
+Object* make_vector(size_t length, Object* value);
+Object** vector_items(Object* obj);
+
+// Reports an error and returns false if vec isn't a vector or index isn't a
+// valid index into it
+bool check_vector_index(Object* vec, Object* index);
+Object* new_scope(Object* prev_scope, Object* names, int size);
+Object* scope_parent(Object* scope);
+Object** scope_slots(Object* scope);
+Object* make_local_ref(int depth, int slot);
+bool is_local_ref(Object* obj);
+int local_ref_depth(Object* obj);
+int local_ref_slot(Object* obj);
 Object* symbol_lookup(Object* scope, Object* sym);
 Object* make_ptr(Object* obj, enum Type type);
 Object* make_number(int64_t val);
 int64_t get_number(Object* obj);
 void bind_value(Object* scope, Object* symbol, Object* value);
+
+// Must be called after a pointer to value has been stored in obj. Records the
+// old objects that point to objects in the nursery.
+void write_barrier(Object* obj, Object* value);
+bool in_nursery(Object* obj);
+
+// The next free cell in the cell nursery and the end of it. Compiled code
+// allocates cons cells by bumping the pointer and calls cons only if it runs out.
+extern _Thread_local uint8_t* cell_ptr;
+extern _Thread_local uint8_t* cell_end;
+
+// Rounds the size up to a multiple of the page size
+size_t page_align(size_t size);
+
+// The hash of the bytes, used for the symbol table and the profiler
+uint64_t hash_bytes(const void* data, size_t len);
+
 Object* symbol(const char* name);
 Object* car(Object* obj);
 Object* cdr(Object* obj);
 Object* cons(Object* car, Object* cdr);
 Object* eval(Object* scope, Object* obj);
+
+// Evaluates the list obj whose first element has already been evaluated to fn
+Object* eval_form(Object* scope, Object* obj, Object* fn);
 int length(Object* list);
 
 void do_writechar(Object* obj);
 
+// The integer operations that the evaluator, the VM and the compiler all
+// implement. Division truncates towards zero and the remainder has the sign of
+// the dividend, like in C. Positive shift counts shift left and negative ones
+// shift right.
+enum Arith
+{
+    ARITH_MUL,
+    ARITH_DIV,
+    ARITH_MOD,
+    ARITH_AND,
+    ARITH_IOR,
+    ARITH_XOR,
+    ARITH_ASH,
+};
+
+// Stores the result of the operation into result, returns false if it's a
+// division by zero
+bool do_arithmetic(enum Arith op, int64_t lhs, int64_t rhs, int64_t* result);
+
+// The lexical scopes that are used when local variables are resolved. The
+// names are the parameters of the function that's being resolved and the
+// parent is the function that encloses it.
+struct LexicalScope
+{
+    Object* names;
+    struct LexicalScope* parent;
+};
+
+typedef struct LexicalScope LexicalScope;
+
+// Returns a local variable reference if the symbol refers to a local variable
+// of the given lexical scopes or of the runtime scope env. Otherwise the symbol
+// itself is returned.
+Object* resolve_local(LexicalScope* lex, Object* env, Object* sym);
+
+// Copies of objects that are stored outside of the heap, used to pass objects
+// between the interpreters of different threads. The first words are the
+// references to the roots followed by the records of the objects that are
+// reachable from them, see pack.
+struct Packed
+{
+    uint64_t* words;
+    size_t used;
+    size_t size;
+    size_t roots;
+    size_t objects;
+};
+
+typedef struct Packed Packed;
+
+// Copies the objects that are reachable from the roots. Nothing is allocated
+// from the heap.
+Packed* pack(Object** roots, size_t count);
+
+// Copies the packed objects into the heap and returns a vector of the roots
+Object* unpack(Packed* packed);
+void packed_free(Packed* packed);
+
+// Unpacks a function and its arguments and calls it. With map, the function is
+// called with each of the arguments separately. The results are returned
+// packed.
+Packed* eval_packed(Packed* input, bool map);
+
+// Sets up the interpreter of the calling thread, either from a heap image or
+// with only the builtins defined. The interpreter is freed with lisp_free.
+bool lisp_init(const char* image);
+void lisp_free();
+
 bool debug_on();
 
 void print(Object* obj);
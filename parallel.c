@@ -0,0 +1,311 @@
+#include "parallel.h"
+
+#include <pthread.h>
+
+// Each worker runs an interpreter of its own and has a deque of tasks. The
+// worker takes tasks from the back of its own deque and when it runs out, it
+// steals them from the front of the other deques. The tasks that are submitted
+// by threads that aren't workers are spread over the deques in turn.
+//
+// The tasks are packed copies of the function and its arguments which means
+// that they can be evaluated by any of the workers. Only the workers evaluate
+// them: the interpreter of a thread that isn't a worker has its own global
+// variables which would make the result depend on the thread that happened to
+// evaluate the task. Everything that's shared between the threads lives
+// outside of the heaps.
+struct Task
+{
+    Packed* input;
+    Packed* output;
+    bool map;
+    bool done;
+};
+
+struct Worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    Task** tasks;
+    size_t head; // The oldest task, stolen by the other workers
+    size_t tail; // One past the newest task, taken by the worker itself
+    size_t size;
+};
+
+typedef struct Worker Worker;
+
+int worker_count = 0;
+
+// The state of the pool. The lock protects the counters and the done flags of
+// the tasks, the deques have locks of their own. The condition is signaled
+// whenever a task is submitted or finished. The number of started workers only
+// changes while the lock is held by start_workers and parallel_free.
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_changed = PTHREAD_COND_INITIALIZER;
+Worker* workers = NULL;
+int workers_started = 0;
+size_t tasks_pending = 0;
+size_t next_worker = 0;
+bool workers_stopping = false;
+
+_Thread_local Worker* self = NULL;
+
+void deque_push(Worker* w, Task* task)
+{
+    pthread_mutex_lock(&w->lock);
+
+    if (w->tail - w->head == w->size)
+    {
+        size_t new_size = w->size ? w->size * 2 : 64;
+        Task** new_tasks = malloc(new_size * sizeof(Task*));
+
+        for (size_t i = w->head; i < w->tail; i++)
+        {
+            new_tasks[i - w->head] = w->tasks[i % w->size];
+        }
+
+        free(w->tasks);
+        w->tasks = new_tasks;
+        w->tail -= w->head;
+        w->head = 0;
+        w->size = new_size;
+    }
+
+    w->tasks[w->tail++ % w->size] = task;
+    pthread_mutex_unlock(&w->lock);
+}
+
+Task* deque_pop(Worker* w)
+{
+    Task* task = NULL;
+    pthread_mutex_lock(&w->lock);
+
+    if (w->tail > w->head)
+    {
+        task = w->tasks[--w->tail % w->size];
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+Task* deque_steal(Worker* w)
+{
+    Task* task = NULL;
+    pthread_mutex_lock(&w->lock);
+
+    if (w->tail > w->head)
+    {
+        task = w->tasks[w->head++ % w->size];
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+Task* take_task()
+{
+    Task* task = self ? deque_pop(self) : NULL;
+    int start = self ? self - workers + 1 : 0;
+
+    for (int i = 0; !task && i < workers_started; i++)
+    {
+        task = deque_steal(&workers[(start + i) % workers_started]);
+    }
+
+    if (task)
+    {
+        pthread_mutex_lock(&pool_lock);
+        tasks_pending--;
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    return task;
+}
+
+void run_task(Task* task)
+{
+    Packed* output = eval_packed(task->input, task->map);
+    packed_free(task->input);
+    task->input = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    task->output = output;
+    task->done = true;
+    pthread_cond_broadcast(&pool_changed);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void* worker_main(void* arg)
+{
+    self = arg;
+
+    // The workers are started with the pool lock held, once it's released all
+    // of them have been started
+    pthread_mutex_lock(&pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+
+    lisp_init(NULL);
+
+    while (true)
+    {
+        Task* task = take_task();
+
+        if (task)
+        {
+            run_task(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool_lock);
+
+        while (tasks_pending == 0 && !workers_stopping)
+        {
+            pthread_cond_wait(&pool_changed, &pool_lock);
+        }
+
+        bool stop = tasks_pending == 0 && workers_stopping;
+        pthread_mutex_unlock(&pool_lock);
+
+        if (stop)
+        {
+            break;
+        }
+    }
+
+    lisp_free();
+    return NULL;
+}
+
+// Called with the pool lock held
+void start_workers()
+{
+    int count = worker_count;
+
+    if (count <= 0)
+    {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+        count = count < 1 ? 1 : count;
+    }
+
+    workers = calloc(count, sizeof(Worker));
+
+    for (int i = 0; i < count; i++)
+    {
+        pthread_mutex_init(&workers[i].lock, NULL);
+
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+        {
+            break;
+        }
+
+        workers_started++;
+    }
+
+    if (workers_started == 0)
+    {
+        printf("Failed to start the workers: %d, %s\n", errno, strerror(errno));
+    }
+}
+
+Task* task_submit(Packed* input, bool map)
+{
+    Task* task = malloc(sizeof(Task));
+    task->input = input;
+    task->output = NULL;
+    task->map = map;
+    task->done = false;
+
+    pthread_mutex_lock(&pool_lock);
+
+    if (!workers)
+    {
+        start_workers();
+    }
+
+    // Without workers, the task fails without an output
+    if (workers_started > 0)
+    {
+        Worker* w = self ? self : &workers[next_worker++ % workers_started];
+        deque_push(w, task);
+        tasks_pending++;
+        pthread_cond_broadcast(&pool_changed);
+    }
+    else
+    {
+        packed_free(task->input);
+        task->input = NULL;
+        task->done = true;
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+    return task;
+}
+
+Packed* task_wait(Task* task)
+{
+    pthread_mutex_lock(&pool_lock);
+
+    while (!task->done)
+    {
+        pthread_mutex_unlock(&pool_lock);
+        Task* other = self ? take_task() : NULL;
+
+        if (other)
+        {
+            run_task(other);
+            pthread_mutex_lock(&pool_lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool_lock);
+
+        // The task is being evaluated by another thread if nothing is pending,
+        // the threads that aren't workers wait for it in any case
+        while (!task->done && (tasks_pending == 0 || !self))
+        {
+            pthread_cond_wait(&pool_changed, &pool_lock);
+        }
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+
+    Packed* output = task->output;
+    free(task);
+    return output;
+}
+
+int parallel_threads()
+{
+    pthread_mutex_lock(&pool_lock);
+
+    if (!workers)
+    {
+        start_workers();
+    }
+
+    int count = workers_started > 0 ? workers_started : 1;
+    pthread_mutex_unlock(&pool_lock);
+    return count;
+}
+
+void parallel_free()
+{
+    pthread_mutex_lock(&pool_lock);
+    workers_stopping = true;
+    pthread_cond_broadcast(&pool_changed);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (int i = 0; i < workers_started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].tasks);
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    free(workers);
+    workers = NULL;
+    workers_started = 0;
+    workers_stopping = false;
+    pthread_mutex_unlock(&pool_lock);
+}
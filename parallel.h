@@ -0,0 +1,31 @@
+#pragma once
+
+#include "lisp.h"
+
+//
+// The worker pool that evaluates frozen functions in parallel
+//
+
+// The number of worker threads, zero uses one per processor. Must be set before
+// the first task is submitted.
+extern int worker_count;
+
+struct Task;
+typedef struct Task Task;
+
+// Starts evaluating the packed function and arguments on one of the workers,
+// see eval_packed. The ownership of the input is passed to the task.
+Task* task_submit(Packed* input, bool map);
+
+// Waits for the task to finish and returns its packed result, NULL if there are
+// no workers. The task is freed and the result must be freed with packed_free.
+// While waiting, a worker evaluates other tasks in its own interpreter. The
+// other threads don't evaluate any tasks: their interpreters have global
+// variables that the workers don't.
+Packed* task_wait(Task* task);
+
+// The number of threads that evaluate the tasks
+int parallel_threads();
+
+// Stops the workers, the tasks must have been waited for
+void parallel_free();
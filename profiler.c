@@ -0,0 +1,553 @@
+#include "profiler.h"
+#include "compiler.h"
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+// How often a sample is taken, in microseconds of CPU time. The kernel may
+// deliver the signal less often than this, the times in the results are based
+// on the CPU time that was actually used.
+#define PROFILE_INTERVAL_USEC 1000
+
+// The calls nested deeper than this are left out of the samples
+#define PROFILE_MAX_DEPTH 4096
+
+// The most JIT frames that are recorded in one sample
+#define PROFILE_MAX_JIT_FRAMES 64
+
+// The number of words in the buffer that the signal handler stores the samples
+// into. The buffer is emptied at the next call that's made after a sample.
+#define SAMPLE_BUFFER_SIZE (1024 * 1024)
+
+// The samples are taken from the stack of calls that are in progress. The
+// functions are stored as indexes into the table of function names as the
+// objects themselves can be moved by the GC at any time. The index of a
+// function is stored in it the first time it's called while profiling.
+//
+// The signal handler only copies the stack and the addresses of the compiled
+// functions that were running into the sample buffer. The samples are added
+// into the results outside of the signal handler, in profile_enter and
+// profile_leave, which means that nothing in the signal handler allocates
+// memory or touches the heap.
+//
+// The compiled functions that call each other directly don't go through the
+// evaluator and don't show up in the call stack. These are found by walking
+// the frame pointers of the compiled code if the sample was taken while it was
+// running. Time spent in the builtins and in the GC is counted towards the Lisp
+// function that called them.
+_Thread_local bool profiling = false;
+
+_Thread_local uint32_t profile_stack[PROFILE_MAX_DEPTH];
+_Thread_local volatile sig_atomic_t profile_depth = 0;
+
+// Each sample is the number of functions in the call stack, the number of JIT
+// frames and then the functions and the return addresses of the JIT frames,
+// innermost first.
+_Thread_local uint64_t* sample_buffer = NULL;
+_Thread_local volatile sig_atomic_t sample_used = 0;
+_Thread_local volatile sig_atomic_t samples_dropped = 0;
+
+struct ProfileEntry
+{
+    char* name;
+    uint64_t self;
+    uint64_t total;
+    uint64_t last_sample; // Keeps recursive calls from being counted twice
+};
+
+typedef struct ProfileEntry ProfileEntry;
+
+// A unique call stack and the number of times it was sampled
+struct ProfileStack
+{
+    uint32_t* frames;
+    uint32_t depth;
+    uint64_t hash;
+    uint64_t count;
+};
+
+typedef struct ProfileStack ProfileStack;
+
+// The function names, the zeroth entry is the top level
+_Thread_local ProfileEntry* entries = NULL;
+_Thread_local size_t entry_count = 0;
+_Thread_local size_t entry_size = 0;
+
+// Maps the names into indexes into the entries. The slots store index + 1 so
+// that zero is an empty slot.
+_Thread_local uint32_t* name_table = NULL;
+_Thread_local size_t name_table_size = 0;
+
+_Thread_local ProfileStack* stacks = NULL;
+_Thread_local size_t stack_count = 0;
+_Thread_local size_t stack_table_size = 0;
+
+_Thread_local uint64_t sample_count = 0;
+
+// The CPU time used by the process when the profiling started
+_Thread_local double profile_start_time = 0;
+
+double cpu_time_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void name_table_grow()
+{
+    size_t new_size = name_table_size ? name_table_size * 2 : 256;
+    uint32_t* new_table = calloc(new_size, sizeof(uint32_t));
+
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        size_t mask = new_size - 1;
+        size_t s = hash_bytes(entries[i].name, strlen(entries[i].name)) & mask;
+
+        while (new_table[s])
+        {
+            s = (s + 1) & mask;
+        }
+
+        new_table[s] = i + 1;
+    }
+
+    free(name_table);
+    name_table = new_table;
+    name_table_size = new_size;
+}
+
+uint32_t profile_name_index(const char* name)
+{
+    if (entry_count * 2 >= name_table_size)
+    {
+        name_table_grow();
+    }
+
+    size_t mask = name_table_size - 1;
+    size_t i = hash_bytes(name, strlen(name)) & mask;
+
+    for (; name_table[i]; i = (i + 1) & mask)
+    {
+        if (strcmp(entries[name_table[i] - 1].name, name) == 0)
+        {
+            return name_table[i] - 1;
+        }
+    }
+
+    if (entry_count == entry_size)
+    {
+        entry_size = entry_size ? entry_size * 2 : 256;
+        entries = realloc(entries, entry_size * sizeof(ProfileEntry));
+    }
+
+    ProfileEntry* e = &entries[entry_count];
+    e->name = strdup(name);
+    e->self = 0;
+    e->total = 0;
+    e->last_sample = 0;
+    name_table[i] = entry_count + 1;
+    return entry_count++;
+}
+
+void stack_table_grow()
+{
+    size_t new_size = stack_table_size ? stack_table_size * 2 : 1024;
+    ProfileStack* new_table = calloc(new_size, sizeof(ProfileStack));
+
+    for (size_t i = 0; i < stack_table_size; i++)
+    {
+        if (stacks[i].frames)
+        {
+            size_t mask = new_size - 1;
+            size_t s = stacks[i].hash & mask;
+
+            while (new_table[s].frames)
+            {
+                s = (s + 1) & mask;
+            }
+
+            new_table[s] = stacks[i];
+        }
+    }
+
+    free(stacks);
+    stacks = new_table;
+    stack_table_size = new_size;
+}
+
+void record_stack(uint32_t* frames, uint32_t depth)
+{
+    if (stack_count * 2 >= stack_table_size)
+    {
+        stack_table_grow();
+    }
+
+    uint64_t hash = hash_bytes(frames, depth * sizeof(uint32_t));
+    size_t mask = stack_table_size - 1;
+    size_t i = hash & mask;
+
+    for (; stacks[i].frames; i = (i + 1) & mask)
+    {
+        ProfileStack* s = &stacks[i];
+
+        if (s->hash == hash && s->depth == depth
+            && memcmp(s->frames, frames, depth * sizeof(uint32_t)) == 0)
+        {
+            s->count++;
+            return;
+        }
+    }
+
+    ProfileStack* s = &stacks[i];
+    s->frames = malloc(depth * sizeof(uint32_t));
+    memcpy(s->frames, frames, depth * sizeof(uint32_t));
+    s->depth = depth;
+    s->hash = hash;
+    s->count = 1;
+    stack_count++;
+}
+
+// Adds one sample from the buffer into the results, returns the number of
+// words it took
+size_t record_sample(uint64_t* sample)
+{
+    uint32_t depth = sample[0];
+    uint32_t jit_frames = sample[1];
+    uint32_t frames[PROFILE_MAX_DEPTH + PROFILE_MAX_JIT_FRAMES + 1];
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < depth; i++)
+    {
+        frames[n++] = sample[2 + i];
+    }
+
+    // The JIT frames are stored innermost first. The outermost one is the
+    // function that was called through the evaluator which is already the
+    // innermost function of the call stack.
+    for (uint32_t i = jit_frames; i > 0; i--)
+    {
+        const char* name = jit_function_name((void*)sample[2 + depth + i - 1]);
+        uint32_t index = profile_name_index(name ? name : "<jit>");
+
+        if (n == 0 || frames[n - 1] != index || i != jit_frames)
+        {
+            frames[n++] = index;
+        }
+    }
+
+    if (n == 0)
+    {
+        frames[n++] = 0;
+    }
+
+    sample_count++;
+    entries[frames[n - 1]].self++;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        ProfileEntry* e = &entries[frames[i]];
+
+        if (e->last_sample != sample_count)
+        {
+            e->last_sample = sample_count;
+            e->total++;
+        }
+    }
+
+    record_stack(frames, n);
+    return 2 + depth + jit_frames;
+}
+
+// Moves the samples from the buffer into the results. The signal is blocked
+// while this is done so that the buffer is not modified.
+void process_samples()
+{
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    for (size_t i = 0; i < (size_t)sample_used;)
+    {
+        i += record_sample(sample_buffer + i);
+    }
+
+    sample_used = 0;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void profile_signal(int sig, siginfo_t* info, void* context)
+{
+    // The signal can be delivered to any thread of the process, the other
+    // interpreters are not profiling.
+    if (!profiling || !sample_buffer)
+    {
+        return;
+    }
+
+    ucontext_t* uc = context;
+    uint32_t depth = profile_depth < PROFILE_MAX_DEPTH ? profile_depth : PROFILE_MAX_DEPTH;
+
+    if (sample_used + 2 + depth + PROFILE_MAX_JIT_FRAMES > SAMPLE_BUFFER_SIZE)
+    {
+        samples_dropped++;
+        return;
+    }
+
+    uint64_t* sample = sample_buffer + sample_used;
+    sample[0] = depth;
+
+    for (uint32_t i = 0; i < depth; i++)
+    {
+        sample[2 + i] = profile_stack[i];
+    }
+
+    // The compiled code always sets up a frame pointer, the return address is
+    // stored right above it. The walk stops at the first frame that isn't a
+    // frame of a compiled function.
+    uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+    uintptr_t* fp = (uintptr_t*)uc->uc_mcontext.gregs[REG_RBP];
+    uint32_t jit_frames = 0;
+
+    while (jit_frames < PROFILE_MAX_JIT_FRAMES && jit_code_contains((void*)pc))
+    {
+        sample[2 + depth + jit_frames++] = pc;
+        pc = fp[1];
+        fp = (uintptr_t*)fp[0];
+    }
+
+    sample[1] = jit_frames;
+    sample_used += 2 + depth + jit_frames;
+}
+
+uint32_t function_index(Object* fn)
+{
+    UserFunction* ufn = &get_func(fn)->ufn;
+
+    if (ufn->profile_id == 0)
+    {
+        const char* name = get_symbol_by_pointed_value(fn);
+        ufn->profile_id = profile_name_index(strcmp(name, "{unbound}") == 0 ? "<lambda>" : name) + 1;
+    }
+
+    return ufn->profile_id - 1;
+}
+
+void profile_enter(Object* fn)
+{
+    if (sample_used)
+    {
+        process_samples();
+    }
+
+    int depth = profile_depth;
+
+    if (depth < PROFILE_MAX_DEPTH)
+    {
+        profile_stack[depth] = function_index(fn);
+    }
+
+    // The signal handler must see the function before the depth is updated
+    atomic_signal_fence(memory_order_seq_cst);
+    profile_depth = depth + 1;
+}
+
+void profile_leave()
+{
+    if (sample_used)
+    {
+        process_samples();
+    }
+
+    // Profiling may have been started while calls were already in progress
+    if (profile_depth > 0)
+    {
+        profile_depth--;
+    }
+}
+
+void profile_replace(Object* fn)
+{
+    int depth = profile_depth;
+
+    if (depth > 0 && depth <= PROFILE_MAX_DEPTH)
+    {
+        uint32_t index = function_index(fn);
+        atomic_signal_fence(memory_order_seq_cst);
+        profile_stack[depth - 1] = index;
+    }
+}
+
+// The names are kept as the functions remember their indexes, only the counts
+// are reset
+void profile_reset()
+{
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        entries[i].self = 0;
+        entries[i].total = 0;
+        entries[i].last_sample = 0;
+    }
+
+    for (size_t i = 0; i < stack_table_size; i++)
+    {
+        free(stacks[i].frames);
+    }
+
+    free(stacks);
+    stacks = NULL;
+    stack_count = stack_table_size = 0;
+    sample_count = 0;
+    samples_dropped = 0;
+}
+
+void profile_start()
+{
+    if (profiling)
+    {
+        return;
+    }
+
+    profile_reset();
+
+    if (!sample_buffer)
+    {
+        sample_buffer = malloc(SAMPLE_BUFFER_SIZE * sizeof(uint64_t));
+        profile_name_index("<toplevel>");
+    }
+
+    profile_depth = 0;
+    sample_used = 0;
+    profile_start_time = cpu_time_ms();
+    profiling = true;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = profile_signal;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = PROFILE_INTERVAL_USEC;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+int compare_self(const void* a, const void* b)
+{
+    const ProfileEntry* lhs = *(const ProfileEntry**)a;
+    const ProfileEntry* rhs = *(const ProfileEntry**)b;
+
+    if (lhs->self != rhs->self)
+    {
+        return lhs->self < rhs->self ? 1 : -1;
+    }
+
+    return lhs->total < rhs->total ? 1 : lhs->total > rhs->total ? -1 : 0;
+}
+
+void print_profile(double elapsed)
+{
+    ProfileEntry** sorted = malloc((entry_count + 1) * sizeof(ProfileEntry*));
+    size_t count = 0;
+
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        if (entries[i].total > 0)
+        {
+            sorted[count++] = &entries[i];
+        }
+    }
+
+    qsort(sorted, count, sizeof(ProfileEntry*), compare_self);
+    double ms = sample_count ? elapsed / sample_count : 0;
+    double pct = sample_count ? 100.0 / sample_count : 0;
+
+    fprintf(stderr, "Samples: %lu (%.0f ms)", sample_count, elapsed);
+
+    if (samples_dropped)
+    {
+        fprintf(stderr, ", dropped: %d", samples_dropped);
+    }
+
+    fprintf(stderr, "\n%10s %7s %10s %7s  %s\n", "self ms", "self%", "total ms", "total%", "function");
+
+    for (size_t i = 0; i < count; i++)
+    {
+        ProfileEntry* e = sorted[i];
+        fprintf(stderr, "%10.0f %6.2f%% %10.0f %6.2f%%  %s\n", e->self * ms, e->self * pct,
+                e->total * ms, e->total * pct, e->name);
+    }
+
+    free(sorted);
+}
+
+bool write_stacks(const char* path)
+{
+    FILE* f = fopen(path, "w");
+
+    if (!f)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < stack_table_size; i++)
+    {
+        ProfileStack* s = &stacks[i];
+
+        if (s->frames)
+        {
+            for (uint32_t d = 0; d < s->depth; d++)
+            {
+                fprintf(f, "%s%s", d > 0 ? ";" : "", entries[s->frames[d]].name);
+            }
+
+            fprintf(f, " %lu\n", s->count);
+        }
+    }
+
+    return fclose(f) == 0;
+}
+
+void profile_free()
+{
+    profile_stop(NULL);
+    profile_reset();
+
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        free(entries[i].name);
+    }
+
+    free(entries);
+    free(name_table);
+    free(sample_buffer);
+    entries = NULL;
+    name_table = NULL;
+    sample_buffer = NULL;
+    entry_count = entry_size = name_table_size = 0;
+}
+
+bool profile_stop(const char* path)
+{
+    if (!profiling)
+    {
+        return true;
+    }
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+
+    process_samples();
+    profiling = false;
+    profile_depth = 0;
+    print_profile(cpu_time_ms() - profile_start_time);
+    return path == NULL || write_stacks(path);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "lisp.h"
+
+//
+// The sampling profiler
+//
+
+// Whether samples are being taken. The calls are only tracked while this is
+// set which keeps the cost of the profiler close to zero when it's not used.
+extern _Thread_local bool profiling;
+
+// Called around every call of a Lisp function. The function is pushed onto the
+// stack of active calls that the samples are taken from.
+void profile_enter(Object* fn);
+void profile_leave();
+
+// Replaces the innermost active call, used for tail calls
+void profile_replace(Object* fn);
+
+#define PROFILE_ENTER(fn) if (profiling) {profile_enter(fn);}
+#define PROFILE_LEAVE() if (profiling) {profile_leave();}
+#define PROFILE_REPLACE(fn) if (profiling) {profile_replace(fn);}
+
+// Starts taking samples, the results of the previous run are discarded
+void profile_start();
+
+// Stops taking samples. The time spent in each function is printed to stderr
+// and if path is not NULL, the sampled call stacks are written into it in the
+// collapsed format that flame graph tools take as input. Returns false if the
+// file could not be written.
+bool profile_stop(const char* path);
+
+// Frees the memory used by the profiler
+void profile_free();
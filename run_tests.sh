@@ -3,5 +3,116 @@
 for testcase in tests/*.lisp
 do
     echo "Test: $testcase"
-	./lisp -e < "$testcase" || break
+	./lisp -e < "$testcase" || exit 1
 done
+
+echo "Test: heap image"
+img=$(mktemp)
+echo "(load ./std.lisp) (save-image $img)" | ./lisp -q > /dev/null && \
+    tail -n +2 tests/test-std.lisp | ./lisp -e -i "$img" > /dev/null || exit 1
+
+# A truncated image is reported as an error
+head -c 100 "$img" > "$img.part"
+echo "(exit)" | ./lisp -q -i "$img.part" | grep -q "^Error: The image is truncated" || exit 1
+rm -f "$img" "$img.part"
+
+# Profiling must not change the output of the program
+echo "Test: profiler"
+prof=$(mktemp)
+./lisp -q -r 1 < tests/test-std.lisp > "$prof.out" 2>&1
+./lisp -q -r 1 -P "$prof" < tests/test-std.lisp 2> /dev/null | cmp -s - "$prof.out" && test -f "$prof" || exit 1
+rm -f "$prof" "$prof.out"
+
+# The compiled functions are listed in the perf map
+echo "Test: perf map"
+./lisp -q -J map < tests/test-std.lisp > /dev/null &
+pid=$!
+wait $pid && grep -q " mul$" "/tmp/perf-$pid.map" || exit 1
+rm -f "/tmp/perf-$pid.map"
+
+# Each thread runs an interpreter of its own
+echo "Test: threads"
+cat tests/test-gc.lisp tests/test-tiering.lisp | ./lisp -q -t 4 > /dev/null || exit 1
+
+# A future can be touched more than once and nothing else is a future
+echo "Test: futures"
+out=$(printf "(define f (future + 1 2))\n(print (touch f))\n(print (touch f))\n(print (touch 0))\n(print (touch (make-vector 2 nil)))\n(print (vector-length f))\n" \
+    | ./lisp -q | tr -d ' \n')
+test "$out" = "33Error:NotafuturenilError:NotafuturenilError:Notavectornil" || exit 1
+
+# The result doesn't depend on the thread that evaluates the function: only the
+# workers evaluate it and functions that use global variables are rejected
+echo "Test: pmap with global variables"
+prog="(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))\n(defvar g 10)\n(defun useg (x) (+ (fib 20) g))\n"
+prog="$prog(print (pmap useg (list 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16)))\n(freeze fib useg)\n(print (pmap useg (list 1 2)))\n"
+for i in 1 2 3 4 5
+do
+    out=$(printf "$prog" | ./lisp -q -w 8 | tr -d ' \n')
+    test "$out" = "Error:Function'useg'isnotfrozenorcompilednil(67756775)" || exit 1
+done
+
+# Compiled code that runs out of the JIT stack reports an error and the program
+# goes on
+echo "Test: JIT stack overflow"
+out=$(printf "(defun deep (n) (if (eq n 0) 0 (+ 1 (deep (- n 1)))))\n(compile deep)\n(print (deep 100000))\n(print (deep 10))\n" \
+    | ./lisp -q -j 8192 | tr -d ' \n')
+test "$out" = "Error:JITstackoverflownil10" || exit 1
+
+# With the default sizes the native stack of the compiled calls runs out first,
+# which is reported the same way
+out=$(printf "(defun deep (n) (if (< n 1) 0 (+ 1 (deep (- n 1)))))\n(compile deep)\n(print (deep 300000))\n(print (deep 10))\n" \
+    | ./lisp -q | tr -d ' \n')
+test "$out" = "Error:JITstackoverflownil10" || exit 1
+
+# The collections that happen while a failed call is run again in the VM must
+# not see the values the compiled code left on the JIT stack
+echo "Test: JIT bailout under GC pressure"
+(echo "(defun pick (a b c d e f g h i j k l) (car a))"
+ echo "(defun outer (x) (+ 1 (pick x 1 2 3 4 5 6 7 8 9 10 11)))"
+ echo "(defun warm (n) (if (eq n 0) nil (progn (outer '(1)) (warm (- n 1)))))"
+ echo "(warm 2000)"
+ echo "(defun churn (n) (progn (make-vector n nil) (outer n)))"
+ for i in $(seq 1000); do echo "(churn $((i % 20 + 1)))"; done) | ./lisp -q > /dev/null || exit 1
+
+# A definition inside a function that isn't of a local variable defines a
+# global and a macro that is defined after the function that calls it gets the
+# arguments as symbols
+echo "Test: local definitions"
+out=$(printf "(defun f (x) (progn (define y 5) (defun h (z) (* z y)) (+ x y)))\n(print (f 1))\n(print y)\n(print (h 2))\n(defun g (x) (m x))\n(defmacro m (a) (list 'quote a))\n(print (g 1))\n" \
+    | ./lisp -q | tr -d ' \n')
+test "$out" = "6510x" || exit 1
+
+# The definitions from stdin and from earlier connections are kept
+echo "Test: server"
+sock=$(mktemp -u)
+send() {
+    perl -MIO::Socket::UNIX -e '
+        my $s = IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => $ARGV[0]) or die;
+        print $s $ARGV[1]; $s->shutdown(1); print while <$s>;' "$sock" "$1"
+}
+echo "(defun sq (x) (* x x))" | ./lisp -q -S "$sock" &
+pid=$!
+for i in $(seq 50); do test -S "$sock" && break; sleep 0.1; done
+send "(define y 7)" > /dev/null
+test "$(send "(print (sq 5)) (print (sq y)) (exit)" | tr -d ' \n')" = "2549" || exit 1
+wait $pid || exit 1
+
+# Without a C compiler, save-compiled reports an error and the program goes on
+echo "Test: compiled code without cc"
+lib=$(mktemp -u --suffix=.so)
+out=$(printf "(defun sq (x) (* x x))\n(compile sq)\n(print (save-compiled $lib sq))\n(print (sq 3))\n" \
+    | PATH=/nonexistent ./lisp -q 2> /dev/null | tr -d ' \n')
+test "$out" = "Error:Cannotbuildthesharedobject,theCcompiler'cc'wasnotfoundnil9" && test ! -e "$lib" || exit 1
+
+# The output must be the same as when std.lisp is loaded and compiled, the
+# first line is the result of load-compiled
+echo "Test: compiled code"
+lib=$(mktemp --suffix=.so)
+functions=$(sed -n '/^(compile/,$p' std.lisp | tr -d '()\n' | sed 's/^compile//')
+echo "(load ./std.lisp) (save-compiled $lib $functions)" | ./lisp -q > /dev/null
+(sed '/^(compile/,$d' std.lisp; echo "(print (load-compiled $lib))"; tail -n +2 tests/test-std.lisp) \
+    | ./lisp -q -r 1 > "$lib.out" 2>&1
+./lisp -q -r 1 < tests/test-std.lisp 2>&1 | (echo "t "; cat) | cmp -s - "$lib.out"
+status=$?
+rm -f "$lib" "$lib.out"
+exit $status
@@ -32,46 +32,17 @@
 ;; Returns the larger of the two values
 (defun max (a b) (if (< a b) b a))
 
-;; Helper for the mul function, uses an accumulator argument
-(defun mul_impl (a b acc)
-  (if (eq b 0)
-      acc
-      (mul_impl a (+ b -1) (+ acc a))))
-
 ;; Multiplication of two numbers
-(defun mul (a b)
-  (if (< a b)
-      (mul_impl b a 0)
-      (mul_impl a b 0)))
-
-;; Helper for the largest_doubling function
-(defun largest-doubling_impl (a b acc)
-   (if (< a (+ b b))
-      acc
-      (largest-doubling_impl a (+ b b) (+ acc acc))))
-
-;; Returns a cons cell with the largest multiple of b that is less than or equal
-;; to a. The value itself is in car and the multiplier is in cdr.
-(defun largest-doubling (a b)
-  (if (< a b)
-      0
-      (largest-doubling_impl a b 1)))
-
-;; Helper for the div function, uses an accumulator argument
-(defun div_impl (a b acc times)
-  (if (< a b)
-      acc
-      (div_impl (- a (mul b (max times 1))) b (+ acc times) (largest-doubling (- a (mul b (max times 1))) b))))
+(defun mul (a b) (* a b))
 
-;; Division of two numbers, very naive implementation
-(defun div (a b)
-  (div_impl a b 0 (largest-doubling a b)))
+;; Division of two numbers, truncates towards zero
+(defun div (a b) (/ a b))
 
 ;; Helper for the pow function
 (defun pow_impl (a b acc)
   (if (eq b 0)
       acc
-      (pow_impl a (- b 1) (mul acc a))))
+      (pow_impl a (- b 1) (* acc a))))
 
 ;; Raises the first number to the power of the second
 (defun pow (a b)
@@ -81,18 +52,6 @@
           a
           (pow_impl a (- b 1) a))))
 
-;; Helper for the mod function, finds the largest doubling of b that's less than a
-(defun mod_impl (a b)
-  (if (< a (+ b b))
-      b
-      (mod_impl a (+ b b))))
-
-;; Modulo, remainder of a divided by b
-(defun mod (a b)
-  (if (< a b)
-      a
-      (mod (- a (mod_impl a b)) b)))
-
 ;;
 ;; List functions
 ;;
@@ -143,10 +102,9 @@
 
 ;; Writes a list of numbers in base ten (i.e. pretty-printed) to stdout
 (defun write-number (n)
-  (if (< n 10) (write-char (+ n 48)) (progn (write-number (div n 10)) (write-char (+ (mod n 10) 48)))))
+  (if (< n 10) (write-char (+ n 48)) (progn (write-number (/ n 10)) (write-char (+ (mod n 10) 48)))))
 
 ;; Compile all of the declared functions. This prevents the implementations and
 ;; builtins used by them from being overridden by the calling code.
-(compile not and or xor min max mul_impl mul largest-doubling_impl largest-doubling
-         div_impl div pow_impl pow mod_impl mod length append mapcar nth
+(compile not and or xor min max mul div pow_impl pow length append mapcar nth
          fill_impl fill generate_impl generate loop write-list write-number)
@@ -0,0 +1,25 @@
+(* 6 7)
+(* 2 3 4)
+(/ 100 7)
+(/ -100 7)
+(/ 1000 10 10)
+(mod 100 7)
+(mod -100 7)
+(mod 100 -7)
+(logand 12 10)
+(logior 12 10)
+(logxor 12 10)
+(ash 1 10)
+(ash -1024 -3)
+(ash 5 -100)
+(/ 1 0)
+(mod 1 0)
+(defun ops (a b) (cons (* a b) (cons (/ a b) (cons (mod a b) (cons (logand a b) (cons (logior a b) (cons (logxor a b) (cons (ash a (- 0 b)) nil))))))))
+(defun sq (x) (* x x))
+(defun digits (n acc) (if (eq n 0) acc (digits (/ n 10) (cons (mod n 10) acc))))
+(compile ops sq digits)
+(ops 100 3)
+(ops -100 -3)
+(ops 7 0)
+(sq 12345)
+(digits 9876543210 nil)
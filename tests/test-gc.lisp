@@ -0,0 +1,10 @@
+(defun build (n acc) (if (< n 1) acc (build (- n 1) (cons n acc))))
+(defun lookup (key alist) (if (eq alist nil) nil (if (eq (car (car alist)) key) (cdr (car alist)) (lookup key (cdr alist)))))
+(defvar before (gc-stats))
+(build 100000 nil)
+(defvar after (gc-stats))
+(< (lookup 'collections before) (lookup 'collections after))
+(< (lookup 'allocated before) (lookup 'allocated after))
+(< 0 (lookup 'heap-size after))
+;; Errors
+(gc-stats 1)
@@ -1,2 +1,8 @@
 (define foobar (lambda (x) (lambda (y) (x y))))
 ((foobar (lambda (z) (+ z 1))) 5)
+;; A definition inside a function rebinds a local variable or defines a global
+(defun rebind (x) (progn (define x (+ x 1)) x))
+(rebind 1)
+(defun make-global (x) (progn (define not-local x) (+ x not-local)))
+(make-global 1)
+not-local
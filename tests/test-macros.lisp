@@ -2,3 +2,29 @@
 (define i 0)
 (perhaps (eq i 0) 5)
 (macroexpand perhaps ((eq i 0) 5))
+;; Expanded when the function is defined
+(defmacro inc (x) (list '+ x 1))
+(defmacro const-form () '(+ n 1))
+(defun count (n acc) (if (< n 1) acc (count (- n 1) (perhaps t (inc acc)))))
+(count 1000 0)
+(defun f (n) (const-form))
+(defun g (n) (+ 100 (const-form)))
+(f 1)
+(g 5)
+(macroexpand const-form ())
+(defun shadow (inc) (inc 5))
+(shadow (lambda (x) (* x 10)))
+(defun lam (x) ((lambda (y) (inc y)) x))
+(lam 41)
+(defun late (x) (later x))
+(defmacro later (x) (list '* x 2))
+(late 21)
+(compile count)
+(count 1000 0)
+;; A macro defined after the function gets the arguments as symbols
+(defun quoted (x) (quote-args x (+ x 1)))
+(defmacro quote-args (a b) (list 'quote (list a b)))
+(quoted 5)
+;; Errors
+(defun bad (x) (inc x x))
+(bad 1)
@@ -0,0 +1,46 @@
+(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(defun build (n acc) (if (< n 1) acc (build (- n 1) (cons n acc))))
+(defun sum (l acc) (if l (sum (cdr l) (+ acc (car l))) acc))
+(defun work (n) (sum (build n nil) 0))
+(freeze fib build sum work)
+(pmap fib (list 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20))
+(pmap work (list 1000 20000 300 40000 5))
+(pmap car (list (list 1 2) (list 'a 'b) (list (list 'x) 3)))
+(defun dup (x) (cons x x))
+(freeze dup)
+(pmap dup (list 1 2 3))
+(pmap fib nil)
+(defun nested (n) (pmap fib (list n n)))
+(freeze nested)
+(pmap nested (list 5 10 15))
+(compile fib)
+(pmap fib (list 10 20 25))
+;; Futures
+(defvar a (future fib 20))
+(defvar b (future build 5 nil))
+(defvar c (future + 1 2 3))
+(build 100000 nil)
+(touch c)
+(touch b)
+(touch a)
+;; A future that was already touched returns the same result
+(touch a)
+;; Errors
+(pmap 1 (list 1))
+(pmap fib 1)
+(pmap fib)
+(future 1)
+(future)
+;; Functions that could see the global variables of this interpreter
+(defvar g 10)
+(defun useg (x) (+ x g))
+(defun uselambda (x) ((lambda (y) (+ y g)) x))
+(freeze uselambda)
+(pmap useg (list 1 2))
+(pmap (lambda (x) (cons x x)) (list 1 2 3))
+(pmap uselambda (list 1 2))
+(future useg 1)
+(touch 'a)
+(touch 0)
+(touch (make-vector 2 nil))
+(vector-ref a 0)
@@ -0,0 +1,66 @@
+;; Functions that are called often enough are compiled automatically
+(defun inc (x) (+ x 1))
+(defun twice (x) (inc (inc x)))
+(defun count-up (n acc) (if (eq n 0) acc (count-up (- n 1) (twice acc))))
+(count-up 20000 0)
+;; Redefining a function that the compiled code calls
+(defun inc (x) (+ x 2))
+(count-up 20000 0)
+;; Type errors are reported like in uncompiled code
+(twice 'a)
+(defun second (l) (car (cdr l)))
+(defun sum-seconds (n acc) (if (eq n 0) acc (sum-seconds (- n 1) (+ acc (second '(1 2))))))
+(sum-seconds 20000 0)
+(second '(1))
+(second 5)
+;; Small compiled functions are inlined into their callers
+(defun smaller (a b) (if (< a b) a b))
+(defun clamp (x) (smaller (+ x 1) 10))
+(defun always-one (x) (smaller 1 2))
+(compile smaller clamp always-one)
+(clamp 3)
+(clamp 30)
+(always-one 5)
+;; The parts that can't be compiled are evaluated by the interpreter
+(defun pair (x) (list x x))
+(defun log-sum (n acc) (if (eq n 0) acc (progn (print (pair n)) (log-sum (- n 1) (+ acc (* n n))))))
+(defun tagged (x) (cons x '(a b)))
+(defun call-with (f x) (+ 1 (f x)))
+(compile log-sum tagged call-with)
+(log-sum 3 0)
+(tagged 1)
+(call-with (lambda (y) (* y 10)) 4)
+;; Global variables that hold lists or symbols are resolved into quoted values
+(defvar numbers '(1 2 3))
+(defvar name 'numbers)
+(defun first-of (l) (car l))
+(defun first-number () (first-of numbers))
+(defun number-name () name)
+(freeze first-number)
+(first-number)
+(compile first-of first-number number-name)
+(first-number)
+(number-name)
+;; Functions compiled together call each other and the calls in tail position
+;; don't use up any stack
+(defun is-even (n) (if (eq n 0) t (is-odd (- n 1))))
+(defun is-odd (n) (if (eq n 0) nil (is-even (- n 1))))
+(compile is-even is-odd)
+(is-even 1000001)
+(is-odd 1000001)
+(defun count-down (n) (if (eq n 0) 'done (count-down (- n 1))))
+(defun count-from (a b) (count-down (+ a b)))
+(compile count-down count-from)
+(count-from 500000 500000)
+;; A tail call to a function that takes more arguments is made by the caller
+(defun step-three (n a b) (if (eq n 0) (+ a b) (step-one (- n 1))))
+(defun step-one (n) (step-three n 1 2))
+(defun step-from (n) (+ 1 (step-one n)))
+(compile step-three step-one step-from)
+(step-one 1000000)
+(step-from 1000000)
+;; A call that isn't in tail position returns to the caller
+(defun nested (n) (if (eq n 0) 0 (+ 1 (if (< n 100) (nested (- n 1)) 0))))
+(compile nested)
+(nested 10)
+(exit)
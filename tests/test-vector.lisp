@@ -0,0 +1,38 @@
+(defvar v (make-vector 3 0))
+(vector-length v)
+(vector-set v 1 'a)
+(vector-ref v 1)
+(vector-ref v 0)
+(vector-length (make-vector 0))
+(vector-ref (make-vector 2) 1)
+;; Errors
+(vector-ref v 3)
+(vector-ref v -1)
+(vector-ref v 'a)
+(vector-ref '(1 2) 0)
+(vector-set v 5 1)
+(vector-length 5)
+(make-vector -1)
+(make-vector 100000000000)
+(make-vector 600000000)
+(vector-length (make-vector 100000))
+;; Vectors are interpreted by the VM and compiled to machine code
+(defun fill (v i n) (if (eq i n) v (progn (vector-set v i (* i i)) (fill v (+ i 1) n))))
+(defun sum (v i acc) (if (eq i (vector-length v)) acc (sum v (+ i 1) (+ acc (vector-ref v i)))))
+(defun sum-twice (v) (+ (sum v 0 0) (sum v 0 0)))
+(defvar squares (fill (make-vector 100000 0) 0 100000))
+(sum squares 0 0)
+(defun nth-square (v i) (vector-ref v (+ (* i 2) (- (* i 3) (+ i (* i 3))) (* i 2))))
+(defun last-of (v) (vector-ref v (- (vector-length v) 1)))
+(compile nth-square last-of sum-twice)
+(nth-square squares 7)
+(last-of squares)
+(sum-twice (fill (make-vector 10 0) 0 10))
+;; The compiled code reports the errors like the interpreter
+(defun get (v i) (vector-ref v i))
+(defun sum-gets (n acc) (if (eq n 0) acc (sum-gets (- n 1) (+ acc (get squares n)))))
+(sum-gets 20000 0)
+(get squares 100000)
+(get squares -5)
+(get 'a 0)
+(get squares nil)
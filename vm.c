@@ -0,0 +1,1038 @@
+#include "vm.h"
+#include "compiler.h"
+#include "profiler.h"
+
+// The bytecode compiler and interpreter
+//
+// All functions are compiled into bytecode the first time they are called. The
+// bytecode is stored in a vector on the heap: the first value is the epoch that
+// the code was compiled in and after it come the instructions. The opcodes and
+// the integer operands are stored as numbers and the constants are stored as
+// objects. This way the GC can treat the bytecode as any other vector.
+//
+// The builtins that are commonly used in function bodies are compiled into
+// instructions. All other builtins, the macros and the calls to anything but
+// functions are done by calling the builtin or eval_form directly with the
+// original form as the argument. This keeps the semantics identical to the
+// tree-walking evaluator. The bytecode uses the same scope vectors for local
+// variables as the evaluator which allows the two to be freely mixed.
+//
+// The builtins are resolved when the function is compiled. If a symbol that
+// pointed to a builtin is rebound, the epoch is incremented which causes all
+// functions to be recompiled when they are called the next time.
+//
+// The interpreter also counts the calls to functions and the tail calls that
+// functions make to themselves, i.e. loop iterations. Once either crosses the
+// threshold set in compiler.h, the function is compiled into machine code.
+
+enum Opcode
+{
+    OP_CONST,      // <value>: Pushes the value
+    OP_LOCAL0,     // <slot>: Pushes a local variable of the current scope
+    OP_LOCAL,      // <depth> <slot>: Pushes a local variable of a parent scope
+    OP_GLOBAL,     // <symbol>: Pushes the global value of the symbol
+    OP_POP,        // Discards the top value
+    OP_JUMP,       // <target>: Jumps to the target
+    OP_JUMP_NIL,   // <target>: Pops the top value, jumps if it is nil
+    OP_CHECKNUM,   // <end>: Replaces the top with nil and jumps to end if it's not a number
+    OP_ADD,        // <end>: Same as OP_CHECKNUM and then adds the top two values
+    OP_SUB,        // <end>: Same as OP_CHECKNUM and then subtracts the top two values
+    OP_NEG,        // Negates the top value
+    OP_MUL,        // <end>: Same as OP_ADD but for the operations in enum Arith,
+    OP_DIV,        //        in the same order. Also jumps to end if the
+    OP_MOD,        //        divisor is zero.
+    OP_LOGAND,
+    OP_LOGIOR,
+    OP_LOGXOR,
+    OP_ASH,
+    OP_LESS,       // Compares the top two values
+    OP_EQ,         // Compares the top two values
+    OP_CAR,        // Replaces the top value with its car
+    OP_CDR,        // Replaces the top value with its cdr
+    OP_VECTOR_REF, // Replaces the vector and the index with the element
+    OP_VECTOR_SET, // Stores the top value into the vector at the index below it
+    OP_VECTOR_LENGTH, // Replaces the top value with its length
+    OP_CONS,       // Replaces the top two values with a cons cell
+    OP_LIST,       // <count>: Replaces the top values with a list
+    OP_LAMBDA,     // <params> <body> <end>: Pushes a closure whose code starts after this
+    OP_BUILTIN,    // <builtin> <form>: Calls the builtin with the unevaluated arguments
+    OP_CALL,       // <count> <form> <end>: Calls eval_form and jumps to end if the
+                   // top value is not a function that takes count arguments
+    OP_INVOKE,     // <count>: Calls the function below the arguments
+    OP_TAILCALL,   // <count>: Same as OP_INVOKE but replaces the current call
+    OP_RETURN,     // Returns the top value
+};
+
+// The declarations for builtins that are compiled into instructions
+Object* builtin_quote(Object* scope, Object* args);
+Object* builtin_if(Object* scope, Object* args);
+Object* builtin_progn(Object* scope, Object* args);
+Object* builtin_less(Object* scope, Object* args);
+Object* builtin_add(Object* scope, Object* args);
+Object* builtin_sub(Object* scope, Object* args);
+Object* builtin_mul(Object* scope, Object* args);
+Object* builtin_div(Object* scope, Object* args);
+Object* builtin_mod(Object* scope, Object* args);
+Object* builtin_logand(Object* scope, Object* args);
+Object* builtin_logior(Object* scope, Object* args);
+Object* builtin_logxor(Object* scope, Object* args);
+Object* builtin_ash(Object* scope, Object* args);
+Object* builtin_eq(Object* scope, Object* args);
+Object* builtin_car(Object* scope, Object* args);
+Object* builtin_cdr(Object* scope, Object* args);
+Object* builtin_vector_ref(Object* scope, Object* args);
+Object* builtin_vector_set(Object* scope, Object* args);
+Object* builtin_vector_length(Object* scope, Object* args);
+Object* builtin_cons(Object* scope, Object* args);
+Object* builtin_list(Object* scope, Object* args);
+Object* builtin_lambda(Object* scope, Object* args);
+
+// The maximum number of values on the VM stack
+#define VM_STACK_SIZE (16 * 1024 * 1024)
+
+_Thread_local Object** vm_stack = NULL;
+_Thread_local Object** vm_sp = NULL;
+_Thread_local int64_t vm_epoch = 0;
+
+void vm_invalidate()
+{
+    vm_epoch++;
+}
+
+//
+// Compilation
+//
+
+// The compilation is done in two passes: the first one only calculates the size
+// of the bytecode and the second one stores the instructions into the vector.
+// Neither of them allocates memory which means that the objects stored in the
+// bytecode cannot be moved during the compilation.
+struct CodeBuffer
+{
+    Object* code; // Nil during the first pass
+    size_t pos;
+};
+
+typedef struct CodeBuffer CodeBuffer;
+
+void emit(CodeBuffer* buf, Object* value)
+{
+    if (buf->code != Nil)
+    {
+        vector_items(buf->code)[buf->pos] = value;
+        write_barrier(buf->code, value);
+    }
+
+    buf->pos++;
+}
+
+void emit_int(CodeBuffer* buf, int64_t value)
+{
+    emit(buf, make_number(value));
+}
+
+// Emits a placeholder for a jump target and returns its position
+size_t emit_label(CodeBuffer* buf)
+{
+    size_t pos = buf->pos;
+    emit(buf, Nil);
+    return pos;
+}
+
+// Makes the label point to the current position
+void patch_label(CodeBuffer* buf, size_t label)
+{
+    if (buf->code != Nil)
+    {
+        vector_items(buf->code)[label] = make_number(buf->pos);
+        write_barrier(buf->code, vector_items(buf->code)[label]);
+    }
+}
+
+// Returns the number of values in the list or -1 if it's not a proper list
+int list_length(Object* list)
+{
+    int i = 0;
+
+    for (; get_type(list) == TYPE_CELL; list = cdr(list))
+    {
+        i++;
+    }
+
+    return list == Nil ? i : -1;
+}
+
+void vm_compile_expr(CodeBuffer* buf, LexicalScope* lex, Object* env, Object* expr, bool tail);
+
+void vm_compile_local(CodeBuffer* buf, Object* ref)
+{
+    if (local_ref_depth(ref) == 0)
+    {
+        emit_int(buf, OP_LOCAL0);
+        emit_int(buf, local_ref_slot(ref));
+    }
+    else
+    {
+        emit_int(buf, OP_LOCAL);
+        emit_int(buf, local_ref_depth(ref));
+        emit_int(buf, local_ref_slot(ref));
+    }
+}
+
+// Compiles each of the arguments so that their values end up on the stack
+void vm_compile_args(CodeBuffer* buf, LexicalScope* lex, Object* env, Object* args)
+{
+    for (; args != Nil; args = cdr(args))
+    {
+        vm_compile_expr(buf, lex, env, car(args), false);
+    }
+}
+
+// Emits a label that's added to a chain of labels that all jump to the same
+// place. The chain is stored in the labels themselves until it's patched.
+void emit_chained_label(CodeBuffer* buf, int64_t* chain)
+{
+    int64_t pos = buf->pos;
+    emit_int(buf, *chain);
+    *chain = pos;
+}
+
+// Makes all labels in the chain point to the current position
+void patch_chain(CodeBuffer* buf, int64_t chain)
+{
+    if (buf->code != Nil)
+    {
+        while (chain != -1)
+        {
+            Object** label = vector_items(buf->code) + chain;
+            chain = get_number(*label);
+            *label = make_number(buf->pos);
+            write_barrier(buf->code, *label);
+        }
+    }
+}
+
+// Compiles (+ a b c), (- a b c) and the other arithmetic operations. The arguments are type checked right after
+// they have been evaluated and the rest of them are skipped if the check fails,
+// just like the builtins do.
+void vm_compile_arithmetic(CodeBuffer* buf, LexicalScope* lex, Object* env, Object* args, int op)
+{
+    int64_t end = -1;
+    bool negate = op == OP_SUB && cdr(args) == Nil;
+
+    vm_compile_expr(buf, lex, env, car(args), false);
+    emit_int(buf, OP_CHECKNUM);
+    emit_chained_label(buf, &end);
+
+    for (args = cdr(args); args != Nil; args = cdr(args))
+    {
+        vm_compile_expr(buf, lex, env, car(args), false);
+        emit_int(buf, op);
+        emit_chained_label(buf, &end);
+    }
+
+    if (negate)
+    {
+        emit_int(buf, OP_NEG);
+    }
+
+    patch_chain(buf, end);
+}
+
+// Compiles a call to a builtin function. Returns true if the code for the tail
+// position was generated.
+bool vm_compile_builtin(CodeBuffer* buf, LexicalScope* lex, Object* env, Object* form, Object* builtin, bool tail)
+{
+    Function fn = get_builtin(builtin)->fn;
+    Object* args = cdr(form);
+    int n = list_length(args);
+
+    if (fn == builtin_quote && n == 1)
+    {
+        emit_int(buf, OP_CONST);
+        emit(buf, car(args));
+    }
+    else if (fn == builtin_if && n == 3)
+    {
+        vm_compile_expr(buf, lex, env, car(args), false);
+        emit_int(buf, OP_JUMP_NIL);
+        size_t else_label = emit_label(buf);
+        vm_compile_expr(buf, lex, env, car(cdr(args)), tail);
+        size_t end_label = 0;
+
+        if (!tail)
+        {
+            emit_int(buf, OP_JUMP);
+            end_label = emit_label(buf);
+        }
+
+        patch_label(buf, else_label);
+        vm_compile_expr(buf, lex, env, car(cdr(cdr(args))), tail);
+
+        if (!tail)
+        {
+            patch_label(buf, end_label);
+        }
+
+        return tail;
+    }
+    else if (fn == builtin_progn && n >= 0)
+    {
+        if (args == Nil)
+        {
+            emit_int(buf, OP_CONST);
+            emit(buf, Nil);
+            return false;
+        }
+
+        for (; cdr(args) != Nil; args = cdr(args))
+        {
+            vm_compile_expr(buf, lex, env, car(args), false);
+            emit_int(buf, OP_POP);
+        }
+
+        vm_compile_expr(buf, lex, env, car(args), tail);
+        return tail;
+    }
+    else if (fn == builtin_add && n >= 1)
+    {
+        vm_compile_arithmetic(buf, lex, env, args, OP_ADD);
+    }
+    else if (fn == builtin_sub && n >= 1)
+    {
+        vm_compile_arithmetic(buf, lex, env, args, OP_SUB);
+    }
+    else if (fn == builtin_mul && n >= 1)
+    {
+        vm_compile_arithmetic(buf, lex, env, args, OP_MUL);
+    }
+    else if (fn == builtin_div && n >= 2)
+    {
+        vm_compile_arithmetic(buf, lex, env, args, OP_DIV);
+    }
+    else if (fn == builtin_mod && n == 2)
+    {
+        vm_compile_arithmetic(buf, lex, env, args, OP_MOD);
+    }
+    else if (fn == builtin_logand && n >= 1)
+    {
+        vm_compile_arithmetic(buf, lex, env, args, OP_LOGAND);
+    }
+    else if (fn == builtin_logior && n >= 1)
+    {
+        vm_compile_arithmetic(buf, lex, env, args, OP_LOGIOR);
+    }
+    else if (fn == builtin_logxor && n >= 1)
+    {
+        vm_compile_arithmetic(buf, lex, env, args, OP_LOGXOR);
+    }
+    else if (fn == builtin_ash && n == 2)
+    {
+        vm_compile_arithmetic(buf, lex, env, args, OP_ASH);
+    }
+    else if (fn == builtin_less && n == 2)
+    {
+        vm_compile_args(buf, lex, env, args);
+        emit_int(buf, OP_LESS);
+    }
+    else if (fn == builtin_eq && n == 2)
+    {
+        vm_compile_args(buf, lex, env, args);
+        emit_int(buf, OP_EQ);
+    }
+    else if (fn == builtin_cons && n == 2)
+    {
+        vm_compile_args(buf, lex, env, args);
+        emit_int(buf, OP_CONS);
+    }
+    else if (fn == builtin_car && n == 1)
+    {
+        vm_compile_args(buf, lex, env, args);
+        emit_int(buf, OP_CAR);
+    }
+    else if (fn == builtin_cdr && n == 1)
+    {
+        vm_compile_args(buf, lex, env, args);
+        emit_int(buf, OP_CDR);
+    }
+    else if (fn == builtin_vector_ref && n == 2)
+    {
+        vm_compile_args(buf, lex, env, args);
+        emit_int(buf, OP_VECTOR_REF);
+    }
+    else if (fn == builtin_vector_set && n == 3)
+    {
+        vm_compile_args(buf, lex, env, args);
+        emit_int(buf, OP_VECTOR_SET);
+    }
+    else if (fn == builtin_vector_length && n == 1)
+    {
+        vm_compile_args(buf, lex, env, args);
+        emit_int(buf, OP_VECTOR_LENGTH);
+    }
+    else if (fn == builtin_list && n >= 0)
+    {
+        vm_compile_args(buf, lex, env, args);
+        emit_int(buf, OP_LIST);
+        emit_int(buf, n);
+    }
+    else if (fn == builtin_lambda && n == 2)
+    {
+        // The code for the body of the lambda is stored right after the
+        // instruction and the closures point directly to it.
+        Object* params = car(args);
+        emit_int(buf, OP_LAMBDA);
+        emit(buf, params);
+        emit(buf, car(cdr(args)));
+        size_t end_label = emit_label(buf);
+        LexicalScope inner = {params, lex};
+        vm_compile_expr(buf, &inner, env, car(cdr(args)), true);
+        patch_label(buf, end_label);
+    }
+    else
+    {
+        emit_int(buf, OP_BUILTIN);
+        emit(buf, builtin);
+        emit(buf, form);
+    }
+
+    return false;
+}
+
+// Compiles a list form. Returns true if the code for the tail position was
+// generated.
+bool vm_compile_form(CodeBuffer* buf, LexicalScope* lex, Object* env, Object* form, bool tail)
+{
+    Object* head = car(form);
+    Object* value = head;
+
+    if (get_type(head) == TYPE_SYMBOL && resolve_local(lex, env, head) == head)
+    {
+        value = get_obj(head)->global;
+    }
+
+    if (get_type(value) == TYPE_BUILTIN)
+    {
+        return vm_compile_builtin(buf, lex, env, form, value, tail);
+    }
+
+    // Whether the function requires the arguments to be evaluated is only
+    // known once the function itself has been evaluated.
+    Object* args = cdr(form);
+    int n = list_length(args);
+    vm_compile_expr(buf, lex, env, head, false);
+    emit_int(buf, OP_CALL);
+    emit_int(buf, n);
+    emit(buf, form);
+    size_t end_label = emit_label(buf);
+
+    if (n >= 0)
+    {
+        vm_compile_args(buf, lex, env, args);
+        emit_int(buf, tail ? OP_TAILCALL : OP_INVOKE);
+        emit_int(buf, n);
+    }
+
+    patch_label(buf, end_label);
+
+    if (tail)
+    {
+        // The result of the eval_form call is returned from here
+        emit_int(buf, OP_RETURN);
+    }
+
+    return tail;
+}
+
+void vm_compile_expr(CodeBuffer* buf, LexicalScope* lex, Object* env, Object* expr, bool tail)
+{
+    switch (get_type(expr))
+    {
+    case TYPE_SYMBOL:
+        {
+            Object* ref = resolve_local(lex, env, expr);
+
+            if (ref != expr)
+            {
+                vm_compile_local(buf, ref);
+            }
+            else
+            {
+                emit_int(buf, OP_GLOBAL);
+                emit(buf, expr);
+            }
+        }
+        break;
+
+    case TYPE_CONST:
+        if (is_local_ref(expr))
+        {
+            vm_compile_local(buf, expr);
+        }
+        else
+        {
+            emit_int(buf, OP_CONST);
+            emit(buf, expr);
+        }
+        break;
+
+    case TYPE_CELL:
+        if (vm_compile_form(buf, lex, env, expr, tail))
+        {
+            return;
+        }
+        break;
+
+    default:
+        emit_int(buf, OP_CONST);
+        emit(buf, expr);
+        break;
+    }
+
+    if (tail)
+    {
+        emit_int(buf, OP_RETURN);
+    }
+}
+
+void vm_compile_function(CodeBuffer* buf, Object* fn)
+{
+    LexicalScope lex = {func_params(fn), NULL};
+    emit_int(buf, vm_epoch);
+    vm_compile_expr(buf, &lex, func_env(fn), func_body(fn), true);
+}
+
+void vm_compile(Object* fn)
+{
+    Object* code = Nil;
+    PUSH2(fn, code);
+
+    CodeBuffer buf = {Nil, 0};
+    vm_compile_function(&buf, fn);
+    size_t size = buf.pos;
+
+    code = make_vector(size, Nil);
+    buf.code = code;
+    buf.pos = 0;
+    vm_compile_function(&buf, fn);
+    assert(buf.pos == size);
+
+    get_func(fn)->ufn.code = code;
+    get_func(fn)->ufn.code_entry = 1;
+    write_barrier(fn, code);
+    POP();
+}
+
+//
+// Execution
+//
+
+// Calls a function that was compiled into machine code after the scope for it
+// was already created
+Object* vm_call_jit(Object* fn, Object* scope)
+{
+    Object** args = jit_sp();
+    int count = get_func(fn)->ufn.param_count;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!jit_push(scope_slots(scope)[i]))
+        {
+            jit_pop(args);
+            return Nil;
+        }
+    }
+
+    return jit_call(fn, args);
+}
+
+Object* vm_eval(Object* fn, Object* scope)
+{
+    static const void* const dispatch[] = {
+        [OP_CONST] = &&op_const,
+        [OP_LOCAL0] = &&op_local0,
+        [OP_LOCAL] = &&op_local,
+        [OP_GLOBAL] = &&op_global,
+        [OP_POP] = &&op_pop,
+        [OP_JUMP] = &&op_jump,
+        [OP_JUMP_NIL] = &&op_jump_nil,
+        [OP_CHECKNUM] = &&op_checknum,
+        [OP_ADD] = &&op_add,
+        [OP_SUB] = &&op_sub,
+        [OP_NEG] = &&op_neg,
+        [OP_MUL] = &&op_arith,
+        [OP_DIV] = &&op_arith,
+        [OP_MOD] = &&op_arith,
+        [OP_LOGAND] = &&op_arith,
+        [OP_LOGIOR] = &&op_arith,
+        [OP_LOGXOR] = &&op_arith,
+        [OP_ASH] = &&op_arith,
+        [OP_LESS] = &&op_less,
+        [OP_EQ] = &&op_eq,
+        [OP_CAR] = &&op_car,
+        [OP_CDR] = &&op_cdr,
+        [OP_VECTOR_REF] = &&op_vector_ref,
+        [OP_VECTOR_SET] = &&op_vector_set,
+        [OP_VECTOR_LENGTH] = &&op_vector_length,
+        [OP_CONS] = &&op_cons,
+        [OP_LIST] = &&op_list,
+        [OP_LAMBDA] = &&op_lambda,
+        [OP_BUILTIN] = &&op_builtin,
+        [OP_CALL] = &&op_call,
+        [OP_INVOKE] = &&op_invoke,
+        [OP_TAILCALL] = &&op_tailcall,
+        [OP_RETURN] = &&op_return,
+    };
+
+    Object* code = Nil;
+    Object* ret = Nil;
+    PUSH3(fn, scope, code);
+
+    // Only used for checking that the stack is balanced
+    Object** base = vm_sp;
+    (void)base;
+    Object** ins;
+    int64_t pc;
+    bool is_tail;
+    bool is_hot = ++get_func(fn)->ufn.call_count >= jit_call_threshold;
+
+// Anything that can allocate memory can move the bytecode and thus the pointer
+// to the instructions must be reloaded after it.
+#define RELOAD() ins = vector_items(code)
+#define NEXT() goto *dispatch[get_number(ins[pc++])]
+#define ARG() ins[pc++]
+#define INT_ARG() get_number(ins[pc++])
+#define VM_PUSH(v) *vm_sp++ = (v)
+#define VM_POP() (*--vm_sp)
+#define TOP vm_sp[-1]
+
+ enter:
+    // Compiled functions only end up here if the compiled code had to bail out
+    if (is_hot && !jit_compiled(fn) && jit_tier_up(fn))
+    {
+        ret = vm_call_jit(fn, scope);
+        goto done;
+    }
+
+    code = get_func(fn)->ufn.code;
+
+    if (code == Nil || get_number(vector_items(code)[0]) != vm_epoch)
+    {
+        vm_compile(fn);
+        code = get_func(fn)->ufn.code;
+    }
+
+    pc = get_func(fn)->ufn.code_entry;
+    RELOAD();
+    NEXT();
+
+ op_const:
+    VM_PUSH(ARG());
+    NEXT();
+
+ op_local0:
+    VM_PUSH(scope_slots(scope)[INT_ARG()]);
+    NEXT();
+
+ op_local:
+    {
+        Object* s = scope;
+
+        for (int64_t depth = INT_ARG(); depth > 0; depth--)
+        {
+            s = scope_parent(s);
+        }
+
+        VM_PUSH(scope_slots(s)[INT_ARG()]);
+    }
+    NEXT();
+
+ op_global:
+    {
+        Object* sym = ARG();
+        Object* val = get_obj(sym)->global;
+
+        if (val == Undefined)
+        {
+            error("Undefined symbol: %s", get_symbol(sym));
+            val = Nil;
+        }
+
+        VM_PUSH(val);
+    }
+    NEXT();
+
+ op_pop:
+    vm_sp--;
+    NEXT();
+
+ op_jump:
+    pc = INT_ARG();
+    NEXT();
+
+ op_jump_nil:
+    {
+        int64_t target = INT_ARG();
+
+        if (VM_POP() == Nil)
+        {
+            pc = target;
+        }
+    }
+    NEXT();
+
+ op_checknum:
+    {
+        int64_t end = INT_ARG();
+
+        if (get_type(TOP) != TYPE_NUMBER)
+        {
+            error("Not a number");
+            TOP = Nil;
+            pc = end;
+        }
+    }
+    NEXT();
+
+ op_add:
+    {
+        int64_t end = INT_ARG();
+        Object* rhs = VM_POP();
+
+        if (get_type(rhs) != TYPE_NUMBER)
+        {
+            error("Not a number");
+            TOP = Nil;
+            pc = end;
+        }
+        else
+        {
+            TOP = make_number(get_number(TOP) + get_number(rhs));
+        }
+    }
+    NEXT();
+
+ op_sub:
+    {
+        int64_t end = INT_ARG();
+        Object* rhs = VM_POP();
+
+        if (get_type(rhs) != TYPE_NUMBER)
+        {
+            error("Not a number");
+            TOP = Nil;
+            pc = end;
+        }
+        else
+        {
+            TOP = make_number(get_number(TOP) - get_number(rhs));
+        }
+    }
+    NEXT();
+
+ op_neg:
+    TOP = make_number(-get_number(TOP));
+    NEXT();
+
+ op_arith:
+    {
+        enum Arith op = get_number(ins[pc - 1]) - OP_MUL;
+        int64_t end = INT_ARG();
+        Object* rhs = VM_POP();
+        int64_t result;
+
+        if (get_type(rhs) != TYPE_NUMBER)
+        {
+            error("Not a number");
+            TOP = Nil;
+            pc = end;
+        }
+        else if (!do_arithmetic(op, get_number(TOP), get_number(rhs), &result))
+        {
+            error("Division by zero");
+            TOP = Nil;
+            pc = end;
+        }
+        else
+        {
+            TOP = make_number(result);
+        }
+    }
+    NEXT();
+
+ op_less:
+    {
+        Object* rhs = VM_POP();
+        TOP = get_number(TOP) < get_number(rhs) ? True : Nil;
+    }
+    NEXT();
+
+ op_eq:
+    {
+        Object* rhs = VM_POP();
+        TOP = TOP == rhs ? True : Nil;
+    }
+    NEXT();
+
+ op_car:
+    if (get_type(TOP) != TYPE_CELL)
+    {
+        error("Evaluation did not produce a list");
+        TOP = Nil;
+    }
+    else
+    {
+        TOP = car(TOP);
+    }
+    NEXT();
+
+ op_cdr:
+    if (get_type(TOP) != TYPE_CELL)
+    {
+        error("Evaluation did not produce a list");
+        TOP = Nil;
+    }
+    else
+    {
+        TOP = cdr(TOP);
+    }
+    NEXT();
+
+ op_vector_ref:
+    {
+        Object* index = VM_POP();
+        TOP = check_vector_index(TOP, index) ? vector_items(TOP)[get_number(index)] : Nil;
+    }
+    NEXT();
+
+ op_vector_set:
+    {
+        Object* value = VM_POP();
+        Object* index = VM_POP();
+
+        if (check_vector_index(TOP, index))
+        {
+            vector_items(TOP)[get_number(index)] = value;
+            write_barrier(TOP, value);
+            TOP = value;
+        }
+        else
+        {
+            TOP = Nil;
+        }
+    }
+    NEXT();
+
+ op_vector_length:
+    if (get_type(TOP) != TYPE_VECTOR)
+    {
+        error("Not a vector");
+        TOP = Nil;
+    }
+    else
+    {
+        TOP = make_number(get_obj(TOP)->length);
+    }
+    NEXT();
+
+ op_cons:
+    {
+        Object* cell = cons(vm_sp[-2], vm_sp[-1]);
+        vm_sp--;
+        TOP = cell;
+        RELOAD();
+    }
+    NEXT();
+
+ op_list:
+    {
+        int64_t count = INT_ARG();
+        Object* list = Nil;
+
+        for (int64_t i = 1; i <= count; i++)
+        {
+            list = cons(vm_sp[-i], list);
+        }
+
+        vm_sp -= count;
+        VM_PUSH(list);
+        RELOAD();
+    }
+    NEXT();
+
+ op_lambda:
+    {
+        Object* params = ARG();
+        Object* body = ARG();
+        int64_t end = INT_ARG();
+        int64_t entry = pc;
+        Object* closure = make_function(params, body, scope);
+        get_func(closure)->ufn.code = code;
+        get_func(closure)->ufn.code_entry = entry;
+        VM_PUSH(closure);
+        pc = end;
+        RELOAD();
+    }
+    NEXT();
+
+ op_builtin:
+    {
+        Function builtin = get_builtin(ARG())->fn;
+        Object* form = ARG();
+        ret = builtin(scope, cdr(form));
+
+        if (ret == TailCall)
+        {
+            ret = eval(ret->tail_scope, ret->tail_expr);
+        }
+
+        VM_PUSH(ret);
+        RELOAD();
+    }
+    NEXT();
+
+ op_call:
+    {
+        int64_t count = INT_ARG();
+        Object* form = ARG();
+        int64_t end = INT_ARG();
+
+        if (get_type(TOP) != TYPE_FUNCTION || get_func(TOP)->ufn.param_count != count)
+        {
+            // Builtins, macros, argument count errors and such
+            Object* callee = VM_POP();
+            ret = eval_form(scope, form, callee);
+            VM_PUSH(ret);
+            pc = end;
+            RELOAD();
+        }
+    }
+    NEXT();
+
+ op_invoke:
+    is_tail = false;
+    goto call;
+
+ op_tailcall:
+    is_tail = true;
+
+ call:
+    {
+        int64_t count = INT_ARG();
+        Object* callee = vm_sp[-count - 1];
+
+        if (jit_compiled(callee))
+        {
+            // Compiled functions take their arguments from the JIT stack and
+            // don't need a scope.
+            Object** args = jit_sp();
+            bool ok = true;
+
+            for (int64_t i = -count; i < 0 && ok; i++)
+            {
+                ok = jit_push(vm_sp[i]);
+            }
+
+            vm_sp -= count + 1;
+
+            if (ok)
+            {
+                PROFILE_ENTER(callee);
+                ret = jit_call(callee, args);
+                PROFILE_LEAVE();
+            }
+            else
+            {
+                jit_pop(args);
+                ret = Nil;
+            }
+        }
+        else
+        {
+            Object* next_scope = new_scope(func_env(callee), func_params(callee), count);
+            Object** slots = scope_slots(next_scope);
+
+            // The scope was allocated after the arguments were evaluated and thus
+            // the write barrier is only needed if it was allocated from the old space.
+            bool is_old = !in_nursery(next_scope);
+
+            for (int64_t i = 0; i < count; i++)
+            {
+                slots[i] = vm_sp[i - count];
+
+                if (is_old)
+                {
+                    write_barrier(next_scope, slots[i]);
+                }
+            }
+
+            callee = vm_sp[-count - 1];
+            vm_sp -= count + 1;
+
+            if (is_tail)
+            {
+                assert(vm_sp == base);
+                UserFunction* ufn = &get_func(callee)->ufn;
+                is_hot = callee == fn ? ++ufn->loop_count >= jit_loop_threshold
+                    : ++ufn->call_count >= jit_call_threshold;
+                fn = callee;
+                scope = next_scope;
+                PROFILE_REPLACE(fn);
+                goto enter;
+            }
+
+            PROFILE_ENTER(callee);
+            ret = vm_eval(callee, next_scope);
+            PROFILE_LEAVE();
+        }
+
+        if (is_tail)
+        {
+            goto done;
+        }
+
+        VM_PUSH(ret);
+        RELOAD();
+    }
+    NEXT();
+
+ op_return:
+    ret = VM_POP();
+
+ done:
+    assert(vm_sp == base);
+    POP();
+    return ret;
+
+#undef RELOAD
+#undef NEXT
+#undef ARG
+#undef INT_ARG
+#undef VM_PUSH
+#undef VM_POP
+#undef TOP
+}
+
+void vm_init()
+{
+    size_t size = VM_STACK_SIZE * sizeof(Object*);
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint8_t* mem = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (mem == MAP_FAILED)
+    {
+        perror("Failed to reserve memory for the VM stack");
+        exit(1);
+    }
+
+    // The guard page at the end turns a stack overflow into a crash
+    mprotect(mem + size, page, PROT_NONE);
+    vm_stack = (Object**)mem;
+    vm_sp = vm_stack;
+}
+
+void vm_free()
+{
+    munmap(vm_stack, VM_STACK_SIZE * sizeof(Object*) + sysconf(_SC_PAGESIZE));
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "lisp.h"
+
+//
+// The bytecode interpreter
+//
+
+// The value stack of the VM. All values between vm_stack and vm_sp are alive.
+extern _Thread_local Object** vm_stack;
+extern _Thread_local Object** vm_sp;
+
+// Calls the function with the arguments stored in the slots of the scope. The
+// function is compiled into bytecode if it hasn't been compiled yet.
+Object* vm_eval(Object* fn, Object* scope);
+
+// Causes all functions to be recompiled into bytecode the next time they are
+// called. Must be called whenever the assumptions that the bytecode was
+// compiled with might no longer be valid, e.g. a builtin function was rebound.
+void vm_invalidate();
+
+void vm_init();
+void vm_free();